@@ -0,0 +1,1517 @@
+/*--
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+
+Module Name:
+
+    control.c
+
+Abstract: This module implements the control device, the sideband through
+          which user-mode tools talk to the filter.  The keyboard stacks are
+          opened exclusively by the raw input thread, so the filter creates
+          a single named device object of its own, which only the system and
+          administrators may open.  It is created along with the first
+          filter device and deleted along with the last one.
+
+          The filter devices are kept in a list, so that a single request can
+          query any number of keyboards.  Requests read the lag mitigation
+          core through its lock-free snapshot and drain routines and never
+          take the carry lock, so the service callback does not wait for
+          them.
+
+          Readers that want every decision map a keyboard's event ring into
+          their process instead of polling.  The ring is created when the
+          first reader maps it and detached from the keyboard when the last
+          one unmaps it, so the service callback only writes events while
+          somebody reads them.
+
+Environment:
+
+    Kernel mode only.
+
+--*/
+
+#include "kbfiltr.h"
+
+//
+// Entries of a batch are padded so that the next one is 8 byte aligned
+//
+#define KBFILTER_ENTRY_SIZE(Length)     ((ULONG) ALIGN_UP_BY((Length), 8))
+
+C_ASSERT(FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events) % 8 == 0);
+C_ASSERT(sizeof(KBFILTR_TRACE_EVENT) % 8 == 0);
+C_ASSERT(FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records) % 8 == 0);
+C_ASSERT(sizeof(KBFILTR_KEYTRACE_RECORD) % 8 == 0);
+
+//
+// Fills in the entry of one keyboard, after its header.  Returns the size of
+// the entry, or zero if it does not fit in Length bytes.
+//
+typedef ULONG
+(*PKBFILTER_BATCH_ROUTINE)(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    );
+
+NTSTATUS
+KbFilter_CreateControlDevice(
+    IN PDRIVER_OBJECT DriverObject
+    );
+
+VOID
+KbFilter_DeleteControlDevice(
+    VOID
+    );
+
+NTSTATUS
+KbFilter_ControlBatch(
+    IN PIRP Irp,
+    IN PKBFILTER_BATCH_ROUTINE Routine,
+    IN ULONG MinimumSize,
+    IN BOOLEAN Cursors
+    );
+
+ULONG
+KbFilter_BatchAttributes(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    );
+
+ULONG
+KbFilter_BatchStatistics(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    );
+
+ULONG
+KbFilter_BatchDrainTrace(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    );
+
+ULONG
+KbFilter_BatchDrainKeyTrace(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    );
+
+PDEVICE_EXTENSION
+KbFilter_FindDevice(
+    IN ULONG Instance
+    );
+
+NTSTATUS
+KbFilter_MapEventRing(
+    IN PIRP Irp
+    );
+
+BOOLEAN
+KbFilter_UnmapEventRings(
+    IN PKBFILTER_CONTROL_FILE File,
+    IN PVOID UserAddress
+    );
+
+PKBFILTER_EVENT_CHANNEL
+KbFilter_CreateEventChannel(
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+PKBFILTER_EVENT_CHANNEL
+KbFilter_DetachEventChannel(
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+VOID
+KbFilter_ReleaseEventChannel(
+    IN PKBFILTER_EVENT_CHANNEL Channel
+    );
+
+VOID
+KbFilter_FreeEventChannel(
+    IN PKBFILTER_EVENT_CHANNEL Channel
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, KbFilter_InitializeControl)
+#pragma alloc_text (PAGE, KbFilter_RegisterDevice)
+#pragma alloc_text (PAGE, KbFilter_UnregisterDevice)
+#pragma alloc_text (PAGE, KbFilter_CreateControlDevice)
+#pragma alloc_text (PAGE, KbFilter_DeleteControlDevice)
+#pragma alloc_text (PAGE, KbFilter_DispatchControl)
+#pragma alloc_text (PAGE, KbFilter_ControlBatch)
+#pragma alloc_text (PAGE, KbFilter_BatchAttributes)
+#pragma alloc_text (PAGE, KbFilter_BatchStatistics)
+#pragma alloc_text (PAGE, KbFilter_BatchDrainTrace)
+#pragma alloc_text (PAGE, KbFilter_BatchDrainKeyTrace)
+#pragma alloc_text (PAGE, KbFilter_FindDevice)
+#pragma alloc_text (PAGE, KbFilter_MapEventRing)
+#pragma alloc_text (PAGE, KbFilter_UnmapEventRings)
+#pragma alloc_text (PAGE, KbFilter_CreateEventChannel)
+#pragma alloc_text (PAGE, KbFilter_DetachEventChannel)
+#pragma alloc_text (PAGE, KbFilter_ReleaseEventChannel)
+#pragma alloc_text (PAGE, KbFilter_FreeEventChannel)
+#endif
+
+//
+// Filter devices, linked through their ListEntry.  The mutex also protects
+// the control device pointer and the instance numbers.
+//
+FAST_MUTEX KbFilterDeviceListMutex;
+LIST_ENTRY KbFilterDeviceList;
+ULONG KbFilterDeviceCount = 0;
+ULONG KbFilterInstanceNo = 0;
+
+PDEVICE_OBJECT KbFilterControlDevice = NULL;
+
+//
+// Dedup domain of the keyboards added while CrossDeviceWindowMs is set.
+// Joins and leaves are serialized by KbFilterDeviceListMutex.
+//
+KBFILTER_DEDUP_DOMAIN KbFilterDedupDomain;
+
+VOID
+KbFilter_InitializeControl(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Initializes the device list.  Called from DriverEntry.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ExInitializeFastMutex(&KbFilterDeviceListMutex);
+    InitializeListHead(&KbFilterDeviceList);
+}
+
+NTSTATUS
+KbFilter_RegisterDevice(
+    IN PDRIVER_OBJECT DriverObject,
+    IN PDEVICE_EXTENSION DevExt,
+    IN BOOLEAN JoinDedupDomain
+    )
+/*++
+
+Routine Description:
+
+    Adds a filter device to the device list and gives it an instance number.
+    Creates the control device if it does not exist yet.  Failing to create
+    it does not fail the keyboard; the next keyboard added tries again.
+    The keyboard joins the driver's dedup domain if requested, tagged with
+    its instance number; two keyboards sharing the low 16 bits of it only
+    miss each other's copies.  Must be called before the keyboard's core
+    sees any input.
+
+Arguments:
+
+    DriverObject - Driver object, for creating the control device
+    DevExt - Device extension of the new filter device
+    JoinDedupDomain - Whether to check the keyboard against the other
+                      keyboards of the dedup domain
+
+Return Value:
+
+    STATUS_SUCCESS, or the reason the control device could not be created.
+    The keyboard is registered either way.
+
+--*/
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&KbFilterDeviceListMutex);
+
+    if (KbFilterControlDevice == NULL) {
+        status = KbFilter_CreateControlDevice(DriverObject);
+    }
+
+    DevExt->InstanceNo = ++KbFilterInstanceNo;
+    InsertTailList(&KbFilterDeviceList, &DevExt->ListEntry);
+    KbFilterDeviceCount++;
+
+    if (JoinDedupDomain) {
+        KbFilter_JoinDedupDomain(&DevExt->Core,
+                                 &KbFilterDedupDomain,
+                                 (USHORT) DevExt->InstanceNo);
+    }
+
+    ExReleaseFastMutex(&KbFilterDeviceListMutex);
+
+    return status;
+}
+
+VOID
+KbFilter_UnregisterDevice(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+
+Routine Description:
+
+    Removes a filter device from the device list and its dedup domain,
+    detaches its event ring and deletes the control device along with the last filter device.  Once
+    this returns, no control request can still be reading the device
+    extension.  Must be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    DevExt - Device extension of the filter device being removed
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_EVENT_CHANNEL channel;
+
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&KbFilterDeviceListMutex);
+
+    RemoveEntryList(&DevExt->ListEntry);
+    KbFilterDeviceCount--;
+
+    KbFilter_LeaveDedupDomain(&DevExt->Core);
+
+    channel = KbFilter_DetachEventChannel(DevExt);
+
+    if (IsListEmpty(&KbFilterDeviceList)) {
+        KbFilter_DeleteControlDevice();
+    }
+
+    ExReleaseFastMutex(&KbFilterDeviceListMutex);
+
+    //
+    // Readers keep the ring mapped; it just stops advancing
+    //
+    if (channel != NULL) {
+        KeFlushQueuedDpcs();
+        KbFilter_ReleaseEventChannel(channel);
+    }
+}
+
+NTSTATUS
+KbFilter_CreateControlDevice(
+    IN PDRIVER_OBJECT DriverObject
+    )
+/*++
+
+Routine Description:
+
+    Creates the control device and its symbolic link.  Only the system and
+    administrators get access to it.  Called with KbFilterDeviceListMutex
+    held.
+
+Arguments:
+
+    DriverObject - Driver object
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    NTSTATUS status;
+    UNICODE_STRING deviceName, linkName;
+    PDEVICE_OBJECT deviceObject;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&deviceName, KBFILTER_CONTROL_DEVICE_NAME);
+
+    status = IoCreateDeviceSecure(DriverObject,
+                                  sizeof(CONTROL_EXTENSION),
+                                  &deviceName,
+                                  FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN,
+                                  FALSE,
+                                  &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  &GUID_DEVCLASS_KBFILTER_CONTROL,
+                                  &deviceObject);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("IoCreateDeviceSecure failed with status code 0x%x\n", status));
+        return status;
+    }
+
+    ((PCONTROL_EXTENSION) deviceObject->DeviceExtension)->Kind = KbFilterDeviceControl;
+
+    RtlInitUnicodeString(&linkName, KBFILTER_CONTROL_LINK_NAME);
+
+    status = IoCreateSymbolicLink(&linkName, &deviceName);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("IoCreateSymbolicLink failed with status code 0x%x\n", status));
+        IoDeleteDevice(deviceObject);
+        return status;
+    }
+
+    deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+
+    KbFilterControlDevice = deviceObject;
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+KbFilter_DeleteControlDevice(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Deletes the control device and its symbolic link, if they exist.  Open
+    handles keep the device object around until they are closed; requests
+    sent through them find an empty device list.  Called with
+    KbFilterDeviceListMutex held.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNICODE_STRING linkName;
+
+    PAGED_CODE();
+
+    if (KbFilterControlDevice == NULL) {
+        return;
+    }
+
+    RtlInitUnicodeString(&linkName, KBFILTER_CONTROL_LINK_NAME);
+    IoDeleteSymbolicLink(&linkName);
+
+    IoDeleteDevice(KbFilterControlDevice);
+    KbFilterControlDevice = NULL;
+}
+
+NTSTATUS
+KbFilter_DispatchControl(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Dispatch routine for every request sent to the control device.  The
+    dispatch routines of the filter devices hand requests over when
+    KbFilter_IsControlDevice is true.  Everything is done synchronously at
+    PASSIVE_LEVEL.
+
+Arguments:
+
+    DeviceObject - Pointer to the control device object.
+    Irp - Pointer to the request packet.
+
+Return Value:
+
+    Status is returned.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack;
+    PKBFILTER_CONTROL_FILE file;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+
+    PAGED_CODE();
+
+    irpStack = IoGetCurrentIrpStackLocation(Irp);
+    file = (PKBFILTER_CONTROL_FILE) irpStack->FileObject->FsContext;
+    Irp->IoStatus.Information = 0;
+
+    switch (irpStack->MajorFunction) {
+    case IRP_MJ_CREATE:
+        file = (PKBFILTER_CONTROL_FILE) ExAllocatePoolWithTag(PagedPool,
+                                                              sizeof(KBFILTER_CONTROL_FILE),
+                                                              KBFILTER_POOL_TAG);
+        if (file == NULL) {
+            InterlockedIncrement(&KbFilterAllocationFailures);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        InitializeListHead(&file->Mappings);
+        file->Process = PsGetCurrentProcess();
+        ObReferenceObject(file->Process);
+        irpStack->FileObject->FsContext = file;
+        break;
+
+    case IRP_MJ_CLEANUP:
+        //
+        // Runs in the process that closes the last handle, which need not
+        // be the one the rings were mapped into if the handle was inherited
+        // or duplicated
+        //
+        KbFilter_UnmapEventRings(file, NULL);
+        break;
+
+    case IRP_MJ_CLOSE:
+        ObDereferenceObject(file->Process);
+        ExFreePoolWithTag(file, KBFILTER_POOL_TAG);
+        break;
+
+    case IRP_MJ_DEVICE_CONTROL:
+        switch (irpStack->Parameters.DeviceIoControl.IoControlCode) {
+        case IOCTL_KBFILTR_GET_KEYBOARD_ATTRIBUTES:
+            status = KbFilter_ControlBatch(Irp,
+                                           KbFilter_BatchAttributes,
+                                           KBFILTER_ENTRY_SIZE(sizeof(KBFILTR_ATTRIBUTES_ENTRY)),
+                                           FALSE);
+            break;
+
+        case IOCTL_KBFILTR_GET_STATISTICS:
+            status = KbFilter_ControlBatch(Irp,
+                                           KbFilter_BatchStatistics,
+                                           KBFILTER_ENTRY_SIZE(sizeof(KBFILTR_STATISTICS_ENTRY)),
+                                           FALSE);
+            break;
+
+        case IOCTL_KBFILTR_DRAIN_TRACE:
+            status = KbFilter_ControlBatch(Irp,
+                                           KbFilter_BatchDrainTrace,
+                                           FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events),
+                                           TRUE);
+            break;
+
+        case IOCTL_KBFILTR_DRAIN_KEYTRACE:
+            status = KbFilter_ControlBatch(Irp,
+                                           KbFilter_BatchDrainKeyTrace,
+                                           FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records),
+                                           TRUE);
+            break;
+
+        case IOCTL_KBFILTR_RELOAD_CONFIGURATION:
+            status = KbFilter_ReloadPolicy();
+            if (NT_SUCCESS(status) &&
+                irpStack->Parameters.DeviceIoControl.OutputBufferLength >=
+                    sizeof(KBFILTR_CONFIGURATION)) {
+                KbFilter_QueryConfiguration((PKBFILTR_CONFIGURATION) Irp->AssociatedIrp.SystemBuffer);
+                Irp->IoStatus.Information = sizeof(KBFILTR_CONFIGURATION);
+            }
+            break;
+
+        case IOCTL_KBFILTR_MAP_EVENT_RING:
+            status = KbFilter_MapEventRing(Irp);
+            break;
+
+        case IOCTL_KBFILTR_UNMAP_EVENT_RING:
+            if (irpStack->Parameters.DeviceIoControl.InputBufferLength <
+                    sizeof(KBFILTR_UNMAP_EVENT_RING)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            if (!KbFilter_UnmapEventRings(file,
+                                          (PVOID) (ULONG_PTR) ((PKBFILTR_UNMAP_EVENT_RING)
+                                              Irp->AssociatedIrp.SystemBuffer)->Address)) {
+                status = STATUS_INVALID_PARAMETER;
+            }
+            break;
+
+        case IOCTL_KBFILTR_GET_CONFIGURATION:
+            if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+                    sizeof(KBFILTR_CONFIGURATION)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            KbFilter_QueryConfiguration((PKBFILTR_CONFIGURATION) Irp->AssociatedIrp.SystemBuffer);
+            Irp->IoStatus.Information = sizeof(KBFILTR_CONFIGURATION);
+            break;
+
+        default:
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+        break;
+
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
+    }
+
+    Irp->IoStatus.Status = status;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return status;
+}
+
+NTSTATUS
+KbFilter_ControlBatch(
+    IN PIRP Irp,
+    IN PKBFILTER_BATCH_ROUTINE Routine,
+    IN ULONG MinimumSize,
+    IN BOOLEAN Cursors
+    )
+/*++
+
+Routine Description:
+
+    Runs a batched request: calls Routine for every keyboard selected by the
+    input buffer, or for every keyboard if it is empty, and packs the entries
+    into the output buffer after a KBFILTR_BATCH.  Each keyboard gets an even
+    share of the space left, but at least MinimumSize bytes, so that drains
+    of busy keyboards do not crowd out the others.  The batch ends at the
+    first entry that does not fit.
+
+    Input and output share the system buffer, so the selection is copied
+    before any entry is written.  The device list stays locked while the
+    entries are filled in, which keeps the selected devices from being
+    deleted.
+
+Arguments:
+
+    Irp - IRP_MJ_DEVICE_CONTROL request for the control device
+    Routine - Fills in the entry of one keyboard
+    MinimumSize - Smallest share of the output buffer worth passing to Routine
+    Cursors - TRUE if the input is a KBFILTR_DRAIN_REQUEST rather than a
+              KBFILTR_DEVICE_SELECTION
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack;
+    PUCHAR buffer;
+    ULONG inputLength, outputLength, offset, size, share;
+    ULONG count, stride, i;
+    PKBFILTR_DRAIN_CURSOR selection = NULL;
+    PKBFILTR_BATCH batch;
+    PKBFILTR_ENTRY entry;
+    PLIST_ENTRY link;
+    PDEVICE_EXTENSION devExt;
+    ULONG instance, cursor;
+
+    PAGED_CODE();
+
+    irpStack = IoGetCurrentIrpStackLocation(Irp);
+    buffer = (PUCHAR) Irp->AssociatedIrp.SystemBuffer;
+    inputLength = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+    outputLength = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (outputLength < sizeof(KBFILTR_BATCH)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    //
+    // Both input layouts start with the count, followed by the array
+    //
+    count = 0;
+    stride = Cursors ? sizeof(KBFILTR_DRAIN_CURSOR) : sizeof(ULONG);
+
+    if (inputLength != 0) {
+        if (inputLength < sizeof(ULONG)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        count = *(PULONG) buffer;
+        if (count > (inputLength - sizeof(ULONG)) / stride) {
+            return STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if (count != 0) {
+        selection = (PKBFILTR_DRAIN_CURSOR) ExAllocatePoolWithTag(PagedPool,
+                                                                  count * sizeof(KBFILTR_DRAIN_CURSOR),
+                                                                  KBFILTER_POOL_TAG);
+        if (selection == NULL) {
+            InterlockedIncrement(&KbFilterAllocationFailures);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (i = 0; i < count; i++) {
+            if (Cursors) {
+                selection[i] = ((PKBFILTR_DRAIN_REQUEST) buffer)->Cursors[i];
+            }
+            else {
+                selection[i].Instance = ((PKBFILTR_DEVICE_SELECTION) buffer)->Instances[i];
+                selection[i].Cursor = 0;
+            }
+        }
+    }
+
+    ExAcquireFastMutex(&KbFilterDeviceListMutex);
+
+    batch = (PKBFILTR_BATCH) buffer;
+    batch->Devices = KbFilterDeviceCount;
+    batch->Count = 0;
+    offset = sizeof(KBFILTR_BATCH);
+
+    if (selection == NULL) {
+        count = KbFilterDeviceCount;
+    }
+
+    link = KbFilterDeviceList.Flink;
+
+    for (i = 0; i < count; i++) {
+        if (selection == NULL) {
+            devExt = CONTAINING_RECORD(link, DEVICE_EXTENSION, ListEntry);
+            link = link->Flink;
+            instance = devExt->InstanceNo;
+            cursor = 0;
+        }
+        else {
+            instance = selection[i].Instance;
+            cursor = selection[i].Cursor;
+
+            devExt = KbFilter_FindDevice(instance);
+        }
+
+        entry = (PKBFILTR_ENTRY) (buffer + offset);
+
+        if (devExt == NULL) {
+            if (outputLength - offset < sizeof(KBFILTR_ENTRY)) {
+                break;
+            }
+
+            RtlZeroMemory(entry, sizeof(KBFILTR_ENTRY));
+            size = sizeof(KBFILTR_ENTRY);
+            entry->Status = STATUS_NO_SUCH_DEVICE;
+        }
+        else {
+            share = (outputLength - offset) / (count - i);
+            share = MIN(MAX(share, MinimumSize), outputLength - offset);
+
+            size = Routine(devExt, cursor, entry, share);
+            if (size == 0) {
+                break;
+            }
+
+            entry->Status = STATUS_SUCCESS;
+        }
+
+        entry->Size = size;
+        entry->Instance = instance;
+
+        offset += size;
+        batch->Count++;
+    }
+
+    ExReleaseFastMutex(&KbFilterDeviceListMutex);
+
+    if (selection != NULL) {
+        ExFreePoolWithTag(selection, KBFILTER_POOL_TAG);
+    }
+
+    Irp->IoStatus.Information = offset;
+
+    return STATUS_SUCCESS;
+}
+
+ULONG
+KbFilter_BatchAttributes(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Returns the keyboard attributes the port driver reported when the class
+    driver queried them.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+    Cursor - Unused
+    Entry - Receives a KBFILTR_ATTRIBUTES_ENTRY
+    Length - Space available for the entry
+
+Return Value:
+
+    Size of the entry, zero if it does not fit.
+
+--*/
+{
+    PKBFILTR_ATTRIBUTES_ENTRY attributes = (PKBFILTR_ATTRIBUTES_ENTRY) Entry;
+    ULONG size = KBFILTER_ENTRY_SIZE(sizeof(KBFILTR_ATTRIBUTES_ENTRY));
+
+    UNREFERENCED_PARAMETER(Cursor);
+
+    PAGED_CODE();
+
+    if (Length < size) {
+        return 0;
+    }
+
+    RtlZeroMemory(attributes, size);
+    RtlCopyMemory(&attributes->Attributes,
+                  &DevExt->KeyboardAttributes,
+                  sizeof(KEYBOARD_ATTRIBUTES));
+
+    return size;
+}
+
+ULONG
+KbFilter_BatchStatistics(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Returns a statistics snapshot of the keyboard, see
+    KbFilter_QueryDeviceStatistics.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+    Cursor - Unused
+    Entry - Receives a KBFILTR_STATISTICS_ENTRY
+    Length - Space available for the entry
+
+Return Value:
+
+    Size of the entry, zero if it does not fit.
+
+--*/
+{
+    PKBFILTR_STATISTICS_ENTRY statistics = (PKBFILTR_STATISTICS_ENTRY) Entry;
+    ULONG size = KBFILTER_ENTRY_SIZE(sizeof(KBFILTR_STATISTICS_ENTRY));
+
+    UNREFERENCED_PARAMETER(Cursor);
+
+    PAGED_CODE();
+
+    if (Length < size) {
+        return 0;
+    }
+
+    RtlZeroMemory(statistics, size);
+    KbFilter_QueryDeviceStatistics(DevExt, &statistics->Statistics);
+
+    return size;
+}
+
+ULONG
+KbFilter_BatchDrainTrace(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Drains the trace events recorded since Cursor, as many as fit.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+    Cursor - Cursor returned for the keyboard by the previous drain
+    Entry - Receives a KBFILTR_TRACE_DRAIN
+    Length - Space available for the entry
+
+Return Value:
+
+    Size of the entry, zero if it does not fit.
+
+--*/
+{
+    PKBFILTR_TRACE_DRAIN drain = (PKBFILTR_TRACE_DRAIN) Entry;
+
+    PAGED_CODE();
+
+    if (Length < FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events)) {
+        return 0;
+    }
+
+    RtlZeroMemory(drain, FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events));
+
+    drain->Cursor = Cursor;
+    drain->Count = KbFilter_DrainTrace(&DevExt->Core,
+                                       &drain->Cursor,
+                                       drain->Events,
+                                       (Length - FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events)) /
+                                           sizeof(KBFILTR_TRACE_EVENT),
+                                       &drain->Lost);
+
+    return FIELD_OFFSET(KBFILTR_TRACE_DRAIN, Events) +
+           drain->Count * sizeof(KBFILTR_TRACE_EVENT);
+}
+
+ULONG
+KbFilter_BatchDrainKeyTrace(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Cursor,
+    OUT PKBFILTR_ENTRY Entry,
+    IN ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Drains the keystroke records captured since Cursor, as many as fit.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+    Cursor - Cursor returned for the keyboard by the previous drain
+    Entry - Receives a KBFILTR_KEYTRACE_DRAIN
+    Length - Space available for the entry
+
+Return Value:
+
+    Size of the entry, zero if it does not fit.
+
+--*/
+{
+    PKBFILTR_KEYTRACE_DRAIN drain = (PKBFILTR_KEYTRACE_DRAIN) Entry;
+
+    PAGED_CODE();
+
+    if (Length < FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records)) {
+        return 0;
+    }
+
+    RtlZeroMemory(drain, FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records));
+
+    drain->Cursor = Cursor;
+    drain->Count = KbFilter_DrainKeyTrace(&DevExt->Core,
+                                          &drain->Cursor,
+                                          drain->Records,
+                                          (Length - FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records)) /
+                                              sizeof(KBFILTR_KEYTRACE_RECORD),
+                                          &drain->Lost);
+
+    return FIELD_OFFSET(KBFILTR_KEYTRACE_DRAIN, Records) +
+           drain->Count * sizeof(KBFILTR_KEYTRACE_RECORD);
+}
+
+PDEVICE_EXTENSION
+KbFilter_FindDevice(
+    IN ULONG Instance
+    )
+/*++
+
+Routine Description:
+
+    Looks up a keyboard by instance number.  Called with
+    KbFilterDeviceListMutex held.
+
+Arguments:
+
+    Instance - Instance number of the keyboard
+
+Return Value:
+
+    Device extension of the keyboard, NULL if it is not attached.
+
+--*/
+{
+    PLIST_ENTRY link;
+    PDEVICE_EXTENSION devExt;
+
+    PAGED_CODE();
+
+    for (link = KbFilterDeviceList.Flink; link != &KbFilterDeviceList; link = link->Flink) {
+        devExt = CONTAINING_RECORD(link, DEVICE_EXTENSION, ListEntry);
+        if (devExt->InstanceNo == Instance) {
+            return devExt;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS
+KbFilter_MapEventRing(
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Maps the event ring of a keyboard into the calling process, creating
+    the ring if nobody reads it yet, and registers the reader's event.  The
+    request must come straight from user mode, so that it runs in the
+    context of the process to map the ring into.
+
+Arguments:
+
+    Irp - IOCTL_KBFILTR_MAP_EVENT_RING request
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack;
+    PKBFILTER_CONTROL_FILE file;
+    KBFILTR_MAP_EVENT_RING request;
+    PKBFILTR_EVENT_RING_MAPPING result;
+    PKBFILTER_EVENT_MAPPING mapping;
+    PKBFILTER_EVENT_CHANNEL channel = NULL, detached = NULL;
+    PDEVICE_EXTENSION devExt;
+    PKEVENT event = NULL;
+    PVOID address = NULL;
+    SIZE_T viewSize = 0;
+    ULONG waiter = 0;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    irpStack = IoGetCurrentIrpStackLocation(Irp);
+    file = (PKBFILTER_CONTROL_FILE) irpStack->FileObject->FsContext;
+
+    if (Irp->RequestorMode != UserMode) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    //
+    // Only the process that opened the handle can tell its mappings apart
+    // when the handle is cleaned up
+    //
+    if (PsGetCurrentProcess() != file->Process) {
+        return STATUS_ACCESS_DENIED;
+    }
+
+    if (irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(KBFILTR_MAP_EVENT_RING)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(KBFILTR_EVENT_RING_MAPPING)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    request = *(PKBFILTR_MAP_EVENT_RING) Irp->AssociatedIrp.SystemBuffer;
+
+    if (request.Event != 0) {
+        status = ObReferenceObjectByHandle((HANDLE) (ULONG_PTR) request.Event,
+                                           EVENT_MODIFY_STATE,
+                                           *ExEventObjectType,
+                                           UserMode,
+                                           (PVOID *) &event,
+                                           NULL);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+    }
+
+    mapping = (PKBFILTER_EVENT_MAPPING) ExAllocatePoolWithTag(PagedPool,
+                                                              sizeof(KBFILTER_EVENT_MAPPING),
+                                                              KBFILTER_POOL_TAG);
+    if (mapping == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        if (event != NULL) {
+            ObDereferenceObject(event);
+        }
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireFastMutex(&KbFilterDeviceListMutex);
+
+    devExt = KbFilter_FindDevice(request.Instance);
+    if (devExt == NULL) {
+        status = STATUS_NO_SUCH_DEVICE;
+        goto Exit;
+    }
+
+    channel = devExt->EventChannel;
+    if (channel == NULL) {
+        channel = KbFilter_CreateEventChannel(devExt);
+        if (channel == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    if (event != NULL) {
+        for (waiter = 0; waiter < KBFILTER_EVENT_WAITERS; waiter++) {
+            if (channel->Waiters[waiter] == NULL) {
+                break;
+            }
+        }
+
+        if (waiter == KBFILTER_EVENT_WAITERS) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    //
+    // A read-only view: its protection cannot be raised above the one it
+    // was mapped with, so readers cannot corrupt the ring for each other
+    //
+    status = ZwMapViewOfSection(channel->Section,
+                                ZwCurrentProcess(),
+                                &address,
+                                0,
+                                0,
+                                NULL,
+                                &viewSize,
+                                ViewUnmap,
+                                0,
+                                PAGE_READONLY);
+    if (!NT_SUCCESS(status)) {
+        goto Exit;
+    }
+
+    RtlZeroMemory(mapping, sizeof(KBFILTER_EVENT_MAPPING));
+    mapping->Channel = channel;
+    mapping->UserAddress = address;
+    mapping->Event = event;
+    mapping->Waiter = waiter;
+
+    if (event != NULL) {
+        InterlockedExchangePointer((PVOID volatile *) &channel->Waiters[waiter], event);
+    }
+
+    InsertTailList(&file->Mappings, &mapping->Link);
+    channel->Mappings++;
+    InterlockedIncrement(&channel->References);
+
+    result = (PKBFILTR_EVENT_RING_MAPPING) Irp->AssociatedIrp.SystemBuffer;
+    RtlZeroMemory(result, sizeof(KBFILTR_EVENT_RING_MAPPING));
+    result->Address = (ULONGLONG) (ULONG_PTR) address;
+    result->Size = channel->Size;
+    Irp->IoStatus.Information = sizeof(KBFILTR_EVENT_RING_MAPPING);
+
+    mapping = NULL;
+    event = NULL;
+    status = STATUS_SUCCESS;
+
+Exit:
+    //
+    // A ring created for a reader that then failed has nobody to read it
+    //
+    if (channel != NULL && channel->Mappings == 0) {
+        detached = KbFilter_DetachEventChannel(devExt);
+    }
+
+    ExReleaseFastMutex(&KbFilterDeviceListMutex);
+
+    if (detached != NULL) {
+        KeFlushQueuedDpcs();
+        KbFilter_ReleaseEventChannel(detached);
+    }
+
+    if (event != NULL) {
+        ObDereferenceObject(event);
+    }
+
+    if (mapping != NULL) {
+        ExFreePoolWithTag(mapping, KBFILTER_POOL_TAG);
+    }
+
+    return status;
+}
+
+BOOLEAN
+KbFilter_UnmapEventRings(
+    IN PKBFILTER_CONTROL_FILE File,
+    IN PVOID UserAddress
+    )
+/*++
+
+Routine Description:
+
+    Removes event ring mappings made through a control device handle.  A
+    ring whose last reader goes away is detached from its keyboard.
+    Registered events are removed and every service callback that may
+    still be signalling them has finished before they are released.
+
+    Views are unmapped only when called in the process that opened the
+    handle.  Called from another process, which can only happen when the
+    handle is cleaned up there, the mappings are removed and their views
+    are left to the opening process: a view keeps the section, and with it
+    the ring's pages, alive until it is unmapped or the process exits.
+    Must be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    File - File context of the handle
+    UserAddress - Address of the mapping to remove, NULL for all mappings
+                  of the handle
+
+Return Value:
+
+    TRUE if a mapping was removed.
+
+--*/
+{
+    PKBFILTER_EVENT_MAPPING mapping;
+    PKBFILTER_EVENT_CHANNEL channel, detached;
+    PLIST_ENTRY link;
+    BOOLEAN removed = FALSE, opener;
+
+    PAGED_CODE();
+
+    opener = (BOOLEAN) (PsGetCurrentProcess() == File->Process);
+    if (UserAddress != NULL && !opener) {
+        return FALSE;
+    }
+
+    for (;;) {
+        mapping = NULL;
+        detached = NULL;
+
+        ExAcquireFastMutex(&KbFilterDeviceListMutex);
+
+        for (link = File->Mappings.Flink; link != &File->Mappings; link = link->Flink) {
+            mapping = CONTAINING_RECORD(link, KBFILTER_EVENT_MAPPING, Link);
+            if (UserAddress == NULL || mapping->UserAddress == UserAddress) {
+                break;
+            }
+            mapping = NULL;
+        }
+
+        if (mapping == NULL) {
+            ExReleaseFastMutex(&KbFilterDeviceListMutex);
+            break;
+        }
+
+        channel = mapping->Channel;
+
+        RemoveEntryList(&mapping->Link);
+        if (mapping->Event != NULL) {
+            InterlockedExchangePointer((PVOID volatile *) &channel->Waiters[mapping->Waiter], NULL);
+        }
+
+        channel->Mappings--;
+        if (channel->Mappings == 0 && channel->DevExt != NULL) {
+            detached = KbFilter_DetachEventChannel(channel->DevExt);
+        }
+
+        ExReleaseFastMutex(&KbFilterDeviceListMutex);
+
+        KeFlushQueuedDpcs();
+
+        if (opener) {
+            ZwUnmapViewOfSection(ZwCurrentProcess(), mapping->UserAddress);
+        }
+        if (mapping->Event != NULL) {
+            ObDereferenceObject(mapping->Event);
+        }
+        ExFreePoolWithTag(mapping, KBFILTER_POOL_TAG);
+
+        KbFilter_ReleaseEventChannel(channel);
+        if (detached != NULL) {
+            KbFilter_ReleaseEventChannel(detached);
+        }
+
+        removed = TRUE;
+        if (UserAddress != NULL) {
+            break;
+        }
+    }
+
+    return removed;
+}
+
+PKBFILTER_EVENT_CHANNEL
+KbFilter_CreateEventChannel(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+
+Routine Description:
+
+    Allocates an event ring for a keyboard and starts writing events to it.
+    The ring is a pagefile-backed section rounded up to whole pages, so that
+    a view exposes nothing but the ring.  The filter writes it at
+    DISPATCH_LEVEL through a view in system space whose pages stay locked
+    for the life of the channel.  Called with KbFilterDeviceListMutex held.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+
+Return Value:
+
+    The attached channel, holding the keyboard's reference, or NULL if
+    there is no memory.
+
+--*/
+{
+    PKBFILTER_EVENT_CHANNEL channel;
+    PKBFILTR_EVENT_RING ring;
+    OBJECT_ATTRIBUTES attributes;
+    LARGE_INTEGER maximumSize;
+    SIZE_T viewSize;
+    NTSTATUS status;
+    ULONG size;
+
+    PAGED_CODE();
+
+    size = (ULONG) ROUND_TO_PAGES(FIELD_OFFSET(KBFILTR_EVENT_RING, Records) +
+                                  KBFILTER_EVENT_RING_RECORDS * sizeof(KBFILTR_EVENT_RECORD));
+
+    channel = (PKBFILTER_EVENT_CHANNEL) ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                              sizeof(KBFILTER_EVENT_CHANNEL),
+                                                              KBFILTER_POOL_TAG);
+    if (channel == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        return NULL;
+    }
+
+    RtlZeroMemory(channel, sizeof(KBFILTER_EVENT_CHANNEL));
+    channel->Size = size;
+
+    maximumSize.QuadPart = size;
+    InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwCreateSection(&channel->Section,
+                             SECTION_ALL_ACCESS,
+                             &attributes,
+                             &maximumSize,
+                             PAGE_READWRITE,
+                             SEC_COMMIT,
+                             NULL);
+    if (!NT_SUCCESS(status)) {
+        channel->Section = NULL;
+        goto Failed;
+    }
+
+    status = ObReferenceObjectByHandle(channel->Section,
+                                       SECTION_MAP_READ | SECTION_MAP_WRITE,
+                                       NULL,
+                                       KernelMode,
+                                       &channel->SectionObject,
+                                       NULL);
+    if (!NT_SUCCESS(status)) {
+        channel->SectionObject = NULL;
+        goto Failed;
+    }
+
+    viewSize = size;
+    status = MmMapViewInSystemSpace(channel->SectionObject, &channel->SystemView, &viewSize);
+    if (!NT_SUCCESS(status)) {
+        channel->SystemView = NULL;
+        goto Failed;
+    }
+
+    channel->Mdl = IoAllocateMdl(channel->SystemView, size, FALSE, FALSE, NULL);
+    if (channel->Mdl == NULL) {
+        goto Failed;
+    }
+
+    __try {
+        MmProbeAndLockPages(channel->Mdl, KernelMode, IoWriteAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER) {
+        goto Failed;
+    }
+
+    ring = (PKBFILTR_EVENT_RING) MmGetSystemAddressForMdlSafe(channel->Mdl,
+                                                              NormalPagePriority | MdlMappingNoExecute);
+    if (ring == NULL) {
+        goto Failed;
+    }
+
+    //
+    // Committed section pages start zeroed
+    //
+    KbFilter_InitializeEventRing(&channel->Writer, ring, KBFILTER_EVENT_RING_RECORDS);
+    channel->References = 1;
+    channel->DevExt = DevExt;
+
+    DevExt->EventChannel = channel;
+    KbFilter_AttachEventRing(&DevExt->Core, &channel->Writer);
+
+    return channel;
+
+Failed:
+    InterlockedIncrement(&KbFilterAllocationFailures);
+
+    KbFilter_FreeEventChannel(channel);
+    return NULL;
+}
+
+PKBFILTER_EVENT_CHANNEL
+KbFilter_DetachEventChannel(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
+
+Routine Description:
+
+    Stops writing events for a keyboard.  A batch in progress may still be
+    writing to the ring, so the caller releases the keyboard's reference
+    only after KeFlushQueuedDpcs, once it has dropped
+    KbFilterDeviceListMutex.  Called with KbFilterDeviceListMutex held.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+
+Return Value:
+
+    The detached channel, NULL if the keyboard had none.
+
+--*/
+{
+    PKBFILTER_EVENT_CHANNEL channel = DevExt->EventChannel;
+
+    PAGED_CODE();
+
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    KbFilter_AttachEventRing(&DevExt->Core, NULL);
+    DevExt->EventChannel = NULL;
+    channel->DevExt = NULL;
+
+    return channel;
+}
+
+VOID
+KbFilter_ReleaseEventChannel(
+    IN PKBFILTER_EVENT_CHANNEL Channel
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference to an event channel and frees the ring once neither
+    a keyboard nor a mapping uses it.
+
+Arguments:
+
+    Channel - Event channel
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (InterlockedDecrement(&Channel->References) != 0) {
+        return;
+    }
+
+    KbFilter_FreeEventChannel(Channel);
+}
+
+VOID
+KbFilter_FreeEventChannel(
+    IN PKBFILTER_EVENT_CHANNEL Channel
+    )
+/*++
+
+Routine Description:
+
+    Frees an event channel and its section, however far its creation got.
+
+Arguments:
+
+    Channel - Event channel no keyboard and no mapping uses
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (Channel->Mdl != NULL) {
+        if (Channel->Mdl->MdlFlags & MDL_PAGES_LOCKED) {
+            MmUnlockPages(Channel->Mdl);
+        }
+        IoFreeMdl(Channel->Mdl);
+    }
+
+    if (Channel->SystemView != NULL) {
+        MmUnmapViewInSystemSpace(Channel->SystemView);
+    }
+
+    if (Channel->SectionObject != NULL) {
+        ObDereferenceObject(Channel->SectionObject);
+    }
+
+    if (Channel->Section != NULL) {
+        ZwClose(Channel->Section);
+    }
+
+    ExFreePoolWithTag(Channel, KBFILTER_POOL_TAG);
+}
+
+VOID
+KbFilter_SignalEventWaiters(
+    IN PKBFILTER_EVENT_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Wakes the readers of an event ring after a batch was published.  Called
+    at DISPATCH_LEVEL from the service callback and the stuck key DPC, so
+    it is not pageable.  Waiters are removed before KeFlushQueuedDpcs and
+    released after it, so an event read here stays valid.
+
+Arguments:
+
+    Writer - Writer returned by KbFilter_PublishEvents, or NULL if nothing
+             was published
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_EVENT_CHANNEL channel;
+    PKEVENT event;
+    ULONG i;
+
+    if (Writer == NULL) {
+        return;
+    }
+
+    channel = CONTAINING_RECORD(Writer, KBFILTER_EVENT_CHANNEL, Writer);
+
+    for (i = 0; i < KBFILTER_EVENT_WAITERS; i++) {
+        event = *(PKEVENT volatile *) &channel->Waiters[i];
+        if (event != NULL) {
+            KeSetEvent(event, IO_NO_INCREMENT, FALSE);
+        }
+    }
+}
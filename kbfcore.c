@@ -0,0 +1,3444 @@
+/*++
+
+Module Name:
+
+    kbfcore.c
+
+Abstract:
+
+    Lag mitigation core of the keyboard filter.  Everything that decides the
+    fate of a keyboard packet lives here, apart from the WDM plumbing that
+    delivers packets to it: stamping scan codes with their arrival time,
+    detecting lag duplicates and fast typematic repeats, learning per-key
+    thresholds and tracing the decisions.
+
+    The module only depends on kbfplat.h, so it is compiled unchanged into
+    the driver and into user-mode builds.  All routines are nonpaged; they
+    run in the service callback at DISPATCH_LEVEL or in the ISR hook.
+
+Environment:
+
+    Kernel mode and user mode
+
+--*/
+
+#include "kbfcore.h"
+
+//
+// Upper limits of the inter-press interval histogram buckets, in ms.
+// Intervals at or above the last limit are not recorded.
+//
+const USHORT KbFilterIntervalBucketLimits[KBFILTER_INTERVAL_BUCKETS] = {
+    2, 4, 8, 16, 24, 32, 48, 64, 96, 128, 160, 192, 256, 384, 512, 1000
+};
+
+VOID
+KbFilter_InitializeCore(
+    OUT PKBFILTER_CORE Core,
+    IN KBFILTER_DEDUP_MODE DedupMode,
+    IN KBFILTER_CLOCK Clock,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context,
+    IN ULONGLONG Frequency
+    )
+/*++
+
+Routine Description:
+
+    Initializes the lag mitigation state of a keyboard: empty key table, the
+    given clock and dedup mode, and the default repeat rate until the class
+    driver sets one.
+
+Arguments:
+
+    Core - Lag mitigation state to initialize
+    DedupMode - How the key table is synchronized
+    Clock - Clock to time keys with
+    Routine - Reader for KbFilterClockInjected, ignored otherwise
+    Context - Context passed to Routine
+    Frequency - Counts per second of Routine, ignored for the system clocks
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KEYBOARD_TYPEMATIC_PARAMETERS typematic;
+
+    RtlZeroMemory(Core, sizeof(KBFILTER_CORE));
+
+    KbfPlatInitializeLock(&Core->RecentKeysLock);
+    KbFilter_InitializeTimeSource(&Core->TimeSource, Clock, Routine, Context, Frequency);
+    Core->DedupMode = DedupMode;
+    Core->DedupActive = TRUE;
+    Core->LastMakeSlot = (LONG) KBFILTER_NO_KEY_SLOT;
+    KbfPlatPerformanceCounter(&Core->ProfileFrequency);
+    Core->Stats = &Core->DefaultShard;
+    Core->StatsShards = 1;
+
+    typematic.UnitId = 0;
+    typematic.Rate = KEYBOARD_TYPEMATIC_RATE_DEFAULT;
+    typematic.Delay = KEYBOARD_TYPEMATIC_DELAY_DEFAULT;
+    KbFilter_SetTypematic(Core, &typematic);
+}
+
+VOID
+KbFilter_RecordArrival(
+    IN PKBFILTER_CORE Core,
+    IN UCHAR DataByte,
+    IN KEYBOARD_SCAN_STATE ScanState
+    )
+/*++
+
+Routine Description:
+
+    Called from KbFilter_IsrHook for every byte i8042prt is about to process.
+    If the byte completes a scan code, the scan code and the current interrupt
+    time are pushed to the arrival ring for KbFilter_ServiceCallback.
+
+    Runs at DIRQL.
+
+Arguments:
+
+    Core - Lag mitigation state owning the arrival ring
+    DataByte - Byte read from the keyboard
+    ScanState - Prefix state of i8042prt before DataByte is processed
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_ARRIVAL arrival;
+    ULONG head;
+    USHORT flags;
+
+    switch (DataByte) {
+    case 0xE0:
+    case 0xE1:
+        //
+        // Prefix bytes, the scan code is completed by a later byte
+        //
+        return;
+
+    case 0x00:
+    case 0xFF:
+    case ACKNOWLEDGE:
+    case RESEND:
+        //
+        // Overrun and command responses do not produce input packets
+        //
+        return;
+    }
+
+    flags = (DataByte & 0x80) ? KEY_BREAK : KEY_MAKE;
+    if (ScanState == GotE0) {
+        flags |= KEY_E0;
+    }
+    else if (ScanState == GotE1) {
+        flags |= KEY_E1;
+    }
+
+    //
+    // If the ring is full the callback is far behind; drop the stamp and let
+    // it fall back to callback time for this packet.
+    //
+    head = Core->ArrivalHead;
+    if (head - Core->ArrivalTail >= KBFILTER_ARRIVAL_RING_SIZE) {
+        return;
+    }
+
+    arrival = &Core->ArrivalRing[head & (KBFILTER_ARRIVAL_RING_SIZE - 1)];
+    arrival->MakeCode = DataByte & 0x7F;
+    arrival->Flags = flags;
+    arrival->KeyTime = KbFilter_QueryKeyTime(&Core->TimeSource);
+
+    //
+    // Publish the entry only after it is completely written
+    //
+    KeMemoryBarrier();
+    Core->ArrivalHead = head + 1;
+}
+
+VOID
+KbFilter_SetIsrReject(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Configures the ISR fast reject of a keyboard from a policy.  The bounce
+    window is converted to clock counts once, so the ISR only compares raw
+    clock readings.  The tick count clock is too coarse to tell bounce from
+    typing, so the fast reject stays off with it.  Must be called before
+    the ISR hook is installed, and after the keyboard has joined its dedup
+    domain, which may change its clock.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Policy - Policy to take IsrRejectUs and the exempt keys from
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONGLONG ticks;
+    ULONG slot;
+
+    RtlZeroMemory(Core->IsrExempt, sizeof(Core->IsrExempt));
+    Core->IsrRejectTicks = 0;
+
+    if (!Policy->Enabled || Policy->IsrRejectUs == 0 ||
+        Core->TimeSource.Clock == KbFilterClockTickCount) {
+        return;
+    }
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        if (Policy->Keys[slot].Options & KBFILTR_KEY_POLICY_EXEMPT) {
+            Core->IsrExempt[slot / 32] |= 1u << (slot % 32);
+        }
+    }
+
+    ticks = Core->TimeSource.Frequency *
+            MIN(Policy->IsrRejectUs, KBFILTER_ISR_REJECT_MAX_US) / 1000000;
+
+    Core->IsrRejectTicks = (ticks != 0) ? (ULONG) ticks : 1;
+}
+
+BOOLEAN
+KbFilter_IsrRejectByte(
+    IN PKBFILTER_CORE Core,
+    IN UCHAR DataByte,
+    IN KEYBOARD_SCAN_STATE ScanState
+    )
+/*++
+
+Routine Description:
+
+    Decides in KbFilter_IsrHook whether a byte is the bounce of a make code
+    and should be dropped before i8042prt processes it.  A byte completes a
+    make code unless it is a prefix, a break code or a command response;
+    the make is rejected if the same key was last accepted less than
+    IsrRejectTicks ago.  Rejected makes do not move the key's time, so
+    continuous chatter is only suppressed within the window of the press
+    it bounces from.  Every rejected byte is counted in IsrRejects.  The
+    caller must reset the scan state along with a rejected byte, since an
+    E0 prefix was already consumed.
+
+    Runs at DIRQL.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    DataByte - Byte read from the keyboard
+    ScanState - Prefix state of i8042prt before DataByte is processed
+
+Return Value:
+
+    TRUE if the byte is to be dropped.
+
+--*/
+{
+    KEYBOARD_INPUT_DATA keyData;
+    PKBFILTER_ISR_ENTRY entry;
+    ULONGLONG now;
+    ULONG slot;
+
+    if (Core->IsrRejectTicks == 0) {
+        return FALSE;
+    }
+
+    switch (DataByte) {
+    case 0xE1:
+        //
+        // Pause is E1 1D 45 E1 9D C5; none of its bytes are rejected
+        //
+        Core->IsrSequenceBytes = 2;
+        return FALSE;
+
+    case 0xE0:
+    case 0x00:
+    case 0xFF:
+    case ACKNOWLEDGE:
+    case RESEND:
+        return FALSE;
+    }
+
+    if (Core->IsrSequenceBytes != 0) {
+        Core->IsrSequenceBytes--;
+        return FALSE;
+    }
+
+    if (ScanState == GotE1 || (DataByte & 0x80)) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(&keyData, sizeof(keyData));
+    keyData.MakeCode = DataByte;
+    keyData.Flags = (ScanState == GotE0) ? KEY_E0 : KEY_MAKE;
+
+    slot = KbFilter_KeySlot(&keyData);
+    if (slot == KBFILTER_NO_KEY_SLOT ||
+        (Core->IsrExempt[slot / 32] & (1u << (slot % 32)))) {
+        return FALSE;
+    }
+
+    now = KbFilter_ReadClock(&Core->TimeSource);
+    entry = &Core->IsrTable[slot % KBFILTER_ISR_TABLE_SIZE];
+
+    if (entry->Slot == slot + 1 && now - entry->Time < Core->IsrRejectTicks) {
+        Core->IsrRejects++;
+        return TRUE;
+    }
+
+    entry->Slot = slot + 1;
+    entry->Time = now;
+    return FALSE;
+}
+
+ULONG
+KbFilter_SimulateIsr(
+    IN PKBFILTER_CORE Core,
+    IN PUCHAR DataBytes,
+    IN ULONG Count,
+    IN OUT PKEYBOARD_SCAN_STATE ScanState,
+    OUT PKEYBOARD_INPUT_DATA OutputData
+    )
+/*++
+
+Routine Description:
+
+    Stands in for the i8042 interrupt in user-mode builds.  Every byte goes
+    through the same steps as in KbFilter_IsrHook: the fast reject, which
+    resets the scan state along with a rejected byte, then the arrival
+    ring.  The bytes that remain are turned into packets by a model of the
+    scan code state machine of i8042prt.  Bytes are stamped with the
+    current reading of the core's clock, so a harness with an injected
+    clock advances it between calls; set IsrHooked for the service callback
+    to use the arrival times.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    DataBytes - Bytes read from the keyboard
+    Count - Number of bytes
+    ScanState - Scan state of i8042prt, Normal before the first call
+    OutputData - Receives the packets i8042prt would queue, must have room
+                 for Count packets
+
+Return Value:
+
+    Number of packets written to OutputData.
+
+--*/
+{
+    PKEYBOARD_INPUT_DATA packet;
+    ULONG i, produced = 0;
+    UCHAR dataByte;
+
+    for (i = 0; i < Count; i++) {
+        dataByte = DataBytes[i];
+
+        if (KbFilter_IsrRejectByte(Core, dataByte, *ScanState)) {
+            *ScanState = Normal;
+            continue;
+        }
+
+        KbFilter_RecordArrival(Core, dataByte, *ScanState);
+
+        switch (dataByte) {
+        case 0xE0:
+            *ScanState = GotE0;
+            continue;
+
+        case 0xE1:
+            *ScanState = GotE1;
+            continue;
+
+        case 0x00:
+        case 0xFF:
+        case ACKNOWLEDGE:
+        case RESEND:
+            continue;
+        }
+
+        packet = &OutputData[produced++];
+        RtlZeroMemory(packet, sizeof(KEYBOARD_INPUT_DATA));
+        packet->MakeCode = dataByte & 0x7F;
+        packet->Flags = (dataByte & 0x80) ? KEY_BREAK : KEY_MAKE;
+        if (*ScanState == GotE0) {
+            packet->Flags |= KEY_E0;
+        }
+        else if (*ScanState == GotE1) {
+            packet->Flags |= KEY_E1;
+        }
+
+        *ScanState = Normal;
+    }
+
+    return produced;
+}
+
+ULONG
+KbFilter_TakeArrivalTime(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CallbackTime
+    )
+/*++
+
+Routine Description:
+
+    Returns the arrival time recorded by KbFilter_IsrHook for a packet.
+    Packets are reported in the order their scan codes completed, so the
+    packet normally matches the oldest ring entry.  Entries for bytes that did
+    not produce a packet are skipped, up to KBFILTER_ARRIVAL_SEARCH of them.
+    Runs at DISPATCH_LEVEL; the port driver does not report packets for the
+    same device on two processors at once.
+
+Arguments:
+
+    Core - Lag mitigation state owning the arrival ring
+    InputData - Packet being reported
+    CallbackTime - Key time to use if no arrival time is found
+
+Return Value:
+
+    Key time of the packet.
+
+--*/
+{
+    PKBFILTER_ARRIVAL arrival;
+    ULONG head, tail, index;
+    USHORT flags;
+
+    if (!Core->IsrHooked) {
+        return CallbackTime;
+    }
+
+    head = Core->ArrivalHead;
+    tail = Core->ArrivalTail;
+
+    //
+    // Read the entries only after the head that published them
+    //
+    KeMemoryBarrier();
+
+    flags = InputData->Flags & (KEY_BREAK | KEY_E0 | KEY_E1);
+
+    for (index = tail;
+         index != head && index - tail < KBFILTER_ARRIVAL_SEARCH;
+         index++) {
+
+        arrival = &Core->ArrivalRing[index & (KBFILTER_ARRIVAL_RING_SIZE - 1)];
+
+        if (arrival->MakeCode == InputData->MakeCode && arrival->Flags == flags) {
+            Core->ArrivalTail = index + 1;
+            return arrival->KeyTime;
+        }
+    }
+
+    //
+    // No match, drop the oldest entry so that a stale entry cannot keep the
+    // ring from ever matching again.
+    //
+    if (tail != head) {
+        Core->ArrivalTail = tail + 1;
+    }
+
+    return CallbackTime;
+}
+
+VOID
+KbFilter_SetTypematic(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_TYPEMATIC_PARAMETERS Typematic
+    )
+/*++
+
+Routine Description:
+
+    Records the typematic parameters of a keyboard and derives its
+    thresholds: the shortest interval accepted between two repeats of a held
+    key, half the repeat period, so that jitter in legitimate repeats is
+    tolerated; the shortest interval between a press and its first repeat,
+    KBFILTER_FIRST_REPEAT_PERCENT of the delay; and the duplicate threshold
+    cap, the delay itself.  Called whenever a typematic request to the
+    keyboard completes, so the thresholds follow the user's settings.
+    Parameters with a zero rate or delay are not settings a keyboard can
+    apply and keep the previous thresholds; a zero delay would otherwise
+    cap every duplicate threshold at zero and turn dedup off.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Typematic - Repeat rate (characters per second) and delay (ms)
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Typematic->Rate == 0 || Typematic->Delay == 0) {
+        return;
+    }
+
+    Core->Typematic = *Typematic;
+    Core->RepeatWindowMs = 1000 / (2 * (ULONG) Typematic->Rate);
+    Core->FirstRepeatWindowMs = (ULONG) Typematic->Delay * KBFILTER_FIRST_REPEAT_PERCENT / 100;
+    Core->TypematicThresholdMs = Typematic->Delay;
+}
+
+ULONG
+KbFilter_KeySlot(
+    IN PKEYBOARD_INPUT_DATA InputData
+    )
+/*++
+
+Routine Description:
+
+    Maps a keyboard packet to its slot in the per-device key table.  The E0
+    and E1 prefixes select separate planes, so that e.g. right Ctrl and left
+    Ctrl are tracked independently.
+
+Arguments:
+
+    InputData - Keyboard input data to map
+
+Return Value:
+
+    Slot index, or KBFILTER_NO_KEY_SLOT if the make code is not tracked.
+
+--*/
+{
+    if (InputData->MakeCode >= KBFILTER_MAKE_CODES) {
+        return KBFILTER_NO_KEY_SLOT;
+    }
+
+    if (InputData->Flags & KEY_E1) {
+        return 2 * KBFILTER_MAKE_CODES + InputData->MakeCode;
+    }
+
+    if (InputData->Flags & KEY_E0) {
+        return KBFILTER_MAKE_CODES + InputData->MakeCode;
+    }
+
+    return InputData->MakeCode;
+}
+
+UCHAR
+KbFilter_KeyClass(
+    IN PKEYBOARD_INPUT_DATA InputData
+    )
+/*++
+
+Routine Description:
+
+    Classifies a key for trace events, so that traces show what kind of key
+    was filtered without recording what was typed.  Ranges follow scan code
+    set 1 as reported by the port drivers.
+
+Arguments:
+
+    InputData - Keyboard input data to classify
+
+Return Value:
+
+    One of the KBFILTR_KEY_CLASS_ values.
+
+--*/
+{
+    USHORT makeCode = InputData->MakeCode;
+
+    if (InputData->Flags & KEY_E1) {
+        return KBFILTR_KEY_CLASS_OTHER;
+    }
+
+    if (InputData->Flags & KEY_E0) {
+        switch (makeCode) {
+        case 0x1D: case 0x38: case 0x5B: case 0x5C: case 0x5D:
+            return KBFILTR_KEY_CLASS_MODIFIER;
+        case 0x1C: case 0x35:
+            return KBFILTR_KEY_CLASS_KEYPAD;
+        }
+
+        if (makeCode >= 0x47 && makeCode <= 0x53) {
+            return KBFILTR_KEY_CLASS_NAVIGATION;
+        }
+        return KBFILTR_KEY_CLASS_OTHER;
+    }
+
+    switch (makeCode) {
+    case 0x1D: case 0x2A: case 0x36: case 0x38: case 0x3A:
+        return KBFILTR_KEY_CLASS_MODIFIER;
+    case 0x37: case 0x45:
+        return KBFILTR_KEY_CLASS_KEYPAD;
+    case 0x57: case 0x58:
+        return KBFILTR_KEY_CLASS_FUNCTION;
+    }
+
+    if (makeCode >= 0x02 && makeCode <= 0x39) {
+        return KBFILTR_KEY_CLASS_CHARACTER;
+    }
+    if (makeCode >= 0x3B && makeCode <= 0x44) {
+        return KBFILTR_KEY_CLASS_FUNCTION;
+    }
+    if (makeCode >= 0x47 && makeCode <= 0x53) {
+        return KBFILTR_KEY_CLASS_KEYPAD;
+    }
+    return KBFILTR_KEY_CLASS_OTHER;
+}
+
+VOID
+KbFilter_TraceKey(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    )
+/*++
+
+Routine Description:
+
+    Records the decision made for a packet in the device's trace ring.  This
+    is called for every traced packet at DISPATCH_LEVEL, so it only claims a
+    sequence number and stores a few bytes; no message is formatted.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    InputData - Packet the decision was made for
+    Decision - One of the KBFILTR_DECISION_ values
+    KeyTime - Key time the packet was checked at
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_TRACE_EVENT event;
+    ULONG sequence;
+
+    sequence = (ULONG) InterlockedIncrement(&Core->TraceHead) - 1;
+    event = &Core->TraceRing[sequence % KBFILTER_TRACE_RING_SIZE];
+
+    event->KeyTime = KeyTime;
+    event->EventId = KBFILTR_TRACE_KEY;
+    event->KeyClass = KbFilter_KeyClass(InputData);
+    event->Decision = Decision;
+    event->Flags = (InputData->Flags & KEY_BREAK) ? KBFILTR_TRACE_FLAG_BREAK : 0;
+}
+
+ULONG
+KbFilter_DrainRing(
+    IN PVOID Ring,
+    IN ULONG RingSize,
+    IN ULONG RecordSize,
+    IN volatile LONG *Head,
+    IN OUT PULONG Cursor,
+    OUT PVOID Records,
+    IN ULONG Count,
+    OUT PULONG Lost
+    )
+/*++
+
+Routine Description:
+
+    Copies the records written to a ring since Cursor, oldest first.  The
+    rings of the core are written by claiming a sequence number from Head
+    and storing the record at the sequence number modulo RingSize.  Readers
+    keep their own cursor, so any number of them can drain the same ring;
+    records are never removed.  Records overwritten before or while they
+    were copied are dropped and counted in Lost.  A record whose write is
+    still in progress on another processor may be returned with stale
+    contents.
+
+Arguments:
+
+    Ring - First record of the ring
+    RingSize - Number of records in the ring
+    RecordSize - Size of one record in bytes
+    Head - Number of records ever written to the ring
+    Cursor - Sequence number of the first record to copy, zero to start with
+             the oldest record; receives the cursor for the next call
+    Records - Receives the records
+    Count - Capacity of Records
+    Lost - Receives the number of records that could not be returned
+
+Return Value:
+
+    Number of records copied to Records.
+
+--*/
+{
+    ULONG head, first, next, copied, overwritten;
+    PUCHAR ring = (PUCHAR) Ring;
+    PUCHAR records = (PUCHAR) Records;
+
+    head = (ULONG) *Head;
+    next = *Cursor;
+    *Lost = 0;
+
+    //
+    // A cursor ahead of the ring did not come from this device, start over
+    //
+    if ((LONG) (head - next) < 0) {
+        next = head - MIN(head, RingSize);
+    }
+
+    if (head - next > RingSize) {
+        *Lost = head - next - RingSize;
+        next = head - RingSize;
+    }
+
+    first = next;
+    for (copied = 0; next != head && copied < Count; copied++, next++) {
+        RtlCopyMemory(records + copied * RecordSize,
+                      ring + (next % RingSize) * RecordSize,
+                      RecordSize);
+    }
+
+    //
+    // Drop the copied records that writers have lapped in the meantime
+    //
+    KeMemoryBarrier();
+    head = (ULONG) *Head;
+
+    if (head - first > RingSize) {
+        overwritten = MIN(head - first - RingSize, copied);
+
+        RtlMoveMemory(records,
+                      records + overwritten * RecordSize,
+                      (copied - overwritten) * RecordSize);
+        copied -= overwritten;
+        *Lost += overwritten;
+    }
+
+    *Cursor = next;
+    return copied;
+}
+
+ULONG
+KbFilter_DrainTrace(
+    IN PKBFILTER_CORE Core,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_TRACE_EVENT Events,
+    IN ULONG Count,
+    OUT PULONG Lost
+    )
+/*++
+
+Routine Description:
+
+    Copies the trace events recorded since Cursor, oldest first, see
+    KbFilter_DrainRing.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Cursor - Sequence number of the first event to copy, zero to start with
+             the oldest event; receives the cursor for the next call
+    Events - Receives the events
+    Count - Capacity of Events
+    Lost - Receives the number of events that could not be returned
+
+Return Value:
+
+    Number of events copied to Events.
+
+--*/
+{
+    return KbFilter_DrainRing(Core->TraceRing,
+                              KBFILTER_TRACE_RING_SIZE,
+                              sizeof(KBFILTR_TRACE_EVENT),
+                              &Core->TraceHead,
+                              Cursor,
+                              Events,
+                              Count,
+                              Lost);
+}
+
+VOID
+KbFilter_CaptureKey(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    )
+/*++
+
+Routine Description:
+
+    Appends a checked packet and the decision made for it to the capture
+    ring, preceded by a SYNC record when the ring position or the time since
+    the previous record calls for one.  Called only when the policy enables
+    RecordKeys.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    InputData - Packet that was checked
+    Decision - One of the KBFILTR_DECISION_ values
+    KeyTime - Key time the packet was checked at
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_KEYTRACE_RECORD record;
+    ULONG sequence, delta;
+
+    sequence = (ULONG) InterlockedIncrement(&Core->CaptureHead) - 1;
+    delta = KeyTime - Core->CaptureLastTime;
+
+    if (sequence % KBFILTR_KEYTRACE_SYNC_INTERVAL == 0 || delta > MAXUSHORT) {
+        record = &Core->CaptureRing[sequence % KBFILTER_CAPTURE_RING_SIZE];
+        record->Kind = KBFILTR_KEYTRACE_SYNC;
+        record->Decision = 0;
+        record->UnitId = 0;
+        record->Flags = 0;
+        record->u.KeyTime = KeyTime;
+
+        sequence = (ULONG) InterlockedIncrement(&Core->CaptureHead) - 1;
+        delta = 0;
+    }
+
+    Core->CaptureLastTime = KeyTime;
+
+    record = &Core->CaptureRing[sequence % KBFILTER_CAPTURE_RING_SIZE];
+    record->Kind = KBFILTR_KEYTRACE_KEY;
+    record->Decision = Decision;
+    record->UnitId = (UCHAR) InputData->UnitId;
+    record->Flags = (UCHAR) InputData->Flags;
+    record->u.Key.DeltaMs = (USHORT) delta;
+    record->u.Key.MakeCode = InputData->MakeCode;
+}
+
+ULONG
+KbFilter_DrainKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    OUT PULONG Lost
+    )
+/*++
+
+Routine Description:
+
+    Copies the keystroke records captured since Cursor, oldest first, see
+    KbFilter_DrainRing.  After lost records the deltas of the records up to
+    the next SYNC record are meaningless.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Cursor - Sequence number of the first record to copy, zero to start with
+             the oldest record; receives the cursor for the next call
+    Records - Receives the records
+    Count - Capacity of Records
+    Lost - Receives the number of records that could not be returned
+
+Return Value:
+
+    Number of records copied to Records.
+
+--*/
+{
+    return KbFilter_DrainRing(Core->CaptureRing,
+                              KBFILTER_CAPTURE_RING_SIZE,
+                              sizeof(KBFILTR_KEYTRACE_RECORD),
+                              &Core->CaptureHead,
+                              Cursor,
+                              Records,
+                              Count,
+                              Lost);
+}
+
+VOID
+KbFilter_InitializeEventRing(
+    OUT PKBFILTER_EVENT_WRITER Writer,
+    OUT PKBFILTR_EVENT_RING Ring,
+    IN ULONG RecordCount
+    )
+/*++
+
+Routine Description:
+
+    Initializes an empty event ring and the writer that fills it.
+
+Arguments:
+
+    Writer - Receives the producer state
+    Ring - Memory for the ring, FIELD_OFFSET(KBFILTR_EVENT_RING, Records)
+           plus RecordCount records
+    RecordCount - Number of records, a power of two
+
+Return Value:
+
+    None.
+
+--*/
+{
+    RtlZeroMemory(Ring,
+                  FIELD_OFFSET(KBFILTR_EVENT_RING, Records) +
+                      RecordCount * sizeof(KBFILTR_EVENT_RECORD));
+
+    Ring->Magic = KBFILTR_EVENT_RING_MAGIC;
+    Ring->Version = KBFILTR_EVENT_RING_VERSION;
+    Ring->RecordSize = sizeof(KBFILTR_EVENT_RECORD);
+    Ring->RecordCount = RecordCount;
+
+    Writer->Ring = Ring;
+    Writer->Mask = RecordCount - 1;
+    Writer->Head = 1;
+    Writer->Published = 0;
+}
+
+PKBFILTER_EVENT_WRITER
+KbFilter_AttachEventRing(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_EVENT_WRITER Writer
+    )
+/*++
+
+Routine Description:
+
+    Starts writing events through Writer, or stops writing them if Writer
+    is NULL.  The previous writer may still be in use by a batch in
+    progress; the caller must wait for it to finish before freeing it.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Writer - Initialized writer, or NULL
+
+Return Value:
+
+    The previous writer, NULL if there was none.
+
+--*/
+{
+    return (PKBFILTER_EVENT_WRITER) InterlockedExchangePointer((PVOID volatile *) &Core->EventWriter,
+                                                               Writer);
+}
+
+VOID
+KbFilter_RecordDecision(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTER_EVENT_WRITER Writer,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    )
+/*++
+
+Routine Description:
+
+    Records a packet and its decision for the consumers that asked for it:
+    the capture ring if the policy enables RecordKeys, and the event ring if
+    a reader has mapped it.  The event record is invalidated before it is
+    rewritten and stamped with its number last, so readers never mistake a
+    half-written record for a complete one.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Policy - Policy in effect
+    Writer - Event ring writer read at the start of the batch, or NULL
+    InputData - Packet the decision was made for
+    Decision - One of the KBFILTR_DECISION_ values
+    KeyTime - Key time the packet was checked at
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_EVENT_RECORD record;
+    ULONG sequence;
+
+    if (Policy->RecordKeys) {
+        KbFilter_CaptureKey(Core, InputData, Decision, KeyTime);
+    }
+
+    if (Writer == NULL) {
+        return;
+    }
+
+    sequence = Writer->Head++;
+    record = &Writer->Ring->Records[sequence & Writer->Mask];
+
+    record->Sequence = 0;
+    KeMemoryBarrier();
+
+    record->KeyTime = KeyTime;
+    record->MakeCode = Policy->RecordKeys ? InputData->MakeCode : 0;
+    record->Flags = InputData->Flags;
+    record->UnitId = (UCHAR) InputData->UnitId;
+    record->Decision = Decision;
+    record->KeyClass = KbFilter_KeyClass(InputData);
+    record->Reserved = 0;
+
+    KeMemoryBarrier();
+    record->Sequence = sequence;
+}
+
+PKBFILTER_EVENT_WRITER
+KbFilter_PublishEvents(
+    IN PKBFILTER_CORE Core
+    )
+/*++
+
+Routine Description:
+
+    Makes the event records written since the last call visible to readers
+    by moving the ring's Head.  Called once at the end of every batch.  The
+    writer is only touched under RecentKeysLock, which the caller must not
+    hold.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+
+Return Value:
+
+    The writer if new records were published, for the caller to wake the
+    readers, NULL otherwise.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState;
+    PKBFILTER_EVENT_WRITER writer;
+    BOOLEAN published = FALSE;
+
+    writer = *(PKBFILTER_EVENT_WRITER volatile *) &Core->EventWriter;
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    KbfPlatAcquireLock(&Core->RecentKeysLock, &lockState);
+
+    if (writer->Published != writer->Head - 1) {
+        KeMemoryBarrier();
+        writer->Published = writer->Head - 1;
+        writer->Ring->Head = writer->Published;
+        published = TRUE;
+    }
+
+    KbfPlatReleaseLock(&Core->RecentKeysLock, lockState);
+
+    return published ? writer : NULL;
+}
+
+ULONG
+KbFilter_ReadEvents(
+    IN PKBFILTR_EVENT_RING Ring,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_EVENT_RECORD Records,
+    IN ULONG Count,
+    OUT PULONG Lost
+    )
+/*++
+
+Routine Description:
+
+    Copies the event records published since Cursor, oldest first.  This is
+    the reader side of the event ring, for tools that map it; it never
+    writes to the ring, so any number of readers can use it at once.
+    Records overwritten before or while they are copied are skipped and
+    counted in Lost, and show up as gaps in the Sequence of the records
+    returned.
+
+Arguments:
+
+    Ring - Mapped event ring
+    Cursor - Number of the next record to copy, zero to start with the
+             oldest record; receives the cursor for the next call
+    Records - Receives the records
+    Count - Capacity of Records
+    Lost - Receives the number of records that could not be returned
+
+Return Value:
+
+    Number of records copied to Records.
+
+--*/
+{
+    volatile KBFILTR_EVENT_RECORD *record;
+    ULONG head, first, next, sequence;
+    ULONG copied = 0;
+
+    *Lost = 0;
+
+    head = Ring->Head;
+    KeMemoryBarrier();
+
+    first = (head >= Ring->RecordCount) ? head - Ring->RecordCount + 1 : 1;
+
+    next = *Cursor;
+    if (next == 0) {
+        next = first;
+    }
+    else if ((LONG) (first - next) > 0) {
+        *Lost = first - next;
+        next = first;
+    }
+
+    for (; (LONG) (head - next) >= 0 && copied < Count; next++) {
+        record = &Ring->Records[next & (Ring->RecordCount - 1)];
+
+        sequence = record->Sequence;
+        KeMemoryBarrier();
+
+        if (sequence == next) {
+            RtlCopyMemory(&Records[copied], (PVOID) record, sizeof(KBFILTR_EVENT_RECORD));
+            KeMemoryBarrier();
+            sequence = record->Sequence;
+        }
+
+        if (sequence != next) {
+            (*Lost)++;
+            continue;
+        }
+
+        Records[copied].Sequence = next;
+        copied++;
+    }
+
+    *Cursor = next;
+    return copied;
+}
+
+ULONGLONG
+KbFilter_ReadClock(
+    IN PKBFILTER_TIME_SOURCE TimeSource
+    )
+/*++
+
+Routine Description:
+
+    Reads the raw value of a time source's clock.  Callable at any IRQL.
+
+Arguments:
+
+    TimeSource - Time source to read
+
+Return Value:
+
+    Clock reading in units of 1 / TimeSource->Frequency seconds.
+
+--*/
+{
+    switch (TimeSource->Clock) {
+    case KbFilterClockPerformanceCounter:
+        return KbfPlatPerformanceCounter(NULL);
+
+    case KbFilterClockTickCount:
+        return KbfPlatTickTime();
+
+    case KbFilterClockInjected:
+        return TimeSource->Routine(TimeSource->Context);
+
+    case KbFilterClockInterruptTime:
+    default:
+        return KbfPlatInterruptTime();
+    }
+}
+
+VOID
+KbFilter_InitializeTimeSource(
+    OUT PKBFILTER_TIME_SOURCE TimeSource,
+    IN KBFILTER_CLOCK Clock,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context,
+    IN ULONGLONG Frequency
+    )
+/*++
+
+Routine Description:
+
+    Initializes a time source and makes the current reading its base.
+
+Arguments:
+
+    TimeSource - Time source to initialize
+    Clock - Clock to read
+    Routine - Reader for KbFilterClockInjected, ignored otherwise
+    Context - Context passed to Routine
+    Frequency - Counts per second of Routine, ignored for the system clocks
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Clock == KbFilterClockInjected && (Routine == NULL || Frequency == 0)) {
+        Clock = KbFilterClockInterruptTime;
+    }
+
+    TimeSource->Clock = Clock;
+    TimeSource->Routine = Routine;
+    TimeSource->Context = Context;
+
+    switch (Clock) {
+    case KbFilterClockPerformanceCounter:
+        KbfPlatPerformanceCounter(&TimeSource->Frequency);
+        break;
+
+    case KbFilterClockInjected:
+        TimeSource->Frequency = Frequency;
+        break;
+
+    default:
+        // Interrupt time and scaled tick count are in 100ns units
+        TimeSource->Frequency = 10000000;
+        break;
+    }
+
+    TimeSource->Base = KbFilter_ReadClock(TimeSource);
+}
+
+ULONG
+KbFilter_QueryKeyTime(
+    IN PKBFILTER_TIME_SOURCE TimeSource
+    )
+/*++
+
+Routine Description:
+
+    Returns the current time in the 32-bit format stored in the key table:
+    milliseconds since the time source's base, plus one so that zero can mark
+    a slot that has never been used.  Callable at any IRQL.
+
+Arguments:
+
+    TimeSource - Time source to read
+
+Return Value:
+
+    Current key time.
+
+--*/
+{
+    ULONGLONG elapsed;
+    ULONGLONG frequency = TimeSource->Frequency;
+
+    elapsed = KbFilter_ReadClock(TimeSource) - TimeSource->Base;
+
+    //
+    // Split the conversion so that high frequency counters cannot overflow
+    //
+    return (ULONG)((elapsed / frequency) * 1000 +
+                   (elapsed % frequency) * 1000 / frequency) + 1;
+}
+
+BOOLEAN
+KbFilter_IsWithinThreshold(
+    IN ULONG LastPress,
+    IN ULONG CurrentTime,
+    IN ULONG ThresholdMs
+    )
+/*++
+
+Routine Description:
+
+    Decides whether a press at CurrentTime is a duplicate of the press
+    recorded at LastPress.  Presses are not always checked in arrival order,
+    e.g. when a packet without an arrival time follows stamped ones, so a
+    press shortly before LastPress is a duplicate as well.
+
+Arguments:
+
+    LastPress - Key time of the last accepted press, zero if none
+    CurrentTime - Key time of the press being checked
+    ThresholdMs - Lag mitigation threshold of the key
+
+Return Value:
+
+    TRUE if the press is within the lag mitigation threshold.
+
+--*/
+{
+    // Keys that have not been pressed yet are never duplicates
+    if (LastPress == 0 || ThresholdMs == 0) {
+        return FALSE;
+    }
+
+    return (CurrentTime - LastPress + ThresholdMs - 1) < (2 * ThresholdMs - 1);
+}
+
+BOOLEAN
+KbFilter_IsLaterPress(
+    IN ULONG LastPress,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Decides whether an accepted press at CurrentTime should replace LastPress
+    in the key table, i.e. whether it happened after LastPress.
+
+Arguments:
+
+    LastPress - Key time of the last accepted press, zero if none
+    CurrentTime - Key time of the accepted press
+
+Return Value:
+
+    TRUE if the key table should record CurrentTime.
+
+--*/
+{
+    return (BOOLEAN) (LastPress == 0 || (LONG)(CurrentTime - LastPress) > 0);
+}
+
+VOID
+KbFilter_LearnInterval(
+    IN PKBFILTER_CORE Core,
+    IN ULONG Slot,
+    IN ULONG IntervalMs,
+    IN ULONG MaxThresholdMs
+    )
+/*++
+
+Routine Description:
+
+    Adds an inter-press interval to a key's histogram and rederives the key's
+    learned threshold.  The cost is bounded by KBFILTER_INTERVAL_BUCKETS.
+
+Arguments:
+
+    Core - Lag mitigation state holding the histograms
+    Slot - Key table slot of the key
+    IntervalMs - Time since the key's last accepted press
+    MaxThresholdMs - Configured threshold of the key, caps the learned one
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_KEY_HISTOGRAM histogram = &Core->KeyHistograms[Slot];
+    ULONG bucket, i;
+    ULONG total = 0;
+    ULONG chatterPeak = 0, humanPeak = 0, valley;
+    ULONG threshold;
+
+    for (bucket = 0; bucket < KBFILTER_INTERVAL_BUCKETS; bucket++) {
+        if (IntervalMs < KbFilterIntervalBucketLimits[bucket]) {
+            break;
+        }
+    }
+
+    if (bucket == KBFILTER_INTERVAL_BUCKETS) {
+        return;
+    }
+
+    //
+    // Halve the whole histogram when a bucket saturates
+    //
+    if (histogram->Counts[bucket] == MAXUCHAR) {
+        for (i = 0; i < KBFILTER_INTERVAL_BUCKETS; i++) {
+            histogram->Counts[i] >>= 1;
+        }
+    }
+    histogram->Counts[bucket]++;
+
+    //
+    // Find the peak of each cluster
+    //
+    for (i = 0; i < KBFILTER_INTERVAL_BUCKETS; i++) {
+        total += histogram->Counts[i];
+
+        if (KbFilterIntervalBucketLimits[i] <= KBFILTER_HUMAN_MIN_INTERVAL_MS) {
+            if (histogram->Counts[i] > histogram->Counts[chatterPeak]) {
+                chatterPeak = i;
+            }
+        }
+        else if (humanPeak == 0 ||
+                 histogram->Counts[i] > histogram->Counts[humanPeak]) {
+            humanPeak = i;
+        }
+    }
+
+    if (total < KBFILTER_ADAPTIVE_MIN_SAMPLES) {
+        Core->LearnedThresholdMs[Slot] = 0;
+        return;
+    }
+
+    //
+    // Cut at the upper limit of the sparsest bucket between the clusters.
+    // Ties go to the higher bucket, so without any chatter the cut is placed
+    // just below the fastest human presses.
+    //
+    valley = chatterPeak;
+    for (i = chatterPeak; i < humanPeak; i++) {
+        if (histogram->Counts[i] <= histogram->Counts[valley]) {
+            valley = i;
+        }
+    }
+
+    threshold = MIN(KbFilterIntervalBucketLimits[valley], MaxThresholdMs);
+    Core->LearnedThresholdMs[Slot] = (USHORT) threshold;
+}
+
+VOID
+KbFilter_MarkKeyDown(
+    IN PKBFILTER_CORE Core,
+    IN ULONG Slot,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime,
+    IN BOOLEAN Repeat
+    )
+/*++
+
+Routine Description:
+
+    Records an accepted make code: marks the key down, remembers when and on
+    which unit it was pressed, and makes it the most recent make, the only
+    key stuck key recovery watches.
+
+Arguments:
+
+    Core - Lag mitigation state containing the key table
+    Slot - Key table slot of the key
+    InputData - Accepted make code
+    CurrentTime - Key time of the make code
+    Repeat - Whether the make code is a typematic repeat of a key that was
+             already down
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Core->KeyDownTime[Slot] = CurrentTime;
+    Core->KeyDownUnitId[Slot] = InputData->UnitId;
+    KbfPlatWriteLong(&Core->LastMakeSlot, (LONG) Slot);
+
+    InterlockedBitTestAndSet(&Core->KeyDown[Slot / 32], Slot % 32);
+    if (Repeat) {
+        InterlockedBitTestAndSet(&Core->KeyRepeating[Slot / 32], Slot % 32);
+    }
+}
+
+UCHAR
+KbFilter_CheckKey(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Decides whether the current key input is a recent duplicate that should be
+    filtered out due to lag-induced multiple key presses.  Accepted key-down events are
+    recorded in the key table, so that later presses of the same key, including
+    ones in the same batch, are checked against them.  Only accepted make
+    codes mark the key down; a dropped duplicate leaves the key as the
+    class driver last saw it.
+
+    Make codes of a key that is still down are typematic repeats.  They only
+    count as duplicates when they arrive faster than the keyboard's repeat
+    delay and rate allow, so held keys repeat without added latency.
+
+    With adaptive thresholds the interval to the last accepted press is
+    learned first, and the key's learned threshold replaces the configured
+    one once enough intervals have been seen.  Repeats are not learned.
+
+    In KbFilterDedupLocked mode the caller must hold RecentKeysLock.  In
+    KbFilterDedupLockFree mode the slot is updated with a compare-exchange and
+    no lock is needed; a press that loses the race against another processor
+    is re-checked against the winner's press.
+
+Arguments:
+
+    Core - Lag mitigation state containing recent key tracking data
+    Policy - Policy in effect for the batch
+    InputData - Current keyboard input data to check
+    CurrentTime - Key time of the packet, see KbFilter_TakeArrivalTime
+
+Return Value:
+
+    KBFILTR_DECISION_ACCEPT if the packet is passed on, otherwise the reason
+    it is dropped: KBFILTR_DECISION_DUPLICATE or KBFILTR_DECISION_REPEAT.
+
+--*/
+{
+    ULONG slot;
+    ULONG threshold;
+    ULONG lastPress;
+    PKBFILTER_KEY_SLOT keySlot;
+    KBFILTER_KEY_SLOT previous, updated;
+    volatile LONG *keyDown, *keyRepeating;
+    BOOLEAN isRepeat, hasRepeated;
+    UCHAR dropDecision;
+
+    slot = KbFilter_KeySlot(InputData);
+    if (slot == KBFILTER_NO_KEY_SLOT) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    keyDown = &Core->KeyDown[slot / 32];
+    keyRepeating = &Core->KeyRepeating[slot / 32];
+
+    // Only filter key-down events (make codes), key-up events end the press
+    if (InputData->Flags & KEY_BREAK) {
+        InterlockedBitTestAndReset(keyDown, slot % 32);
+        InterlockedBitTestAndReset(keyRepeating, slot % 32);
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    isRepeat = (BOOLEAN) ((KbfPlatReadLong(keyDown) & (1u << (slot % 32))) != 0);
+    hasRepeated = (BOOLEAN) ((KbfPlatReadLong(keyRepeating) & (1u << (slot % 32))) != 0);
+
+    if (!Policy->Enabled || !KbfPlatReadLong(&Core->DedupActive) ||
+        (Policy->Keys[slot].Options & KBFILTR_KEY_POLICY_EXEMPT)) {
+        KbFilter_MarkKeyDown(Core, slot, InputData, CurrentTime, FALSE);
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    keySlot = &Core->KeyTable[slot];
+    dropDecision = KBFILTR_DECISION_DUPLICATE;
+
+    if (isRepeat) {
+        threshold = hasRepeated ? Core->RepeatWindowMs : Core->FirstRepeatWindowMs;
+        dropDecision = KBFILTR_DECISION_REPEAT;
+    }
+    else {
+        threshold = Policy->Keys[slot].ThresholdMs;
+        if (Policy->TypematicThresholds && Core->TypematicThresholdMs < threshold) {
+            threshold = Core->TypematicThresholdMs;
+        }
+    }
+
+    if (!isRepeat && Policy->AdaptiveThresholds) {
+        lastPress = keySlot->Fields.LastPress;
+
+        if (lastPress != 0 && KbFilter_IsLaterPress(lastPress, CurrentTime)) {
+            KbFilter_LearnInterval(Core, slot, CurrentTime - lastPress, threshold);
+        }
+
+        if (Core->LearnedThresholdMs[slot] != 0) {
+            threshold = Core->LearnedThresholdMs[slot];
+        }
+    }
+
+    if (Core->DedupMode == KbFilterDedupLocked) {
+
+        if (KbFilter_IsWithinThreshold(keySlot->Fields.LastPress, CurrentTime, threshold)) {
+            return dropDecision;
+        }
+
+        if (KbFilter_IsLaterPress(keySlot->Fields.LastPress, CurrentTime)) {
+            keySlot->Fields.LastPress = CurrentTime;
+        }
+        keySlot->Fields.PressCount++;
+
+        KbFilter_MarkKeyDown(Core, slot, InputData, CurrentTime, isRepeat);
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    for (;;) {
+        //
+        // LastPress is read atomically even if the 64-bit read tears on
+        // 32-bit processors; a torn PressCount just makes the exchange fail.
+        //
+        previous.Value = KbfPlatReadLong64(&keySlot->Value);
+
+        if (KbFilter_IsWithinThreshold(previous.Fields.LastPress, CurrentTime, threshold)) {
+            return dropDecision;
+        }
+
+        updated.Fields.LastPress = previous.Fields.LastPress;
+        if (KbFilter_IsLaterPress(previous.Fields.LastPress, CurrentTime)) {
+            updated.Fields.LastPress = CurrentTime;
+        }
+        updated.Fields.PressCount = previous.Fields.PressCount + 1;
+
+        if (InterlockedCompareExchange64(&keySlot->Value,
+                                         updated.Value,
+                                         previous.Value) == previous.Value) {
+
+            KbFilter_MarkKeyDown(Core, slot, InputData, CurrentTime, isRepeat);
+            return KBFILTR_DECISION_ACCEPT;
+        }
+    }
+}
+
+VOID
+KbFilter_JoinDedupDomain(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_DEDUP_DOMAIN Domain,
+    IN USHORT DeviceTag
+    )
+/*++
+
+Routine Description:
+
+    Adds a keyboard to a dedup domain.  The first member brings its time
+    source and starts with an empty table; later members adopt the
+    domain's time source, so all key times of the domain share one base.
+    Must be called before the core checks any packet or records arrival
+    times.  Joins and leaves are serialized by the caller.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Domain - Dedup domain to join
+    DeviceTag - Tag identifying the keyboard in the domain, unique among
+                its members
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Domain->Members == 0) {
+        RtlZeroMemory(Domain->Keys, sizeof(Domain->Keys));
+        Domain->TimeSource = Core->TimeSource;
+    }
+    else {
+        Core->TimeSource = Domain->TimeSource;
+    }
+
+    Domain->Members++;
+    Core->DomainTag = DeviceTag;
+    Core->DedupDomain = Domain;
+}
+
+VOID
+KbFilter_LeaveDedupDomain(
+    IN PKBFILTER_CORE Core
+    )
+/*++
+
+Routine Description:
+
+    Removes a keyboard from its dedup domain, if it joined one.  The
+    keyboard's last presses stay in the table and age out; the domain
+    itself must outlive any batch of the keyboard still being checked.
+    Joins and leaves are serialized by the caller.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Core->DedupDomain == NULL) {
+        return;
+    }
+
+    Core->DedupDomain->Members--;
+    Core->DedupDomain = NULL;
+}
+
+UCHAR
+KbFilter_CheckDomain(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Decides whether a packet was already reported by another keyboard of
+    the dedup domain.  Runs before KbFilter_CheckKey, so a copy is dropped
+    before it marks the key down or up on this keyboard, or takes a press
+    from the key table.  The domain's slot of
+    the key holds the last packet of the key from any member.  A packet
+    within CrossDeviceWindowMs of a packet from another keyboard or unit is
+    dropped; otherwise the slot is claimed with a compare-exchange, and a
+    packet that loses the race is re-checked against the winner.
+
+    Makes, repeats and breaks all go through the domain, so the copy of a
+    held key neither repeats nor releases the key on its own.  The check
+    does not depend on the lag detector, since the copies are not caused by
+    lag.  A packet the domain accepts claims the slot even if the per-key
+    check then drops it; copies of a duplicate are duplicates as well.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Policy - Policy in effect for the batch
+    InputData - Packet to check
+    CurrentTime - Key time of the packet, in the domain's time base
+
+Return Value:
+
+    KBFILTR_DECISION_CROSS_DEVICE if another keyboard reported the key
+    within the window, otherwise KBFILTR_DECISION_ACCEPT, also if the
+    keyboard is not in a domain.
+
+--*/
+{
+    PKBFILTER_DEDUP_DOMAIN domain;
+    PKBFILTER_DOMAIN_SLOT keySlot;
+    KBFILTER_DOMAIN_SLOT previous, updated;
+    ULONG slot;
+
+    domain = *(PKBFILTER_DEDUP_DOMAIN volatile *) &Core->DedupDomain;
+
+    if (domain == NULL || !Policy->Enabled || Policy->CrossDeviceWindowMs == 0) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    slot = KbFilter_KeySlot(InputData);
+    if (slot == KBFILTER_NO_KEY_SLOT ||
+        (Policy->Keys[slot].Options & KBFILTR_KEY_POLICY_EXEMPT)) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    keySlot = &domain->Keys[slot];
+
+    updated.Fields.DeviceTag = Core->DomainTag;
+    updated.Fields.UnitId = InputData->UnitId;
+
+    for (;;) {
+        previous.Value = KbfPlatReadLong64(&keySlot->Value);
+
+        if ((previous.Fields.DeviceTag != updated.Fields.DeviceTag ||
+             previous.Fields.UnitId != updated.Fields.UnitId) &&
+            KbFilter_IsWithinThreshold(previous.Fields.LastPress,
+                                       CurrentTime,
+                                       Policy->CrossDeviceWindowMs)) {
+            return KBFILTR_DECISION_CROSS_DEVICE;
+        }
+
+        //
+        // A packet older than the slot leaves it to the later one
+        //
+        if (!KbFilter_IsLaterPress(previous.Fields.LastPress, CurrentTime)) {
+            return KBFILTR_DECISION_ACCEPT;
+        }
+
+        updated.Fields.LastPress = CurrentTime;
+
+        if (InterlockedCompareExchange64(&keySlot->Value,
+                                         updated.Value,
+                                         previous.Value) == previous.Value) {
+            return KBFILTR_DECISION_ACCEPT;
+        }
+    }
+}
+
+UCHAR
+KbFilter_CheckSequence(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Decides whether a make code starts or continues a replay of the keys
+    accepted just before it.  A make of a key last accepted 2 to
+    KBFILTER_SEQUENCE_MAX_RUN makes ago, or SequenceMaxRun if the policy
+    sets a lower cap, within SequenceWindowMs, is the
+    candidate start of a replayed run as long as that suffix of the history.
+    The makes of the candidate run are hashed from the rest of the range and
+    compared with the hash of the suffix; on a match, once the keys have
+    been compared one by one to rule out a collision, the whole run is
+    dropped, this make now and the others as they are checked.  Runs that
+    do not end within the range are left to the per-key check.
+
+    Only makes that reach the per-key check are history, so a run replayed
+    several times is dropped every time.  Break codes are never dropped.
+
+Arguments:
+
+    Core - Lag mitigation state containing the sequence history
+    Policy - Policy in effect for the range
+    InputData - Current keyboard input data to check
+    InputDataEnd - One past the last packet of the range
+    CurrentTime - Key time of the packet, see KbFilter_TakeArrivalTime
+
+Return Value:
+
+    KBFILTR_DECISION_SEQUENCE if the packet is part of a replayed run,
+    otherwise KBFILTR_DECISION_ACCEPT.
+
+--*/
+{
+    PKBFILTER_SEQUENCE_ENTRY first;
+    PKEYBOARD_INPUT_DATA nextInput;
+    ULONG slot, last, run, count, maxRun, entry;
+    ULONG runHash, suffixHash, power;
+
+    slot = KbFilter_KeySlot(InputData);
+    if (slot == KBFILTER_NO_KEY_SLOT || (InputData->Flags & KEY_BREAK)) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    if (Core->SequenceDropRemaining != 0) {
+        Core->SequenceDropRemaining--;
+        return KBFILTR_DECISION_SEQUENCE;
+    }
+
+    if (!Policy->Enabled || !KbfPlatReadLong(&Core->DedupActive)) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    last = Core->SequenceLast[slot];
+    if (last == 0) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    maxRun = KBFILTER_SEQUENCE_MAX_RUN;
+    if (Policy->SequenceMaxRun != 0 && Policy->SequenceMaxRun < maxRun) {
+        maxRun = Policy->SequenceMaxRun;
+    }
+
+    run = Core->SequenceCount - last + 1;
+    if (run < 2 || run > maxRun) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    first = &Core->SequenceHistory[(last - 1) % KBFILTER_SEQUENCE_HISTORY];
+    if ((LONG) (CurrentTime - first->KeyTime) < 0 ||
+        CurrentTime - first->KeyTime > Policy->SequenceWindowMs) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    //
+    // Hash the next run makes of the range, this one included
+    //
+    runHash = 0;
+    power = 1;
+    count = 0;
+    for (nextInput = InputData; nextInput < InputDataEnd && count < run; nextInput++) {
+        slot = KbFilter_KeySlot(nextInput);
+        if (slot == KBFILTER_NO_KEY_SLOT || (nextInput->Flags & KEY_BREAK)) {
+            continue;
+        }
+
+        if (Policy->Keys[slot].Options & KBFILTR_KEY_POLICY_EXEMPT) {
+            return KBFILTR_DECISION_ACCEPT;
+        }
+
+        runHash = runHash * KBFILTER_SEQUENCE_HASH_BASE + slot + 1;
+        power *= KBFILTER_SEQUENCE_HASH_BASE;
+        count++;
+    }
+
+    if (count < run) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    //
+    // Hash of the last run entries of the history, from the prefix hashes
+    // of its last entry and of the entry before the suffix
+    //
+    suffixHash = Core->SequenceHistory[(Core->SequenceCount - 1) % KBFILTER_SEQUENCE_HISTORY].Prefix;
+    if (last >= 2) {
+        suffixHash -= Core->SequenceHistory[(last - 2) % KBFILTER_SEQUENCE_HISTORY].Prefix * power;
+    }
+
+    if (runHash != suffixHash) {
+        return KBFILTR_DECISION_ACCEPT;
+    }
+
+    //
+    // Different runs can hash alike; only drop the run if its keys are
+    // those of the suffix, one by one
+    //
+    entry = last - 1;
+    for (nextInput = InputData; entry < Core->SequenceCount; nextInput++) {
+        slot = KbFilter_KeySlot(nextInput);
+        if (slot == KBFILTER_NO_KEY_SLOT || (nextInput->Flags & KEY_BREAK)) {
+            continue;
+        }
+
+        if (Core->SequenceHistory[entry % KBFILTER_SEQUENCE_HISTORY].Slot != slot) {
+            return KBFILTR_DECISION_ACCEPT;
+        }
+        entry++;
+    }
+
+    Core->SequenceDropRemaining = run - 1;
+    return KBFILTR_DECISION_SEQUENCE;
+}
+
+VOID
+KbFilter_RecordSequence(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Appends an accepted make code to the sequence history.
+
+Arguments:
+
+    Core - Lag mitigation state containing the sequence history
+    InputData - Accepted keyboard input data
+    CurrentTime - Key time of the packet
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_SEQUENCE_ENTRY entry;
+    ULONG slot, prefix = 0;
+
+    slot = KbFilter_KeySlot(InputData);
+    if (slot == KBFILTER_NO_KEY_SLOT || (InputData->Flags & KEY_BREAK)) {
+        return;
+    }
+
+    if (Core->SequenceCount != 0) {
+        prefix = Core->SequenceHistory[(Core->SequenceCount - 1) % KBFILTER_SEQUENCE_HISTORY].Prefix;
+    }
+
+    entry = &Core->SequenceHistory[Core->SequenceCount % KBFILTER_SEQUENCE_HISTORY];
+    entry->Slot = slot;
+    entry->KeyTime = CurrentTime;
+    entry->Prefix = prefix * KBFILTER_SEQUENCE_HASH_BASE + slot + 1;
+
+    Core->SequenceCount++;
+    Core->SequenceLast[slot] = Core->SequenceCount;
+}
+
+ULONG
+KbFilter_StuckKeyBound(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Returns the time a key may stay down without a make code before it is
+    considered orphaned: the policy's StuckKeyMs, but at least the typematic
+    delay plus KBFILTER_STUCK_KEY_REPEATS repeat periods.
+
+Arguments:
+
+    Core - Lag mitigation state with the typematic parameters
+    Policy - Policy in effect
+
+Return Value:
+
+    Bound in ms.
+
+--*/
+{
+    ULONG minimum;
+
+    minimum = Core->Typematic.Delay +
+              KBFILTER_STUCK_KEY_REPEATS * 2 * Core->RepeatWindowMs;
+
+    return (Policy->StuckKeyMs > minimum) ? Policy->StuckKeyMs : minimum;
+}
+
+BOOLEAN
+KbFilter_MakeBreak(
+    IN PKBFILTER_CORE Core,
+    IN ULONG Slot,
+    OUT PKEYBOARD_INPUT_DATA BreakData
+    )
+/*++
+
+Routine Description:
+
+    Marks the key in a key table slot up, synthesizes its break code and
+    counts the break in the statistics.  The key is marked up with an
+    interlocked operation first, so when the stuck key timer and a range
+    release the same key concurrently, only one of them produces a break.
+
+Arguments:
+
+    Core - Lag mitigation state containing the key table
+    Slot - Key table slot of the key
+    BreakData - Receives the break code
+
+Return Value:
+
+    TRUE if BreakData was filled in, FALSE if the key was already up.
+
+--*/
+{
+    if (!InterlockedBitTestAndReset(&Core->KeyDown[Slot / 32], Slot % 32)) {
+        return FALSE;
+    }
+    InterlockedBitTestAndReset(&Core->KeyRepeating[Slot / 32], Slot % 32);
+
+    RtlZeroMemory(BreakData, sizeof(KEYBOARD_INPUT_DATA));
+    BreakData->UnitId = Core->KeyDownUnitId[Slot];
+    BreakData->MakeCode = (USHORT) (Slot % KBFILTER_MAKE_CODES);
+    BreakData->Flags = KEY_BREAK;
+
+    if (Slot >= 2 * KBFILTER_MAKE_CODES) {
+        BreakData->Flags |= KEY_E1;
+    }
+    else if (Slot >= KBFILTER_MAKE_CODES) {
+        BreakData->Flags |= KEY_E0;
+    }
+
+    KbFilter_StatsShard(Core)->SynthesizedBreaks++;
+    return TRUE;
+}
+
+BOOLEAN
+KbFilter_ReleaseOrphanedKey(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime,
+    OUT PKEYBOARD_INPUT_DATA BreakData
+    )
+/*++
+
+Routine Description:
+
+    Checks whether a make code arrives for the key pressed last while it is
+    still down but has not repeated for longer than the stuck key bound.
+    Its break code was lost, so one is synthesized to go before the make,
+    which is then checked as a new press.  Keys held before the last one do
+    not repeat and are never released.
+
+Arguments:
+
+    Core - Lag mitigation state containing the key table
+    Policy - Policy in effect for the range
+    InputData - Keyboard input data about to be checked
+    CurrentTime - Key time of the packet
+    BreakData - Receives the synthesized break code
+
+Return Value:
+
+    TRUE if BreakData was filled in and must be delivered before InputData.
+
+--*/
+{
+    ULONG slot;
+
+    slot = KbFilter_KeySlot(InputData);
+    if (slot == KBFILTER_NO_KEY_SLOT || (InputData->Flags & KEY_BREAK)) {
+        return FALSE;
+    }
+
+    if ((LONG) slot != KbfPlatReadLong(&Core->LastMakeSlot) ||
+        !(KbfPlatReadLong(&Core->KeyDown[slot / 32]) & (1u << (slot % 32)))) {
+        return FALSE;
+    }
+
+    if ((LONG) (CurrentTime - Core->KeyDownTime[slot]) < 0 ||
+        CurrentTime - Core->KeyDownTime[slot] < KbFilter_StuckKeyBound(Core, Policy)) {
+        return FALSE;
+    }
+
+    return KbFilter_MakeBreak(Core, slot, BreakData);
+}
+
+ULONG
+KbFilter_ReleaseStuckKeys(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN ULONG CurrentTime,
+    OUT PKEYBOARD_INPUT_DATA OutputData,
+    IN ULONG OutputCount,
+    OUT PULONG NextCheckMs
+    )
+/*++
+
+Routine Description:
+
+    Synthesizes the break code of the key pressed last if it has been down
+    without a make code for longer than the stuck key bound, for the caller
+    to deliver.  Keys held before it do not repeat and are left alone.  May
+    run concurrently with KbFilter_FilterPackets; while the break is
+    recorded in order-dependent consumers, see KBFILTER_ORDERED, the check
+    runs under RecentKeysLock, which the caller must not hold.
+
+Arguments:
+
+    Core - Lag mitigation state containing the key table
+    Policy - Policy in effect
+    CurrentTime - Current key time, see KbFilter_QueryKeyTime
+    OutputData - Receives the break codes
+    OutputCount - Number of packets OutputData has room for
+    NextCheckMs - Receives the time until the key pressed last could become
+                  orphaned, zero if it is up
+
+Return Value:
+
+    Number of break codes written to OutputData.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState = 0;
+    PKBFILTER_EVENT_WRITER writer;
+    ULONG slot, bound, elapsed;
+    ULONG count = 0, next = 0;
+    BOOLEAN locked;
+
+    writer = *(PKBFILTER_EVENT_WRITER volatile *) &Core->EventWriter;
+    bound = KbFilter_StuckKeyBound(Core, Policy);
+
+    locked = (BOOLEAN) KBFILTER_ORDERED(Policy, writer);
+    if (locked) {
+        KbfPlatAcquireLock(&Core->RecentKeysLock, &lockState);
+    }
+
+    slot = (ULONG) KbfPlatReadLong(&Core->LastMakeSlot);
+
+    if (slot < KBFILTER_KEY_SLOTS &&
+        (KbfPlatReadLong(&Core->KeyDown[slot / 32]) & (1u << (slot % 32)))) {
+
+        elapsed = CurrentTime - Core->KeyDownTime[slot];
+        if ((LONG) elapsed < 0) {
+            elapsed = 0;
+        }
+
+        if (elapsed < bound) {
+            next = bound - elapsed;
+        }
+        else if (count == OutputCount) {
+
+            //
+            // No room for the break, retry right away
+            //
+            next = 1;
+        }
+        else if (KbFilter_MakeBreak(Core, slot, &OutputData[count])) {
+            KbFilter_RecordDecision(Core,
+                                    Policy,
+                                    writer,
+                                    &OutputData[count],
+                                    KBFILTR_DECISION_ACCEPT,
+                                    CurrentTime);
+            count++;
+        }
+    }
+
+    if (locked) {
+        KbfPlatReleaseLock(&Core->RecentKeysLock, lockState);
+    }
+
+    *NextCheckMs = next;
+    return count;
+}
+
+VOID
+KbFilter_UpdateLagDetector(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN ULONG LatencyMs,
+    IN ULONG CurrentTime
+    )
+/*++
+
+Routine Description:
+
+    Adds a latency sample to the DPC latency estimate and decides whether
+    duplicates are filtered.  Filtering starts as soon as the estimate
+    reaches the policy's watermark and stops once it has stayed below the
+    watermark for the cooldown period.  Ranges checked concurrently each add
+    their sample with a compare-exchange and race for the transitions, so
+    every transition is counted once.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Policy - Policy in effect for the range
+    LatencyMs - Time the oldest packet of the range waited for delivery
+    CurrentTime - Key time of the service callback
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LONG sample, previous, estimate;
+
+    if (Policy->LagWatermarkMs == 0) {
+        if (!KbfPlatReadLong(&Core->DedupActive)) {
+            InterlockedExchange(&Core->DedupActive, TRUE);
+        }
+        return;
+    }
+
+    sample = (LONG) (MIN(LatencyMs, KBFILTER_LAG_MAX_SAMPLE_MS) << 4);
+    do {
+        previous = KbfPlatReadLong(&Core->LagEstimate);
+        estimate = previous + (sample - previous) / (1 << KBFILTER_LAG_EWMA_SHIFT);
+    } while (InterlockedCompareExchange(&Core->LagEstimate, estimate, previous) != previous);
+
+    if ((ULONG) (estimate >> 4) >= Policy->LagWatermarkMs) {
+        KbfPlatWriteLong((volatile LONG *) &Core->LagAboveTime, (LONG) CurrentTime);
+
+        if (InterlockedCompareExchange(&Core->DedupActive, TRUE, FALSE) == FALSE) {
+            InterlockedIncrement(&Core->LagEnterCount);
+        }
+    }
+    else if (KbfPlatReadLong(&Core->DedupActive) &&
+             CurrentTime - (ULONG) KbfPlatReadLong((volatile LONG *) &Core->LagAboveTime) >=
+                 Policy->LagCooldownMs) {
+
+        if (InterlockedCompareExchange(&Core->DedupActive, FALSE, TRUE) == TRUE) {
+            InterlockedIncrement(&Core->LagExitCount);
+        }
+    }
+}
+
+VOID
+KbFilter_ProfileBatch(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_STATS_SHARD Shard,
+    IN ULONG Packets,
+    IN ULONGLONG Counts
+    )
+/*++
+
+Routine Description:
+
+    Records the cost of one range of packets in the batch cost profile of
+    the current processor's statistics shard.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Shard - Statistics shard of the current processor
+    Packets - Number of packets in the range
+    Counts - Performance counter counts spent on the range
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_BATCH_PROFILE profile = &Shard->Profile;
+    ULONGLONG ns;
+    ULONG bucket = 0;
+
+    ns = Counts * 1000000000 / Core->ProfileFrequency;
+    if (ns > MAXULONG) {
+        ns = MAXULONG;
+    }
+
+    while (bucket < KBFILTR_COST_BUCKETS - 1 && (ns >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+
+    profile->Batches++;
+    profile->Packets += Packets;
+    profile->TotalNs += ns;
+    profile->CostBuckets[bucket]++;
+
+    if ((ULONG) ns > profile->MaxNs) {
+        profile->MaxNs = (ULONG) ns;
+    }
+    if (Packets > profile->MaxPackets) {
+        profile->MaxPackets = Packets;
+    }
+}
+
+VOID
+KbFilter_QueryProfile(
+    IN PKBFILTER_CORE Core,
+    OUT PKBFILTR_BATCH_PROFILE Profile
+    )
+/*++
+
+Routine Description:
+
+    Adds up the batch cost profiles of a keyboard's statistics shards.  The
+    shards are read without synchronization, so counters of a batch that is
+    being recorded may be off by one.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Profile - Receives the profile
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_BATCH_PROFILE shard;
+    ULONG i, j;
+
+    RtlZeroMemory(Profile, sizeof(KBFILTR_BATCH_PROFILE));
+
+    for (i = 0; i < Core->StatsShards; i++) {
+        shard = &Core->Stats[i].Profile;
+
+        Profile->Batches += shard->Batches;
+        Profile->Packets += shard->Packets;
+        Profile->TotalNs += shard->TotalNs;
+        Profile->MaxNs = MAX(Profile->MaxNs, shard->MaxNs);
+        Profile->MaxPackets = MAX(Profile->MaxPackets, shard->MaxPackets);
+        for (j = 0; j < KBFILTR_COST_BUCKETS; j++) {
+            Profile->CostBuckets[j] += shard->CostBuckets[j];
+        }
+    }
+}
+
+VOID
+KbFilter_AttachStatistics(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_STATS_SHARD Shards,
+    IN ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Gives a keyboard one statistics shard per processor.  Must be called
+    before the first packet is filtered; the shards must stay allocated for
+    the lifetime of Core.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Shards - Zeroed, cache line aligned shards
+    Count - Number of shards, normally KbfPlatProcessorCount()
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Shards == NULL || Count == 0) {
+        return;
+    }
+
+    Core->Stats = Shards;
+    Core->StatsShards = Count;
+}
+
+PKBFILTER_STATS_SHARD
+KbFilter_StatsShard(
+    IN PKBFILTER_CORE Core
+    )
+/*++
+
+Routine Description:
+
+    Returns the statistics shard of the current processor.  The caller must
+    run at DISPATCH_LEVEL or above, so that it stays on that processor while
+    it updates the shard.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+
+Return Value:
+
+    Shard to count in.
+
+--*/
+{
+    return &Core->Stats[KbfPlatCurrentProcessor() % Core->StatsShards];
+}
+
+VOID
+KbFilter_QueryStatistics(
+    IN PKBFILTER_CORE Core,
+    OUT PKBFILTR_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    Adds up the statistics shards of a keyboard and fills in the lag
+    detector state and the batch cost profile.  The shards are read without
+    synchronization, so counters of batches in progress may be missing.
+    Counters only the driver knows, such as the cache hits, are left zero.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Statistics - Receives the snapshot
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_STATS_SHARD shard;
+    ULONGLONG lockSpinTicks = 0;
+    ULONG i, j;
+
+    RtlZeroMemory(Statistics, sizeof(KBFILTR_STATISTICS));
+    Statistics->Size = sizeof(KBFILTR_STATISTICS);
+    Statistics->Processors = Core->StatsShards;
+
+    for (i = 0; i < Core->StatsShards; i++) {
+        shard = &Core->Stats[i];
+
+        Statistics->PacketsIn += shard->PacketsIn;
+        for (j = 0; j < KBFILTR_DECISIONS; j++) {
+            Statistics->Decisions[j] += shard->Decisions[j];
+        }
+        Statistics->PassThroughPackets += shard->PassThroughPackets;
+        Statistics->SynthesizedBreaks += shard->SynthesizedBreaks;
+        Statistics->BackpressurePackets += shard->BackpressurePackets;
+        for (j = 0; j < KBFILTR_BATCH_SIZE_BUCKETS; j++) {
+            Statistics->BatchSizeBuckets[j] += shard->BatchSizeBuckets[j];
+        }
+        lockSpinTicks += shard->LockSpinTicks;
+    }
+
+    if (Core->ProfileFrequency != 0) {
+        Statistics->LockSpinNs = (lockSpinTicks / Core->ProfileFrequency) * 1000000000 +
+                                 (lockSpinTicks % Core->ProfileFrequency) * 1000000000 /
+                                     Core->ProfileFrequency;
+    }
+
+    Statistics->LagEnterCount = (ULONG) Core->LagEnterCount;
+    Statistics->LagExitCount = (ULONG) Core->LagExitCount;
+    Statistics->IsrRejects = Core->IsrRejects;
+    Statistics->DedupActive = (BOOLEAN) (KbfPlatReadLong(&Core->DedupActive) != FALSE);
+    KbFilter_QueryProfile(Core, &Statistics->Profile);
+}
+
+ULONG
+KbFilter_FilterPackets(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputDataStart,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    OUT PKEYBOARD_INPUT_DATA OutputData
+    )
+/*++
+
+Routine Description:
+
+    Runs lag mitigation over a range of packets and copies the accepted ones
+    to OutputData.  Packets are checked at the arrival time recorded by
+    KbFilter_IsrHook; packets without one share a single time read for the
+    whole range.  Ranges of the same keyboard may be checked concurrently.
+    A range is checked under a single acquisition of RecentKeysLock, or with
+    no lock at all in KbFilterDedupLockFree mode or while the lag detector
+    finds the system healthy, unless an order-dependent stage is in use, see
+    KBFILTER_ORDERED.  The wait of the first,
+    oldest packet feeds the lag detector before any packet is checked.
+    With a SequenceWindowMs in the policy, replayed runs of keys are dropped
+    before the per-key check, see KbFilter_CheckSequence.  Packets are
+    checked against the other keyboards of the dedup domain before the
+    per-key check updates the keyboard's own key state, see
+    KbFilter_CheckDomain.  With StuckKeyMs,
+    lost break codes are synthesized, see KbFilter_ReleaseOrphanedKey.
+    With KBFILTER_PROFILE the cost of the range is recorded in the profile.
+    Packets, decisions and the range size are counted in the statistics
+    shard of the current processor.  Decisions are recorded with
+    KbFilter_RecordDecision; the caller publishes event records with
+    KbFilter_PublishEvents once the whole batch is filtered.
+
+Arguments:
+
+    Core - Lag mitigation state containing recent key tracking data
+    Policy - Policy in effect for the range
+    InputDataStart - First packet to check
+    InputDataEnd - One past the last packet to check
+    OutputData - Receives the accepted packets, must have room for
+                 KBFILTER_MAX_OUTPUT_PER_INPUT(Policy) times
+                 InputDataEnd - InputDataStart packets
+
+Return Value:
+
+    Number of packets copied to OutputData.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState = 0;
+    PKBFILTER_STATS_SHARD shard;
+    PKBFILTER_EVENT_WRITER writer;
+    ULONG callbackTime, keyTime;
+    ULONG filteredCount = 0, count, bucket = 0;
+    LONG previousTime;
+    PKEYBOARD_INPUT_DATA currentInput;
+    BOOLEAN locked;
+    UCHAR decision;
+#if KBFILTER_PROFILE
+    ULONGLONG start = KbfPlatPerformanceCounter(NULL);
+    ULONGLONG lockStart;
+#endif
+
+    count = (ULONG) (InputDataEnd - InputDataStart);
+    if (count == 0) {
+        return 0;
+    }
+
+    shard = KbFilter_StatsShard(Core);
+    shard->PacketsIn += count;
+    while (bucket < KBFILTR_BATCH_SIZE_BUCKETS - 1 && (count >> (bucket + 1)) != 0) {
+        bucket++;
+    }
+    shard->BatchSizeBuckets[bucket]++;
+
+    writer = *(PKBFILTER_EVENT_WRITER volatile *) &Core->EventWriter;
+
+    callbackTime = KbFilter_QueryKeyTime(&Core->TimeSource);
+
+    keyTime = KbFilter_TakeArrivalTime(Core, InputDataStart, callbackTime);
+
+    if (Core->IsrHooked) {
+        KbFilter_UpdateLagDetector(Core,
+                                   Policy,
+                                   KbFilter_IsLaterPress(keyTime, callbackTime) ?
+                                       callbackTime - keyTime : 0,
+                                   callbackTime);
+    }
+    else {
+        //
+        // Without arrival times the oldest packet arrived after the
+        // previous callback at the earliest.  What one report produces was
+        // delivered as it came; more packets queued for up to the time
+        // since then, which may include idle time, so the sample is capped.
+        // Later ranges of the same callback add no sample.
+        //
+        do {
+            previousTime = KbfPlatReadLong(&Core->LastCallbackTime);
+        } while (InterlockedCompareExchange(&Core->LastCallbackTime,
+                                            (LONG) callbackTime,
+                                            previousTime) != previousTime);
+
+        if ((ULONG) previousTime != callbackTime) {
+            KbFilter_UpdateLagDetector(Core,
+                                       Policy,
+                                       (count > KBFILTER_LAG_REPORT_PACKETS && previousTime != 0 &&
+                                        KbFilter_IsLaterPress((ULONG) previousTime, callbackTime)) ?
+                                           MIN(callbackTime - (ULONG) previousTime,
+                                               KBFILTER_LAG_QUEUED_MAX_MS) : 0,
+                                       callbackTime);
+        }
+    }
+
+    if (!Policy->Enabled || !KbfPlatReadLong(&Core->DedupActive)) {
+        shard->PassThroughPackets += count;
+    }
+
+    locked = (BOOLEAN) (KBFILTER_ORDERED(Policy, writer) ||
+                        (Core->DedupMode == KbFilterDedupLocked &&
+                         Policy->Enabled &&
+                         KbfPlatReadLong(&Core->DedupActive)));
+    if (locked) {
+#if KBFILTER_PROFILE
+        lockStart = KbfPlatPerformanceCounter(NULL);
+        KbfPlatAcquireLock(&Core->RecentKeysLock, &lockState);
+        shard->LockSpinTicks += KbfPlatPerformanceCounter(NULL) - lockStart;
+#else
+        KbfPlatAcquireLock(&Core->RecentKeysLock, &lockState);
+#endif
+    }
+
+    for (currentInput = InputDataStart; currentInput < InputDataEnd; currentInput++) {
+        if (currentInput != InputDataStart) {
+            keyTime = KbFilter_TakeArrivalTime(Core, currentInput, callbackTime);
+        }
+
+        //
+        // A make of a key whose break was lost is preceded by a synthesized
+        // break, and is then checked as a new press
+        //
+        if (Policy->StuckKeyMs != 0 &&
+            KbFilter_ReleaseOrphanedKey(Core, Policy, currentInput, keyTime, &OutputData[filteredCount])) {
+
+            KbFilter_RecordDecision(Core,
+                                    Policy,
+                                    writer,
+                                    &OutputData[filteredCount],
+                                    KBFILTR_DECISION_ACCEPT,
+                                    keyTime);
+            filteredCount++;
+        }
+
+        // Check if this is part of a replayed run or a lag-induced duplicate
+        decision = KBFILTR_DECISION_ACCEPT;
+        if (Policy->SequenceWindowMs != 0) {
+            decision = KbFilter_CheckSequence(Core, Policy, currentInput, InputDataEnd, keyTime);
+        }
+
+        //
+        // A copy from another keyboard of the domain is dropped before the
+        // per-key check, so it neither presses nor releases the key here
+        //
+        if (decision == KBFILTR_DECISION_ACCEPT) {
+            decision = KbFilter_CheckDomain(Core, Policy, currentInput, keyTime);
+
+            if (decision == KBFILTR_DECISION_ACCEPT) {
+                decision = KbFilter_CheckKey(Core, Policy, currentInput, keyTime);
+            }
+
+            if (decision == KBFILTR_DECISION_ACCEPT && Policy->SequenceWindowMs != 0) {
+                KbFilter_RecordSequence(Core, currentInput, keyTime);
+            }
+        }
+
+        KbFilter_RecordDecision(Core, Policy, writer, currentInput, decision, keyTime);
+
+        shard->Decisions[decision]++;
+
+        if (decision != KBFILTR_DECISION_ACCEPT) {
+            // Skip this input - it's a duplicate
+            KbFilterTraceDrop((Core, currentInput, decision, keyTime));
+            continue;
+        }
+
+        KbFilterTraceAccept((Core, currentInput, decision, keyTime));
+
+        OutputData[filteredCount] = *currentInput;
+        filteredCount++;
+    }
+
+    if (locked) {
+        KbfPlatReleaseLock(&Core->RecentKeysLock, lockState);
+    }
+
+#if KBFILTER_PROFILE
+    KbFilter_ProfileBatch(Core,
+                          shard,
+                          count,
+                          KbfPlatPerformanceCounter(NULL) - start);
+#endif
+
+    return filteredCount;
+}
+
+VOID
+KbFilter_InitializeCarry(
+    OUT PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Capacity
+    )
+/*++
+
+Routine Description:
+
+    Initializes an empty carry queue on caller-supplied storage.  Nothing
+    is delivered until KbFilter_ConnectCarry supplies the class service.
+
+Arguments:
+
+    Carry - Carry queue to initialize
+    Packets - Queue storage, Capacity packets
+    Capacity - Number of packets Packets has room for
+
+Return Value:
+
+    None.
+
+--*/
+{
+    RtlZeroMemory(Carry, sizeof(KBFILTER_CARRY));
+    KbfPlatInitializeLock(&Carry->Lock);
+    Carry->Packets = Packets;
+    Carry->Capacity = Capacity;
+}
+
+VOID
+KbFilter_ConnectCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKBFILTER_CLASS_SERVICE ClassService,
+    IN PVOID ClassContext
+    )
+/*++
+
+Routine Description:
+
+    Sets the class service the carry queue delivers to.  Called once,
+    before the first batch is filtered.
+
+Arguments:
+
+    Carry - Carry queue
+    ClassService - Service callback of the class driver
+    ClassContext - First argument of ClassService
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Carry->ClassContext = ClassContext;
+    Carry->ClassService = ClassService;
+}
+
+PKEYBOARD_INPUT_DATA
+KbFilter_ResizeCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Capacity
+    )
+/*++
+
+Routine Description:
+
+    Moves an idle carry queue to new storage.  The queue is only moved while
+    it is empty and no chunk holds a reservation or is being delivered,
+    which is normally the case when the port driver reports its attributes,
+    before the keyboard sends anything.
+
+Arguments:
+
+    Carry - Carry queue
+    Packets - New queue storage, Capacity packets
+    Capacity - Number of packets Packets has room for
+
+Return Value:
+
+    The storage the caller must free: the previous storage if the queue
+    was moved, Packets if it was busy.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState;
+    PKEYBOARD_INPUT_DATA previous = Packets;
+
+    KbfPlatAcquireLock(&Carry->Lock, &lockState);
+
+    if (Carry->Count == 0 && Carry->Reserved == 0 && !Carry->Delivering) {
+        previous = Carry->Packets;
+        Carry->Packets = Packets;
+        Carry->Capacity = Capacity;
+    }
+
+    KbfPlatReleaseLock(&Carry->Lock, lockState);
+
+    return previous;
+}
+
+ULONG
+KbFilter_ReserveCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Reserves room in the carry queue for up to Count packets that are about
+    to be produced, so that whatever the class service does not consume of
+    them can always be queued.  The reservation is handed back by
+    KbFilter_DeliverCarry.
+
+Arguments:
+
+    Carry - Carry queue
+    Count - Number of packets wanted
+
+Return Value:
+
+    Number of packets reserved, at most Count.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState;
+    ULONG reserved;
+
+    KbfPlatAcquireLock(&Carry->Lock, &lockState);
+
+    reserved = MIN(Count, Carry->Capacity - Carry->Count - Carry->Reserved);
+    Carry->Reserved += reserved;
+
+    KbfPlatReleaseLock(&Carry->Lock, lockState);
+
+    return reserved;
+}
+
+BOOLEAN
+KbFilter_DeliverCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Count,
+    IN ULONG Reserved
+    )
+/*++
+
+Routine Description:
+
+    Queues Packets behind the carry queue and hands the queue to the class
+    service, keeping whatever it does not consume, in order, for the next
+    attempt.  Only one caller at a time delivers; a caller that finds a
+    delivery in progress leaves its packets to it.  The class service is
+    called without the lock held: the delivering caller owns the head of
+    the queue, and other callers only append behind it.
+
+Arguments:
+
+    Carry - Carry queue
+    Packets - Packets to deliver after the queue, may be NULL
+    Count - Number of packets in Packets
+    Reserved - Room reserved with KbFilter_ReserveCarry for Packets, at
+               least Count
+
+Return Value:
+
+    TRUE if packets were left in the queue by this call and the caller must
+    retry the delivery later, FALSE otherwise.
+
+--*/
+{
+    KBFPLAT_LOCK_STATE lockState;
+    ULONG consumed, count;
+    BOOLEAN retry;
+
+    KbfPlatAcquireLock(&Carry->Lock, &lockState);
+
+    if (Count != 0 && Carry->Count == 0 && !Carry->Delivering) {
+
+        //
+        // Nothing is waiting, so the packets go to the class service
+        // straight from the caller's buffer.  The reservation keeps room for
+        // the ones it does not consume until they are queued.
+        //
+        Carry->Delivering = TRUE;
+        KbfPlatReleaseLock(&Carry->Lock, lockState);
+
+        consumed = 0;
+        Carry->ClassService(Carry->ClassContext, Packets, Packets + Count, &consumed);
+        consumed = MIN(consumed, Count);
+
+        KbfPlatAcquireLock(&Carry->Lock, &lockState);
+
+        //
+        // Packets queued by others meanwhile are newer than the remainder
+        //
+        if (consumed < Count) {
+            RtlMoveMemory(Carry->Packets + (Count - consumed),
+                          Carry->Packets,
+                          Carry->Count * sizeof(KEYBOARD_INPUT_DATA));
+            RtlCopyMemory(Carry->Packets,
+                          Packets + consumed,
+                          (Count - consumed) * sizeof(KEYBOARD_INPUT_DATA));
+            Carry->Count += Count - consumed;
+        }
+        Carry->Reserved -= Reserved;
+
+    } else {
+
+        if (Count != 0) {
+            RtlCopyMemory(Carry->Packets + Carry->Count,
+                          Packets,
+                          Count * sizeof(KEYBOARD_INPUT_DATA));
+            Carry->Count += Count;
+        }
+        Carry->Reserved -= Reserved;
+
+        if (Carry->Delivering || Carry->ClassService == NULL) {
+            KbfPlatReleaseLock(&Carry->Lock, lockState);
+            return FALSE;
+        }
+
+        Carry->Delivering = TRUE;
+        consumed = Count = 0;
+    }
+
+    //
+    // Drain the queue for as long as the class service consumes all of it
+    //
+    while (consumed == Count && Carry->Count != 0) {
+        count = Carry->Count;
+        KbfPlatReleaseLock(&Carry->Lock, lockState);
+
+        consumed = 0;
+        Carry->ClassService(Carry->ClassContext, Carry->Packets, Carry->Packets + count, &consumed);
+        consumed = MIN(consumed, count);
+        Count = count;
+
+        KbfPlatAcquireLock(&Carry->Lock, &lockState);
+
+        Carry->Count -= consumed;
+        if (Carry->Count != 0 && consumed != 0) {
+            RtlMoveMemory(Carry->Packets,
+                          Carry->Packets + consumed,
+                          Carry->Count * sizeof(KEYBOARD_INPUT_DATA));
+        }
+    }
+
+    Carry->Delivering = FALSE;
+    retry = (BOOLEAN) (Carry->Count != 0);
+
+    KbfPlatReleaseLock(&Carry->Lock, lockState);
+
+    return retry;
+}
+
+ULONG
+KbFilter_FilterBatch(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA InputDataStart,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    OUT PBOOLEAN Retry
+    )
+/*++
+
+Routine Description:
+
+    Filters a batch reported by the port driver and delivers the accepted
+    packets to the class service through the carry queue, one chunk at a
+    time, without allocating.  Once the queue has no room for another chunk
+    the rest of the batch is left with the port driver, which reports it
+    again later.  Callable concurrently for the same core and queue; in the
+    driver at DISPATCH_LEVEL, so the statistics shard stays the same.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+    Policy - Policy in effect for the batch
+    Carry - Carry queue of the keyboard
+    InputDataStart - First packet of the batch
+    InputDataEnd - One past the last packet of the batch
+    Retry - Receives TRUE if packets were left in the carry queue and the
+            caller must retry the delivery later
+
+Return Value:
+
+    Number of packets taken from the batch.  Every one of them has been
+    filtered, and the accepted ones were consumed by the class service or
+    queued.
+
+--*/
+{
+    KEYBOARD_INPUT_DATA chunk[KBFILTER_CHUNK_PACKETS];
+    PKEYBOARD_INPUT_DATA currentInput = InputDataStart, chunkEnd;
+    ULONG perInput, reserved, filteredCount;
+#if KBFILTER_PROFILE
+    ULONGLONG lockStart;
+#endif
+
+    perInput = KBFILTER_MAX_OUTPUT_PER_INPUT(Policy);
+    *Retry = FALSE;
+
+    while (currentInput < InputDataEnd) {
+#if KBFILTER_PROFILE
+        lockStart = KbfPlatPerformanceCounter(NULL);
+#endif
+        reserved = KbFilter_ReserveCarry(Carry,
+                                         MIN((ULONG) (InputDataEnd - currentInput) * perInput,
+                                             KBFILTER_CHUNK_PACKETS));
+#if KBFILTER_PROFILE
+        KbFilter_StatsShard(Core)->LockSpinTicks += KbfPlatPerformanceCounter(NULL) - lockStart;
+#endif
+
+        //
+        // The queue is full.  Hand back the reservation and offer the queue
+        // to the class service once more, in case it has made room.
+        //
+        if (reserved < perInput) {
+            if (KbFilter_DeliverCarry(Carry, NULL, 0, reserved)) {
+                *Retry = TRUE;
+            }
+            break;
+        }
+
+        chunkEnd = currentInput + reserved / perInput;
+        filteredCount = KbFilter_FilterPackets(Core, Policy, currentInput, chunkEnd, chunk);
+        currentInput = chunkEnd;
+
+        if (KbFilter_DeliverCarry(Carry, chunk, filteredCount, reserved)) {
+            *Retry = TRUE;
+        }
+    }
+
+    if (currentInput < InputDataEnd) {
+        KbFilter_StatsShard(Core)->BackpressurePackets += (ULONG) (InputDataEnd - currentInput);
+    }
+
+    return (ULONG) (currentInput - InputDataStart);
+}
+
+BOOLEAN
+KbFilter_DecodeKeyRecord(
+    IN PKBFILTR_KEYTRACE_RECORD Record,
+    IN OUT PULONG KeyTime,
+    IN OUT PBOOLEAN Synchronized,
+    OUT PKEYBOARD_INPUT_DATA InputData
+    )
+/*++
+
+Routine Description:
+
+    Decodes the next record of a keystroke trace.  SYNC records set the key
+    time; key records advance it and are returned as packets.  Key records
+    before the first SYNC record are skipped, since their time is unknown.
+
+Arguments:
+
+    Record - Record to decode
+    KeyTime - Key time of the previous record; receives the key time of this
+              record
+    Synchronized - Whether a SYNC record has been decoded yet, FALSE for the
+                   first record of a trace
+    InputData - Receives the packet of a key record
+
+Return Value:
+
+    TRUE if Record is a key record to replay, FALSE otherwise.
+
+--*/
+{
+    switch (Record->Kind & KBFILTR_KEYTRACE_KIND_MASK) {
+    case KBFILTR_KEYTRACE_SYNC:
+        *KeyTime = Record->u.KeyTime;
+        *Synchronized = TRUE;
+        return FALSE;
+
+    case KBFILTR_KEYTRACE_KEY:
+        if (!*Synchronized) {
+            return FALSE;
+        }
+
+        *KeyTime += Record->u.Key.DeltaMs;
+
+        RtlZeroMemory(InputData, sizeof(KEYBOARD_INPUT_DATA));
+        InputData->UnitId = Record->UnitId;
+        InputData->MakeCode = Record->u.Key.MakeCode;
+        InputData->Flags = Record->Flags;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+ULONGLONG
+KbFilter_ReplayClock(
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Injected clock of a replay, in ms.  Reads the time the replay set for
+    the range being checked.
+
+Arguments:
+
+    Context - Replay state
+
+Return Value:
+
+    Clock reading.
+
+--*/
+{
+    return ((PKBFILTER_REPLAY) Context)->Now;
+}
+
+VOID
+KbFilter_ReplayRange(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTER_REPLAY Replay,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN PKBFILTER_REPLAY_ROUTINE Routine,
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Checks the packets gathered for one range with KbFilter_FilterPackets at
+    their recorded key time, and reports the decision made for each.  A
+    break synthesized for a make code is written to the event ring right
+    before the make's own record and is not reported.
+
+Arguments:
+
+    Core - Lag mitigation state to replay into
+    Policy - Policy to check the range against
+    Replay - Replay state holding the range
+    Records - Records of the trace, for the recorded decisions
+    Routine - Called for every packet of the range
+    Context - Context passed to Routine
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTR_EVENT_RECORD event;
+    ULONG index, sequence;
+
+    if (Replay->Count == 0) {
+        return;
+    }
+
+    Replay->Now = (ULONG) (Replay->KeyTime - 1);
+    sequence = Replay->Writer.Head;
+
+    KbFilter_FilterPackets(Core,
+                           Policy,
+                           Replay->Packets,
+                           Replay->Packets + Replay->Count,
+                           Replay->Output);
+
+    for (index = 0; index < Replay->Count; index++) {
+        event = &Replay->u.Ring.Records[sequence++ & Replay->Writer.Mask];
+
+        if (!(Replay->Packets[index].Flags & KEY_BREAK) && (event->Flags & KEY_BREAK)) {
+            event = &Replay->u.Ring.Records[sequence++ & Replay->Writer.Mask];
+        }
+
+        Routine(Context,
+                Replay->Indices[index],
+                &Replay->Packets[index],
+                Replay->KeyTime,
+                Records[Replay->Indices[index]].Decision,
+                event->Decision);
+    }
+
+    Replay->Count = 0;
+}
+
+ULONG
+KbFilter_ReplayPackets(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    IN PKBFILTER_REPLAY_ROUTINE Routine,
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Feeds a recorded keystroke trace through KbFilter_FilterPackets at full
+    speed, using the recorded key times instead of a clock, and reports the
+    recorded and replayed decision of every packet.  Consecutive packets
+    with the same key time are checked as one range, so sequence dedup and
+    stuck key recovery run as they did in the service callback.  Key
+    records before the first SYNC record are skipped, since their time is
+    unknown.  Breaks the filter synthesized while recording are in the trace
+    and are replayed like the packets they stood in for.
+
+    Core should be freshly initialized, with the typematic parameters of the
+    recorded keyboard, so that the replay starts from the same state as the
+    recording.  The replay takes over the core's clock and event ring.
+    Nothing else is shared, so traces can be replayed on several threads at
+    once, each with its own Core.  The replay state is kept on the stack,
+    so this is meant for user-mode tools.
+
+Arguments:
+
+    Core - Lag mitigation state to replay into
+    Policy - Policy to check the trace against
+    Records - Records of the trace, without the file header
+    Count - Number of records
+    Routine - Called for every replayed packet, in trace order
+    Context - Context passed to Routine
+
+Return Value:
+
+    Number of packets replayed.
+
+--*/
+{
+    KBFILTER_REPLAY replay;
+    KEYBOARD_INPUT_DATA inputData;
+    ULONG index, keyTime = 0, replayed = 0;
+    BOOLEAN synchronized = FALSE;
+
+    replay.Now = 0;
+    replay.KeyTime = 0;
+    replay.Count = 0;
+    KbFilter_InitializeTimeSource(&Core->TimeSource,
+                                  KbFilterClockInjected,
+                                  KbFilter_ReplayClock,
+                                  &replay,
+                                  1000);
+    KbFilter_InitializeEventRing(&replay.Writer, &replay.u.Ring, KBFILTER_REPLAY_EVENTS);
+    KbFilter_AttachEventRing(Core, &replay.Writer);
+
+    for (index = 0; index < Count; index++) {
+        if (!KbFilter_DecodeKeyRecord(&Records[index], &keyTime, &synchronized, &inputData)) {
+            continue;
+        }
+
+        if (replay.Count == KBFILTER_CHUNK_PACKETS ||
+            (replay.Count != 0 && keyTime != replay.KeyTime)) {
+            KbFilter_ReplayRange(Core, Policy, &replay, Records, Routine, Context);
+        }
+
+        replay.KeyTime = keyTime;
+        replay.Indices[replay.Count] = index;
+        replay.Packets[replay.Count] = inputData;
+        replay.Count++;
+        replayed++;
+    }
+
+    KbFilter_ReplayRange(Core, Policy, &replay, Records, Routine, Context);
+
+    KbFilter_AttachEventRing(Core, NULL);
+    return replayed;
+}
+
+VOID
+KbFilter_ReplayDiff(
+    IN PVOID Context,
+    IN ULONG Index,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG KeyTime,
+    IN UCHAR Recorded,
+    IN UCHAR Replayed
+    )
+/*++
+
+Routine Description:
+
+    Replay routine of KbFilter_ReplayKeyTrace.  Cross-device drops depend on
+    the other keyboards, which the trace does not record; the replay accepts
+    those packets, as the filter would have without the other keyboards.
+
+Arguments:
+
+    Context - KBFILTER_REPLAY_DIFF of the replay
+    Index - Index of the packet's record
+    InputData - Replayed packet
+    KeyTime - Key time of the packet
+    Recorded - Decision in the trace
+    Replayed - Decision of the replay
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_REPLAY_DIFF diff = (PKBFILTER_REPLAY_DIFF) Context;
+
+    if (Replayed == ((Recorded == KBFILTR_DECISION_CROSS_DEVICE) ? KBFILTR_DECISION_ACCEPT : Recorded)) {
+        return;
+    }
+
+    diff->Differences++;
+    if (diff->DiffRoutine != NULL) {
+        diff->DiffRoutine(diff->Context, Index, InputData, KeyTime, Recorded, Replayed);
+    }
+}
+
+ULONG
+KbFilter_ReplayKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    IN PKBFILTER_REPLAY_ROUTINE DiffRoutine,
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Replays a recorded keystroke trace with KbFilter_ReplayPackets and
+    reports every packet whose decision differs from the recorded one.
+    Cross-device drops are expected to be accepted by the replay.
+
+Arguments:
+
+    Core - Lag mitigation state to replay into, freshly initialized
+    Policy - Policy to check the trace against
+    Records - Records of the trace, without the file header
+    Count - Number of records
+    DiffRoutine - Called for every differing decision, may be NULL
+    Context - Context passed to DiffRoutine
+
+Return Value:
+
+    Number of packets whose decision differs from the recorded one.
+
+--*/
+{
+    KBFILTER_REPLAY_DIFF diff;
+
+    diff.DiffRoutine = DiffRoutine;
+    diff.Context = Context;
+    diff.Differences = 0;
+
+    KbFilter_ReplayPackets(Core, Policy, Records, Count, KbFilter_ReplayDiff, &diff);
+
+    return diff.Differences;
+}
+
+VOID
+KbFilter_ScoreDecision(
+    IN PVOID Context,
+    IN ULONG Index,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG KeyTime,
+    IN UCHAR Recorded,
+    IN UCHAR Replayed
+    )
+/*++
+
+Routine Description:
+
+    Replay routine of KbFilter_EvaluateKeyTrace.  Scores the replayed
+    decision of a key-down packet against the duplicate label of its record.
+
+Arguments:
+
+    Context - KBFILTER_REPLAY_SCORE of the evaluation
+    Index - Index of the packet's record
+    InputData - Replayed packet
+    KeyTime - Key time of the packet
+    Recorded - Decision in the trace, unused
+    Replayed - Decision of the replay
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_REPLAY_SCORE score = (PKBFILTER_REPLAY_SCORE) Context;
+    PKBFILTER_EVALUATION evaluation = score->Evaluation;
+    ULONG slot, latency;
+    BOOLEAN duplicate;
+
+    UNREFERENCED_PARAMETER(Recorded);
+
+    slot = KbFilter_KeySlot(InputData);
+    if ((InputData->Flags & KEY_BREAK) || slot == KBFILTER_NO_KEY_SLOT) {
+        return;
+    }
+
+    evaluation->Presses++;
+    duplicate = (BOOLEAN) ((score->Records[Index].Kind & KBFILTR_KEYTRACE_DUPLICATE) != 0);
+
+    if (Replayed != KBFILTR_DECISION_ACCEPT) {
+        if (duplicate) {
+            evaluation->TruePositives++;
+        }
+        else {
+            evaluation->FalsePositives++;
+            if (evaluation->PendingSince[slot] == 0) {
+                evaluation->PendingSince[slot] = KeyTime;
+            }
+        }
+        return;
+    }
+
+    if (duplicate) {
+        evaluation->FalseNegatives++;
+    }
+
+    //
+    // The first press accepted after dropped legitimate ones ends the
+    // wait for the character.
+    //
+    if (evaluation->PendingSince[slot] != 0) {
+        latency = KeyTime - evaluation->PendingSince[slot];
+        evaluation->AddedLatencyMs += latency;
+        if (latency > evaluation->MaxAddedLatencyMs) {
+            evaluation->MaxAddedLatencyMs = latency;
+        }
+        evaluation->PendingSince[slot] = 0;
+    }
+}
+
+VOID
+KbFilter_EvaluateKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    OUT PKBFILTER_EVALUATION Evaluation
+    )
+/*++
+
+Routine Description:
+
+    Replays a keystroke trace whose duplicates are labelled with
+    KBFILTR_KEYTRACE_DUPLICATE through KbFilter_ReplayPackets and scores the
+    policy: how many duplicates it drops, how many legitimate presses it
+    drops with them, and how long those presses are delayed.  Every check
+    of the filter counts, the sequence check and the lag detector included.
+
+    Like KbFilter_ReplayKeyTrace this only touches Core and Evaluation, so a
+    sweep over traces and policies can run one evaluation per thread.  Core
+    should be freshly initialized.
+
+Arguments:
+
+    Core - Lag mitigation state to replay into
+    Policy - Policy to evaluate
+    Records - Records of the trace, without the file header
+    Count - Number of records
+    Evaluation - Receives the score of the policy
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KBFILTER_REPLAY_SCORE score;
+    ULONG slot;
+
+    RtlZeroMemory(Evaluation, sizeof(KBFILTER_EVALUATION));
+
+    score.Records = Records;
+    score.Evaluation = Evaluation;
+    KbFilter_ReplayPackets(Core, Policy, Records, Count, KbFilter_ScoreDecision, &score);
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        if (Evaluation->PendingSince[slot] != 0) {
+            Evaluation->UnresolvedDrops++;
+        }
+    }
+
+    Evaluation->PrecisionPermille = 1000;
+    if (Evaluation->TruePositives + Evaluation->FalsePositives != 0) {
+        Evaluation->PrecisionPermille = (ULONG)
+            ((ULONGLONG) Evaluation->TruePositives * 1000 /
+             (Evaluation->TruePositives + Evaluation->FalsePositives));
+    }
+
+    Evaluation->RecallPermille = 1000;
+    if (Evaluation->TruePositives + Evaluation->FalseNegatives != 0) {
+        Evaluation->RecallPermille = (ULONG)
+            ((ULONGLONG) Evaluation->TruePositives * 1000 /
+             (Evaluation->TruePositives + Evaluation->FalseNegatives));
+    }
+}
@@ -0,0 +1,1025 @@
+/*++
+
+Module Name:
+
+    kbfcore.h
+
+Abstract:
+
+    Declarations of the lag mitigation core.  The core holds all packet
+    processing of the filter: key table, duplicate and repeat detection,
+    adaptive thresholds, arrival timestamps and the trace ring.  It does not
+    depend on WDM; everything platform specific goes through kbfplat.h, so
+    the core can also be built and exercised in user mode.
+
+Environment:
+
+    Kernel mode and user mode
+
+--*/
+
+#ifndef KBFCORE_H
+#define KBFCORE_H
+
+#include "kbfplat.h"
+#include "public.h"
+
+//
+// Lag mitigation constants
+//
+#define LAG_MITIGATION_THRESHOLD_MS 300  // 300ms threshold for duplicate detection
+
+//
+// The last accepted press of every key is kept in a table indexed directly by
+// scan code.  There is one plane of KBFILTER_MAKE_CODES slots for plain keys,
+// one for E0-prefixed keys and one for E1-prefixed keys.  Make codes outside
+// the table (KBFILTER_NO_KEY_SLOT) are never filtered.
+//
+#define KBFILTER_MAKE_CODES     0x80
+#define KBFILTER_KEY_SLOTS      (3 * KBFILTER_MAKE_CODES)
+#define KBFILTER_NO_KEY_SLOT    ((ULONG) -1)
+
+//
+// Clock used for every timing decision of the filter.  Interrupt time and the
+// performance counter are monotonic and unaffected by system time changes;
+// the tick count is cheaper to read but only as precise as the clock tick.
+// An injected clock lets a test harness drive the filter deterministically.
+// All clocks must be readable at any IRQL, since KbFilter_IsrHook uses them.
+//
+typedef enum _KBFILTER_CLOCK {
+    KbFilterClockInterruptTime = 0,
+    KbFilterClockPerformanceCounter,
+    KbFilterClockTickCount,
+    KbFilterClockInjected
+} KBFILTER_CLOCK;
+
+#define KBFILTER_DEFAULT_CLOCK KbFilterClockInterruptTime
+
+typedef ULONGLONG (*PKBFILTER_CLOCK_ROUTINE)(PVOID Context);
+
+typedef struct _KBFILTER_TIME_SOURCE {
+    KBFILTER_CLOCK Clock;
+
+    //
+    // Reader and its context, only used by KbFilterClockInjected
+    //
+    PKBFILTER_CLOCK_ROUTINE Routine;
+    PVOID Context;
+
+    //
+    // Clock counts per second, and the reading that key time 1 refers to
+    //
+    ULONGLONG Frequency;
+    ULONGLONG Base;
+} KBFILTER_TIME_SOURCE, *PKBFILTER_TIME_SOURCE;
+
+//
+// How the key table is synchronized.  The service callback of a keyboard can
+// run on several processors at once: kbdhid reports packets from read
+// completions, which complete wherever the USB stack finishes them, and the
+// filter delivers its carry queue from timer DPCs.  KbFilter_FilterPackets is
+// therefore safe to call concurrently for the same core.  In the locked mode
+// a range is checked under RecentKeysLock.  In the lock-free mode every
+// check-and-update is a single 64-bit compare-exchange on the key's slot, so
+// ranges checked on several processors never spin on each other.
+//
+// Sequence dedup, keystroke capture and the event ring depend on the order
+// of the packets, so while any of them is in use a range is checked under
+// RecentKeysLock in either mode, see KbFilter_FilterPackets.
+//
+typedef enum _KBFILTER_DEDUP_MODE {
+    KbFilterDedupLocked = 0,
+    KbFilterDedupLockFree
+} KBFILTER_DEDUP_MODE;
+
+#define KBFILTER_DEFAULT_DEDUP_MODE KbFilterDedupLockFree
+
+#define KBFILTER_ORDERED(_Policy_, _Writer_)                                \
+    ((_Policy_)->SequenceWindowMs != 0 || (_Policy_)->RecordKeys ||         \
+     (_Writer_) != NULL)
+
+//
+// Adaptive thresholds.  For every key the filter keeps a histogram of the
+// intervals between consecutive presses, in KBFILTER_INTERVAL_BUCKETS
+// roughly logarithmic buckets of 8-bit counts.  When a bucket saturates all
+// buckets of the key are halved, so old typing ages out.  Once a key has
+// KBFILTER_ADAPTIVE_MIN_SAMPLES intervals, its threshold is placed in the
+// sparsest bucket between the chatter cluster (intervals below
+// KBFILTER_HUMAN_MIN_INTERVAL_MS) and the human typing cluster, and capped at
+// the key's configured threshold, so adaptation only ever relaxes a key.
+//
+#define KBFILTER_INTERVAL_BUCKETS           16
+#define KBFILTER_ADAPTIVE_MIN_SAMPLES       32
+#define KBFILTER_HUMAN_MIN_INTERVAL_MS      64
+
+//
+// Thresholds derived from the typematic parameters.  Repeats of a held key
+// are accepted from half a repeat period after the previous one, the first
+// repeat from KBFILTER_FIRST_REPEAT_PERCENT of the typematic delay after the
+// press.  Two presses further apart than the typematic delay are never
+// duplicates, whatever the configured threshold.
+//
+#define KBFILTER_FIRST_REPEAT_PERCENT   75
+
+//
+// Lag detector.  On keyboards whose packets carry ISR arrival times, the
+// time the oldest packet of each range waited for the service callback is
+// smoothed into an estimate of the DPC latency, an exponentially weighted
+// average with weight 1/2^KBFILTER_LAG_EWMA_SHIFT kept in 1/16 ms.  Other
+// keyboards only know when the previous callback ran.  One report can
+// change several keys at once, a chord or a rollover release with the next
+// press, so a callback of up to KBFILTER_LAG_REPORT_PACKETS packets counts
+// as not delayed however long the keyboard was idle before.  A larger batch
+// must have queued; its oldest packet is taken to have waited since the
+// previous callback, at most KBFILTER_LAG_QUEUED_MAX_MS, since the time
+// before the first queued press was as likely idle as stalled.  With a
+// LagWatermarkMs in the policy, duplicates are only filtered while the
+// estimate is at or above the watermark, and for LagCooldownMs after it
+// last was.
+//
+#define KBFILTER_LAG_EWMA_SHIFT     3
+#define KBFILTER_LAG_COOLDOWN_MS    2000
+#define KBFILTER_LAG_MAX_SAMPLE_MS  60000
+#define KBFILTER_LAG_REPORT_PACKETS 6
+#define KBFILTER_LAG_QUEUED_MAX_MS  500
+
+//
+// Sequence dedup.  Lag can replay a whole run of keys ("the" becoming
+// "thethe") in one range.  The last KBFILTER_SEQUENCE_HISTORY accepted make
+// codes are kept with a polynomial prefix hash, so the hash of any suffix
+// of up to KBFILTER_SEQUENCE_MAX_RUN makes is available in O(1).  A run of
+// makes in the range whose hash equals the suffix of the same length, and
+// whose first make follows the original within SequenceWindowMs, is
+// dropped.  The history size must be a power of two.
+//
+#define KBFILTER_SEQUENCE_HISTORY   32
+#define KBFILTER_SEQUENCE_MAX_RUN   16
+#define KBFILTER_SEQUENCE_HASH_BASE 0x01000193
+
+//
+// Stuck key recovery.  Lag can lose the break code of a key, which then
+// stays down at the class level.  The key pressed last that has been down
+// for StuckKeyMs without a typematic repeat is orphaned; a break code is synthesized for
+// it, either when the next make of the key arrives or from a timer.  The
+// bound never drops below the typematic delay plus KBFILTER_STUCK_KEY_REPEATS
+// repeat periods, so held keys are never released.  With StuckKeyMs set a
+// range can produce up to two packets per input packet.
+//
+#define KBFILTER_STUCK_KEY_REPEATS  4
+
+#define KBFILTER_MAX_OUTPUT_PER_INPUT(_Policy_) \
+    (((_Policy_)->StuckKeyMs != 0) ? 2 : 1)
+
+//
+// Statistics shard, one per processor and cache line aligned, so that the
+// counters of a batch are only ever written by the processor it runs on.
+// The service callback runs at DISPATCH_LEVEL, so the counters need no
+// interlocked operations.  Lock spin time is in performance counter ticks.
+// With KBFILTER_PROFILE the batch cost profile is kept per shard as well.
+//
+typedef struct KBFPLAT_CACHE_ALIGN _KBFILTER_STATS_SHARD {
+    ULONGLONG PacketsIn;
+    ULONGLONG Decisions[KBFILTR_DECISIONS];
+    ULONGLONG PassThroughPackets;
+    ULONGLONG SynthesizedBreaks;
+    ULONGLONG BackpressurePackets;
+    ULONGLONG LockSpinTicks;
+    ULONG BatchSizeBuckets[KBFILTR_BATCH_SIZE_BUCKETS];
+    KBFILTR_BATCH_PROFILE Profile;
+} KBFILTER_STATS_SHARD, *PKBFILTER_STATS_SHARD;
+
+typedef struct _KBFILTER_SEQUENCE_ENTRY {
+    ULONG Slot;
+    ULONG KeyTime;
+    ULONG Prefix;
+} KBFILTER_SEQUENCE_ENTRY, *PKBFILTER_SEQUENCE_ENTRY;
+
+typedef struct _KBFILTER_KEY_HISTOGRAM {
+    UCHAR Counts[KBFILTER_INTERVAL_BUCKETS];
+} KBFILTER_KEY_HISTOGRAM, *PKBFILTER_KEY_HISTOGRAM;
+
+//
+// Lag mitigation policy.  A policy is built from the registry at startup and
+// whenever the configuration is reloaded, and is never modified once
+// published in KbFilterPolicy.  The service callback reads the pointer once
+// per batch at DISPATCH_LEVEL without taking a lock; a replaced policy is
+// freed only after a barrier DPC has run on every processor.
+//
+typedef struct _KBFILTER_KEY_POLICY {
+    USHORT ThresholdMs;
+    USHORT Options;         // KBFILTR_KEY_POLICY_EXEMPT
+} KBFILTER_KEY_POLICY, *PKBFILTER_KEY_POLICY;
+
+typedef struct _KBFILTER_POLICY {
+    BOOLEAN Enabled;
+    BOOLEAN AdaptiveThresholds;
+    BOOLEAN TypematicThresholds;
+    BOOLEAN RecordKeys;
+
+    //
+    // Lag detector, a zero watermark turns it off
+    //
+    ULONG LagWatermarkMs;
+    ULONG LagCooldownMs;
+
+    //
+    // Sequence dedup window, zero turns sequence dedup off.  SequenceMaxRun
+    // caps the length of a replayed run, up to KBFILTER_SEQUENCE_MAX_RUN,
+    // which zero stands for.  The driver leaves it zero; the tools sweep it.
+    //
+    ULONG SequenceWindowMs;
+    ULONG SequenceMaxRun;
+
+    //
+    // Time a key may stay down without repeating, zero turns stuck key
+    // recovery off
+    //
+    ULONG StuckKeyMs;
+
+    //
+    // Bounce window of the ISR fast reject, zero turns it off.  Applied to
+    // devices added after the policy is published.
+    //
+    ULONG IsrRejectUs;
+
+    //
+    // Window in which a press already reported by another keyboard of the
+    // dedup domain is dropped, zero turns cross-device dedup off.  Keyboards
+    // only join the domain if it is set when they are added.
+    //
+    ULONG CrossDeviceWindowMs;
+
+    //
+    // Applied to devices added after the policy is published
+    //
+    KBFILTER_DEDUP_MODE DedupMode;
+    KBFILTER_CLOCK Clock;
+
+    KBFILTER_KEY_POLICY Keys[KBFILTER_KEY_SLOTS];
+} KBFILTER_POLICY, *PKBFILTER_POLICY;
+
+//
+// One key table slot.  LastPress is the key time of the last accepted press
+// (zero if the key has not been pressed yet) and PressCount the number of
+// accepted presses.  Both are updated together through Value.
+//
+typedef union _KBFILTER_KEY_SLOT {
+    struct {
+        ULONG LastPress;
+        ULONG PressCount;
+    } Fields;
+    LONG64 Value;
+} KBFILTER_KEY_SLOT, *PKBFILTER_KEY_SLOT;
+
+//
+// Dedup domain.  With a KVM switch or a keyboard exposing two HID interfaces
+// the same press arrives through two device stacks within milliseconds.
+// Keyboards that join a domain share one table of the last press of every
+// key, tagged with the keyboard and unit that reported it; a press of a key
+// that another keyboard reported within CrossDeviceWindowMs is dropped.
+// Every check-and-update is a single 64-bit compare-exchange on the key's
+// slot, so keyboards never serialize on a lock.  Members adopt the domain's
+// time source when they join, so their key times are comparable.
+//
+typedef union _KBFILTER_DOMAIN_SLOT {
+    struct {
+        ULONG LastPress;
+        USHORT DeviceTag;
+        USHORT UnitId;
+    } Fields;
+    LONG64 Value;
+} KBFILTER_DOMAIN_SLOT, *PKBFILTER_DOMAIN_SLOT;
+
+typedef struct KBFPLAT_CACHE_ALIGN _KBFILTER_DEDUP_DOMAIN {
+    KBFILTER_DOMAIN_SLOT Keys[KBFILTER_KEY_SLOTS];
+    KBFILTER_TIME_SOURCE TimeSource;
+    ULONG Members;
+} KBFILTER_DEDUP_DOMAIN, *PKBFILTER_DEDUP_DOMAIN;
+
+//
+// Scan codes completed in KbFilter_IsrHook are stamped with their arrival
+// time and passed to the service callback through a single-producer,
+// single-consumer ring, so that lag mitigation measures the time between
+// presses at the keyboard rather than the time between callbacks.  The size
+// must be a power of two.  KBFILTER_ARRIVAL_SEARCH bounds how many ring
+// entries the callback skips to resynchronize with the packet stream.
+//
+#define KBFILTER_ARRIVAL_RING_SIZE  64
+#define KBFILTER_ARRIVAL_SEARCH     4
+
+typedef struct _KBFILTER_ARRIVAL {
+    USHORT MakeCode;
+    USHORT Flags;
+    ULONG KeyTime;
+} KBFILTER_ARRIVAL, *PKBFILTER_ARRIVAL;
+
+//
+// ISR fast reject.  With IsrRejectUs in the policy, KbFilter_IsrHook drops
+// a make code that completes less than IsrRejectUs after the last accepted
+// make of the same key, before i8042prt queues a packet for it.  The last
+// makes are kept in a direct-mapped table of KBFILTER_ISR_TABLE_SIZE
+// entries, indexed by key slot, in raw clock readings.  Break codes and the
+// bytes of E1 sequences are never rejected.  IsrRejectUs is capped at
+// KBFILTER_ISR_REJECT_MAX_US.  A PS/2 keyboard clocks out an 11-bit frame
+// at 10 to 16.7 kHz, so every byte takes 0.66 to 1.1 ms, and a bounce puts
+// at least a break, and for E0 keys two prefixes, between two makes: the
+// second make completes 2 to 4 byte times after the first at the earliest.
+// The cap leaves room for that while staying well below the fastest
+// typematic repeat, 33 ms, so held keys are never rejected; slower bounce
+// is left to the service callback, which sees the whole batch.
+//
+#define KBFILTER_ISR_TABLE_SIZE     8
+#define KBFILTER_ISR_REJECT_MAX_US  10000
+
+typedef struct _KBFILTER_ISR_ENTRY {
+    ULONGLONG Time;
+    ULONG Slot;                                             // key slot plus one, zero if unused
+    ULONG Reserved;
+} KBFILTER_ISR_ENTRY, *PKBFILTER_ISR_ENTRY;
+
+//
+// Trace ring.  Events are KBFILTR_TRACE_EVENT records (public.h) written
+// without locks into a power-of-two ring per device.  KBFILTER_TRACE_LEVEL
+// selects at compile time which decisions are recorded; disabled levels
+// compile to nothing.
+//
+#define KBFILTER_TRACE_OFF          0
+#define KBFILTER_TRACE_DROPS        1
+#define KBFILTER_TRACE_ALL          2
+
+#ifndef KBFILTER_TRACE_LEVEL
+  #define KBFILTER_TRACE_LEVEL      KBFILTER_TRACE_DROPS
+#endif
+
+#define KBFILTER_TRACE_RING_SIZE    256
+
+#if KBFILTER_TRACE_LEVEL >= KBFILTER_TRACE_DROPS
+  #define KbFilterTraceDrop(_x_) KbFilter_TraceKey _x_
+#else
+  #define KbFilterTraceDrop(_x_)
+#endif
+
+#if KBFILTER_TRACE_LEVEL >= KBFILTER_TRACE_ALL
+  #define KbFilterTraceAccept(_x_) KbFilter_TraceKey _x_
+#else
+  #define KbFilterTraceAccept(_x_)
+#endif
+
+//
+// Event ring writer.  The event ring (public.h) is shared with user-mode
+// readers, so the producer keeps its own position here and never reads the
+// ring back.  Records are written as they are decided; KbFilter_PublishEvents
+// moves the ring's Head once per batch.  A writer is attached to a single
+// core and is only used under its RecentKeysLock.
+//
+#define KBFILTER_EVENT_RING_RECORDS 1024
+
+typedef struct _KBFILTER_EVENT_WRITER {
+    PKBFILTR_EVENT_RING Ring;
+    ULONG Mask;
+    ULONG Head;                                             // number of the next record
+    ULONG Published;                                        // Head last stored in the ring
+} KBFILTER_EVENT_WRITER, *PKBFILTER_EVENT_WRITER;
+
+//
+// Keystroke capture.  With RecordKeys in the policy every checked packet is
+// appended to a per-device ring of KBFILTR_KEYTRACE_RECORD (public.h), in
+// the trace file format.  KbFilter_ReplayPackets feeds a recorded trace back
+// through KbFilter_FilterPackets, and KbFilter_ReplayKeyTrace reports the
+// decisions that differ.
+//
+// Packets reported in one callback share a key time unless the ISR hook
+// stamped them, so a replay checks consecutive packets with the same key
+// time as one range, of at most KBFILTER_CHUNK_PACKETS like the service
+// callback.  Decisions are read back from an event ring of the replay's
+// own, which also holds the breaks the replay synthesizes.
+//
+#define KBFILTER_CAPTURE_RING_SIZE  512
+
+typedef VOID (*PKBFILTER_REPLAY_ROUTINE)(
+    PVOID Context,
+    ULONG Index,
+    PKEYBOARD_INPUT_DATA InputData,
+    ULONG KeyTime,
+    UCHAR Recorded,
+    UCHAR Replayed
+    );
+
+//
+// Result of evaluating one policy against one labelled keystroke trace with
+// KbFilter_EvaluateKeyTrace.  Only key-down packets are counted.  A
+// legitimate press that is dropped delays the character until the next
+// accepted press of the same key; that delay is the latency the policy
+// adds.  Drops never followed by an accepted press are counted separately.
+//
+typedef struct _KBFILTER_EVALUATION {
+    ULONG Presses;
+    ULONG TruePositives;            // labelled duplicates dropped
+    ULONG FalsePositives;           // legitimate presses dropped
+    ULONG FalseNegatives;           // labelled duplicates accepted
+    ULONG PrecisionPermille;        // TP / (TP + FP), 1000 without drops
+    ULONG RecallPermille;           // TP / (TP + FN), 1000 without duplicates
+    ULONGLONG AddedLatencyMs;
+    ULONG MaxAddedLatencyMs;
+    ULONG UnresolvedDrops;
+
+    //
+    // Key time of the oldest pending dropped legitimate press of each key
+    //
+    ULONG PendingSince[KBFILTER_KEY_SLOTS];
+} KBFILTER_EVALUATION, *PKBFILTER_EVALUATION;
+
+//
+// Carry queue of accepted packets the class service has not consumed yet,
+// see KbFilter_FilterBatch.  A batch is filtered one chunk of at most
+// KBFILTER_CHUNK_PACKETS output packets at a time into a buffer on the
+// caller's stack, after reserving room in the queue for the chunk.  When
+// nothing is queued ahead of it the chunk goes to the class service from
+// there; only what the class service leaves is copied into the queue.
+// Lock protects the counts and is never held while packets are filtered or
+// delivered.  Only the caller that set Delivering calls the class service,
+// so packets reach it in order.  The queue storage belongs to the caller.
+//
+#define KBFILTER_CARRY_PACKETS      100
+#define KBFILTER_CARRY_MAX_PACKETS  4096
+#define KBFILTER_CHUNK_PACKETS      32
+
+typedef VOID (*PKBFILTER_CLASS_SERVICE)(
+    PVOID Context,
+    PKEYBOARD_INPUT_DATA InputDataStart,
+    PKEYBOARD_INPUT_DATA InputDataEnd,
+    PULONG InputDataConsumed
+    );
+
+typedef struct _KBFILTER_CARRY {
+    KBFPLAT_LOCK Lock;
+    PKEYBOARD_INPUT_DATA Packets;
+    ULONG Capacity;
+    ULONG Count;                                            // queued packets
+    ULONG Reserved;                                         // room promised to chunks
+    BOOLEAN Delivering;
+    PKBFILTER_CLASS_SERVICE ClassService;
+    PVOID ClassContext;
+} KBFILTER_CARRY, *PKBFILTER_CARRY;
+
+//
+// State of a keystroke trace replay, see KbFilter_ReplayPackets.  The event
+// ring holds the records of one range, synthesized breaks included.
+//
+#define KBFILTER_REPLAY_EVENTS      (2 * KBFILTER_CHUNK_PACKETS)
+
+typedef struct _KBFILTER_REPLAY {
+    ULONGLONG Now;                                          // injected clock, key time - 1
+    ULONG KeyTime;
+    ULONG Count;
+    ULONG Indices[KBFILTER_CHUNK_PACKETS];                  // record of each packet
+    KEYBOARD_INPUT_DATA Packets[KBFILTER_CHUNK_PACKETS];
+    KEYBOARD_INPUT_DATA Output[KBFILTER_REPLAY_EVENTS];
+    KBFILTER_EVENT_WRITER Writer;
+    union {
+        KBFILTR_EVENT_RING Ring;
+        UCHAR Storage[FIELD_OFFSET(KBFILTR_EVENT_RING, Records) +
+                      KBFILTER_REPLAY_EVENTS * sizeof(KBFILTR_EVENT_RECORD)];
+    } u;
+} KBFILTER_REPLAY, *PKBFILTER_REPLAY;
+
+typedef struct _KBFILTER_REPLAY_DIFF {
+    PKBFILTER_REPLAY_ROUTINE DiffRoutine;
+    PVOID Context;
+    ULONG Differences;
+} KBFILTER_REPLAY_DIFF, *PKBFILTER_REPLAY_DIFF;
+
+typedef struct _KBFILTER_REPLAY_SCORE {
+    PKBFILTR_KEYTRACE_RECORD Records;                       // for the duplicate labels
+    PKBFILTER_EVALUATION Evaluation;
+} KBFILTER_REPLAY_SCORE, *PKBFILTER_REPLAY_SCORE;
+
+//
+// Cost profile.  With KBFILTER_PROFILE set, KbFilter_FilterPackets reads the
+// performance counter before and after each range and records the cost in
+// a KBFILTR_BATCH_PROFILE (public.h).  Only checked builds profile by
+// default; free builds keep the two counter reads off the keystroke path.
+//
+#ifndef KBFILTER_PROFILE
+  #if defined(DBG) && DBG
+    #define KBFILTER_PROFILE 1
+  #else
+    #define KBFILTER_PROFILE 0
+  #endif
+#endif
+
+//
+// Per-keyboard state of the core.  The driver embeds one in each device
+// extension; user-mode builds can allocate as many as they like.
+//
+typedef struct _KBFILTER_CORE
+{
+    //
+    // Last accepted press of each key.  Key times are in
+    // milliseconds since the base of TimeSource plus one, so that zero can
+    // mean the key has not been pressed yet.
+    //
+    KBFILTER_KEY_SLOT KeyTable[KBFILTER_KEY_SLOTS];
+    KBFILTER_TIME_SOURCE TimeSource;
+    KBFILTER_DEDUP_MODE DedupMode;
+    KBFPLAT_LOCK RecentKeysLock;
+
+    //
+    // Dedup domain the keyboard has joined, NULL if none, and the tag its
+    // presses are recorded with there
+    //
+    PKBFILTER_DEDUP_DOMAIN DedupDomain;
+    USHORT DomainTag;
+
+    //
+    // Inter-press interval histograms and the thresholds learned from them,
+    // zero while a key has too few samples.  In the lock-free mode these are
+    // updated without synchronization; a lost increment only costs a sample.
+    //
+    KBFILTER_KEY_HISTOGRAM KeyHistograms[KBFILTER_KEY_SLOTS];
+    USHORT LearnedThresholdMs[KBFILTER_KEY_SLOTS];
+
+    //
+    // Keys currently held down, one bit per key table slot, and the keys
+    // among them that have repeated.  A make code for a key that is already
+    // down is a typematic repeat and is checked against the repeat windows
+    // derived from the keyboard's typematic parameters, see
+    // KbFilter_SetTypematic, instead of the duplicate threshold.  With
+    // TypematicThresholds in the policy, the duplicate threshold of every
+    // key is capped at TypematicThresholdMs.
+    //
+    volatile LONG KeyDown[KBFILTER_KEY_SLOTS / 32];
+    volatile LONG KeyRepeating[KBFILTER_KEY_SLOTS / 32];
+    KEYBOARD_TYPEMATIC_PARAMETERS Typematic;
+    ULONG RepeatWindowMs;
+    ULONG FirstRepeatWindowMs;
+    ULONG TypematicThresholdMs;
+
+    //
+    // Key time and unit of the last accepted make of every key, and the slot
+    // of the most recent accepted make of any key.  Keyboards only repeat
+    // the key pressed last, so only that key can be found orphaned; keys
+    // held before it, such as modifiers, stay silent while they are down.
+    //
+    ULONG KeyDownTime[KBFILTER_KEY_SLOTS];
+    USHORT KeyDownUnitId[KBFILTER_KEY_SLOTS];
+    volatile LONG LastMakeSlot;
+
+    //
+    // Lag detector state, see KbFilter_UpdateLagDetector.  DedupActive is
+    // TRUE while duplicates are filtered; LagEnterCount and LagExitCount
+    // count the transitions.  Ranges checked concurrently update the
+    // estimate with compare-exchange, and only the range that flips
+    // DedupActive counts the transition.
+    //
+    volatile LONG LagEstimate;
+    volatile ULONG LagAboveTime;
+    volatile LONG LastCallbackTime;                         // without arrival times
+    volatile LONG DedupActive;
+    volatile LONG LagEnterCount;
+    volatile LONG LagExitCount;
+
+    //
+    // Sequence dedup state, see KbFilter_CheckSequence.  Entry n of the
+    // history is the n-th accepted make code, stored at
+    // n % KBFILTER_SEQUENCE_HISTORY; SequenceLast holds one plus the entry
+    // number of each key's last accepted make, zero if there is none.
+    // SequenceDropRemaining counts the makes of a matched run still to
+    // drop.  Protected by RecentKeysLock, which KbFilter_FilterPackets holds
+    // for the whole range while sequence dedup is on.
+    //
+    KBFILTER_SEQUENCE_ENTRY SequenceHistory[KBFILTER_SEQUENCE_HISTORY];
+    ULONG SequenceCount;
+    ULONG SequenceLast[KBFILTER_KEY_SLOTS];
+    ULONG SequenceDropRemaining;
+
+    //
+    // Arrival times of scan codes seen by KbFilter_IsrHook.  ArrivalHead is
+    // only written by the ISR and ArrivalTail only by the service callback,
+    // which i8042prt never runs on two processors at once for a keyboard.
+    // IsrHooked is set once the i8042 hook is installed; other stacks use
+    // the time of the service callback instead.
+    //
+    KBFILTER_ARRIVAL ArrivalRing[KBFILTER_ARRIVAL_RING_SIZE];
+    volatile ULONG ArrivalHead;
+    volatile ULONG ArrivalTail;
+    BOOLEAN IsrHooked;
+
+    //
+    // ISR fast reject state, see KbFilter_IsrRejectByte.  Only the ISR
+    // touches the table, and i8042prt never runs it on two processors at
+    // once.  IsrRejectTicks is zero while the fast reject is off;
+    // IsrExempt has a bit for every key exempt in the policy.
+    // IsrSequenceBytes counts the bytes of an E1 sequence still to come.
+    //
+    KBFILTER_ISR_ENTRY IsrTable[KBFILTER_ISR_TABLE_SIZE];
+    ULONG IsrRejectTicks;
+    ULONG IsrExempt[KBFILTER_KEY_SLOTS / 32];
+    ULONG IsrSequenceBytes;
+    volatile ULONG IsrRejects;
+
+    //
+    // Trace events.  TraceHead counts the events ever recorded; the event
+    // with sequence number n is stored at n % KBFILTER_TRACE_RING_SIZE.
+    //
+    KBFILTR_TRACE_EVENT TraceRing[KBFILTER_TRACE_RING_SIZE];
+    volatile LONG TraceHead;
+
+    //
+    // Keystroke capture, see KbFilter_CaptureKey.  CaptureHead counts the
+    // records ever written; CaptureLastTime is the key time the next delta
+    // is relative to.  Written under RecentKeysLock.
+    //
+    KBFILTR_KEYTRACE_RECORD CaptureRing[KBFILTER_CAPTURE_RING_SIZE];
+    volatile LONG CaptureHead;
+    ULONG CaptureLastTime;
+
+    //
+    // Event ring writer, NULL while no reader has mapped the ring.  Read
+    // once per batch; see KbFilter_AttachEventRing.
+    //
+    PKBFILTER_EVENT_WRITER EventWriter;
+
+    //
+    // Performance counter frequency of the batch cost profile and the lock
+    // spin times in the statistics shards
+    //
+    ULONGLONG ProfileFrequency;
+
+    //
+    // Statistics shards, see KbFilter_AttachStatistics.  Until shards are
+    // attached, or if they cannot be allocated, DefaultShard is the only one.
+    //
+    PKBFILTER_STATS_SHARD Stats;
+    ULONG StatsShards;
+    KBFILTER_STATS_SHARD DefaultShard;
+
+} KBFILTER_CORE, *PKBFILTER_CORE;
+
+//
+// Prototypes
+//
+VOID
+KbFilter_InitializeCore(
+    OUT PKBFILTER_CORE Core,
+    IN KBFILTER_DEDUP_MODE DedupMode,
+    IN KBFILTER_CLOCK Clock,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context,
+    IN ULONGLONG Frequency
+    );
+
+VOID
+KbFilter_SetTypematic(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_TYPEMATIC_PARAMETERS Typematic
+    );
+
+ULONG
+KbFilter_KeySlot(
+    IN PKEYBOARD_INPUT_DATA InputData
+    );
+
+UCHAR
+KbFilter_KeyClass(
+    IN PKEYBOARD_INPUT_DATA InputData
+    );
+
+VOID
+KbFilter_TraceKey(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    );
+
+ULONG
+KbFilter_DrainTrace(
+    IN PKBFILTER_CORE Core,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_TRACE_EVENT Events,
+    IN ULONG Count,
+    OUT PULONG Lost
+    );
+
+VOID
+KbFilter_CaptureKey(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    );
+
+ULONG
+KbFilter_DrainKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    OUT PULONG Lost
+    );
+
+BOOLEAN
+KbFilter_DecodeKeyRecord(
+    IN PKBFILTR_KEYTRACE_RECORD Record,
+    IN OUT PULONG KeyTime,
+    IN OUT PBOOLEAN Synchronized,
+    OUT PKEYBOARD_INPUT_DATA InputData
+    );
+
+ULONG
+KbFilter_ReplayPackets(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    IN PKBFILTER_REPLAY_ROUTINE Routine,
+    IN PVOID Context
+    );
+
+VOID
+KbFilter_ReplayDiff(
+    IN PVOID Context,
+    IN ULONG Index,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG KeyTime,
+    IN UCHAR Recorded,
+    IN UCHAR Replayed
+    );
+
+ULONG
+KbFilter_ReplayKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    IN PKBFILTER_REPLAY_ROUTINE DiffRoutine,
+    IN PVOID Context
+    );
+
+VOID
+KbFilter_EvaluateKeyTrace(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count,
+    OUT PKBFILTER_EVALUATION Evaluation
+    );
+
+VOID
+KbFilter_RecordArrival(
+    IN PKBFILTER_CORE Core,
+    IN UCHAR DataByte,
+    IN KEYBOARD_SCAN_STATE ScanState
+    );
+
+VOID
+KbFilter_SetIsrReject(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy
+    );
+
+BOOLEAN
+KbFilter_IsrRejectByte(
+    IN PKBFILTER_CORE Core,
+    IN UCHAR DataByte,
+    IN KEYBOARD_SCAN_STATE ScanState
+    );
+
+ULONG
+KbFilter_SimulateIsr(
+    IN PKBFILTER_CORE Core,
+    IN PUCHAR DataBytes,
+    IN ULONG Count,
+    IN OUT PKEYBOARD_SCAN_STATE ScanState,
+    OUT PKEYBOARD_INPUT_DATA OutputData
+    );
+
+ULONG
+KbFilter_TakeArrivalTime(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CallbackTime
+    );
+
+VOID
+KbFilter_InitializeTimeSource(
+    OUT PKBFILTER_TIME_SOURCE TimeSource,
+    IN KBFILTER_CLOCK Clock,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context,
+    IN ULONGLONG Frequency
+    );
+
+ULONGLONG
+KbFilter_ReadClock(
+    IN PKBFILTER_TIME_SOURCE TimeSource
+    );
+
+ULONG
+KbFilter_QueryKeyTime(
+    IN PKBFILTER_TIME_SOURCE TimeSource
+    );
+
+VOID
+KbFilter_UpdateLagDetector(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN ULONG LatencyMs,
+    IN ULONG CurrentTime
+    );
+
+UCHAR
+KbFilter_CheckSequence(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    IN ULONG CurrentTime
+    );
+
+VOID
+KbFilter_RecordSequence(
+    IN PKBFILTER_CORE Core,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    );
+
+BOOLEAN
+KbFilter_ReleaseOrphanedKey(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime,
+    OUT PKEYBOARD_INPUT_DATA BreakData
+    );
+
+ULONG
+KbFilter_StuckKeyBound(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy
+    );
+
+ULONG
+KbFilter_ReleaseStuckKeys(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN ULONG CurrentTime,
+    OUT PKEYBOARD_INPUT_DATA OutputData,
+    IN ULONG OutputCount,
+    OUT PULONG NextCheckMs
+    );
+
+VOID
+KbFilter_MarkKeyDown(
+    IN PKBFILTER_CORE Core,
+    IN ULONG Slot,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime,
+    IN BOOLEAN Repeat
+    );
+
+UCHAR
+KbFilter_CheckKey(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    );
+
+VOID
+KbFilter_JoinDedupDomain(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_DEDUP_DOMAIN Domain,
+    IN USHORT DeviceTag
+    );
+
+VOID
+KbFilter_LeaveDedupDomain(
+    IN PKBFILTER_CORE Core
+    );
+
+UCHAR
+KbFilter_CheckDomain(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN ULONG CurrentTime
+    );
+
+VOID
+KbFilter_AttachStatistics(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_STATS_SHARD Shards,
+    IN ULONG Count
+    );
+
+VOID
+KbFilter_InitializeEventRing(
+    OUT PKBFILTER_EVENT_WRITER Writer,
+    OUT PKBFILTR_EVENT_RING Ring,
+    IN ULONG RecordCount
+    );
+
+PKBFILTER_EVENT_WRITER
+KbFilter_AttachEventRing(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_EVENT_WRITER Writer
+    );
+
+VOID
+KbFilter_RecordDecision(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTER_EVENT_WRITER Writer,
+    IN PKEYBOARD_INPUT_DATA InputData,
+    IN UCHAR Decision,
+    IN ULONG KeyTime
+    );
+
+PKBFILTER_EVENT_WRITER
+KbFilter_PublishEvents(
+    IN PKBFILTER_CORE Core
+    );
+
+ULONG
+KbFilter_ReadEvents(
+    IN PKBFILTR_EVENT_RING Ring,
+    IN OUT PULONG Cursor,
+    OUT PKBFILTR_EVENT_RECORD Records,
+    IN ULONG Count,
+    OUT PULONG Lost
+    );
+
+PKBFILTER_STATS_SHARD
+KbFilter_StatsShard(
+    IN PKBFILTER_CORE Core
+    );
+
+VOID
+KbFilter_QueryStatistics(
+    IN PKBFILTER_CORE Core,
+    OUT PKBFILTR_STATISTICS Statistics
+    );
+
+VOID
+KbFilter_QueryProfile(
+    IN PKBFILTER_CORE Core,
+    OUT PKBFILTR_BATCH_PROFILE Profile
+    );
+
+ULONG
+KbFilter_FilterPackets(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKEYBOARD_INPUT_DATA InputDataStart,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    OUT PKEYBOARD_INPUT_DATA OutputData
+    );
+
+VOID
+KbFilter_InitializeCarry(
+    OUT PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Capacity
+    );
+
+VOID
+KbFilter_ConnectCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKBFILTER_CLASS_SERVICE ClassService,
+    IN PVOID ClassContext
+    );
+
+PKEYBOARD_INPUT_DATA
+KbFilter_ResizeCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Capacity
+    );
+
+ULONG
+KbFilter_ReserveCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN ULONG Count
+    );
+
+BOOLEAN
+KbFilter_DeliverCarry(
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA Packets,
+    IN ULONG Count,
+    IN ULONG Reserved
+    );
+
+ULONG
+KbFilter_FilterBatch(
+    IN PKBFILTER_CORE Core,
+    IN PKBFILTER_POLICY Policy,
+    IN PKBFILTER_CARRY Carry,
+    IN PKEYBOARD_INPUT_DATA InputDataStart,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    OUT PBOOLEAN Retry
+    );
+
+#endif  // KBFCORE_H
@@ -16,10 +16,10 @@ Abstract: This is an upper device filter driver sample for PS/2 keyboard. This
         driver layers in between the KbdClass driver and i8042prt driver and
         hooks the callback routine that moves keyboard inputs from the port
         driver to class driver. With this filter, you can remove or insert
-        additional keys into the stream. This sample also creates a raw
-        PDO and registers an interface so that application can talk to
-        the filter driver directly without going thru the PS/2 devicestack.
-        The reason for providing this additional interface is because the keyboard
+        additional keys into the stream. The filter also creates a control
+        device, see control.c, so that applications can talk to the filter
+        driver directly without going thru the PS/2 devicestack.  The reason
+        for providing this additional interface is because the keyboard
         device is an exclusive secure device and it's not possible to open the
         device from usermode and send custom ioctls.
 
@@ -43,9 +43,10 @@ Environment:
 #pragma alloc_text (INIT, DriverEntry)
 #pragma alloc_text (PAGE, KbFilter_AddDevice)
 #pragma alloc_text (PAGE, KbFilter_DispatchInternalDeviceControl)
+#pragma alloc_text (PAGE, KbFilter_DispatchPnp)
 #endif
 
-ULONG InstanceNo = 0;
+volatile LONG KbFilterAllocationFailures = 0;
 
 NTSTATUS
 DriverEntry(
@@ -73,19 +74,31 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(RegistryPath);
+    NTSTATUS status;
 
     DebugPrint(("Keyboard Filter Driver Sample - WDM Edition.\n"));
 
+    //
+    // Load the lag mitigation policy from the service key
+    //
+    status = KbFilter_InitializePolicy(RegistryPath);
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("KbFilter_InitializePolicy failed with status code 0x%x\n", status));
+        return status;
+    }
+
+    KbFilter_InitializeControl();
+
     //
     // Set up the device driver entry points.
     //
     DriverObject->MajorFunction[IRP_MJ_CREATE] = KbFilter_DispatchGeneral;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = KbFilter_DispatchGeneral;
     DriverObject->MajorFunction[IRP_MJ_CLOSE] = KbFilter_DispatchGeneral;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = KbFilter_DispatchGeneral;
     DriverObject->MajorFunction[IRP_MJ_INTERNAL_DEVICE_CONTROL] = KbFilter_DispatchInternalDeviceControl;
-    DriverObject->MajorFunction[IRP_MJ_POWER] = KbFilter_DispatchGeneral;
-    DriverObject->MajorFunction[IRP_MJ_PNP] = KbFilter_DispatchGeneral;
+    DriverObject->MajorFunction[IRP_MJ_POWER] = KbFilter_DispatchPower;
+    DriverObject->MajorFunction[IRP_MJ_PNP] = KbFilter_DispatchPnp;
     DriverObject->MajorFunction[IRP_MJ_SYSTEM_CONTROL] = KbFilter_DispatchGeneral;
     DriverObject->DriverExtension->AddDevice = KbFilter_AddDevice;
     DriverObject->DriverUnload = KbFilter_Unload;
@@ -119,9 +132,20 @@ Return Value:
     NTSTATUS                status;
     PDEVICE_OBJECT          deviceObject = NULL;
     PDEVICE_EXTENSION       filterExt;
+    KBFILTR_CONFIGURATION   configuration;
+    PKEYBOARD_INPUT_DATA    carryPackets;
     
     DebugPrint(("Enter KbFilter_AddDevice \n"));
 
+    //
+    // Pick up configuration changes whenever a keyboard arrives.  If the
+    // reload fails the current policy stays in effect.  The settings are
+    // copied, since a reload through the control device may free the
+    // policy at any time.
+    //
+    KbFilter_ReloadPolicy();
+    KbFilter_QueryConfiguration(&configuration);
+
     //
     // Create filter device object.
     //
@@ -144,8 +168,25 @@ Return Value:
     //
     // Initialize the device extension
     //
+    filterExt->Kind = KbFilterDeviceFilter;
     filterExt->DeviceObject = deviceObject;
 
+    //
+    // The carry queue is sized for the default port queue until the port
+    // driver reports its own, see KbFilter_ResizeCarryStorage
+    //
+    carryPackets = (PKEYBOARD_INPUT_DATA) ExAllocatePoolWithTag(
+                       NonPagedPoolNx,
+                       KBFILTER_CARRY_PACKETS * sizeof(KEYBOARD_INPUT_DATA),
+                       KBFILTER_POOL_TAG);
+    if (carryPackets == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        IoDeleteDevice(deviceObject);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KbFilter_InitializeCarry(&filterExt->Carry, carryPackets, KBFILTER_CARRY_PACKETS);
+
     //
     // Attach to the device stack
     //
@@ -153,6 +194,7 @@ Return Value:
 
     if (!filterExt->TargetDeviceObject) {
         DebugPrint(("IoAttachDeviceToDeviceStack failed\n"));
+        ExFreePoolWithTag(carryPackets, KBFILTER_POOL_TAG);
         IoDeleteDevice(deviceObject);
         return STATUS_UNSUCCESSFUL;
     }
@@ -160,9 +202,37 @@ Return Value:
     //
     // Initialize lag mitigation structures
     //
-    KeInitializeSpinLock(&filterExt->RecentKeysLock);
-    filterExt->RecentKeyIndex = 0;
-    RtlZeroMemory(filterExt->RecentKeys, sizeof(filterExt->RecentKeys));
+    KbFilter_InitializeCore(&filterExt->Core,
+                            (KBFILTER_DEDUP_MODE) configuration.DedupMode,
+                            (KBFILTER_CLOCK) configuration.Clock,
+                            NULL,
+                            NULL,
+                            0);
+
+    KeInitializeTimer(&filterExt->CarryTimer);
+    KeInitializeDpc(&filterExt->CarryDpc, KbFilter_CarryDpc, filterExt);
+    KeInitializeTimer(&filterExt->StuckTimer);
+    KeInitializeDpc(&filterExt->StuckDpc, KbFilter_StuckKeyDpc, filterExt);
+    KeInitializeSpinLock(&filterExt->CacheLock);
+
+    //
+    // One statistics shard per processor, each on its own cache lines.  The
+    // core counts in a single shard of its own if there is no memory.
+    //
+    filterExt->StatsShards = (PKBFILTER_STATS_SHARD) ExAllocatePoolWithTag(
+                                 NonPagedPoolNxCacheAligned,
+                                 KbfPlatProcessorCount() * sizeof(KBFILTER_STATS_SHARD),
+                                 KBFILTER_POOL_TAG);
+    if (filterExt->StatsShards != NULL) {
+        RtlZeroMemory(filterExt->StatsShards,
+                      KbfPlatProcessorCount() * sizeof(KBFILTER_STATS_SHARD));
+        KbFilter_AttachStatistics(&filterExt->Core,
+                                  filterExt->StatsShards,
+                                  KbfPlatProcessorCount());
+    }
+    else {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+    }
 
     //
     // Set the device object flags
@@ -173,10 +243,23 @@ Return Value:
     deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
     //
-    // Create a RAW pdo so we can provide a sideband communication with
-    // the application. For now, this is disabled to minimize WDF dependencies.
+    // Make the keyboard known to the control device, creating it along with
+    // the first keyboard.  The keyboard is filtered even without a control
+    // device; the next keyboard added creates it again.
+    //
+    status = KbFilter_RegisterDevice(DriverObject,
+                                     filterExt,
+                                     (BOOLEAN) (configuration.CrossDeviceWindowMs != 0));
+    if (!NT_SUCCESS(status)) {
+        DebugPrint(("No control device for keyboard %u, status 0x%x\n",
+                    filterExt->InstanceNo,
+                    status));
+    }
+
+    //
+    // The ISR hook is installed later, when the port driver asks for it
     //
-    // status = KbFiltr_CreateRawPdo(deviceObject, ++InstanceNo);
+    KbFilter_ConfigureIsrReject(&filterExt->Core);
 
     return STATUS_SUCCESS;
 }
@@ -203,6 +286,8 @@ Return Value:
     UNREFERENCED_PARAMETER(DriverObject);
     
     DebugPrint(("KbFilter_Unload\n"));
+
+    KbFilter_FreePolicy();
 }
 
 NTSTATUS
@@ -229,7 +314,11 @@ Return Value:
 --*/
 {
     PDEVICE_EXTENSION deviceExtension;
-    
+
+    if (KbFilter_IsControlDevice(DeviceObject)) {
+        return KbFilter_DispatchControl(DeviceObject, Irp);
+    }
+
     deviceExtension = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
     
     //
@@ -239,6 +328,124 @@ Return Value:
     return IoCallDriver(deviceExtension->TargetDeviceObject, Irp);
 }
 
+NTSTATUS
+KbFilter_DispatchPnp(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Dispatch routine for PnP requests.  Every state change empties the
+    typematic and indicator cache, since the port driver reprograms the
+    keyboard.  On removal the timers are stopped once the lower drivers have
+    removed their devices, and the filter device is detached and deleted.
+
+Arguments:
+
+    DeviceObject - Pointer to the device object.
+    Irp - Pointer to the request packet.
+
+Return Value:
+
+    Status returned from the next driver.
+
+--*/
+{
+    PDEVICE_EXTENSION devExt;
+    PIO_STACK_LOCATION irpStack;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    if (KbFilter_IsControlDevice(DeviceObject)) {
+        return KbFilter_DispatchControl(DeviceObject, Irp);
+    }
+
+    devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+    irpStack = IoGetCurrentIrpStackLocation(Irp);
+
+    switch (irpStack->MinorFunction) {
+    case IRP_MN_START_DEVICE:
+    case IRP_MN_STOP_DEVICE:
+    case IRP_MN_SURPRISE_REMOVAL:
+        KbFilter_InvalidateCache(devExt, KBFILTER_CACHE_ALL);
+        break;
+
+    case IRP_MN_REMOVE_DEVICE:
+        KbFilter_InvalidateCache(devExt, KBFILTER_CACHE_ALL);
+
+        //
+        // Control requests no longer see the keyboard once it is off the
+        // device list, so its extension can go away
+        //
+        KbFilter_UnregisterDevice(devExt);
+
+        IoSkipCurrentIrpStackLocation(Irp);
+        status = IoCallDriver(devExt->TargetDeviceObject, Irp);
+
+        //
+        // The port driver no longer reports packets, so only the timers can
+        // still run
+        //
+        KbFilter_StopTimers(devExt);
+
+        if (devExt->StatsShards != NULL) {
+            ExFreePoolWithTag(devExt->StatsShards, KBFILTER_POOL_TAG);
+        }
+        ExFreePoolWithTag(devExt->Carry.Packets, KBFILTER_POOL_TAG);
+
+        IoDetachDevice(devExt->TargetDeviceObject);
+        IoDeleteDevice(DeviceObject);
+        return status;
+    }
+
+    IoSkipCurrentIrpStackLocation(Irp);
+    return IoCallDriver(devExt->TargetDeviceObject, Irp);
+}
+
+NTSTATUS
+KbFilter_DispatchPower(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Dispatch routine for power requests.  A power state change empties the
+    typematic and indicator cache, since the keyboard is reprogrammed when
+    it powers up again.
+
+Arguments:
+
+    DeviceObject - Pointer to the device object.
+    Irp - Pointer to the request packet.
+
+Return Value:
+
+    Status returned from the next driver.
+
+--*/
+{
+    PDEVICE_EXTENSION devExt;
+
+    if (KbFilter_IsControlDevice(DeviceObject)) {
+        return KbFilter_DispatchControl(DeviceObject, Irp);
+    }
+
+    devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->MinorFunction == IRP_MN_SET_POWER) {
+        KbFilter_InvalidateCache(devExt, KBFILTER_CACHE_ALL);
+    }
+
+    PoStartNextPowerIrp(Irp);
+    IoSkipCurrentIrpStackLocation(Irp);
+    return PoCallDriver(devExt->TargetDeviceObject, Irp);
+}
+
 NTSTATUS
 KbFilter_DispatchInternalDeviceControl(
     IN PDEVICE_OBJECT DeviceObject,
@@ -290,6 +497,10 @@ Return Value:
 
     DebugPrint(("Entered KbFilter_DispatchInternalDeviceControl\n"));
 
+    if (KbFilter_IsControlDevice(DeviceObject)) {
+        return KbFilter_DispatchControl(DeviceObject, Irp);
+    }
+
     devExt = (PDEVICE_EXTENSION) DeviceObject->DeviceExtension;
     irpStack = IoGetCurrentIrpStackLocation(Irp);
     
@@ -323,6 +534,10 @@ Return Value:
         
         devExt->UpperConnectData = *connectData;
 
+        KbFilter_ConnectCarry(&devExt->Carry,
+                              (PKBFILTER_CLASS_SERVICE)(ULONG_PTR) connectData->ClassService,
+                              connectData->ClassDeviceObject);
+
         //
         // Hook into the report chain.  Everytime a keyboard packet is reported
         // to the system, KbFilter_ServiceCallback will be called
@@ -401,6 +616,7 @@ Return Value:
         devExt->IsrWritePort = hookKeyboard->IsrWritePort;
         devExt->QueueKeyboardPacket = hookKeyboard->QueueKeyboardPacket;
         devExt->CallContext = hookKeyboard->CallContext;
+        devExt->Core.IsrHooked = TRUE;
 
         status = STATUS_SUCCESS;
         break;
@@ -411,15 +627,34 @@ Return Value:
         break;
         
     //
-    // Might want to capture these in the future.  For now, then pass them down
-    // the stack.  These queries must be successful for the RIT to communicate
-    // with the keyboard.
+    // Complete these queries from the cache when possible, otherwise pass
+    // them down and cache the result.  These queries must be successful for
+    // the RIT to communicate with the keyboard.
     //
     case IOCTL_KEYBOARD_QUERY_INDICATOR_TRANSLATION:
     case IOCTL_KEYBOARD_QUERY_INDICATORS:
-    case IOCTL_KEYBOARD_SET_INDICATORS:
     case IOCTL_KEYBOARD_QUERY_TYPEMATIC:
+        if (KbFilter_CompleteFromCache(devExt, Irp)) {
+            return STATUS_SUCCESS;
+        }
+        needCompletion = TRUE;
+        break;
+
+    //
+    // The cached state is unknown until the request completes
+    //
+    case IOCTL_KEYBOARD_SET_INDICATORS:
+        KbFilter_InvalidateCache(devExt, KBFILTER_CACHE_INDICATORS);
+        needCompletion = TRUE;
+        break;
+
+    //
+    // The repeat delay and rate are learned when the request completes, see
+    // KbFilterRequestCompletionRoutine
+    //
     case IOCTL_KEYBOARD_SET_TYPEMATIC:
+        KbFilter_InvalidateCache(devExt, KBFILTER_CACHE_TYPEMATIC);
+        needCompletion = TRUE;
         break;
     }
 
@@ -589,95 +824,141 @@ Return Value:
         }
     }
 
+    //
+    // Drop the bounce of a make code before i8042prt queues a packet for
+    // it.  An E0 prefix was already consumed, so the scan state goes back
+    // to Normal along with the byte.
+    //
+    if (KbFilter_IsrRejectByte(&devExt->Core, *DataByte, *ScanState)) {
+        *ScanState = Normal;
+        *ContinueProcessing = FALSE;
+        return retVal;
+    }
+
+    KbFilter_RecordArrival(&devExt->Core, *DataByte, *ScanState);
+
     *ContinueProcessing = TRUE;
     return retVal;
 }
 
-BOOLEAN
-KbFilter_IsRecentDuplicateKey(
-    IN PDEVICE_EXTENSION DevExt,
-    IN PKEYBOARD_INPUT_DATA InputData
+VOID
+KbFilter_ServiceCallback(
+    IN PDEVICE_OBJECT  DeviceObject,
+    IN PKEYBOARD_INPUT_DATA InputDataStart,
+    IN PKEYBOARD_INPUT_DATA InputDataEnd,
+    IN OUT PULONG InputDataConsumed
     )
 /*++
 
 Routine Description:
 
-    Checks if the current key input is a recent duplicate that should be filtered
-    out due to lag-induced multiple key presses.
+    Called when there are keyboard packets to report to the Win32 subsystem.
+    You can do anything you like to the packets.  For instance:
+
+    o Drop a packet altogether
+    o Mutate the contents of a packet
+    o Insert packets into the stream
 
 Arguments:
 
-    DevExt - Device extension containing recent key tracking data
-    InputData - Current keyboard input data to check
+    DeviceObject - Context passed during the connect IOCTL
+
+    InputDataStart - First packet to be reported
+
+    InputDataEnd - One past the last packet to be reported.  Total number of
+                   packets is equal to InputDataEnd - InputDataStart
+
+    InputDataConsumed - Set to the number of packets taken from the port
+                        driver.  Every one of them has been filtered, and the
+                        accepted ones were consumed by the RIT (via the
+                        function pointer we replaced in the connect IOCTL) or
+                        queued for a retry, so none is reported again.
 
 Return Value:
 
-    TRUE if this is a recent duplicate that should be filtered, FALSE otherwise.
+    Status is returned.
 
 --*/
 {
+    PDEVICE_EXTENSION   devExt;
+    PKBFILTER_POLICY    policy;
+    BOOLEAN retry;
+    LARGE_INTEGER dueTime;
     KIRQL oldIrql;
-    LARGE_INTEGER currentTime;
-    LARGE_INTEGER timeDiff;
-    ULONG i;
-    BOOLEAN isDuplicate = FALSE;
 
-    // Only filter key-down events (make codes)
-    if (InputData->Flags & KEY_BREAK) {
-        return FALSE;
-    }
+    devExt = FilterGetData(DeviceObject);
 
-    KeQuerySystemTime(&currentTime);
+    //
+    // Stay on one processor, so the statistics shard of the batch stays the
+    // same throughout
+    //
+    KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
 
-    KeAcquireSpinLock(&DevExt->RecentKeysLock, &oldIrql);
+    //
+    // Read the policy once, so a concurrent reload takes effect with the
+    // next batch.  Only at DISPATCH_LEVEL: KbFilter_ReloadPolicy frees the
+    // old policy once its barrier DPC has run on every processor, which
+    // cannot happen while this processor is still in the batch.
+    //
+    policy = *(PKBFILTER_POLICY volatile *) &KbFilterPolicy;
 
-    // Check recent keys for duplicates
-    for (i = 0; i < MAX_RECENT_KEYS; i++) {
-        PRECENT_KEY_INPUT recentKey = &DevExt->RecentKeys[i];
-        
-        // Skip empty slots
-        if (recentKey->MakeCode == 0) {
-            continue;
-        }
+    //
+    // Filter the batch one chunk at a time on the stack and hand every
+    // chunk to the class driver, so no pool allocation is made on this
+    // path.  The carry lock is only held to reserve queue room and queue
+    // what the class driver leaves.
+    //
+    *InputDataConsumed = KbFilter_FilterBatch(&devExt->Core,
+                                              policy,
+                                              &devExt->Carry,
+                                              InputDataStart,
+                                              InputDataEnd,
+                                              &retry);
 
-        // Check if this is the same key
-        if (recentKey->MakeCode == InputData->MakeCode) {
-            // Calculate time difference in 100ns units
-            timeDiff.QuadPart = currentTime.QuadPart - recentKey->Timestamp.QuadPart;
-            
-            // Convert to milliseconds (100ns units to ms)
-            LONG timeDiffMs = (LONG)(timeDiff.QuadPart / 10000);
-            
-            // If within threshold, it's a duplicate
-            if (timeDiffMs < LAG_MITIGATION_THRESHOLD_MS) {
-                isDuplicate = TRUE;
-                DebugPrint(("Filtered duplicate key 0x%x (time diff: %dms)\n", 
-                           InputData->MakeCode, timeDiffMs));
-                break;
-            }
-        }
+    //
+    // Event ring readers see the whole batch at once
+    //
+    KbFilter_SignalEventWaiters(KbFilter_PublishEvents(&devExt->Core));
+
+    //
+    // The class input queue is full, retry once it has had time to drain
+    //
+    if (retry) {
+        KbFilter_RetryCarry(devExt);
     }
 
-    KeReleaseSpinLock(&DevExt->RecentKeysLock, oldIrql);
+    //
+    // Look for orphaned keys once the stuck key bound has passed
+    //
+    if (policy->StuckKeyMs != 0 && !devExt->StuckTimerArmed) {
+        KeAcquireSpinLockAtDpcLevel(&devExt->Carry.Lock);
+        if (!devExt->StuckTimerArmed && !devExt->Removed) {
+            dueTime.QuadPart = -10000LL * KbFilter_StuckKeyBound(&devExt->Core, policy);
+            KeSetTimer(&devExt->StuckTimer, dueTime, &devExt->StuckDpc);
+            devExt->StuckTimerArmed = TRUE;
+        }
+        KeReleaseSpinLockFromDpcLevel(&devExt->Carry.Lock);
+    }
 
-    return isDuplicate;
+    KeLowerIrql(oldIrql);
 }
 
 VOID
-KbFilter_AddRecentKey(
-    IN PDEVICE_EXTENSION DevExt,
-    IN PKEYBOARD_INPUT_DATA InputData
+KbFilter_RetryCarry(
+    IN PDEVICE_EXTENSION DevExt
     )
 /*++
 
 Routine Description:
 
-    Adds a key input to the recent keys tracking for lag mitigation.
+    Arms CarryTimer to offer the carry queue to the class driver again,
+    unless the device is being removed.  The timer is set under the carry
+    lock, so it cannot be armed after removal has cancelled it.  Called at
+    DISPATCH_LEVEL.
 
 Arguments:
 
-    DevExt - Device extension containing recent key tracking data
-    InputData - Keyboard input data to add to recent keys
+    DevExt - Device extension owning the carry queue
 
 Return Value:
 
@@ -685,131 +966,213 @@ Return Value:
 
 --*/
 {
-    KIRQL oldIrql;
-    LARGE_INTEGER currentTime;
+    LARGE_INTEGER dueTime;
 
-    // Only track key-down events (make codes)
-    if (InputData->Flags & KEY_BREAK) {
-        return;
+    KeAcquireSpinLockAtDpcLevel(&DevExt->Carry.Lock);
+
+    if (!DevExt->Removed) {
+        dueTime.QuadPart = -10000LL * KBFILTER_CARRY_RETRY_MS;
+        KeSetTimer(&DevExt->CarryTimer, dueTime, &DevExt->CarryDpc);
     }
 
-    KeQuerySystemTime(&currentTime);
+    KeReleaseSpinLockFromDpcLevel(&DevExt->Carry.Lock);
+}
+
+VOID
+KbFilter_StopTimers(
+    IN PDEVICE_EXTENSION DevExt
+    )
+/*++
 
-    KeAcquireSpinLock(&DevExt->RecentKeysLock, &oldIrql);
+Routine Description:
+
+    Stops the carry and stuck key timers of a keyboard being removed:
+    keeps them from re-arming, cancels them and waits for running DPCs.
+    Takes the carry lock, so it stays out of the pageable section even
+    though it is only called from KbFilter_DispatchPnp at PASSIVE_LEVEL.
+
+Arguments:
 
-    // Add to circular buffer
-    DevExt->RecentKeys[DevExt->RecentKeyIndex].MakeCode = InputData->MakeCode;
-    DevExt->RecentKeys[DevExt->RecentKeyIndex].Flags = InputData->Flags;
-    DevExt->RecentKeys[DevExt->RecentKeyIndex].Timestamp = currentTime;
+    DevExt - Device extension of the keyboard being removed
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL oldIrql;
 
-    // Move to next slot in circular buffer
-    DevExt->RecentKeyIndex = (DevExt->RecentKeyIndex + 1) % MAX_RECENT_KEYS;
+    KeAcquireSpinLock(&DevExt->Carry.Lock, &oldIrql);
+    DevExt->Removed = TRUE;
+    KeReleaseSpinLock(&DevExt->Carry.Lock, oldIrql);
 
-    KeReleaseSpinLock(&DevExt->RecentKeysLock, oldIrql);
+    KeCancelTimer(&DevExt->CarryTimer);
+    KeCancelTimer(&DevExt->StuckTimer);
+    KeFlushQueuedDpcs();
 }
 
 VOID
-KbFilter_ServiceCallback(
-    IN PDEVICE_OBJECT  DeviceObject,
-    IN PKEYBOARD_INPUT_DATA InputDataStart,
-    IN PKEYBOARD_INPUT_DATA InputDataEnd,
-    IN OUT PULONG InputDataConsumed
+KbFilter_ResizeCarryStorage(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG InputDataQueueLength
     )
 /*++
 
 Routine Description:
 
-    Called when there are keyboard packets to report to the Win32 subsystem.
-    You can do anything you like to the packets.  For instance:
-
-    o Drop a packet altogether
-    o Mutate the contents of a packet
-    o Insert packets into the stream
+    Sizes the carry queue after the input data queue of the port driver, so
+    that a full port queue is filtered and queued without backpressure.  The
+    queue is left alone if the allocation fails or packets are in flight.
+    Called at IRQL <= DISPATCH_LEVEL.
 
 Arguments:
 
-    DeviceObject - Context passed during the connect IOCTL
+    DevExt - Device extension owning the carry queue
+    InputDataQueueLength - Length reported in the keyboard attributes
 
-    InputDataStart - First packet to be reported
+Return Value:
 
-    InputDataEnd - One past the last packet to be reported.  Total number of
-                   packets is equal to InputDataEnd - InputDataStart
+    None.
+
+--*/
+{
+    PKEYBOARD_INPUT_DATA packets;
+    ULONG capacity;
+
+    capacity = MIN(MAX(InputDataQueueLength, KBFILTER_CHUNK_PACKETS),
+                   KBFILTER_CARRY_MAX_PACKETS);
+    if (capacity == DevExt->Carry.Capacity) {
+        return;
+    }
+
+    packets = (PKEYBOARD_INPUT_DATA) ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                           capacity * sizeof(KEYBOARD_INPUT_DATA),
+                                                           KBFILTER_POOL_TAG);
+    if (packets == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        return;
+    }
+
+    DebugPrint(("Carry queue resized to %u packets\n", capacity));
+
+    ExFreePoolWithTag(KbFilter_ResizeCarry(&DevExt->Carry, packets, capacity),
+                      KBFILTER_POOL_TAG);
+}
+
+VOID
+KbFilter_CarryDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    Retries the delivery of packets left in the carry queue when the class
+    driver could not take them, until the queue is empty.
 
-    InputDataConsumed - Set to the total number of packets consumed by the RIT
-                        (via the function pointer we replaced in the connect
-                        IOCTL)
+Arguments:
+
+    Dpc - CarryDpc
+    DeferredContext - Device extension owning the carry queue
+    SystemArgument1, SystemArgument2 - Unused
 
 Return Value:
 
-    Status is returned.
+    None.
 
 --*/
 {
-    PDEVICE_EXTENSION   devExt;
-    PKEYBOARD_INPUT_DATA currentInput, outputStart, outputCurrent;
-    ULONG originalCount, filteredCount = 0;
+    PDEVICE_EXTENSION devExt = (PDEVICE_EXTENSION) DeferredContext;
 
-    devExt = FilterGetData(DeviceObject);
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
 
-    originalCount = (ULONG)(InputDataEnd - InputDataStart);
-    
-    // Allocate temporary buffer for filtered inputs
-    outputStart = (PKEYBOARD_INPUT_DATA)ExAllocatePoolWithTag(
-        NonPagedPoolNx,
-        originalCount * sizeof(KEYBOARD_INPUT_DATA),
-        KBFILTER_POOL_TAG
-    );
-
-    if (outputStart == NULL) {
-        // If allocation fails, pass through all inputs unfiltered
-        DebugPrint(("Memory allocation failed, passing through unfiltered\n"));
-        (*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR) devExt->UpperConnectData.ClassService)(
-            devExt->UpperConnectData.ClassDeviceObject,
-            InputDataStart,
-            InputDataEnd,
-            InputDataConsumed);
-        return;
+    if (KbFilter_DeliverCarry(&devExt->Carry, NULL, 0, 0)) {
+        KbFilter_RetryCarry(devExt);
     }
+}
+
+VOID
+KbFilter_StuckKeyDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+/*++
 
-    outputCurrent = outputStart;
+Routine Description:
 
-    // Process each input packet
-    for (currentInput = InputDataStart; currentInput < InputDataEnd; currentInput++) {
-        DebugPrint(("kbfilter v1: %x\n", currentInput->MakeCode));
+    Delivers break codes for keys that stayed down past the stuck key bound
+    without a typematic repeat, whose break codes were lost.  The breaks go
+    through the carry queue behind any packets still waiting there.  The
+    timer is re-armed for as long as keys are down.
 
-        // Check if this is a lag-induced duplicate
-        if (KbFilter_IsRecentDuplicateKey(devExt, currentInput)) {
-            // Skip this input - it's a duplicate
-            continue;
-        }
+Arguments:
 
-        // Copy the input to output buffer
-        *outputCurrent = *currentInput;
-        outputCurrent++;
-        filteredCount++;
+    Dpc - StuckDpc
+    DeferredContext - Device extension owning the key state
+    SystemArgument1, SystemArgument2 - Unused
 
-        // Add to recent keys tracking (only for key-down events)
-        KbFilter_AddRecentKey(devExt, currentInput);
-    }
+Return Value:
+
+    None.
+
+--*/
+{
+    PDEVICE_EXTENSION devExt = (PDEVICE_EXTENSION) DeferredContext;
+    PKBFILTER_POLICY policy;
+    KEYBOARD_INPUT_DATA chunk[KBFILTER_CHUNK_PACKETS];
+    LARGE_INTEGER dueTime;
+    ULONG released, reserved, nextCheckMs = 0;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    policy = *(PKBFILTER_POLICY volatile *) &KbFilterPolicy;
+
+    if (policy->StuckKeyMs != 0) {
 
-    // Call the upper service with filtered inputs
-    if (filteredCount > 0) {
-        (*(PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR) devExt->UpperConnectData.ClassService)(
-            devExt->UpperConnectData.ClassDeviceObject,
-            outputStart,
-            outputStart + filteredCount,
-            InputDataConsumed);
-    } else {
-        *InputDataConsumed = 0;
+        //
+        // Keys that do not fit into the reserved room are released by the
+        // next run
+        //
+        reserved = KbFilter_ReserveCarry(&devExt->Carry, KBFILTER_CHUNK_PACKETS);
+
+        released = KbFilter_ReleaseStuckKeys(&devExt->Core,
+                                             policy,
+                                             KbFilter_QueryKeyTime(&devExt->Core.TimeSource),
+                                             chunk,
+                                             reserved,
+                                             &nextCheckMs);
+        if (released != 0) {
+            DebugPrint(("Released %u stuck keys\n", released));
+        }
+
+        if (KbFilter_DeliverCarry(&devExt->Carry, chunk, released, reserved)) {
+            KbFilter_RetryCarry(devExt);
+        }
+
+        if (released != 0) {
+            KbFilter_SignalEventWaiters(KbFilter_PublishEvents(&devExt->Core));
+        }
     }
 
-    // Free the temporary buffer
-    ExFreePoolWithTag(outputStart, KBFILTER_POOL_TAG);
+    KeAcquireSpinLockAtDpcLevel(&devExt->Carry.Lock);
 
-    if (originalCount != filteredCount) {
-        DebugPrint(("Filtered %d duplicate keys out of %d total\n", 
-                   originalCount - filteredCount, originalCount));
+    devExt->StuckTimerArmed = (BOOLEAN) (nextCheckMs != 0 && !devExt->Removed);
+    if (devExt->StuckTimerArmed) {
+        dueTime.QuadPart = -10000LL * MAX(nextCheckMs, KBFILTER_CARRY_RETRY_MS);
+        KeSetTimer(&devExt->StuckTimer, dueTime, &devExt->StuckDpc);
     }
+
+    KeReleaseSpinLockFromDpcLevel(&devExt->Carry.Lock);
 }
 
 NTSTATUS
@@ -838,25 +1201,277 @@ Return Value:
 {
     PDEVICE_EXTENSION deviceExtension = (PDEVICE_EXTENSION) Context;
     PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG ioControlCode = irpStack->Parameters.DeviceIoControl.IoControlCode;
+    ULONG length;
 
     UNREFERENCED_PARAMETER(DeviceObject);
- 
+
+    if (Irp->PendingReturned) {
+        IoMarkIrpPending(Irp);
+    }
+
+    switch (ioControlCode) {
+
     //
     // Save the keyboard attributes in our context area so that we can return
     // them to the app later.
     //
-    if (NT_SUCCESS(Irp->IoStatus.Status) && 
-        irpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_KEYBOARD_QUERY_ATTRIBUTES) {
+    case IOCTL_KEYBOARD_QUERY_ATTRIBUTES:
+        if (NT_SUCCESS(Irp->IoStatus.Status) &&
+            Irp->IoStatus.Information >= sizeof(KEYBOARD_ATTRIBUTES)) {
 
-        if (Irp->IoStatus.Information >= sizeof(KEYBOARD_ATTRIBUTES)) {
-            
             RtlCopyMemory(&deviceExtension->KeyboardAttributes,
                          Irp->AssociatedIrp.SystemBuffer,
                          sizeof(KEYBOARD_ATTRIBUTES));
+
+            KbFilter_ResizeCarryStorage(deviceExtension,
+                                        deviceExtension->KeyboardAttributes.InputDataQueueLength);
+        }
+        break;
+
+    //
+    // Cache what the port driver reported for a query, or was told to set by
+    // a SET_ request, whose input is still in the system buffer
+    //
+    case IOCTL_KEYBOARD_QUERY_INDICATOR_TRANSLATION:
+    case IOCTL_KEYBOARD_QUERY_INDICATORS:
+    case IOCTL_KEYBOARD_QUERY_TYPEMATIC:
+    case IOCTL_KEYBOARD_SET_INDICATORS:
+    case IOCTL_KEYBOARD_SET_TYPEMATIC:
+        if (!NT_SUCCESS(Irp->IoStatus.Status)) {
+            break;
         }
+
+        if (ioControlCode == IOCTL_KEYBOARD_SET_INDICATORS ||
+            ioControlCode == IOCTL_KEYBOARD_SET_TYPEMATIC) {
+            length = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+        }
+        else {
+            length = (ULONG) Irp->IoStatus.Information;
+        }
+
+        KbFilter_UpdateCache(deviceExtension,
+                             ioControlCode,
+                             Irp->AssociatedIrp.SystemBuffer,
+                             length);
+
+        //
+        // Derive the repeat windows and duplicate threshold cap of the
+        // keyboard from the repeat delay and rate now in effect
+        //
+        if ((ioControlCode == IOCTL_KEYBOARD_QUERY_TYPEMATIC ||
+             ioControlCode == IOCTL_KEYBOARD_SET_TYPEMATIC) &&
+            length >= sizeof(KEYBOARD_TYPEMATIC_PARAMETERS)) {
+
+            KbFilter_SetTypematic(&deviceExtension->Core,
+                                  (PKEYBOARD_TYPEMATIC_PARAMETERS) Irp->AssociatedIrp.SystemBuffer);
+        }
+        break;
     }
 
     return STATUS_SUCCESS;
 }
 
+BOOLEAN
+KbFilter_CompleteFromCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PIRP Irp
+    )
+/*++
+
+Routine Description:
+
+    Completes a typematic or indicator query with the cached answer, if
+    the cache holds one and the output buffer is large enough.  Counts a
+    cache hit or miss.
+
+Arguments:
+
+    DevExt - Device extension holding the cache
+    Irp - IOCTL_KEYBOARD_QUERY_TYPEMATIC, IOCTL_KEYBOARD_QUERY_INDICATORS or
+          IOCTL_KEYBOARD_QUERY_INDICATOR_TRANSLATION request
+
+Return Value:
+
+    TRUE if the request was completed, FALSE if it must be sent down.
+
+--*/
+{
+    PIO_STACK_LOCATION irpStack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG outputBufferLength;
+    ULONG entry, length;
+    PVOID cached;
+    KIRQL oldIrql;
+
+    outputBufferLength = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    switch (irpStack->Parameters.DeviceIoControl.IoControlCode) {
+    case IOCTL_KEYBOARD_QUERY_TYPEMATIC:
+        entry = KBFILTER_CACHE_TYPEMATIC;
+        cached = &DevExt->CachedTypematic;
+        length = sizeof(KEYBOARD_TYPEMATIC_PARAMETERS);
+        break;
+
+    case IOCTL_KEYBOARD_QUERY_INDICATORS:
+        entry = KBFILTER_CACHE_INDICATORS;
+        cached = &DevExt->CachedIndicators;
+        length = sizeof(KEYBOARD_INDICATOR_PARAMETERS);
+        break;
+
+    case IOCTL_KEYBOARD_QUERY_INDICATOR_TRANSLATION:
+        entry = KBFILTER_CACHE_TRANSLATION;
+        cached = &DevExt->CachedTranslation;
+        length = 0;
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    KeAcquireSpinLock(&DevExt->CacheLock, &oldIrql);
+
+    if (entry == KBFILTER_CACHE_TRANSLATION) {
+        length = DevExt->CachedTranslationLength;
+    }
+
+    if (!(DevExt->CacheValid & entry) || outputBufferLength < length) {
+        KeReleaseSpinLock(&DevExt->CacheLock, oldIrql);
+        InterlockedIncrement(&DevExt->CacheMisses);
+        return FALSE;
+    }
+
+    RtlCopyMemory(Irp->AssociatedIrp.SystemBuffer, cached, length);
+
+    KeReleaseSpinLock(&DevExt->CacheLock, oldIrql);
+    InterlockedIncrement(&DevExt->CacheHits);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = length;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return TRUE;
+}
+
+VOID
+KbFilter_UpdateCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG IoControlCode,
+    IN PVOID Buffer,
+    IN ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Fills a cache entry from a completed query or SET_ request.  Buffers that
+    are too short, or a translation that does not fit, leave the entry
+    empty.  Callable at DISPATCH_LEVEL.
+
+Arguments:
+
+    DevExt - Device extension holding the cache
+    IoControlCode - Control code of the completed request
+    Buffer - Parameters the port driver reported or was told to set
+    Length - Valid length of Buffer
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&DevExt->CacheLock, &oldIrql);
+
+    switch (IoControlCode) {
+    case IOCTL_KEYBOARD_QUERY_TYPEMATIC:
+    case IOCTL_KEYBOARD_SET_TYPEMATIC:
+        DevExt->CacheValid &= ~KBFILTER_CACHE_TYPEMATIC;
+        if (Length >= sizeof(KEYBOARD_TYPEMATIC_PARAMETERS)) {
+            RtlCopyMemory(&DevExt->CachedTypematic, Buffer, sizeof(KEYBOARD_TYPEMATIC_PARAMETERS));
+            DevExt->CacheValid |= KBFILTER_CACHE_TYPEMATIC;
+        }
+        break;
+
+    case IOCTL_KEYBOARD_QUERY_INDICATORS:
+    case IOCTL_KEYBOARD_SET_INDICATORS:
+        DevExt->CacheValid &= ~KBFILTER_CACHE_INDICATORS;
+        if (Length >= sizeof(KEYBOARD_INDICATOR_PARAMETERS)) {
+            RtlCopyMemory(&DevExt->CachedIndicators, Buffer, sizeof(KEYBOARD_INDICATOR_PARAMETERS));
+            DevExt->CacheValid |= KBFILTER_CACHE_INDICATORS;
+        }
+        break;
+
+    case IOCTL_KEYBOARD_QUERY_INDICATOR_TRANSLATION:
+        DevExt->CacheValid &= ~KBFILTER_CACHE_TRANSLATION;
+        if (Length >= FIELD_OFFSET(KEYBOARD_INDICATOR_TRANSLATION, IndicatorList) &&
+            Length <= sizeof(DevExt->CachedTranslation)) {
+            RtlCopyMemory(&DevExt->CachedTranslation, Buffer, Length);
+            DevExt->CachedTranslationLength = Length;
+            DevExt->CacheValid |= KBFILTER_CACHE_TRANSLATION;
+        }
+        break;
+    }
+
+    KeReleaseSpinLock(&DevExt->CacheLock, oldIrql);
+}
+
+VOID
+KbFilter_InvalidateCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Entries
+    )
+/*++
+
+Routine Description:
+
+    Empties cache entries, so that the next query goes to the port driver.
+
+Arguments:
+
+    DevExt - Device extension holding the cache
+    Entries - KBFILTER_CACHE_ bits of the entries to empty
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&DevExt->CacheLock, &oldIrql);
+    DevExt->CacheValid &= ~Entries;
+    KeReleaseSpinLock(&DevExt->CacheLock, oldIrql);
+}
+
+VOID
+KbFilter_QueryDeviceStatistics(
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PKBFILTR_STATISTICS Statistics
+    )
+/*++
+
+Routine Description:
+
+    Takes a snapshot of the statistics of a keyboard: the counters of the
+    lag mitigation core, added up over all processors, and the counters kept
+    by the driver itself.
+
+Arguments:
+
+    DevExt - Device extension of the keyboard
+    Statistics - Receives the snapshot
+
+Return Value:
 
+    None.
+
+--*/
+{
+    KbFilter_QueryStatistics(&DevExt->Core, Statistics);
+
+    Statistics->AllocationFailures = (ULONG) KbFilterAllocationFailures;
+    Statistics->CacheHits = (ULONG) DevExt->CacheHits;
+    Statistics->CacheMisses = (ULONG) DevExt->CacheMisses;
+}
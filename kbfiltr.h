@@ -31,14 +31,23 @@ Environment:
 #define NTSTRSAFE_LIB
 #include <ntstrsafe.h>
 
+#include <wdmsec.h>
+
 #include <initguid.h>
 #include <devguid.h>
 
 #include "public.h"
+#include "kbfcore.h"
 
 #define KBFILTER_POOL_TAG (ULONG) 'tlfK'
 
-#define EnableDebugOutput
+//
+// Debug output is only compiled into checked builds.  Nothing on the
+// keystroke path may use DebugPrint; it records trace events instead.
+//
+#if DBG
+  #define EnableDebugOutput
+#endif
 
 #ifdef EnableDebugOutput
   #define DebugPrint(_x_) DbgPrint _x_
@@ -52,30 +61,133 @@ Environment:
   #define TRAP()
 #endif
 
-#define MIN(_A_,_B_) (((_A_) < (_B_)) ? (_A_) : (_B_))
+//
+// Accepted packets the class driver does not consume wait in a per-device
+// carry queue, see KBFILTER_CARRY in kbfcore.h, and are retried from a
+// timer DPC every KBFILTER_CARRY_RETRY_MS.  The queue starts out with
+// KBFILTER_CARRY_PACKETS entries, the default input data queue length of
+// i8042prt and kbdhid, and is resized to the InputDataQueueLength the port
+// driver reports in its keyboard attributes.
+//
+#define KBFILTER_CARRY_RETRY_MS     10
+
+//
+// Typematic and indicator state is cached per device, so that repeated
+// queries are completed without a round trip to the port driver.  Query
+// results and successful SET_ requests fill the cache from the completion
+// routine; PnP and power transitions empty it.  An indicator translation
+// with more than KBFILTER_TRANSLATION_KEYS keys is not cached.
+//
+#define KBFILTER_CACHE_TYPEMATIC    0x00000001
+#define KBFILTER_CACHE_INDICATORS   0x00000002
+#define KBFILTER_CACHE_TRANSLATION  0x00000004
+#define KBFILTER_CACHE_ALL          0x00000007
+
+#define KBFILTER_TRANSLATION_KEYS   8
+
+//
+// The driver creates a filter device object for every keyboard and a single
+// control device object for user-mode tools, see control.c.  The extensions
+// of both start with the kind of the device, so the dispatch routines can
+// tell them apart even after the control device has been deleted while a
+// handle to it is still open.
+//
+typedef enum _KBFILTER_DEVICE_KIND {
+    KbFilterDeviceFilter = 1,
+    KbFilterDeviceControl
+} KBFILTER_DEVICE_KIND;
+
+#define KBFILTER_CONTROL_DEVICE_NAME    L"\\Device\\KbFiltr"
+#define KBFILTER_CONTROL_LINK_NAME      L"\\DosDevices\\KbFiltr"
+
+//
+// Device class of the control device, used by IoCreateDeviceSecure to look
+// up security overrides
+//
+DEFINE_GUID(GUID_DEVCLASS_KBFILTER_CONTROL,
+0x4552c138, 0x36c6, 0x45f1, 0x8c, 0x33, 0x79, 0x97, 0xde, 0x56, 0xae, 0xc0);
+// {4552C138-36C6-45F1-8C33-7997DE56AEC0}
+
+typedef struct _CONTROL_EXTENSION
+{
+    KBFILTER_DEVICE_KIND Kind;
+
+} CONTROL_EXTENSION, *PCONTROL_EXTENSION;
+
+#define KbFilter_IsControlDevice(DeviceObject) \
+    (((PCONTROL_EXTENSION) (DeviceObject)->DeviceExtension)->Kind == KbFilterDeviceControl)
+
+//
+// Event ring of a keyboard, see public.h.  The ring is a pagefile-backed
+// section, so every reader gets a read-only view of it; the filter writes
+// through a view in system space whose pages Mdl keeps locked, and Section
+// is a kernel handle only the driver can map writable.  The channel
+// holds a reference for the keyboard it is attached to and one for every
+// mapping, so the pages stay allocated until the last reader has unmapped
+// them, even if the keyboard goes away first.  Up to KBFILTER_EVENT_WAITERS
+// readers can have an event signalled once per batch.  Everything but the
+// writer and the waiter slots is protected by KbFilterDeviceListMutex.
+//
+#define KBFILTER_EVENT_WAITERS      8
+
+typedef struct _DEVICE_EXTENSION *PDEVICE_EXTENSION;
+
+typedef struct _KBFILTER_EVENT_CHANNEL {
+    KBFILTER_EVENT_WRITER Writer;
+    volatile LONG References;
+    ULONG Mappings;
+    ULONG Size;
+    HANDLE Section;
+    PVOID SectionObject;
+    PVOID SystemView;
+    PMDL Mdl;                                               // locks SystemView
+    PDEVICE_EXTENSION DevExt;                               // NULL once detached
+    PKEVENT Waiters[KBFILTER_EVENT_WAITERS];
+} KBFILTER_EVENT_CHANNEL, *PKBFILTER_EVENT_CHANNEL;
 
 //
-// Lag mitigation constants
+// One mapping of an event ring into the process that opened a control
+// device handle, listed in the file context of the handle
 //
-#define MAX_RECENT_KEYS 16
-#define LAG_MITIGATION_THRESHOLD_MS 300  // 300ms threshold for duplicate detection
+typedef struct _KBFILTER_EVENT_MAPPING {
+    LIST_ENTRY Link;
+    PKBFILTER_EVENT_CHANNEL Channel;
+    PVOID UserAddress;
+    PKEVENT Event;
+    ULONG Waiter;
+} KBFILTER_EVENT_MAPPING, *PKBFILTER_EVENT_MAPPING;
 
 //
-// Structure to track recent key inputs for lag mitigation
+// Rings are only mapped into Process, the process that opened the handle,
+// which stays referenced until the handle is closed
 //
-typedef struct _RECENT_KEY_INPUT {
-    USHORT MakeCode;
-    USHORT Flags;
-    LARGE_INTEGER Timestamp;
-} RECENT_KEY_INPUT, *PRECENT_KEY_INPUT;
+typedef struct _KBFILTER_CONTROL_FILE {
+    LIST_ENTRY Mappings;
+    PEPROCESS Process;
+} KBFILTER_CONTROL_FILE, *PKBFILTER_CONTROL_FILE;
 
 typedef struct _DEVICE_EXTENSION
 {
+    KBFILTER_DEVICE_KIND Kind;
+
     //
     // Back pointer to device object
     //
     PDEVICE_OBJECT DeviceObject;
 
+    //
+    // Link in KbFilterDeviceList and the instance number the control device
+    // reports for this keyboard, both protected by KbFilterDeviceListMutex
+    //
+    LIST_ENTRY ListEntry;
+    ULONG InstanceNo;
+
+    //
+    // Event ring while at least one reader has it mapped, protected by
+    // KbFilterDeviceListMutex
+    //
+    PKBFILTER_EVENT_CHANNEL EventChannel;
+
     //
     // Target device for requests
     //
@@ -119,13 +231,59 @@ typedef struct _DEVICE_EXTENSION
     KEYBOARD_ATTRIBUTES KeyboardAttributes;
 
     //
-    // Lag mitigation - track recent key inputs
+    // Lag mitigation state, see kbfcore.h
+    //
+    KBFILTER_CORE Core;
+
+    //
+    // Carry queue of accepted packets not yet consumed by the class driver.
+    // The storage is allocated from nonpaged pool in AddDevice.
+    //
+    KBFILTER_CARRY Carry;
+    KTIMER CarryTimer;
+    KDPC CarryDpc;
+
+    //
+    // Stuck key recovery, see KbFilter_StuckKeyDpc.  StuckTimerArmed is
+    // protected by the carry lock; break codes synthesized by the DPC are
+    // queued in the carry queue, so no packet storage is allocated for them.
+    //
+    KTIMER StuckTimer;
+    KDPC StuckDpc;
+    BOOLEAN StuckTimerArmed;
+
+    //
+    // Set under the carry lock once IRP_MN_REMOVE_DEVICE arrives, so that
+    // the timers are no longer armed
     //
-    RECENT_KEY_INPUT RecentKeys[MAX_RECENT_KEYS];
-    ULONG RecentKeyIndex;
-    KSPIN_LOCK RecentKeysLock;
+    BOOLEAN Removed;
 
-} DEVICE_EXTENSION, *PDEVICE_EXTENSION;
+    //
+    // Cached typematic and indicator state.  CacheValid holds the
+    // KBFILTER_CACHE_ bits of the entries that are filled in; everything is
+    // protected by CacheLock, since completion routines can run at
+    // DISPATCH_LEVEL.
+    //
+    KSPIN_LOCK CacheLock;
+    ULONG CacheValid;
+    KEYBOARD_TYPEMATIC_PARAMETERS CachedTypematic;
+    KEYBOARD_INDICATOR_PARAMETERS CachedIndicators;
+    union {
+        KEYBOARD_INDICATOR_TRANSLATION Translation;
+        UCHAR Buffer[FIELD_OFFSET(KEYBOARD_INDICATOR_TRANSLATION, IndicatorList) +
+                     KBFILTER_TRANSLATION_KEYS * sizeof(INDICATOR_LIST)];
+    } CachedTranslation;
+    ULONG CachedTranslationLength;
+    volatile LONG CacheHits;
+    volatile LONG CacheMisses;
+
+    //
+    // Per-processor statistics shards attached to Core, NULL if they could
+    // not be allocated
+    //
+    PKBFILTER_STATS_SHARD StatsShards;
+
+} DEVICE_EXTENSION;
 
 //
 // Function to get device extension from device object
@@ -148,6 +306,8 @@ DRIVER_ADD_DEVICE KbFilter_AddDevice;
 
 DRIVER_DISPATCH KbFilter_DispatchGeneral;
 DRIVER_DISPATCH KbFilter_DispatchInternalDeviceControl;
+DRIVER_DISPATCH KbFilter_DispatchPnp;
+DRIVER_DISPATCH KbFilter_DispatchPower;
 DRIVER_UNLOAD KbFilter_Unload;
 
 IO_COMPLETION_ROUTINE KbFilterRequestCompletionRoutine;
@@ -180,59 +340,142 @@ KbFilter_ServiceCallback(
     IN OUT PULONG InputDataConsumed
     );
 
-IO_COMPLETION_ROUTINE KbFilterRequestCompletionRoutine;
+VOID
+KbFilter_RetryCarry(
+    IN PDEVICE_EXTENSION DevExt
+    );
 
+VOID
+KbFilter_StopTimers(
+    IN PDEVICE_EXTENSION DevExt
+    );
 
-//
-// IOCTL Related defintions
-//
+VOID
+KbFilter_ResizeCarryStorage(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG InputDataQueueLength
+    );
 
-//
-// Used to identify kbfilter bus. This guid is used as the enumeration string
-// for the device id.
-DEFINE_GUID(GUID_BUS_KBFILTER,
-0xa65c87f9, 0xbe02, 0x4ed9, 0x92, 0xec, 0x1, 0x2d, 0x41, 0x61, 0x69, 0xfa);
-// {A65C87F9-BE02-4ed9-92EC-012D416169FA}
+KDEFERRED_ROUTINE KbFilter_CarryDpc;
 
-DEFINE_GUID(GUID_DEVINTERFACE_KBFILTER,
-0x3fb7299d, 0x6847, 0x4490, 0xb0, 0xc9, 0x99, 0xe0, 0x98, 0x6a, 0xb8, 0x86);
-// {3FB7299D-6847-4490-B0C9-99E0986AB886}
+KDEFERRED_ROUTINE KbFilter_StuckKeyDpc;
 
+BOOLEAN
+KbFilter_CompleteFromCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN PIRP Irp
+    );
 
-#define  KBFILTR_DEVICE_ID L"{A65C87F9-BE02-4ed9-92EC-012D416169FA}\\KeyboardFilter\0"
+VOID
+KbFilter_UpdateCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG IoControlCode,
+    IN PVOID Buffer,
+    IN ULONG Length
+    );
 
+VOID
+KbFilter_InvalidateCache(
+    IN PDEVICE_EXTENSION DevExt,
+    IN ULONG Entries
+    );
 
-typedef struct _RPDO_DEVICE_DATA
-{
-    ULONG InstanceNo;
+VOID
+KbFilter_QueryDeviceStatistics(
+    IN PDEVICE_EXTENSION DevExt,
+    OUT PKBFILTR_STATISTICS Statistics
+    );
 
-    //
-    // Device object for the rawPdo
-    //
-    PDEVICE_OBJECT DeviceObject;
+//
+// Control device (control.c)
+//
+extern FAST_MUTEX KbFilterDeviceListMutex;
+extern LIST_ENTRY KbFilterDeviceList;
+extern PDEVICE_OBJECT KbFilterControlDevice;
 
-    //
-    // Parent device object 
-    //
-    PDEVICE_OBJECT ParentDeviceObject;
+VOID
+KbFilter_InitializeControl(
+    VOID
+    );
 
-} RPDO_DEVICE_DATA, *PRPDO_DEVICE_DATA;
+NTSTATUS
+KbFilter_RegisterDevice(
+    IN PDRIVER_OBJECT DriverObject,
+    IN PDEVICE_EXTENSION DevExt,
+    IN BOOLEAN JoinDedupDomain
+    );
+
+VOID
+KbFilter_UnregisterDevice(
+    IN PDEVICE_EXTENSION DevExt
+    );
+
+NTSTATUS
+KbFilter_DispatchControl(
+    IN PDEVICE_OBJECT DeviceObject,
+    IN PIRP Irp
+    );
+
+VOID
+KbFilter_SignalEventWaiters(
+    IN PKBFILTER_EVENT_WRITER Writer
+    );
+
+//
+// Pool allocations that failed since the driver was loaded
+//
+extern volatile LONG KbFilterAllocationFailures;
 
 //
-// Function to get rawPdo device data from device object
+// Policy management (policy.c)
 //
-#define PdoGetData(DeviceObject) \
-    ((PRPDO_DEVICE_DATA) DeviceObject->DeviceExtension)
+extern PKBFILTER_POLICY KbFilterPolicy;
+
+PKEY_VALUE_PARTIAL_INFORMATION
+KbFilter_QueryRegistryValue(
+    IN HANDLE Key,
+    IN PCWSTR ValueName,
+    IN ULONG Type
+    );
+
+ULONG
+KbFilter_QueryRegistryDword(
+    IN HANDLE Key,
+    IN PCWSTR ValueName,
+    IN ULONG DefaultValue
+    );
+
+PKBFILTER_POLICY
+KbFilter_LoadPolicy(
+    VOID
+    );
 
-// Raw PDO functionality is disabled to minimize WDF dependencies
-/*
 NTSTATUS
-KbFiltr_CreateRawPdo(
-    PDEVICE_OBJECT       Device,
-    ULONG                InstanceNo
-);
-*/
+KbFilter_InitializePolicy(
+    IN PUNICODE_STRING RegistryPath
+    );
+
+NTSTATUS
+KbFilter_ReloadPolicy(
+    VOID
+    );
 
+KDEFERRED_ROUTINE KbFilter_PolicyBarrierDpc;
+
+VOID
+KbFilter_QueryConfiguration(
+    OUT PKBFILTR_CONFIGURATION Configuration
+    );
+
+VOID
+KbFilter_ConfigureIsrReject(
+    IN PKBFILTER_CORE Core
+    );
+
+VOID
+KbFilter_FreePolicy(
+    VOID
+    );
 
 
 #endif  // KBFILTER_H
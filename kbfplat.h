@@ -0,0 +1,467 @@
+/*++
+
+Module Name:
+
+    kbfplat.h
+
+Abstract:
+
+    Platform shim for the lag mitigation core (kbfcore.c).  The core only
+    uses the types, interlocked operations, spin locks and clocks declared
+    here, so the same source is compiled into the driver and into user-mode
+    builds used to measure and regression-test it.
+
+    In kernel mode (_KERNEL_MODE) the shim maps directly onto the WDK.  In
+    user mode it supplies the few keyboard definitions the core needs and
+    implements the rest with GCC atomics and POSIX monotonic clocks.
+
+Environment:
+
+    Kernel mode and user mode
+
+--*/
+
+#ifndef KBFPLAT_H
+#define KBFPLAT_H
+
+#ifdef _KERNEL_MODE
+
+#pragma warning(disable:4201)
+
+#include "ntddk.h"
+#include "kbdmou.h"
+#include <ntddkbd.h>
+#include <ntdd8042.h>
+
+#pragma warning(default:4201)
+
+typedef KSPIN_LOCK KBFPLAT_LOCK, *PKBFPLAT_LOCK;
+typedef KIRQL KBFPLAT_LOCK_STATE;
+
+#define KbfPlatInitializeLock(_lock_)           KeInitializeSpinLock(_lock_)
+#define KbfPlatAcquireLock(_lock_, _state_)     KeAcquireSpinLock(_lock_, _state_)
+#define KbfPlatReleaseLock(_lock_, _state_)     KeReleaseSpinLock(_lock_, _state_)
+
+//
+// Plain reads and writes of a LONG that other processors update with
+// interlocked operations.  Aligned LONG accesses are atomic; volatile keeps
+// the compiler from tearing, caching or reordering them.  LONG64 reads may
+// tear on 32-bit processors.
+//
+#define KbfPlatReadLong(_source_)               (*(LONG const volatile *) (_source_))
+#define KbfPlatReadLong64(_source_)             (*(LONG64 const volatile *) (_source_))
+#define KbfPlatWriteLong(_target_, _value_)     (*(LONG volatile *) (_target_) = (_value_))
+
+//
+// Processors, for per-processor data.  The current processor only stays
+// the same while the caller runs at DISPATCH_LEVEL or above.
+//
+#define KBFPLAT_CACHE_ALIGN                     DECLSPEC_CACHEALIGN
+#define KbfPlatProcessorCount()                 KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS)
+#define KbfPlatCurrentProcessor()               KeGetCurrentProcessorNumberEx(NULL)
+
+//
+// Clocks, callable at any IRQL.  Interrupt time and tick time are in 100ns
+// units; the performance counter runs at the frequency it returns.
+//
+FORCEINLINE
+ULONGLONG
+KbfPlatInterruptTime(
+    VOID
+    )
+{
+    return KeQueryInterruptTime();
+}
+
+FORCEINLINE
+ULONGLONG
+KbfPlatPerformanceCounter(
+    OUT PULONGLONG Frequency
+    )
+{
+    LARGE_INTEGER counter, frequency;
+
+    counter = KeQueryPerformanceCounter(&frequency);
+    if (Frequency != NULL) {
+        *Frequency = (ULONGLONG) frequency.QuadPart;
+    }
+    return (ULONGLONG) counter.QuadPart;
+}
+
+FORCEINLINE
+ULONGLONG
+KbfPlatTickTime(
+    VOID
+    )
+{
+    LARGE_INTEGER counter;
+
+    KeQueryTickCount(&counter);
+    return (ULONGLONG) counter.QuadPart * KeQueryTimeIncrement();
+}
+
+#else  // _KERNEL_MODE
+
+//
+// clockid_t and clock_gettime are POSIX, not ISO C, so strict -std=c11
+// builds need them requested explicitly
+//
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef VOID
+#define VOID void
+#endif
+
+#define IN
+#define OUT
+#define FORCEINLINE static inline __attribute__((always_inline))
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+typedef uint8_t  UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t  LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t  LONG64, *PLONG64;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef void    *PVOID;
+
+#define MAXUCHAR    0xff
+#define MAXUSHORT   0xffff
+#define MAXULONG    0xffffffff
+
+//
+// Keyboard definitions from ntddkbd.h and ntdd8042.h used by the core
+//
+typedef struct _KEYBOARD_INPUT_DATA {
+    USHORT UnitId;
+    USHORT MakeCode;
+    USHORT Flags;
+    USHORT Reserved;
+    ULONG ExtraInformation;
+} KEYBOARD_INPUT_DATA, *PKEYBOARD_INPUT_DATA;
+
+#define KEY_MAKE    0
+#define KEY_BREAK   1
+#define KEY_E0      2
+#define KEY_E1      4
+
+typedef struct _KEYBOARD_TYPEMATIC_PARAMETERS {
+    USHORT UnitId;
+    USHORT Rate;
+    USHORT Delay;
+} KEYBOARD_TYPEMATIC_PARAMETERS, *PKEYBOARD_TYPEMATIC_PARAMETERS;
+
+typedef struct _KEYBOARD_ID {
+    UCHAR Type;
+    UCHAR Subtype;
+} KEYBOARD_ID, *PKEYBOARD_ID;
+
+typedef struct _KEYBOARD_ATTRIBUTES {
+    KEYBOARD_ID KeyboardIdentifier;
+    USHORT KeyboardMode;
+    USHORT NumberOfFunctionKeys;
+    USHORT NumberOfIndicators;
+    USHORT NumberOfKeysTotal;
+    ULONG InputDataQueueLength;
+    KEYBOARD_TYPEMATIC_PARAMETERS KeyRepeatMinimum;
+    KEYBOARD_TYPEMATIC_PARAMETERS KeyRepeatMaximum;
+} KEYBOARD_ATTRIBUTES, *PKEYBOARD_ATTRIBUTES;
+
+#define KEYBOARD_TYPEMATIC_RATE_DEFAULT     30
+#define KEYBOARD_TYPEMATIC_DELAY_DEFAULT    250
+
+typedef enum _KEYBOARD_SCAN_STATE {
+    Normal,
+    GotE0,
+    GotE1
+} KEYBOARD_SCAN_STATE, *PKEYBOARD_SCAN_STATE;
+
+#define ACKNOWLEDGE 0xFA
+#define RESEND      0xFE
+
+//
+// Device I/O control definitions used by public.h
+//
+#ifndef CTL_CODE
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+#define METHOD_BUFFERED         0
+#define FILE_ANY_ACCESS         0
+#define FILE_READ_DATA          1
+#define FILE_WRITE_DATA         2
+#define FILE_DEVICE_KEYBOARD    0x0000000b
+#endif
+
+#define FIELD_OFFSET(_type_, _field_)   ((LONG) offsetof(_type_, _field_))
+
+#define RtlZeroMemory(_d_, _n_)         memset((_d_), 0, (_n_))
+#define RtlCopyMemory(_d_, _s_, _n_)    memcpy((_d_), (_s_), (_n_))
+#define RtlMoveMemory(_d_, _s_, _n_)    memmove((_d_), (_s_), (_n_))
+#define UNREFERENCED_PARAMETER(_p_)     ((void) (_p_))
+
+//
+// Interlocked operations, all full barriers like their kernel counterparts
+//
+#define KeMemoryBarrier()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+FORCEINLINE
+LONG
+InterlockedIncrement(
+    volatile LONG *Addend
+    )
+{
+    return __atomic_add_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+LONG
+InterlockedDecrement(
+    volatile LONG *Addend
+    )
+{
+    return __atomic_sub_fetch(Addend, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+LONG
+InterlockedExchangeAdd(
+    volatile LONG *Addend,
+    LONG Value
+    )
+{
+    return __atomic_fetch_add(Addend, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+LONG
+InterlockedExchange(
+    volatile LONG *Target,
+    LONG Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+LONG
+InterlockedCompareExchange(
+    volatile LONG *Destination,
+    LONG Exchange,
+    LONG Comperand
+    )
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE
+LONG64
+InterlockedCompareExchange64(
+    volatile LONG64 *Destination,
+    LONG64 Exchange,
+    LONG64 Comperand
+    )
+{
+    __atomic_compare_exchange_n(Destination, &Comperand, Exchange, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comperand;
+}
+
+FORCEINLINE
+PVOID
+InterlockedExchangePointer(
+    PVOID volatile *Target,
+    PVOID Value
+    )
+{
+    return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE
+BOOLEAN
+InterlockedBitTestAndSet(
+    volatile LONG *Base,
+    LONG Bit
+    )
+{
+    LONG mask = (LONG) (1u << Bit);
+
+    return (__atomic_fetch_or(Base, mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+FORCEINLINE
+BOOLEAN
+InterlockedBitTestAndReset(
+    volatile LONG *Base,
+    LONG Bit
+    )
+{
+    LONG mask = (LONG) (1u << Bit);
+
+    return (__atomic_fetch_and(Base, ~mask, __ATOMIC_SEQ_CST) & mask) != 0;
+}
+
+//
+// Plain reads and writes of a LONG that other threads update with
+// interlocked operations, atomic but without a barrier
+//
+FORCEINLINE
+LONG
+KbfPlatReadLong(
+    const volatile LONG *Source
+    )
+{
+    return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+FORCEINLINE
+LONG64
+KbfPlatReadLong64(
+    const volatile LONG64 *Source
+    )
+{
+    return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+FORCEINLINE
+VOID
+KbfPlatWriteLong(
+    volatile LONG *Target,
+    LONG Value
+    )
+{
+    __atomic_store_n(Target, Value, __ATOMIC_RELAXED);
+}
+
+//
+// Spin locks.  There is no IRQL in user mode, the state is unused.
+//
+typedef volatile LONG KBFPLAT_LOCK, *PKBFPLAT_LOCK;
+typedef UCHAR KBFPLAT_LOCK_STATE;
+
+FORCEINLINE
+VOID
+KbfPlatInitializeLock(
+    PKBFPLAT_LOCK Lock
+    )
+{
+    *Lock = 0;
+}
+
+FORCEINLINE
+VOID
+KbfPlatAcquireLock(
+    PKBFPLAT_LOCK Lock,
+    KBFPLAT_LOCK_STATE *State
+    )
+{
+    *State = 0;
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        while (KbfPlatReadLong(Lock) != 0) {
+            // spin until the lock looks free
+        }
+    }
+}
+
+FORCEINLINE
+VOID
+KbfPlatReleaseLock(
+    PKBFPLAT_LOCK Lock,
+    KBFPLAT_LOCK_STATE State
+    )
+{
+    (void) State;
+    __atomic_store_n(Lock, 0, __ATOMIC_RELEASE);
+}
+
+//
+// Processors.  Threads stand in for processors in user-mode builds: every
+// thread is numbered the first time it asks, and threads only share a
+// number once there are more than KBFPLAT_PROCESSORS of them.
+//
+#define KBFPLAT_CACHE_ALIGN                     __attribute__((aligned(64)))
+#define KBFPLAT_PROCESSORS                      16
+#define KbfPlatProcessorCount()                 KBFPLAT_PROCESSORS
+
+FORCEINLINE
+ULONG
+KbfPlatCurrentProcessor(
+    VOID
+    )
+{
+    static volatile LONG threads;
+    static _Thread_local ULONG processor;
+
+    if (processor == 0) {
+        processor = (ULONG) InterlockedIncrement(&threads);
+    }
+    return (processor - 1) % KBFPLAT_PROCESSORS;
+}
+
+//
+// Clocks, with the units of their kernel counterparts
+//
+FORCEINLINE
+ULONGLONG
+KbfPlatReadPosixClock(
+    clockid_t Clock
+    )
+{
+    struct timespec now;
+
+    clock_gettime(Clock, &now);
+    return (ULONGLONG) now.tv_sec * 1000000000 + (ULONGLONG) now.tv_nsec;
+}
+
+FORCEINLINE
+ULONGLONG
+KbfPlatInterruptTime(
+    VOID
+    )
+{
+    return KbfPlatReadPosixClock(CLOCK_MONOTONIC) / 100;
+}
+
+FORCEINLINE
+ULONGLONG
+KbfPlatPerformanceCounter(
+    OUT PULONGLONG Frequency
+    )
+{
+    if (Frequency != NULL) {
+        *Frequency = 1000000000;
+    }
+    return KbfPlatReadPosixClock(CLOCK_MONOTONIC);
+}
+
+FORCEINLINE
+ULONGLONG
+KbfPlatTickTime(
+    VOID
+    )
+{
+#ifdef CLOCK_MONOTONIC_COARSE
+    return KbfPlatReadPosixClock(CLOCK_MONOTONIC_COARSE) / 100;
+#else
+    return KbfPlatReadPosixClock(CLOCK_MONOTONIC) / 100;
+#endif
+}
+
+#endif // _KERNEL_MODE
+
+#define MIN(_A_,_B_) (((_A_) < (_B_)) ? (_A_) : (_B_))
+#define MAX(_A_,_B_) (((_A_) > (_B_)) ? (_A_) : (_B_))
+
+#endif  // KBFPLAT_H
@@ -0,0 +1,599 @@
+/*--
+
+Copyright (c) Microsoft Corporation.  All rights reserved.
+
+    THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY
+    KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR
+    PURPOSE.
+
+
+Module Name:
+
+    policy.c
+
+Abstract: This module loads the lag mitigation policy from the Parameters
+          subkey of the service key and publishes it to the service callback.
+
+          A published policy is immutable.  Reloading builds a complete new
+          policy, swaps it in with a single pointer exchange and frees the
+          old one once a barrier DPC has run on every processor.  Readers
+          only use the policy at DISPATCH_LEVEL, so none can still hold the
+          old one by then, and KbFilter_ServiceCallback never takes a lock
+          for the policy.
+
+Environment:
+
+    Kernel mode only.
+
+--*/
+
+#include "kbfiltr.h"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (INIT, KbFilter_InitializePolicy)
+#pragma alloc_text (PAGE, KbFilter_ReloadPolicy)
+#pragma alloc_text (PAGE, KbFilter_QueryConfiguration)
+#pragma alloc_text (PAGE, KbFilter_ConfigureIsrReject)
+#pragma alloc_text (PAGE, KbFilter_FreePolicy)
+#pragma alloc_text (PAGE, KbFilter_QueryRegistryValue)
+#pragma alloc_text (PAGE, KbFilter_QueryRegistryDword)
+#pragma alloc_text (PAGE, KbFilter_LoadPolicy)
+#endif
+
+PKBFILTER_POLICY KbFilterPolicy = NULL;
+
+//
+// Copy of the service key path, DriverEntry's copy does not outlive it
+//
+UNICODE_STRING KbFilterRegistryPath = { 0, 0, NULL };
+
+//
+// Serializes reloads against each other
+//
+FAST_MUTEX KbFilterPolicyMutex;
+
+PKEY_VALUE_PARTIAL_INFORMATION
+KbFilter_QueryRegistryValue(
+    IN HANDLE Key,
+    IN PCWSTR ValueName,
+    IN ULONG Type
+    )
+/*++
+
+Routine Description:
+
+    Reads a registry value of the given type.
+
+Arguments:
+
+    Key - Open handle to the key holding the value
+    ValueName - Name of the value
+    Type - Expected registry type of the value
+
+Return Value:
+
+    Value information allocated from paged pool, to be freed by the caller
+    with ExFreePoolWithTag, or NULL if the value does not exist or has a
+    different type.
+
+--*/
+{
+    NTSTATUS status;
+    UNICODE_STRING valueName;
+    PKEY_VALUE_PARTIAL_INFORMATION info;
+    ULONG length = 0;
+
+    PAGED_CODE();
+
+    RtlInitUnicodeString(&valueName, ValueName);
+
+    status = ZwQueryValueKey(Key,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             NULL,
+                             0,
+                             &length);
+
+    if (status != STATUS_BUFFER_TOO_SMALL && status != STATUS_BUFFER_OVERFLOW) {
+        return NULL;
+    }
+
+    info = (PKEY_VALUE_PARTIAL_INFORMATION) ExAllocatePoolWithTag(PagedPool,
+                                                                  length,
+                                                                  KBFILTER_POOL_TAG);
+    if (info == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        return NULL;
+    }
+
+    status = ZwQueryValueKey(Key,
+                             &valueName,
+                             KeyValuePartialInformation,
+                             info,
+                             length,
+                             &length);
+
+    if (!NT_SUCCESS(status) || info->Type != Type) {
+        ExFreePoolWithTag(info, KBFILTER_POOL_TAG);
+        return NULL;
+    }
+
+    return info;
+}
+
+ULONG
+KbFilter_QueryRegistryDword(
+    IN HANDLE Key,
+    IN PCWSTR ValueName,
+    IN ULONG DefaultValue
+    )
+/*++
+
+Routine Description:
+
+    Reads a REG_DWORD value.
+
+Arguments:
+
+    Key - Open handle to the key holding the value, may be NULL
+    ValueName - Name of the value
+    DefaultValue - Returned if the value cannot be read
+
+Return Value:
+
+    The value.
+
+--*/
+{
+    PKEY_VALUE_PARTIAL_INFORMATION info;
+    ULONG value = DefaultValue;
+
+    PAGED_CODE();
+
+    if (Key == NULL) {
+        return DefaultValue;
+    }
+
+    info = KbFilter_QueryRegistryValue(Key, ValueName, REG_DWORD);
+    if (info != NULL) {
+        if (info->DataLength >= sizeof(ULONG)) {
+            value = *(PULONG) info->Data;
+        }
+        ExFreePoolWithTag(info, KBFILTER_POOL_TAG);
+    }
+
+    return value;
+}
+
+PKBFILTER_POLICY
+KbFilter_LoadPolicy(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Builds a new policy from the registry.  Values that are missing or out of
+    range keep their compiled-in defaults, so a policy is always returned
+    unless memory is exhausted.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Policy allocated from nonpaged pool, or NULL.
+
+--*/
+{
+    NTSTATUS status;
+    PKBFILTER_POLICY policy;
+    PKEY_VALUE_PARTIAL_INFORMATION info;
+    PKBFILTR_KEY_POLICY_ENTRY entry;
+    OBJECT_ATTRIBUTES attributes;
+    UNICODE_STRING parametersPath;
+    KEYBOARD_INPUT_DATA keyData;
+    HANDLE key = NULL;
+    ULONG threshold, value, count, i, slot;
+
+    PAGED_CODE();
+
+    policy = (PKBFILTER_POLICY) ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                      sizeof(KBFILTER_POLICY),
+                                                      KBFILTER_POOL_TAG);
+    if (policy == NULL) {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+        return NULL;
+    }
+
+    //
+    // Open <service key>\Parameters
+    //
+    parametersPath.Length = 0;
+    parametersPath.MaximumLength = KbFilterRegistryPath.Length + sizeof(L"\\Parameters");
+    parametersPath.Buffer = (PWSTR) ExAllocatePoolWithTag(PagedPool,
+                                                          parametersPath.MaximumLength,
+                                                          KBFILTER_POOL_TAG);
+    if (parametersPath.Buffer != NULL) {
+        RtlCopyUnicodeString(&parametersPath, &KbFilterRegistryPath);
+        RtlAppendUnicodeToString(&parametersPath, L"\\Parameters");
+
+        InitializeObjectAttributes(&attributes,
+                                   &parametersPath,
+                                   OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                                   NULL,
+                                   NULL);
+
+        status = ZwOpenKey(&key, KEY_READ, &attributes);
+        if (!NT_SUCCESS(status)) {
+            DebugPrint(("No policy parameters (0x%x), using defaults\n", status));
+            key = NULL;
+        }
+
+        ExFreePoolWithTag(parametersPath.Buffer, KBFILTER_POOL_TAG);
+    }
+    else {
+        InterlockedIncrement(&KbFilterAllocationFailures);
+    }
+
+    policy->Enabled = (BOOLEAN) (KbFilter_QueryRegistryDword(key,
+                                                             KBFILTR_REG_ENABLED,
+                                                             TRUE) != 0);
+
+    policy->AdaptiveThresholds = (BOOLEAN) (KbFilter_QueryRegistryDword(key,
+                                                                        KBFILTR_REG_ADAPTIVE,
+                                                                        FALSE) != 0);
+
+    policy->TypematicThresholds = (BOOLEAN) (KbFilter_QueryRegistryDword(key,
+                                                                         KBFILTR_REG_TYPEMATIC,
+                                                                         TRUE) != 0);
+
+    policy->RecordKeys = (BOOLEAN) (KbFilter_QueryRegistryDword(key,
+                                                                KBFILTR_REG_RECORD_KEYS,
+                                                                FALSE) != 0);
+
+    threshold = KbFilter_QueryRegistryDword(key,
+                                            KBFILTR_REG_THRESHOLD_MS,
+                                            LAG_MITIGATION_THRESHOLD_MS);
+    if (threshold > MAXUSHORT) {
+        threshold = LAG_MITIGATION_THRESHOLD_MS;
+    }
+
+    value = KbFilter_QueryRegistryDword(key,
+                                        KBFILTR_REG_DEDUP_MODE,
+                                        KBFILTER_DEFAULT_DEDUP_MODE);
+    policy->DedupMode = (value == KbFilterDedupLocked) ?
+                        KbFilterDedupLocked : KbFilterDedupLockFree;
+
+    policy->LagWatermarkMs = KbFilter_QueryRegistryDword(key,
+                                                         KBFILTR_REG_LAG_WATERMARK_MS,
+                                                         0);
+
+    policy->LagCooldownMs = KbFilter_QueryRegistryDword(key,
+                                                        KBFILTR_REG_LAG_COOLDOWN_MS,
+                                                        KBFILTER_LAG_COOLDOWN_MS);
+
+    policy->SequenceWindowMs = KbFilter_QueryRegistryDword(key,
+                                                           KBFILTR_REG_SEQUENCE_WINDOW_MS,
+                                                           0);
+
+    policy->StuckKeyMs = KbFilter_QueryRegistryDword(key,
+                                                     KBFILTR_REG_STUCK_KEY_MS,
+                                                     0);
+
+    policy->CrossDeviceWindowMs = KbFilter_QueryRegistryDword(key,
+                                                              KBFILTR_REG_CROSS_DEVICE_WINDOW_MS,
+                                                              0);
+
+    policy->IsrRejectUs = KbFilter_QueryRegistryDword(key,
+                                                      KBFILTR_REG_ISR_REJECT_US,
+                                                      0);
+    if (policy->IsrRejectUs > KBFILTER_ISR_REJECT_MAX_US) {
+        policy->IsrRejectUs = KBFILTER_ISR_REJECT_MAX_US;
+    }
+
+    //
+    // The injected clock is only available to test harnesses
+    //
+    value = KbFilter_QueryRegistryDword(key,
+                                        KBFILTR_REG_CLOCK,
+                                        KBFILTER_DEFAULT_CLOCK);
+    policy->Clock = (value < KbFilterClockInjected) ?
+                    (KBFILTER_CLOCK) value : KBFILTER_DEFAULT_CLOCK;
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        policy->Keys[slot].ThresholdMs = (USHORT) threshold;
+        policy->Keys[slot].Options = 0;
+    }
+
+    //
+    // Apply the per-key overrides
+    //
+    info = (key != NULL) ?
+           KbFilter_QueryRegistryValue(key, KBFILTR_REG_KEY_POLICY, REG_BINARY) :
+           NULL;
+
+    if (info != NULL) {
+        entry = (PKBFILTR_KEY_POLICY_ENTRY) info->Data;
+        count = info->DataLength / sizeof(KBFILTR_KEY_POLICY_ENTRY);
+
+        for (i = 0; i < count; i++, entry++) {
+
+            if (!(entry->Options & KBFILTR_KEY_POLICY_ENABLED)) {
+                continue;
+            }
+
+            RtlZeroMemory(&keyData, sizeof(keyData));
+            keyData.MakeCode = entry->MakeCode;
+            keyData.Flags = entry->Flags & (KEY_E0 | KEY_E1);
+
+            slot = KbFilter_KeySlot(&keyData);
+            if (slot == KBFILTER_NO_KEY_SLOT) {
+                continue;
+            }
+
+            policy->Keys[slot].ThresholdMs = entry->ThresholdMs;
+            policy->Keys[slot].Options = entry->Options & KBFILTR_KEY_POLICY_EXEMPT;
+        }
+
+        ExFreePoolWithTag(info, KBFILTER_POOL_TAG);
+    }
+
+    if (key != NULL) {
+        ZwClose(key);
+    }
+
+    return policy;
+}
+
+NTSTATUS
+KbFilter_InitializePolicy(
+    IN PUNICODE_STRING RegistryPath
+    )
+/*++
+
+Routine Description:
+
+    Saves the service key path and publishes the initial policy.  Called from
+    DriverEntry.
+
+Arguments:
+
+    RegistryPath - Service key path passed to DriverEntry
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    ExInitializeFastMutex(&KbFilterPolicyMutex);
+
+    KbFilterRegistryPath.Length = 0;
+    KbFilterRegistryPath.MaximumLength = RegistryPath->Length;
+    KbFilterRegistryPath.Buffer = (PWSTR) ExAllocatePoolWithTag(PagedPool,
+                                                                RegistryPath->Length,
+                                                                KBFILTER_POOL_TAG);
+    if (KbFilterRegistryPath.Buffer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlCopyUnicodeString(&KbFilterRegistryPath, RegistryPath);
+
+    KbFilterPolicy = KbFilter_LoadPolicy();
+    if (KbFilterPolicy == NULL) {
+        ExFreePoolWithTag(KbFilterRegistryPath.Buffer, KBFILTER_POOL_TAG);
+        KbFilterRegistryPath.Buffer = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+KbFilter_ReloadPolicy(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Rereads the policy from the registry and publishes it.  Service callbacks
+    that are running while the policy is replaced finish their batch with the
+    old policy, which is freed after KbFilter_PolicyBarrierDpc has run on
+    every processor.  Must be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+    PKBFILTER_POLICY newPolicy, oldPolicy;
+
+    PAGED_CODE();
+
+    newPolicy = KbFilter_LoadPolicy();
+    if (newPolicy == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    ExAcquireFastMutex(&KbFilterPolicyMutex);
+
+    oldPolicy = (PKBFILTER_POLICY) InterlockedExchangePointer((PVOID volatile *) &KbFilterPolicy,
+                                                              newPolicy);
+
+    ExReleaseFastMutex(&KbFilterPolicyMutex);
+
+    //
+    // The service callback and the stuck key DPC read the policy at
+    // DISPATCH_LEVEL and use it without lowering the IRQL.  A DPC only runs
+    // on a processor once it drops below DISPATCH_LEVEL, so once the barrier
+    // has run on every processor no reader can still hold the old policy.
+    // Every reload frees only the policy it replaced, so the barrier need
+    // not hold the mutex.
+    //
+    KeGenericCallDpc(KbFilter_PolicyBarrierDpc, NULL);
+
+    ExFreePoolWithTag(oldPolicy, KBFILTER_POOL_TAG);
+
+    DebugPrint(("Lag mitigation policy reloaded\n"));
+
+    return STATUS_SUCCESS;
+}
+
+VOID
+KbFilter_PolicyBarrierDpc(
+    IN PKDPC Dpc,
+    IN PVOID DeferredContext,
+    IN PVOID SystemArgument1,
+    IN PVOID SystemArgument2
+    )
+/*++
+
+Routine Description:
+
+    Runs on every processor for KbFilter_ReloadPolicy through
+    KeGenericCallDpc.  By the time it runs, the processor has finished any
+    service callback or stuck key DPC that read the old policy.
+
+Arguments:
+
+    Dpc - Generic call DPC
+    DeferredContext - Unused
+    SystemArgument1 - Passed to KeSignalCallDpcDone
+    SystemArgument2 - Passed to KeSignalCallDpcSynchronize
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(DeferredContext);
+
+    KeSignalCallDpcSynchronize(SystemArgument2);
+    KeSignalCallDpcDone(SystemArgument1);
+}
+
+VOID
+KbFilter_QueryConfiguration(
+    OUT PKBFILTR_CONFIGURATION Configuration
+    )
+/*++
+
+Routine Description:
+
+    Copies the settings of the published policy for the control device.
+    Holding KbFilterPolicyMutex keeps a concurrent reload from freeing the
+    policy while it is read.  Must be called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Configuration - Receives the settings
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PKBFILTER_POLICY policy;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(Configuration, sizeof(KBFILTR_CONFIGURATION));
+    Configuration->Size = sizeof(KBFILTR_CONFIGURATION);
+
+    ExAcquireFastMutex(&KbFilterPolicyMutex);
+
+    policy = KbFilterPolicy;
+
+    Configuration->Enabled = policy->Enabled;
+    Configuration->AdaptiveThresholds = policy->AdaptiveThresholds;
+    Configuration->TypematicThresholds = policy->TypematicThresholds;
+    Configuration->RecordKeys = policy->RecordKeys;
+    Configuration->DedupMode = (ULONG) policy->DedupMode;
+    Configuration->Clock = (ULONG) policy->Clock;
+    Configuration->LagWatermarkMs = policy->LagWatermarkMs;
+    Configuration->LagCooldownMs = policy->LagCooldownMs;
+    Configuration->SequenceWindowMs = policy->SequenceWindowMs;
+    Configuration->StuckKeyMs = policy->StuckKeyMs;
+    Configuration->CrossDeviceWindowMs = policy->CrossDeviceWindowMs;
+    Configuration->IsrRejectUs = policy->IsrRejectUs;
+
+    ExReleaseFastMutex(&KbFilterPolicyMutex);
+}
+
+VOID
+KbFilter_ConfigureIsrReject(
+    IN PKBFILTER_CORE Core
+    )
+/*++
+
+Routine Description:
+
+    Configures the ISR fast reject of a new keyboard from the published
+    policy, see KbFilter_SetIsrReject.  Holding KbFilterPolicyMutex keeps a
+    concurrent reload from freeing the policy while it is read.  Must be
+    called at PASSIVE_LEVEL.
+
+Arguments:
+
+    Core - Lag mitigation state of the keyboard
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    ExAcquireFastMutex(&KbFilterPolicyMutex);
+
+    KbFilter_SetIsrReject(Core, KbFilterPolicy);
+
+    ExReleaseFastMutex(&KbFilterPolicyMutex);
+}
+
+VOID
+KbFilter_FreePolicy(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the published policy and the saved service key path.  Called from
+    KbFilter_Unload, when no device can be using the policy any more.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (KbFilterPolicy != NULL) {
+        ExFreePoolWithTag(KbFilterPolicy, KBFILTER_POOL_TAG);
+        KbFilterPolicy = NULL;
+    }
+
+    if (KbFilterRegistryPath.Buffer != NULL) {
+        ExFreePoolWithTag(KbFilterRegistryPath.Buffer, KBFILTER_POOL_TAG);
+        KbFilterRegistryPath.Buffer = NULL;
+    }
+}
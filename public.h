@@ -8,4 +8,388 @@
                                                         METHOD_BUFFERED,    \
                                                         FILE_READ_DATA)
 
+#define IOCTL_KBFILTR_DRAIN_KEYTRACE CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                               IOCTL_INDEX + 2,    \
+                                               METHOD_BUFFERED,    \
+                                               FILE_READ_DATA)
+
+#define IOCTL_KBFILTR_DRAIN_TRACE CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                            IOCTL_INDEX + 1,    \
+                                            METHOD_BUFFERED,    \
+                                            FILE_READ_DATA)
+
+#define IOCTL_KBFILTR_GET_STATISTICS CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                               IOCTL_INDEX + 3,    \
+                                               METHOD_BUFFERED,    \
+                                               FILE_READ_DATA)
+
+#define IOCTL_KBFILTR_GET_CONFIGURATION CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                                  IOCTL_INDEX + 4,    \
+                                                  METHOD_BUFFERED,    \
+                                                  FILE_READ_DATA)
+
+#define IOCTL_KBFILTR_RELOAD_CONFIGURATION CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                                     IOCTL_INDEX + 5,    \
+                                                     METHOD_BUFFERED,    \
+                                                     FILE_WRITE_DATA)
+
+#define IOCTL_KBFILTR_MAP_EVENT_RING CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                               IOCTL_INDEX + 6,    \
+                                               METHOD_BUFFERED,    \
+                                               FILE_READ_DATA)
+
+#define IOCTL_KBFILTR_UNMAP_EVENT_RING CTL_CODE( FILE_DEVICE_KEYBOARD,   \
+                                                 IOCTL_INDEX + 7,    \
+                                                 METHOD_BUFFERED,    \
+                                                 FILE_READ_DATA)
+
+//
+// The IOCTLs are sent to the filter's control device, which only the system
+// and administrators may open.  The keyboard stacks themselves are opened
+// exclusively by the raw input thread.
+//
+#define KBFILTR_CONTROL_DEVICE_PATH     L"\\\\.\\KbFiltr"
+
+//
+// Batched requests.  Every keyboard the filter is attached to has an
+// instance number that stays the same until the keyboard is removed.  The
+// attributes, statistics and drain IOCTLs take the instances to query as
+// input, or an empty input buffer for every keyboard, and return a
+// KBFILTR_BATCH followed by one entry per keyboard.  Every entry starts with
+// a KBFILTR_ENTRY, and the next entry follows Size bytes after it.  Entries
+// for keyboards that are gone consist of the header only, with Status set to
+// STATUS_NO_SUCH_DEVICE.  When the output buffer fills up the batch ends
+// early, so Count can be less than the number of keyboards asked for.
+//
+// IOCTL_KBFILTR_GET_KEYBOARD_ATTRIBUTES with an empty input buffer also
+// serves to enumerate the keyboards.
+//
+typedef struct _KBFILTR_DEVICE_SELECTION {
+    ULONG Count;
+    ULONG Instances[1];
+} KBFILTR_DEVICE_SELECTION, *PKBFILTR_DEVICE_SELECTION;
+
+typedef struct _KBFILTR_BATCH {
+    ULONG Devices;                                          // keyboards attached
+    ULONG Count;                                            // entries that follow
+} KBFILTR_BATCH, *PKBFILTR_BATCH;
+
+typedef struct _KBFILTR_ENTRY {
+    ULONG Size;                                             // multiple of 8
+    ULONG Instance;
+    LONG Status;                                            // NTSTATUS
+    ULONG Reserved;
+} KBFILTR_ENTRY, *PKBFILTR_ENTRY;
+
+typedef struct _KBFILTR_ATTRIBUTES_ENTRY {
+    KBFILTR_ENTRY Header;
+    KEYBOARD_ATTRIBUTES Attributes;
+} KBFILTR_ATTRIBUTES_ENTRY, *PKBFILTR_ATTRIBUTES_ENTRY;
+
+//
+// Registry configuration, read from the Parameters subkey of the service key
+//
+#define KBFILTR_REG_ENABLED             L"Enabled"          // REG_DWORD, 0 or 1
+#define KBFILTR_REG_THRESHOLD_MS        L"ThresholdMs"      // REG_DWORD
+#define KBFILTR_REG_DEDUP_MODE          L"DedupMode"        // REG_DWORD, 0 locked, 1 lock-free
+#define KBFILTR_REG_CLOCK               L"Clock"            // REG_DWORD, 0 interrupt time,
+                                                            // 1 performance counter, 2 tick count
+#define KBFILTR_REG_ADAPTIVE            L"AdaptiveThresholds" // REG_DWORD, 0 or 1
+#define KBFILTR_REG_TYPEMATIC           L"TypematicThresholds" // REG_DWORD, 0 or 1
+#define KBFILTR_REG_KEY_POLICY          L"KeyPolicy"        // REG_BINARY, KBFILTR_KEY_POLICY_ENTRY[]
+#define KBFILTR_REG_RECORD_KEYS         L"RecordKeys"       // REG_DWORD, 0 or 1, records keystrokes!
+#define KBFILTR_REG_LAG_WATERMARK_MS    L"LagWatermarkMs"   // REG_DWORD, 0 filters all the time
+#define KBFILTR_REG_LAG_COOLDOWN_MS     L"LagCooldownMs"    // REG_DWORD
+#define KBFILTR_REG_SEQUENCE_WINDOW_MS  L"SequenceWindowMs" // REG_DWORD, 0 turns sequence dedup off
+#define KBFILTR_REG_STUCK_KEY_MS        L"StuckKeyMs"       // REG_DWORD, 0 turns stuck key recovery off
+#define KBFILTR_REG_CROSS_DEVICE_WINDOW_MS L"CrossDeviceWindowMs" // REG_DWORD, 0 turns cross-device dedup off
+#define KBFILTR_REG_ISR_REJECT_US       L"IsrRejectUs"      // REG_DWORD, 0 turns the ISR fast reject off
+
+//
+// Per-key overrides stored in the KeyPolicy value.  Flags holds the KEY_E0 or
+// KEY_E1 prefix of the key.  Entries without KBFILTR_KEY_POLICY_ENABLED are
+// ignored, so an override can be switched off without deleting it.
+//
+#define KBFILTR_KEY_POLICY_ENABLED      0x0001
+#define KBFILTR_KEY_POLICY_EXEMPT       0x0002              // never filter this key
+
+typedef struct _KBFILTR_KEY_POLICY_ENTRY {
+    USHORT MakeCode;
+    USHORT Flags;
+    USHORT ThresholdMs;
+    USHORT Options;
+} KBFILTR_KEY_POLICY_ENTRY, *PKBFILTR_KEY_POLICY_ENTRY;
+
+//
+// Trace events.  The filter records its decisions in a fixed-size binary ring
+// per keyboard; messages are only formatted by the user-mode consumer that
+// drains it.  Events carry the class of a key, never its scan code.
+//
+#define KBFILTR_TRACE_KEY               1                   // one packet was checked
+
+#define KBFILTR_DECISION_ACCEPT         0
+#define KBFILTR_DECISION_DUPLICATE      1                   // dropped, lag duplicate
+#define KBFILTR_DECISION_REPEAT         2                   // dropped, repeat faster than typematic
+#define KBFILTR_DECISION_SEQUENCE       3                   // dropped, replayed key sequence
+#define KBFILTR_DECISION_CROSS_DEVICE   4                   // dropped, reported by another keyboard
+
+#define KBFILTR_KEY_CLASS_OTHER         0
+#define KBFILTR_KEY_CLASS_CHARACTER     1                   // main block, incl. space, enter, tab
+#define KBFILTR_KEY_CLASS_MODIFIER      2                   // shift, ctrl, alt, windows, caps lock
+#define KBFILTR_KEY_CLASS_FUNCTION      3
+#define KBFILTR_KEY_CLASS_NAVIGATION    4                   // E0 arrows, home, page up, ...
+#define KBFILTR_KEY_CLASS_KEYPAD        5
+
+#define KBFILTR_TRACE_FLAG_BREAK        0x01                // key-up packet
+
+typedef struct _KBFILTR_TRACE_EVENT {
+    ULONG KeyTime;                                          // ms, see the driver's time source
+    UCHAR EventId;
+    UCHAR KeyClass;
+    UCHAR Decision;
+    UCHAR Flags;
+} KBFILTR_TRACE_EVENT, *PKBFILTR_TRACE_EVENT;
+
+//
+// IOCTL_KBFILTR_DRAIN_TRACE takes the cursor returned by the previous call
+// for each keyboard (zero the first time) and returns the events recorded
+// since, in order, and the cursor for the next call.  An empty input buffer
+// drains every keyboard from zero.  Lost counts the events that were
+// overwritten before they could be read.  The output buffer is shared out
+// evenly between the keyboards.
+//
+typedef struct _KBFILTR_DRAIN_CURSOR {
+    ULONG Instance;
+    ULONG Cursor;
+} KBFILTR_DRAIN_CURSOR, *PKBFILTR_DRAIN_CURSOR;
+
+typedef struct _KBFILTR_DRAIN_REQUEST {
+    ULONG Count;
+    KBFILTR_DRAIN_CURSOR Cursors[1];
+} KBFILTR_DRAIN_REQUEST, *PKBFILTR_DRAIN_REQUEST;
+
+typedef struct _KBFILTR_TRACE_DRAIN {
+    KBFILTR_ENTRY Header;
+    ULONG Cursor;
+    ULONG Lost;
+    ULONG Count;
+    ULONG Reserved;
+    KBFILTR_TRACE_EVENT Events[1];
+} KBFILTR_TRACE_DRAIN, *PKBFILTR_TRACE_DRAIN;
+
+//
+// Keystroke traces.  When RecordKeys is set the filter records every packet
+// it checks, with its make code, so traces contain everything typed and
+// must be handled like passwords.  A trace file is a KBFILTR_KEYTRACE_HEADER
+// followed by fixed-size records up to the end of the file, so a trace can
+// be appended to at any time and read in place through a file mapping.
+//
+// Key records carry the time since the previous record.  A SYNC record sets
+// the absolute key time instead; one precedes the first key record and any
+// delta that does not fit in 16 bits.  The driver also emits one every
+// KBFILTR_KEYTRACE_SYNC_INTERVAL records, so a reader that lost records can
+// resynchronize at the next SYNC record.
+//
+#define KBFILTR_KEYTRACE_MAGIC          0x5254424B          // "KBTR"
+#define KBFILTR_KEYTRACE_VERSION        1
+
+#define KBFILTR_KEYTRACE_KEY            0
+#define KBFILTR_KEYTRACE_SYNC           1
+#define KBFILTR_KEYTRACE_KIND_MASK      0x7F
+
+//
+// Set in Kind of a key record by offline labelling when the packet is known
+// to be a lag duplicate.  The driver never sets it.
+//
+#define KBFILTR_KEYTRACE_DUPLICATE      0x80
+
+#define KBFILTR_KEYTRACE_SYNC_INTERVAL  64
+
+typedef struct _KBFILTR_KEYTRACE_HEADER {
+    ULONG Magic;
+    USHORT Version;
+    USHORT RecordSize;                                      // readers skip unknown trailing bytes
+    ULONG Reserved[2];
+} KBFILTR_KEYTRACE_HEADER, *PKBFILTR_KEYTRACE_HEADER;
+
+typedef struct _KBFILTR_KEYTRACE_RECORD {
+    UCHAR Kind;                                             // KBFILTR_KEYTRACE_KEY or _SYNC, plus labels
+    UCHAR Decision;                                         // KBFILTR_DECISION_
+    UCHAR UnitId;
+    UCHAR Flags;                                            // KEY_ flags of the packet
+    union {
+        struct {
+            USHORT DeltaMs;
+            USHORT MakeCode;
+        } Key;
+        ULONG KeyTime;                                      // KBFILTR_KEYTRACE_SYNC
+    } u;
+} KBFILTR_KEYTRACE_RECORD, *PKBFILTR_KEYTRACE_RECORD;
+
+//
+// IOCTL_KBFILTR_DRAIN_KEYTRACE works like IOCTL_KBFILTR_DRAIN_TRACE and
+// returns the records to append to a trace file.
+//
+typedef struct _KBFILTR_KEYTRACE_DRAIN {
+    KBFILTR_ENTRY Header;
+    ULONG Cursor;
+    ULONG Lost;
+    ULONG Count;
+    ULONG Reserved;
+    KBFILTR_KEYTRACE_RECORD Records[1];
+} KBFILTR_KEYTRACE_DRAIN, *PKBFILTR_KEYTRACE_DRAIN;
+
+//
+// Cost profile of the filter.  Every range of packets checked by the filter
+// counts as one batch; its cost is the time spent checking it, excluding
+// the class driver.  CostBuckets[i] counts the batches that took between
+// 2^i and 2^(i+1) - 1 ns, so percentiles can be read off the histogram.
+// The filter makes no allocations per batch.  Only drivers built with
+// KBFILTER_PROFILE, by default checked builds, fill in the profile; it is
+// all zero otherwise.
+//
+#define KBFILTR_COST_BUCKETS            32
+
+typedef struct _KBFILTR_BATCH_PROFILE {
+    ULONGLONG Batches;
+    ULONGLONG Packets;
+    ULONGLONG TotalNs;
+    ULONG MaxNs;
+    ULONG MaxPackets;                                       // largest batch
+    ULONG CostBuckets[KBFILTR_COST_BUCKETS];
+} KBFILTR_BATCH_PROFILE, *PKBFILTR_BATCH_PROFILE;
+
+//
+// Statistics of a keyboard, returned by IOCTL_KBFILTR_GET_STATISTICS.  The
+// filter keeps the counters per processor and adds them up on request, so
+// a snapshot taken while keys are typed may be a batch behind.
+//
+// Decisions[] counts the checked packets by KBFILTR_DECISION_, accepted ones
+// included.  PassThroughPackets were accepted unchecked, since filtering was
+// disabled or the lag detector found the system healthy; cross-device dedup
+// still applies to them.  BackpressurePackets
+// were left with the port driver because the carry queue was full.
+// BatchSizeBuckets[i] counts the ranges of 2^i to 2^(i+1) - 1 packets, the
+// last bucket every larger range.  LockSpinNs is the time spent waiting for
+// the filter's spin locks.  AllocationFailures is driver-wide.  IsrRejects
+// counts the make codes dropped in the i8042 ISR hook; they never reach the
+// service callback and are not in PacketsIn.
+//
+#define KBFILTR_DECISIONS               5
+#define KBFILTR_BATCH_SIZE_BUCKETS      9
+
+typedef struct _KBFILTR_STATISTICS {
+    ULONG Size;                                             // sizeof(KBFILTR_STATISTICS)
+    ULONG Processors;                                       // shards added up
+    ULONGLONG PacketsIn;
+    ULONGLONG Decisions[KBFILTR_DECISIONS];
+    ULONGLONG PassThroughPackets;
+    ULONGLONG SynthesizedBreaks;                            // stuck key recovery
+    ULONGLONG BackpressurePackets;
+    ULONGLONG LockSpinNs;
+    ULONG BatchSizeBuckets[KBFILTR_BATCH_SIZE_BUCKETS];
+    ULONG AllocationFailures;
+    ULONG CacheHits;                                        // typematic and indicator queries
+    ULONG CacheMisses;
+    ULONG LagEnterCount;
+    ULONG LagExitCount;
+    ULONG IsrRejects;
+    BOOLEAN DedupActive;
+    UCHAR Reserved[3];
+    KBFILTR_BATCH_PROFILE Profile;
+} KBFILTR_STATISTICS, *PKBFILTR_STATISTICS;
+
+typedef struct _KBFILTR_STATISTICS_ENTRY {
+    KBFILTR_ENTRY Header;
+    KBFILTR_STATISTICS Statistics;
+} KBFILTR_STATISTICS_ENTRY, *PKBFILTR_STATISTICS_ENTRY;
+
+//
+// Driver-wide settings in effect, returned by IOCTL_KBFILTR_GET_CONFIGURATION.
+// IOCTL_KBFILTR_RELOAD_CONFIGURATION rereads them from the registry, so a
+// tool tunes the filter by writing the Parameters values and reloading; it
+// returns the new settings if the output buffer is large enough.  DedupMode,
+// Clock and IsrRejectUs apply to keyboards added after the reload, and so does
+// turning CrossDeviceWindowMs on.
+//
+typedef struct _KBFILTR_CONFIGURATION {
+    ULONG Size;                                             // sizeof(KBFILTR_CONFIGURATION)
+    BOOLEAN Enabled;
+    BOOLEAN AdaptiveThresholds;
+    BOOLEAN TypematicThresholds;
+    BOOLEAN RecordKeys;
+    ULONG DedupMode;
+    ULONG Clock;
+    ULONG LagWatermarkMs;
+    ULONG LagCooldownMs;
+    ULONG SequenceWindowMs;
+    ULONG StuckKeyMs;
+    ULONG CrossDeviceWindowMs;
+    ULONG IsrRejectUs;
+} KBFILTR_CONFIGURATION, *PKBFILTR_CONFIGURATION;
+
+//
+// Event ring.  IOCTL_KBFILTR_MAP_EVENT_RING maps a keyboard's event ring
+// read-only into the calling process; a reader that writes to it faults.  The
+// filter writes one KBFILTR_EVENT_RECORD per packet and decision, including
+// synthesized breaks, and never waits for readers.  Each reader keeps its
+// own cursor; records it was too slow for are simply overwritten.
+//
+// Records are numbered from 1, and record n is stored at
+// Records[n & (RecordCount - 1)].  Sequence is zero while the slot is being
+// rewritten and n once record n is complete, so a reader copies a slot and
+// then checks that Sequence still holds the number it expects; a larger
+// number means the record was lost.  Head is the number of the newest
+// complete record and is updated once per batch.  The optional event passed
+// when mapping is signalled once per batch as well.
+//
+// MakeCode is only filled in while RecordKeys is set; otherwise readers see
+// the key class alone, as in trace events.  The ring stays mapped until
+// IOCTL_KBFILTR_UNMAP_EVENT_RING or until the handle is closed, even if the
+// keyboard is removed; it then stops advancing.  Handles used to map rings
+// must not be duplicated into other processes.
+//
+#define KBFILTR_EVENT_RING_MAGIC        0x4E52424B          // "KBRN"
+#define KBFILTR_EVENT_RING_VERSION      1
+
+typedef struct _KBFILTR_EVENT_RECORD {
+    volatile ULONG Sequence;
+    ULONG KeyTime;
+    USHORT MakeCode;
+    USHORT Flags;                                           // KEY_ flags of the packet
+    UCHAR UnitId;
+    UCHAR Decision;                                         // KBFILTR_DECISION_
+    UCHAR KeyClass;                                         // KBFILTR_KEY_CLASS_
+    UCHAR Reserved;
+} KBFILTR_EVENT_RECORD, *PKBFILTR_EVENT_RECORD;
+
+typedef struct _KBFILTR_EVENT_RING {
+    ULONG Magic;
+    USHORT Version;
+    USHORT RecordSize;
+    ULONG RecordCount;                                      // power of two
+    volatile ULONG Head;
+    ULONG Reserved[12];                                     // pads the header to 64 bytes
+    KBFILTR_EVENT_RECORD Records[1];
+} KBFILTR_EVENT_RING, *PKBFILTR_EVENT_RING;
+
+typedef struct _KBFILTR_MAP_EVENT_RING {
+    ULONG Instance;
+    ULONG Reserved;
+    ULONGLONG Event;                                        // event HANDLE, or zero
+} KBFILTR_MAP_EVENT_RING, *PKBFILTR_MAP_EVENT_RING;
+
+typedef struct _KBFILTR_EVENT_RING_MAPPING {
+    ULONGLONG Address;                                      // KBFILTR_EVENT_RING in the caller
+    ULONG Size;
+    ULONG Reserved;
+} KBFILTR_EVENT_RING_MAPPING, *PKBFILTR_EVENT_RING_MAPPING;
+
+//
+// IOCTL_KBFILTR_UNMAP_EVENT_RING takes the Address returned by the mapping
+//
+typedef struct _KBFILTR_UNMAP_EVENT_RING {
+    ULONGLONG Address;
+} KBFILTR_UNMAP_EVENT_RING, *PKBFILTR_UNMAP_EVENT_RING;
+
 #endif
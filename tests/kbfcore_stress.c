@@ -0,0 +1,487 @@
+/*++
+
+Module Name:
+
+    kbfcore_stress.c
+
+Abstract:
+
+    Concurrency stress tests of the lag mitigation core.  Several threads
+    check packets against one core at the same time, as service callbacks
+    of one keyboard do on several processors, and the results are compared
+    with what the locked mode decides for the same packets on one thread.
+    Run one test by passing its name, or all of them without arguments.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbfcore.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_THREADS      4
+#define STRESS_PACKETS      200000
+#define STRESS_ROUNDS       20000
+#define STRESS_RANGE_COUNT  20000
+#define STRESS_RANGE_SIZE   8
+
+static int Failures;
+
+#define CHECK(_expr_)                                                       \
+    do {                                                                    \
+        if (!(_expr_)) {                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                    __FILE__, __LINE__, #_expr_);                           \
+            Failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(_actual_, _expected_)                                      \
+    do {                                                                    \
+        unsigned long long _a_ = (unsigned long long) (_actual_);           \
+        unsigned long long _e_ = (unsigned long long) (_expected_);         \
+        if (_a_ != _e_) {                                                   \
+            fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n",           \
+                    __FILE__, __LINE__, #_actual_, _a_, _e_);               \
+            Failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+//
+// Injected clock that advances by one ms on every read, so that concurrent
+// ranges see distinct, increasing times
+//
+static volatile LONG StressNow;
+
+static
+ULONGLONG
+StressReadClock(
+    PVOID Context
+    )
+{
+    (void) Context;
+    return (ULONGLONG) (ULONG) InterlockedIncrement(&StressNow);
+}
+
+//
+// A core with a statistics shard per thread, as the driver gives every
+// keyboard one per processor; freed with free
+//
+typedef struct _STRESS_CORE {
+    KBFILTER_CORE Core;
+    KBFILTER_STATS_SHARD Shards[KBFPLAT_PROCESSORS];
+} STRESS_CORE, *PSTRESS_CORE;
+
+static
+PKBFILTER_CORE
+StressCreateCore(
+    KBFILTER_DEDUP_MODE DedupMode
+    )
+{
+    PSTRESS_CORE stress;
+
+    stress = aligned_alloc(64, (sizeof(STRESS_CORE) + 63) & ~(size_t) 63);
+    if (stress == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    KbFilter_InitializeCore(&stress->Core, DedupMode, KbFilterClockInjected, StressReadClock, NULL, 1000);
+    memset(stress->Shards, 0, sizeof(stress->Shards));
+    KbFilter_AttachStatistics(&stress->Core, stress->Shards, KBFPLAT_PROCESSORS);
+    return &stress->Core;
+}
+
+static
+VOID
+StressDefaultPolicy(
+    PKBFILTER_POLICY Policy
+    )
+{
+    ULONG slot;
+
+    memset(Policy, 0, sizeof(KBFILTER_POLICY));
+    Policy->Enabled = TRUE;
+    Policy->TypematicThresholds = TRUE;
+    Policy->AdaptiveThresholds = TRUE;
+    Policy->LagCooldownMs = KBFILTER_LAG_COOLDOWN_MS;
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        Policy->Keys[slot].ThresholdMs = LAG_MITIGATION_THRESHOLD_MS;
+    }
+}
+
+//
+// Partitioned keys.  Thread n owns the make codes congruent to n modulo
+// STRESS_THREADS, so the threads share key-down words, histograms and the
+// slot cache lines, but every key sees the packets of one thread only.  The
+// decisions of a key only depend on its own packets, so they must equal the
+// decisions of the locked mode on one thread.
+//
+typedef struct _STRESS_STREAM {
+    PKBFILTER_CORE Core;
+    PKBFILTER_POLICY Policy;
+    ULONG Thread;
+    KEYBOARD_INPUT_DATA Input[STRESS_PACKETS];
+    ULONG KeyTime[STRESS_PACKETS];
+    UCHAR Decision[STRESS_PACKETS];
+} STRESS_STREAM, *PSTRESS_STREAM;
+
+static
+VOID
+StressGenerate(
+    PSTRESS_STREAM Stream
+    )
+{
+    ULONG i, keyTime = 1, seed = 1 + Stream->Thread;
+    USHORT makeCode;
+
+    for (i = 0; i < STRESS_PACKETS; i++) {
+        seed = seed * 1103515245 + 12345;
+        keyTime += (seed >> 16) % 150;
+
+        makeCode = (USHORT) (((seed >> 8) % 16) * STRESS_THREADS + Stream->Thread);
+
+        memset(&Stream->Input[i], 0, sizeof(KEYBOARD_INPUT_DATA));
+        Stream->Input[i].MakeCode = makeCode;
+        Stream->Input[i].Flags = ((seed >> 4) % 3 == 0) ? KEY_BREAK : KEY_MAKE;
+        Stream->KeyTime[i] = keyTime;
+    }
+}
+
+static
+void *
+StressCheckStream(
+    void *Context
+    )
+{
+    PSTRESS_STREAM stream = Context;
+    ULONG i;
+
+    for (i = 0; i < STRESS_PACKETS; i++) {
+        stream->Decision[i] = KbFilter_CheckKey(stream->Core,
+                                                stream->Policy,
+                                                &stream->Input[i],
+                                                stream->KeyTime[i]);
+    }
+
+    return NULL;
+}
+
+static
+VOID
+TestLockFreeMatchesLocked(
+    VOID
+    )
+{
+    static STRESS_STREAM streams[STRESS_THREADS];
+    pthread_t threads[STRESS_THREADS];
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE shared, locked;
+    UCHAR decision;
+    ULONG n, i, mismatches = 0;
+
+    StressDefaultPolicy(&policy);
+    shared = StressCreateCore(KbFilterDedupLockFree);
+    locked = StressCreateCore(KbFilterDedupLocked);
+
+    for (n = 0; n < STRESS_THREADS; n++) {
+        streams[n].Core = shared;
+        streams[n].Policy = &policy;
+        streams[n].Thread = n;
+        StressGenerate(&streams[n]);
+    }
+
+    for (n = 0; n < STRESS_THREADS; n++) {
+        CHECK(pthread_create(&threads[n], NULL, StressCheckStream, &streams[n]) == 0);
+    }
+    for (n = 0; n < STRESS_THREADS; n++) {
+        pthread_join(threads[n], NULL);
+    }
+
+    //
+    // Replay every stream on one thread in the locked mode
+    //
+    for (n = 0; n < STRESS_THREADS; n++) {
+        for (i = 0; i < STRESS_PACKETS; i++) {
+            decision = KbFilter_CheckKey(locked, &policy, &streams[n].Input[i], streams[n].KeyTime[i]);
+            if (decision != streams[n].Decision[i]) {
+                mismatches++;
+            }
+        }
+    }
+
+    CHECK_EQ(mismatches, 0);
+    CHECK(memcmp(shared->KeyTable, locked->KeyTable, sizeof(shared->KeyTable)) == 0);
+    CHECK(memcmp((void *) shared->KeyDown, (void *) locked->KeyDown, sizeof(shared->KeyDown)) == 0);
+
+    free(shared);
+    free(locked);
+}
+
+//
+// Contended key.  In every round all threads report the same press of one
+// key at the same key time, as if the packet had been reported on every
+// processor.  Exactly one of them may be accepted.
+//
+typedef struct _STRESS_CONTENTION {
+    PKBFILTER_CORE Core;
+    PKBFILTER_POLICY Policy;
+    pthread_barrier_t *Barrier;
+    ULONG Thread;
+    ULONG Accepted[STRESS_ROUNDS];
+} STRESS_CONTENTION, *PSTRESS_CONTENTION;
+
+static
+void *
+StressContend(
+    void *Context
+    )
+{
+    PSTRESS_CONTENTION contention = Context;
+    KEYBOARD_INPUT_DATA input;
+    ULONG round, keyTime;
+
+    memset(&input, 0, sizeof(input));
+    input.MakeCode = 0x1E;
+
+    for (round = 0; round < STRESS_ROUNDS; round++) {
+        keyTime = 1 + round * 1000;
+
+        pthread_barrier_wait(contention->Barrier);
+
+        input.Flags = KEY_MAKE;
+        if (KbFilter_CheckKey(contention->Core, contention->Policy, &input, keyTime) ==
+            KBFILTR_DECISION_ACCEPT) {
+            contention->Accepted[round]++;
+        }
+
+        pthread_barrier_wait(contention->Barrier);
+
+        if (contention->Thread == 0) {
+            input.Flags = KEY_BREAK;
+            KbFilter_CheckKey(contention->Core, contention->Policy, &input, keyTime + 500);
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+TestSameKeyContention(
+    VOID
+    )
+{
+    static STRESS_CONTENTION contention[STRESS_THREADS];
+    pthread_t threads[STRESS_THREADS];
+    pthread_barrier_t barrier;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    ULONG n, round, accepted, wrongRounds = 0;
+
+    StressDefaultPolicy(&policy);
+    policy.AdaptiveThresholds = FALSE;
+    core = StressCreateCore(KbFilterDedupLockFree);
+    pthread_barrier_init(&barrier, NULL, STRESS_THREADS);
+
+    for (n = 0; n < STRESS_THREADS; n++) {
+        memset(&contention[n], 0, sizeof(contention[n]));
+        contention[n].Core = core;
+        contention[n].Policy = &policy;
+        contention[n].Barrier = &barrier;
+        contention[n].Thread = n;
+        CHECK(pthread_create(&threads[n], NULL, StressContend, &contention[n]) == 0);
+    }
+    for (n = 0; n < STRESS_THREADS; n++) {
+        pthread_join(threads[n], NULL);
+    }
+
+    for (round = 0; round < STRESS_ROUNDS; round++) {
+        accepted = 0;
+        for (n = 0; n < STRESS_THREADS; n++) {
+            accepted += contention[n].Accepted[round];
+        }
+        if (accepted != 1) {
+            wrongRounds++;
+        }
+    }
+
+    CHECK_EQ(wrongRounds, 0);
+    CHECK_EQ(core->KeyTable[0x1E].Fields.PressCount, STRESS_ROUNDS);
+
+    pthread_barrier_destroy(&barrier);
+    free(core);
+}
+
+//
+// Concurrent ranges with the order-dependent stages on.  Sequence dedup,
+// the capture ring and the event ring must see every packet exactly once
+// and in one order, whichever thread checked it.
+//
+typedef struct _STRESS_RANGES {
+    PKBFILTER_CORE Core;
+    PKBFILTER_POLICY Policy;
+    ULONG Thread;
+    ULONG Packets;
+    ULONG AcceptedMakes;
+} STRESS_RANGES, *PSTRESS_RANGES;
+
+static
+void *
+StressFilterRanges(
+    void *Context
+    )
+{
+    PSTRESS_RANGES ranges = Context;
+    KEYBOARD_INPUT_DATA input[STRESS_RANGE_SIZE], output[2 * STRESS_RANGE_SIZE];
+    ULONG range, i, count, seed = 7 + ranges->Thread;
+
+    for (range = 0; range < STRESS_RANGE_COUNT; range++) {
+        memset(input, 0, sizeof(input));
+        for (i = 0; i < STRESS_RANGE_SIZE; i++) {
+            seed = seed * 1103515245 + 12345;
+            input[i].MakeCode = (USHORT) (0x10 + (seed >> 16) % 6);
+            input[i].Flags = ((seed >> 8) & 1) ? KEY_BREAK : KEY_MAKE;
+        }
+
+        count = KbFilter_FilterPackets(ranges->Core,
+                                       ranges->Policy,
+                                       input,
+                                       input + STRESS_RANGE_SIZE,
+                                       output);
+
+        ranges->Packets += STRESS_RANGE_SIZE;
+        for (i = 0; i < count; i++) {
+            if (!(output[i].Flags & KEY_BREAK)) {
+                ranges->AcceptedMakes++;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static
+VOID
+TestConcurrentRanges(
+    VOID
+    )
+{
+    static STRESS_RANGES ranges[STRESS_THREADS];
+    pthread_t threads[STRESS_THREADS];
+    KBFILTER_EVENT_WRITER writer;
+    PKBFILTR_EVENT_RING ring;
+    KBFILTER_POLICY policy;
+    static KBFILTR_KEYTRACE_RECORD trace[KBFILTER_CAPTURE_RING_SIZE];
+    KBFILTR_STATISTICS statistics;
+    PKBFILTER_CORE core;
+    ULONG n, packets = 0, acceptedMakes = 0, cursor, drained, lost;
+
+    StressDefaultPolicy(&policy);
+    policy.SequenceWindowMs = 1000;
+    policy.RecordKeys = TRUE;
+    core = StressCreateCore(KbFilterDedupLockFree);
+
+    ring = malloc(FIELD_OFFSET(KBFILTR_EVENT_RING, Records) +
+                  KBFILTER_EVENT_RING_RECORDS * sizeof(KBFILTR_EVENT_RECORD));
+    CHECK(ring != NULL);
+    if (ring == NULL) {
+        free(core);
+        return;
+    }
+    KbFilter_InitializeEventRing(&writer, ring, KBFILTER_EVENT_RING_RECORDS);
+    KbFilter_AttachEventRing(core, &writer);
+
+    for (n = 0; n < STRESS_THREADS; n++) {
+        memset(&ranges[n], 0, sizeof(ranges[n]));
+        ranges[n].Core = core;
+        ranges[n].Policy = &policy;
+        ranges[n].Thread = n;
+        CHECK(pthread_create(&threads[n], NULL, StressFilterRanges, &ranges[n]) == 0);
+    }
+    for (n = 0; n < STRESS_THREADS; n++) {
+        pthread_join(threads[n], NULL);
+        packets += ranges[n].Packets;
+        acceptedMakes += ranges[n].AcceptedMakes;
+    }
+
+    KbFilter_PublishEvents(core);
+
+    //
+    // One event record per packet and one history entry per accepted make.
+    // The capture ring holds one KEY record per packet, and at most one
+    // SYNC record before each, since ranges that read the clock in one
+    // order may be recorded in the other.
+    //
+    CHECK_EQ(ring->Head, packets);
+    CHECK_EQ(core->SequenceCount, acceptedMakes);
+    CHECK((ULONG) core->CaptureHead >= packets);
+    CHECK((ULONG) core->CaptureHead <= 2 * packets);
+
+    //
+    // Every thread counted in its own shard, so no packet was lost
+    //
+    KbFilter_QueryStatistics(core, &statistics);
+    CHECK_EQ(statistics.PacketsIn, packets);
+
+    cursor = (ULONG) core->CaptureHead - KBFILTER_CAPTURE_RING_SIZE;
+    drained = KbFilter_DrainKeyTrace(core, &cursor, trace, KBFILTER_CAPTURE_RING_SIZE, &lost);
+    CHECK_EQ(drained, KBFILTER_CAPTURE_RING_SIZE);
+    CHECK_EQ(lost, 0);
+    for (n = 0; n < drained; n++) {
+        CHECK(trace[n].Kind == KBFILTR_KEYTRACE_SYNC ||
+              (trace[n].Kind == KBFILTR_KEYTRACE_KEY && trace[n].Decision < KBFILTR_DECISIONS));
+    }
+
+    KbFilter_AttachEventRing(core, NULL);
+    free(ring);
+    free(core);
+}
+
+typedef struct _STRESS_ENTRY {
+    const char *Name;
+    VOID (*Routine)(VOID);
+} STRESS_ENTRY;
+
+static const STRESS_ENTRY Tests[] = {
+    { "lockfree_matches_locked",    TestLockFreeMatchesLocked },
+    { "same_key_contention",        TestSameKeyContention },
+    { "concurrent_ranges",          TestConcurrentRanges },
+};
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++) {
+        if (argc > 1 && strcmp(argv[1], Tests[i].Name) != 0) {
+            continue;
+        }
+
+        found = 1;
+        Tests[i].Routine();
+        printf("%s: %s\n", Tests[i].Name, (Failures == 0) ? "passed" : "FAILED");
+        if (Failures != 0) {
+            return 1;
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "unknown test %s\n", argv[1]);
+        return 2;
+    }
+
+    return 0;
+}
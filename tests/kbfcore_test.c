@@ -0,0 +1,1225 @@
+/*++
+
+Module Name:
+
+    kbfcore_test.c
+
+Abstract:
+
+    Unit tests of the lag mitigation core, built against the user-mode
+    branch of kbfplat.h.  Every test runs on freshly initialized cores with
+    an injected millisecond clock, so results do not depend on the machine.
+    Run one test by passing its name, or all of them without arguments.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kbfcore.h"
+
+//
+// Scan codes (set 1) used by the tests
+//
+#define SC_T        0x14
+#define SC_H        0x23
+#define SC_E        0x12
+#define SC_X        0x2D
+#define SC_SHIFT    0x2A
+
+static int Failures;
+
+#define CHECK(_expr_)                                                       \
+    do {                                                                    \
+        if (!(_expr_)) {                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                    \
+                    __FILE__, __LINE__, #_expr_);                           \
+            Failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+#define CHECK_EQ(_actual_, _expected_)                                      \
+    do {                                                                    \
+        unsigned long long _a_ = (unsigned long long) (_actual_);           \
+        unsigned long long _e_ = (unsigned long long) (_expected_);         \
+        if (_a_ != _e_) {                                                   \
+            fprintf(stderr, "%s:%d: %s is %llu, expected %llu\n",           \
+                    __FILE__, __LINE__, #_actual_, _a_, _e_);               \
+            Failures++;                                                     \
+        }                                                                   \
+    } while (0)
+
+//
+// Injected clock in ms.  Cores are initialized at Now == 0, so the key time
+// of a packet checked at Now is Now + 1.
+//
+typedef struct _TEST_CLOCK {
+    ULONGLONG Now;
+} TEST_CLOCK, *PTEST_CLOCK;
+
+static
+ULONGLONG
+TestReadClock(
+    PVOID Context
+    )
+{
+    return ((PTEST_CLOCK) Context)->Now;
+}
+
+static
+PKBFILTER_CORE
+TestCreateCore(
+    KBFILTER_DEDUP_MODE DedupMode,
+    PTEST_CLOCK Clock
+    )
+{
+    PKBFILTER_CORE core;
+
+    core = malloc(sizeof(KBFILTER_CORE));
+    if (core == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(2);
+    }
+
+    Clock->Now = 0;
+    KbFilter_InitializeCore(core, DedupMode, KbFilterClockInjected, TestReadClock, Clock, 1000);
+    return core;
+}
+
+//
+// Driver defaults from policy.c: 300 ms threshold capped by the typematic
+// delay, everything else off
+//
+static
+VOID
+TestDefaultPolicy(
+    PKBFILTER_POLICY Policy
+    )
+{
+    ULONG slot;
+
+    memset(Policy, 0, sizeof(KBFILTER_POLICY));
+    Policy->Enabled = TRUE;
+    Policy->TypematicThresholds = TRUE;
+    Policy->LagCooldownMs = KBFILTER_LAG_COOLDOWN_MS;
+    Policy->DedupMode = KBFILTER_DEFAULT_DEDUP_MODE;
+    Policy->Clock = KbFilterClockInjected;
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        Policy->Keys[slot].ThresholdMs = LAG_MITIGATION_THRESHOLD_MS;
+    }
+}
+
+static
+KEYBOARD_INPUT_DATA
+Key(
+    USHORT MakeCode,
+    USHORT Flags
+    )
+{
+    KEYBOARD_INPUT_DATA input;
+
+    memset(&input, 0, sizeof(input));
+    input.MakeCode = MakeCode;
+    input.Flags = Flags;
+    return input;
+}
+
+static
+UCHAR
+Check(
+    PKBFILTER_CORE Core,
+    PKBFILTER_POLICY Policy,
+    USHORT MakeCode,
+    USHORT Flags,
+    ULONG KeyTime
+    )
+{
+    KEYBOARD_INPUT_DATA input = Key(MakeCode, Flags);
+
+    return KbFilter_CheckKey(Core, Policy, &input, KeyTime);
+}
+
+static
+BOOLEAN
+IsKeyDown(
+    PKBFILTER_CORE Core,
+    ULONG Slot
+    )
+{
+    return (BOOLEAN) ((Core->KeyDown[Slot / 32] & (1u << (Slot % 32))) != 0);
+}
+
+//
+// Tests
+//
+
+static
+VOID
+TestCheckKeyDuplicate(
+    VOID
+    )
+{
+    static const KBFILTER_DEDUP_MODE modes[] = { KbFilterDedupLocked, KbFilterDedupLockFree };
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    ULONG i;
+
+    TestDefaultPolicy(&policy);
+
+    for (i = 0; i < 2; i++) {
+        core = TestCreateCore(modes[i], &clock);
+
+        //
+        // The default 250 ms typematic delay caps the 300 ms threshold
+        //
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE, 1000), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_BREAK, 1010), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE, 1100), KBFILTR_DECISION_DUPLICATE);
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_BREAK, 1110), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE, 1260), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(core->KeyTable[SC_T].Fields.LastPress, 1260);
+        CHECK_EQ(core->KeyTable[SC_T].Fields.PressCount, 2);
+
+        //
+        // Other keys and the E0 plane have their own slots
+        //
+        CHECK_EQ(Check(core, &policy, SC_H, KEY_MAKE, 1270), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE | KEY_E0, 1270), KBFILTR_DECISION_ACCEPT);
+
+        //
+        // A press shortly before the recorded one is a duplicate as well
+        //
+        CHECK_EQ(Check(core, &policy, SC_H, KEY_BREAK, 1280), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, SC_H, KEY_MAKE, 1265), KBFILTR_DECISION_DUPLICATE);
+
+        //
+        // Make codes outside the table are never filtered
+        //
+        CHECK_EQ(Check(core, &policy, 0x80, KEY_MAKE, 1300), KBFILTR_DECISION_ACCEPT);
+        CHECK_EQ(Check(core, &policy, 0x80, KEY_MAKE, 1301), KBFILTR_DECISION_ACCEPT);
+
+        free(core);
+    }
+}
+
+static
+VOID
+TestCheckKeyRepeat(
+    VOID
+    )
+{
+    KEYBOARD_TYPEMATIC_PARAMETERS typematic;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+
+    TestDefaultPolicy(&policy);
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // Default typematic: 30 cps and 250 ms, so the first repeat is accepted
+    // from 187 ms after the press and later ones from 16 ms apart
+    //
+    CHECK_EQ(core->FirstRepeatWindowMs, 187);
+    CHECK_EQ(core->RepeatWindowMs, 16);
+
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1000), KBFILTR_DECISION_ACCEPT);
+    CHECK(IsKeyDown(core, SC_E));
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1100), KBFILTR_DECISION_REPEAT);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1250), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1260), KBFILTR_DECISION_REPEAT);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1283), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1316), KBFILTR_DECISION_ACCEPT);
+
+    //
+    // The break ends the press; the next make is a press again
+    //
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_BREAK, 1320), KBFILTR_DECISION_ACCEPT);
+    CHECK(!IsKeyDown(core, SC_E));
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1400), KBFILTR_DECISION_DUPLICATE);
+
+    //
+    // A zero delay or rate keeps the previous thresholds, so dedup stays on
+    //
+    typematic.UnitId = 0;
+    typematic.Rate = 30;
+    typematic.Delay = 0;
+    KbFilter_SetTypematic(core, &typematic);
+    typematic.Rate = 0;
+    typematic.Delay = 500;
+    KbFilter_SetTypematic(core, &typematic);
+    CHECK_EQ(core->TypematicThresholdMs, 250);
+    CHECK_EQ(core->FirstRepeatWindowMs, 187);
+    CHECK_EQ(core->RepeatWindowMs, 16);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_BREAK, 1410), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_E, KEY_MAKE, 1500), KBFILTR_DECISION_DUPLICATE);
+
+    free(core);
+}
+
+static
+VOID
+TestCheckKeyExempt(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+
+    TestDefaultPolicy(&policy);
+    policy.Keys[SC_X].Options = KBFILTR_KEY_POLICY_EXEMPT;
+    core = TestCreateCore(KbFilterDedupLocked, &clock);
+
+    CHECK_EQ(Check(core, &policy, SC_X, KEY_MAKE, 1000), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_X, KEY_BREAK, 1001), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_X, KEY_MAKE, 1002), KBFILTR_DECISION_ACCEPT);
+
+    //
+    // With the policy disabled nothing is dropped, but key state is kept
+    //
+    policy.Enabled = FALSE;
+    CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE, 1000), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_T, KEY_BREAK, 1001), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(Check(core, &policy, SC_T, KEY_MAKE, 1002), KBFILTR_DECISION_ACCEPT);
+    CHECK(IsKeyDown(core, SC_T));
+
+    free(core);
+}
+
+static
+VOID
+TestCheckKeyModesAgree(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE locked, lockFree;
+    TEST_CLOCK lockedClock, lockFreeClock;
+    KEYBOARD_INPUT_DATA input;
+    ULONG i, keyTime = 1;
+    UCHAR lockedDecision, lockFreeDecision;
+
+    TestDefaultPolicy(&policy);
+    policy.AdaptiveThresholds = TRUE;
+    locked = TestCreateCore(KbFilterDedupLocked, &lockedClock);
+    lockFree = TestCreateCore(KbFilterDedupLockFree, &lockFreeClock);
+
+    srand(11);
+    for (i = 0; i < 100000; i++) {
+        keyTime += (ULONG) (rand() % 120);
+        input = Key((USHORT) (rand() % 8 + SC_E),
+                    (USHORT) ((rand() % 3 == 0) ? KEY_BREAK : KEY_MAKE));
+
+        lockedDecision = KbFilter_CheckKey(locked, &policy, &input, keyTime);
+        lockFreeDecision = KbFilter_CheckKey(lockFree, &policy, &input, keyTime);
+        if (lockedDecision != lockFreeDecision) {
+            CHECK_EQ(lockFreeDecision, lockedDecision);
+            break;
+        }
+    }
+
+    CHECK(memcmp(locked->KeyTable, lockFree->KeyTable, sizeof(locked->KeyTable)) == 0);
+
+    free(locked);
+    free(lockFree);
+}
+
+//
+// Filters a range through KbFilter_FilterPackets at the given clock time
+// and returns the number of accepted packets
+//
+static
+ULONG
+Filter(
+    PKBFILTER_CORE Core,
+    PKBFILTER_POLICY Policy,
+    PTEST_CLOCK Clock,
+    ULONGLONG Now,
+    PKEYBOARD_INPUT_DATA Input,
+    ULONG Count,
+    PKEYBOARD_INPUT_DATA Output
+    )
+{
+    Clock->Now = Now;
+    return KbFilter_FilterPackets(Core, Policy, Input, Input + Count, Output);
+}
+
+static
+VOID
+TestCheckSequence(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    KEYBOARD_INPUT_DATA word[6], other[6], output[12];
+    ULONG count;
+
+    TestDefaultPolicy(&policy);
+    policy.SequenceWindowMs = 1000;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    word[0] = Key(SC_T, KEY_MAKE);
+    word[1] = Key(SC_T, KEY_BREAK);
+    word[2] = Key(SC_H, KEY_MAKE);
+    word[3] = Key(SC_H, KEY_BREAK);
+    word[4] = Key(SC_E, KEY_MAKE);
+    word[5] = Key(SC_E, KEY_BREAK);
+
+    CHECK_EQ(Filter(core, &policy, &clock, 1000, word, 6, output), 6);
+    CHECK_EQ(core->SequenceCount, 3);
+
+    //
+    // A replay of the whole word outside the per-key threshold is dropped
+    // as a run; its breaks pass
+    //
+    count = Filter(core, &policy, &clock, 1400, word, 6, output);
+    CHECK_EQ(count, 3);
+    CHECK_EQ(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE], 3);
+    CHECK(output[0].Flags & KEY_BREAK);
+    CHECK_EQ(core->SequenceCount, 3);
+
+    //
+    // A run that does not match the history is left to the per-key check
+    //
+    other[0] = Key(SC_T, KEY_MAKE);
+    other[1] = Key(SC_T, KEY_BREAK);
+    other[2] = Key(SC_H, KEY_MAKE);
+    other[3] = Key(SC_H, KEY_BREAK);
+    other[4] = Key(SC_X, KEY_MAKE);
+    other[5] = Key(SC_X, KEY_BREAK);
+
+    count = Filter(core, &policy, &clock, 1800, other, 6, output);
+    CHECK_EQ(count, 6);
+    CHECK_EQ(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE], 3);
+
+    //
+    // Outside the window a replay is not a replay
+    //
+    count = Filter(core, &policy, &clock, 5000, other, 6, output);
+    CHECK_EQ(count, 6);
+    CHECK_EQ(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE], 3);
+
+    free(core);
+
+    //
+    // A run whose hash matches the suffix but whose keys differ, as after
+    // a hash collision, is not a replay
+    //
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    CHECK_EQ(Filter(core, &policy, &clock, 1000, word, 6, output), 6);
+    core->SequenceHistory[1].Slot = KbFilter_KeySlot(&other[4]);
+    CHECK_EQ(Filter(core, &policy, &clock, 1400, word, 6, output), 6);
+    CHECK_EQ(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE], 0);
+    free(core);
+
+    //
+    // Runs longer than SequenceMaxRun are not replays either
+    //
+    policy.SequenceMaxRun = 2;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    CHECK_EQ(Filter(core, &policy, &clock, 1000, word, 6, output), 6);
+    CHECK_EQ(Filter(core, &policy, &clock, 1400, word, 6, output), 6);
+    CHECK_EQ(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE], 0);
+    free(core);
+}
+
+static
+VOID
+TestCheckDomain(
+    VOID
+    )
+{
+    KBFILTER_DEDUP_DOMAIN *domain;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE first, second;
+    TEST_CLOCK firstClock, secondClock;
+    KEYBOARD_INPUT_DATA input, output[2];
+
+    TestDefaultPolicy(&policy);
+    policy.CrossDeviceWindowMs = 40;
+
+    domain = calloc(1, sizeof(KBFILTER_DEDUP_DOMAIN));
+    CHECK(domain != NULL);
+    if (domain == NULL) {
+        return;
+    }
+
+    first = TestCreateCore(KbFilterDedupLockFree, &firstClock);
+    second = TestCreateCore(KbFilterDedupLockFree, &secondClock);
+    KbFilter_JoinDedupDomain(first, domain, 1);
+    KbFilter_JoinDedupDomain(second, domain, 2);
+    CHECK_EQ(domain->Members, 2);
+
+    //
+    // The second keyboard adopts the time source of the first
+    //
+    CHECK(second->TimeSource.Context == &firstClock);
+
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 1000), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(KbFilter_CheckDomain(second, &policy, &input, 1005), KBFILTR_DECISION_CROSS_DEVICE);
+
+    //
+    // The same keyboard is never a cross-device copy of itself, and the
+    // slot follows its later presses
+    //
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 1010), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(KbFilter_CheckDomain(second, &policy, &input, 1049), KBFILTR_DECISION_CROSS_DEVICE);
+    CHECK_EQ(KbFilter_CheckDomain(second, &policy, &input, 1050), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 1060), KBFILTR_DECISION_CROSS_DEVICE);
+
+    //
+    // Other units of the same keyboard count as other devices
+    //
+    input = Key(SC_H, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 2000), KBFILTR_DECISION_ACCEPT);
+    input.UnitId = 1;
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 2001), KBFILTR_DECISION_CROSS_DEVICE);
+
+    //
+    // Exempt keys and a zero window turn the check off
+    //
+    policy.Keys[SC_E].Options = KBFILTR_KEY_POLICY_EXEMPT;
+    input = Key(SC_E, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckDomain(first, &policy, &input, 3000), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(KbFilter_CheckDomain(second, &policy, &input, 3001), KBFILTR_DECISION_ACCEPT);
+
+    policy.CrossDeviceWindowMs = 0;
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckDomain(second, &policy, &input, 1061), KBFILTR_DECISION_ACCEPT);
+
+    //
+    // A copy dropped by the domain leaves the key state of its keyboard
+    // alone: the key is not marked down by the copy of the press, and the
+    // copy of the release does not end the keyboard's own press
+    //
+    policy.CrossDeviceWindowMs = 40;
+    firstClock.Now = 4000;
+    input = Key(SC_X, KEY_MAKE);
+    CHECK_EQ(KbFilter_FilterPackets(first, &policy, &input, &input + 1, output), 1);
+    firstClock.Now = 4005;
+    CHECK_EQ(KbFilter_FilterPackets(second, &policy, &input, &input + 1, output), 0);
+    CHECK(!IsKeyDown(second, SC_X));
+    CHECK_EQ(second->KeyTable[SC_X].Fields.PressCount, 0);
+
+    firstClock.Now = 4100;
+    CHECK_EQ(KbFilter_FilterPackets(second, &policy, &input, &input + 1, output), 1);
+    CHECK(IsKeyDown(second, SC_X));
+    firstClock.Now = 4200;
+    input = Key(SC_X, KEY_BREAK);
+    CHECK_EQ(KbFilter_FilterPackets(first, &policy, &input, &input + 1, output), 1);
+    firstClock.Now = 4210;
+    CHECK_EQ(KbFilter_FilterPackets(second, &policy, &input, &input + 1, output), 0);
+    CHECK(IsKeyDown(second, SC_X));
+
+    KbFilter_LeaveDedupDomain(second);
+    KbFilter_LeaveDedupDomain(first);
+    CHECK_EQ(domain->Members, 0);
+    CHECK(first->DedupDomain == NULL);
+
+    free(first);
+    free(second);
+    free(domain);
+}
+
+static
+VOID
+TestLagWithoutIsr(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    KEYBOARD_INPUT_DATA input[8], output[16];
+    ULONG i;
+
+    TestDefaultPolicy(&policy);
+    policy.LagWatermarkMs = 20;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // Lone packets were not delayed; filtering stops after the cooldown
+    //
+    input[0] = Key(SC_E, KEY_MAKE);
+    input[1] = Key(SC_E, KEY_BREAK);
+    Filter(core, &policy, &clock, 1000, &input[0], 1, output);
+    Filter(core, &policy, &clock, 1050, &input[1], 1, output);
+    Filter(core, &policy, &clock, 3000, &input[0], 1, output);
+    CHECK_EQ(core->LagEstimate, 0);
+    CHECK(!core->DedupActive);
+    CHECK_EQ(core->LagExitCount, 1);
+
+    //
+    // A fast double letter is delivered while the system keeps up
+    //
+    CHECK_EQ(Filter(core, &policy, &clock, 3050, &input[1], 1, output), 1);
+    CHECK_EQ(Filter(core, &policy, &clock, 3100, &input[0], 1, output), 1);
+
+    //
+    // A chord pressed after a minute of idle is one report, not a minute
+    // of queueing
+    //
+    input[0] = Key(SC_SHIFT, KEY_MAKE);
+    input[1] = Key(SC_X, KEY_MAKE);
+    input[2] = Key(SC_H, KEY_MAKE);
+    input[3] = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(Filter(core, &policy, &clock, 63100, input, 4, output), 4);
+    CHECK_EQ(core->LagEstimate, 0);
+    CHECK(!core->DedupActive);
+    CHECK_EQ(core->LagEnterCount, 0);
+
+    //
+    // More packets than a report holds piled up during a 500 ms stall; they
+    // are taken to have waited since the previous callback, filtering
+    // starts with them and drops the makes of the replayed presses
+    //
+    for (i = 0; i < 8; i++) {
+        input[i] = Key(SC_E, (USHORT) ((i & 1) ? KEY_BREAK : KEY_MAKE));
+    }
+    CHECK_EQ(Filter(core, &policy, &clock, 63600, input, 8, output), 5);
+    CHECK_EQ(core->LagEstimate >> 4, 500 >> KBFILTER_LAG_EWMA_SHIFT);
+    CHECK(core->DedupActive);
+    CHECK_EQ(core->LagEnterCount, 1);
+
+    //
+    // A second range of the same callback adds no sample
+    //
+    Filter(core, &policy, &clock, 63600, input, 2, output);
+    CHECK_EQ(core->LagEstimate >> 4, 500 >> KBFILTER_LAG_EWMA_SHIFT);
+
+    //
+    // The idle time before a backlog is not counted as waiting
+    //
+    Filter(core, &policy, &clock, 123600, input, 8, output);
+    CHECK((core->LagEstimate >> 4) <= KBFILTER_LAG_QUEUED_MAX_MS);
+
+    free(core);
+}
+
+static
+VOID
+TestReleaseOrphanedKey(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    KEYBOARD_INPUT_DATA input, breakData;
+
+    TestDefaultPolicy(&policy);
+    policy.StuckKeyMs = 1000;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // The bound never drops below the typematic delay plus four repeats
+    //
+    CHECK_EQ(KbFilter_StuckKeyBound(core, &policy), 1000);
+    policy.StuckKeyMs = 1;
+    CHECK_EQ(KbFilter_StuckKeyBound(core, &policy), 250 + KBFILTER_STUCK_KEY_REPEATS * 2 * 16);
+    policy.StuckKeyMs = 1000;
+
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1000), KBFILTR_DECISION_ACCEPT);
+
+    //
+    // Within the bound the key is held, not orphaned
+    //
+    CHECK(!KbFilter_ReleaseOrphanedKey(core, &policy, &input, 1999, &breakData));
+    CHECK(IsKeyDown(core, SC_T));
+
+    //
+    // Past the bound a break is synthesized and the key is up again
+    //
+    CHECK(KbFilter_ReleaseOrphanedKey(core, &policy, &input, 2000, &breakData));
+    CHECK_EQ(breakData.MakeCode, SC_T);
+    CHECK_EQ(breakData.Flags, KEY_BREAK);
+    CHECK(!IsKeyDown(core, SC_T));
+    CHECK_EQ(core->Stats->SynthesizedBreaks, 1);
+
+    //
+    // Breaks and keys that are up never produce a break
+    //
+    CHECK(!KbFilter_ReleaseOrphanedKey(core, &policy, &input, 5000, &breakData));
+    input = Key(SC_T, KEY_BREAK);
+    CHECK(!KbFilter_ReleaseOrphanedKey(core, &policy, &input, 5000, &breakData));
+
+    //
+    // The break of an E0 key carries the prefix
+    //
+    input = Key(SC_H, KEY_MAKE | KEY_E0);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 6000), KBFILTR_DECISION_ACCEPT);
+    CHECK(KbFilter_ReleaseOrphanedKey(core, &policy, &input, 7000, &breakData));
+    CHECK_EQ(breakData.Flags, KEY_BREAK | KEY_E0);
+
+    free(core);
+}
+
+static
+VOID
+TestHeldModifier(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    KEYBOARD_INPUT_DATA input, output[4];
+    ULONG nextCheckMs;
+
+    TestDefaultPolicy(&policy);
+    policy.StuckKeyMs = 1000;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // Shift is held while a letter is typed; the keyboard only repeats the
+    // letter, so Shift stays silent but is not orphaned
+    //
+    input = Key(SC_SHIFT, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1000), KBFILTR_DECISION_ACCEPT);
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1100), KBFILTR_DECISION_ACCEPT);
+    input = Key(SC_T, KEY_BREAK);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1200), KBFILTR_DECISION_ACCEPT);
+
+    CHECK_EQ(KbFilter_ReleaseStuckKeys(core, &policy, 5000, output, 4, &nextCheckMs), 0);
+    CHECK_EQ(nextCheckMs, 0);
+    CHECK(IsKeyDown(core, SC_SHIFT));
+
+    input = Key(SC_SHIFT, KEY_MAKE);
+    CHECK(!KbFilter_ReleaseOrphanedKey(core, &policy, &input, 5000, output));
+    CHECK(IsKeyDown(core, SC_SHIFT));
+
+    //
+    // The letter pressed last is watched, and released once it has been
+    // silent past the bound
+    //
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 6000), KBFILTR_DECISION_ACCEPT);
+    CHECK_EQ(KbFilter_ReleaseStuckKeys(core, &policy, 6500, output, 4, &nextCheckMs), 0);
+    CHECK_EQ(nextCheckMs, 500);
+    CHECK_EQ(KbFilter_ReleaseStuckKeys(core, &policy, 7000, output, 4, &nextCheckMs), 1);
+    CHECK_EQ(output[0].MakeCode, SC_T);
+    CHECK(!IsKeyDown(core, SC_T));
+    CHECK(IsKeyDown(core, SC_SHIFT));
+    CHECK_EQ(core->Stats->SynthesizedBreaks, 1);
+
+    free(core);
+}
+
+static
+VOID
+TestDroppedMakeKeepsKeyUp(
+    VOID
+    )
+{
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    KEYBOARD_INPUT_DATA input;
+
+    TestDefaultPolicy(&policy);
+    policy.StuckKeyMs = 1000;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // A press, its release, and a lag duplicate of the press: the class
+    // driver saw the key go up, and so does the core
+    //
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1000), KBFILTR_DECISION_ACCEPT);
+    input = Key(SC_T, KEY_BREAK);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1050), KBFILTR_DECISION_ACCEPT);
+    input = Key(SC_T, KEY_MAKE);
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1060), KBFILTR_DECISION_DUPLICATE);
+    CHECK(!IsKeyDown(core, SC_T));
+    CHECK_EQ(core->KeyDownTime[SC_T], 1000);
+
+    //
+    // The next real press is a new press, not a typematic repeat
+    //
+    CHECK_EQ(KbFilter_CheckKey(core, &policy, &input, 1400), KBFILTR_DECISION_ACCEPT);
+    CHECK(IsKeyDown(core, SC_T));
+    CHECK_EQ(core->KeyDownTime[SC_T], 1400);
+
+    free(core);
+}
+
+//
+// Captures packets at the given key times, drains the capture ring and
+// decodes it again
+//
+#define CODEC_PACKETS   200
+
+static
+VOID
+TestKeyTraceCodec(
+    VOID
+    )
+{
+    static KBFILTR_KEYTRACE_RECORD records[2 * CODEC_PACKETS];
+    KEYBOARD_INPUT_DATA input[CODEC_PACKETS], decoded;
+    ULONG keyTimes[CODEC_PACKETS];
+    ULONG i, cursor = 0, lost = 0, count, keyTime = 0, decodedCount = 0, syncs = 0;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    BOOLEAN synchronized = FALSE;
+
+    TestDefaultPolicy(&policy);
+    policy.RecordKeys = TRUE;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // Mostly short deltas, with a few that do not fit in 16 bits
+    //
+    for (i = 0; i < CODEC_PACKETS; i++) {
+        keyTime += (i % 50 == 49) ? 70000 : (i % 7) * 13;
+        keyTimes[i] = keyTime + 1;
+        input[i] = Key((USHORT) (SC_E + i % 5), (USHORT) ((i & 1) ? KEY_BREAK : KEY_MAKE));
+        input[i].UnitId = (USHORT) (i % 3);
+        if (i % 11 == 0) {
+            input[i].Flags |= KEY_E0;
+        }
+
+        KbFilter_CaptureKey(core, &input[i], (UCHAR) (i % KBFILTR_DECISIONS), keyTimes[i]);
+    }
+
+    count = KbFilter_DrainKeyTrace(core, &cursor, records, 2 * CODEC_PACKETS, &lost);
+    CHECK_EQ(lost, 0);
+    CHECK(count > CODEC_PACKETS);
+    CHECK_EQ(cursor, (ULONG) core->CaptureHead);
+
+    //
+    // A second drain returns nothing new
+    //
+    CHECK_EQ(KbFilter_DrainKeyTrace(core, &cursor, records + count, 1, &lost), 0);
+
+    CHECK_EQ(records[0].Kind, KBFILTR_KEYTRACE_SYNC);
+
+    keyTime = 0;
+    for (i = 0; i < count; i++) {
+        if (records[i].Kind == KBFILTR_KEYTRACE_SYNC) {
+            syncs++;
+        }
+
+        if (!KbFilter_DecodeKeyRecord(&records[i], &keyTime, &synchronized, &decoded)) {
+            continue;
+        }
+
+        if (decodedCount < CODEC_PACKETS) {
+            CHECK_EQ(keyTime, keyTimes[decodedCount]);
+            CHECK_EQ(decoded.MakeCode, input[decodedCount].MakeCode);
+            CHECK_EQ(decoded.Flags, input[decodedCount].Flags);
+            CHECK_EQ(decoded.UnitId, input[decodedCount].UnitId);
+            CHECK_EQ(records[i].Decision, decodedCount % KBFILTR_DECISIONS);
+        }
+        decodedCount++;
+    }
+
+    CHECK_EQ(decodedCount, CODEC_PACKETS);
+
+    //
+    // One SYNC per interval plus one per long delta
+    //
+    CHECK(syncs >= CODEC_PACKETS / KBFILTR_KEYTRACE_SYNC_INTERVAL + CODEC_PACKETS / 50);
+
+    //
+    // Key records before the first SYNC are skipped
+    //
+    keyTime = 0;
+    synchronized = FALSE;
+    CHECK(!KbFilter_DecodeKeyRecord(&records[1], &keyTime, &synchronized, &decoded));
+
+    free(core);
+}
+
+static
+VOID
+TestKeyTraceReplay(
+    VOID
+    )
+{
+    static KBFILTR_KEYTRACE_RECORD records[4096];
+    KEYBOARD_INPUT_DATA input, output[2];
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    ULONG i, cursor = 0, lost = 0, count;
+    ULONGLONG now = 1000;
+
+    TestDefaultPolicy(&policy);
+    policy.RecordKeys = TRUE;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    srand(13);
+    for (i = 0; i < 500; i++) {
+        now += (ULONGLONG) (rand() % 200);
+        input = Key((USHORT) (SC_E + rand() % 4), (USHORT) ((rand() % 2) ? KEY_BREAK : KEY_MAKE));
+        Filter(core, &policy, &clock, now, &input, 1, output);
+    }
+
+    count = KbFilter_DrainKeyTrace(core, &cursor, records, 4096, &lost);
+    CHECK_EQ(lost, 0);
+    CHECK(core->Stats->Decisions[KBFILTR_DECISION_DUPLICATE] != 0);
+    free(core);
+
+    //
+    // The recording policy reproduces every decision; a lower threshold
+    // does not
+    //
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    CHECK_EQ(KbFilter_ReplayKeyTrace(core, &policy, records, count, NULL, NULL), 0);
+    free(core);
+
+    for (i = 0; i < KBFILTER_KEY_SLOTS; i++) {
+        policy.Keys[i].ThresholdMs = 10;
+    }
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    CHECK(KbFilter_ReplayKeyTrace(core, &policy, records, count, NULL, NULL) != 0);
+    free(core);
+}
+
+static
+VOID
+TestCountReplayed(
+    PVOID Context,
+    ULONG Index,
+    PKEYBOARD_INPUT_DATA InputData,
+    ULONG KeyTime,
+    UCHAR Recorded,
+    UCHAR Replayed
+    )
+{
+    PULONG decisions = Context;
+
+    (void) Index;
+    (void) InputData;
+    (void) KeyTime;
+    (void) Recorded;
+
+    decisions[Replayed]++;
+}
+
+static
+VOID
+TestKeyTraceReplayRanges(
+    VOID
+    )
+{
+    static KBFILTR_KEYTRACE_RECORD records[4096];
+    static const USHORT word[] = { SC_T, SC_H, SC_E };
+    KEYBOARD_INPUT_DATA input[16], output[32];
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    ULONG i, j, count, traced = 0, cursor = 0, lost = 0, replayed[KBFILTR_DECISIONS];
+    ULONGLONG now = 1000, recorded[KBFILTR_DECISIONS], synthesized;
+
+    TestDefaultPolicy(&policy);
+    policy.RecordKeys = TRUE;
+    policy.SequenceWindowMs = 200;
+    policy.StuckKeyMs = 1000;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    //
+    // Ranges of a word replayed within the range, each followed by a press
+    // of X whose break is lost; the next range starts with X again, past
+    // the stuck key bound
+    //
+    for (i = 0; i < 40; i++) {
+        count = 0;
+        if (i != 0) {
+            input[count++] = Key(SC_X, KEY_MAKE);
+            input[count++] = Key(SC_X, KEY_BREAK);
+        }
+        for (j = 0; j < 6; j++) {
+            input[count++] = Key(word[j % 3], KEY_MAKE);
+            input[count++] = Key(word[j % 3], KEY_BREAK);
+        }
+        input[count++] = Key(SC_X, KEY_MAKE);
+
+        now += 1500;
+        Filter(core, &policy, &clock, now, input, count, output);
+
+        traced += KbFilter_DrainKeyTrace(core, &cursor, &records[traced], 4096 - traced, &lost);
+    }
+
+    CHECK(core->Stats->Decisions[KBFILTR_DECISION_SEQUENCE] != 0);
+    CHECK(core->Stats->SynthesizedBreaks != 0);
+    memcpy(recorded, core->Stats->Decisions, sizeof(recorded));
+    synthesized = core->Stats->SynthesizedBreaks;
+
+    CHECK_EQ(lost, 0);
+    free(core);
+
+    //
+    // Packets with one key time are replayed as one range, so the sequence
+    // check and stuck key recovery decide as they did when recording.  The
+    // synthesized breaks are in the trace and replay as accepted breaks.
+    //
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    CHECK_EQ(KbFilter_ReplayKeyTrace(core, &policy, records, traced, NULL, NULL), 0);
+    CHECK_EQ(core->Stats->SynthesizedBreaks, 0);
+    free(core);
+
+    memset(replayed, 0, sizeof(replayed));
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    KbFilter_ReplayPackets(core, &policy, records, traced, TestCountReplayed, replayed);
+    CHECK_EQ(replayed[KBFILTR_DECISION_SEQUENCE], recorded[KBFILTR_DECISION_SEQUENCE]);
+    CHECK_EQ(replayed[KBFILTR_DECISION_ACCEPT], recorded[KBFILTR_DECISION_ACCEPT] + synthesized);
+    free(core);
+}
+
+//
+// Class service stub that takes at most Limit packets per call, like a
+// class driver whose input queue is nearly full
+//
+typedef struct _TEST_CLASS {
+    KEYBOARD_INPUT_DATA Received[1024];
+    ULONG Count;
+    ULONG Limit;
+} TEST_CLASS, *PTEST_CLASS;
+
+static
+VOID
+TestEvaluateKeyTrace(
+    VOID
+    )
+{
+    static KBFILTR_KEYTRACE_RECORD records[64];
+    static const struct {
+        ULONGLONG Now;
+        USHORT Flags;
+    } presses[] = {
+        { 1000, KEY_MAKE }, { 1050, KEY_BREAK },
+        { 1080, KEY_MAKE }, { 1083, KEY_BREAK },        // lag copy
+        { 3000, KEY_MAKE }, { 3050, KEY_BREAK },
+        { 3150, KEY_MAKE }, { 3200, KEY_BREAK },        // fast double letter
+        { 4000, KEY_MAKE }, { 4050, KEY_BREAK },
+    };
+    KEYBOARD_INPUT_DATA input, output[2];
+    KBFILTER_EVALUATION evaluation;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core;
+    TEST_CLOCK clock;
+    ULONG i, count, makes = 0, cursor = 0, lost = 0;
+
+    TestDefaultPolicy(&policy);
+    policy.RecordKeys = TRUE;
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+
+    for (i = 0; i < sizeof(presses) / sizeof(presses[0]); i++) {
+        input = Key(SC_E, presses[i].Flags);
+        Filter(core, &policy, &clock, presses[i].Now, &input, 1, output);
+    }
+
+    count = KbFilter_DrainKeyTrace(core, &cursor, records, 64, &lost);
+    CHECK_EQ(lost, 0);
+    free(core);
+
+    //
+    // Label the second press as the lag copy
+    //
+    for (i = 0; i < count; i++) {
+        if ((records[i].Kind & KBFILTR_KEYTRACE_KIND_MASK) == KBFILTR_KEYTRACE_KEY &&
+            !(records[i].Flags & KEY_BREAK) &&
+            ++makes == 2) {
+            records[i].Kind |= KBFILTR_KEYTRACE_DUPLICATE;
+        }
+    }
+
+    //
+    // The copy and the double letter are dropped; the double letter waits
+    // for the next press of E
+    //
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    KbFilter_EvaluateKeyTrace(core, &policy, records, count, &evaluation);
+    CHECK_EQ(evaluation.Presses, 5);
+    CHECK_EQ(evaluation.TruePositives, 1);
+    CHECK_EQ(evaluation.FalsePositives, 1);
+    CHECK_EQ(evaluation.FalseNegatives, 0);
+    CHECK_EQ(evaluation.PrecisionPermille, 500);
+    CHECK_EQ(evaluation.RecallPermille, 1000);
+    CHECK_EQ(evaluation.AddedLatencyMs, 850);
+    CHECK_EQ(evaluation.MaxAddedLatencyMs, 850);
+    CHECK_EQ(evaluation.UnresolvedDrops, 0);
+    free(core);
+
+    for (i = 0; i < KBFILTER_KEY_SLOTS; i++) {
+        policy.Keys[i].ThresholdMs = 10;
+    }
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    KbFilter_EvaluateKeyTrace(core, &policy, records, count, &evaluation);
+    CHECK_EQ(evaluation.TruePositives, 0);
+    CHECK_EQ(evaluation.FalsePositives, 0);
+    CHECK_EQ(evaluation.FalseNegatives, 1);
+    CHECK_EQ(evaluation.PrecisionPermille, 1000);
+    CHECK_EQ(evaluation.RecallPermille, 0);
+    CHECK_EQ(evaluation.AddedLatencyMs, 0);
+    free(core);
+}
+
+static
+VOID
+TestClassService(
+    PVOID Context,
+    PKEYBOARD_INPUT_DATA InputDataStart,
+    PKEYBOARD_INPUT_DATA InputDataEnd,
+    PULONG InputDataConsumed
+    )
+{
+    PTEST_CLASS testClass = Context;
+    ULONG count = (ULONG) (InputDataEnd - InputDataStart);
+
+    count = MIN(count, testClass->Limit);
+    count = MIN(count, 1024 - testClass->Count);
+    memcpy(&testClass->Received[testClass->Count], InputDataStart, count * sizeof(KEYBOARD_INPUT_DATA));
+    testClass->Count += count;
+    *InputDataConsumed = count;
+}
+
+static
+VOID
+TestCarryDelivery(
+    VOID
+    )
+{
+    static TEST_CLASS testClass;
+    KEYBOARD_INPUT_DATA input[600], expected[600], storage[64];
+    KBFILTER_CARRY carry;
+    KBFILTER_POLICY policy;
+    PKBFILTER_CORE core, reference;
+    TEST_CLOCK clock, referenceClock;
+    ULONG i, taken, expectedCount, batchStart, retries = 0;
+    BOOLEAN retry;
+
+    TestDefaultPolicy(&policy);
+    core = TestCreateCore(KbFilterDedupLockFree, &clock);
+    reference = TestCreateCore(KbFilterDedupLockFree, &referenceClock);
+
+    srand(17);
+    for (i = 0; i < 600; i++) {
+        //
+        // Mostly breaks, which are always accepted, so the queue fills up
+        //
+        input[i] = Key((USHORT) (SC_E + rand() % 8), (USHORT) ((rand() % 4 != 0) ? KEY_BREAK : KEY_MAKE));
+    }
+
+    //
+    // The reference filters the same batches without a carry queue
+    //
+    expectedCount = 0;
+    for (batchStart = 0; batchStart < 600; batchStart += 50) {
+        referenceClock.Now = batchStart;
+        expectedCount += KbFilter_FilterPackets(reference,
+                                                &policy,
+                                                &input[batchStart],
+                                                &input[batchStart + 50],
+                                                &expected[expectedCount]);
+    }
+
+    //
+    // A queue smaller than a batch and a class service that takes 10
+    // packets per retry and at times none at all: batches are taken in
+    // part, and the rest is reported again, as the port driver does
+    //
+    KbFilter_InitializeCarry(&carry, storage, 64);
+    KbFilter_ConnectCarry(&carry, TestClassService, &testClass);
+
+    batchStart = 0;
+    while (batchStart < 600) {
+        clock.Now = batchStart - batchStart % 50;
+        testClass.Limit = (batchStart % 3 == 0) ? 0 : 10;
+        taken = KbFilter_FilterBatch(core,
+                                     &policy,
+                                     &carry,
+                                     &input[batchStart],
+                                     &input[batchStart + 50 - batchStart % 50],
+                                     &retry);
+        batchStart += taken;
+
+        if (retry || taken == 0) {
+            retries++;
+            testClass.Limit = 10;
+            KbFilter_DeliverCarry(&carry, NULL, 0, 0);
+        }
+    }
+
+    testClass.Limit = 1024;
+    CHECK(!KbFilter_DeliverCarry(&carry, NULL, 0, 0));
+
+    CHECK(retries != 0);
+    CHECK(core->Stats->BackpressurePackets != 0);
+    CHECK_EQ(carry.Count, 0);
+    CHECK_EQ(carry.Reserved, 0);
+    CHECK_EQ(testClass.Count, expectedCount);
+    CHECK(memcmp(testClass.Received, expected, expectedCount * sizeof(KEYBOARD_INPUT_DATA)) == 0);
+
+    free(core);
+    free(reference);
+}
+
+typedef struct _TEST_ENTRY {
+    const char *Name;
+    VOID (*Routine)(VOID);
+} TEST_ENTRY;
+
+static const TEST_ENTRY Tests[] = {
+    { "check_key_duplicate",    TestCheckKeyDuplicate },
+    { "check_key_repeat",       TestCheckKeyRepeat },
+    { "check_key_exempt",       TestCheckKeyExempt },
+    { "check_key_modes_agree",  TestCheckKeyModesAgree },
+    { "check_sequence",         TestCheckSequence },
+    { "check_domain",           TestCheckDomain },
+    { "lag_without_isr",        TestLagWithoutIsr },
+    { "release_orphaned_key",   TestReleaseOrphanedKey },
+    { "held_modifier",          TestHeldModifier },
+    { "dropped_make_keeps_key_up", TestDroppedMakeKeepsKeyUp },
+    { "keytrace_codec",         TestKeyTraceCodec },
+    { "keytrace_replay",        TestKeyTraceReplay },
+    { "keytrace_replay_ranges", TestKeyTraceReplayRanges },
+    { "evaluate_keytrace",      TestEvaluateKeyTrace },
+    { "carry_delivery",         TestCarryDelivery },
+};
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(Tests) / sizeof(Tests[0]); i++) {
+        if (argc > 1 && strcmp(argv[1], Tests[i].Name) != 0) {
+            continue;
+        }
+
+        found = 1;
+        Tests[i].Routine();
+        printf("%s: %s\n", Tests[i].Name, (Failures == 0) ? "passed" : "FAILED");
+        if (Failures != 0) {
+            return 1;
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "unknown test %s\n", argv[1]);
+        return 2;
+    }
+
+    return 0;
+}
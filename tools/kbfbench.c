@@ -0,0 +1,551 @@
+/*++
+
+Module Name:
+
+    kbfbench.c
+
+Abstract:
+
+    Benchmark of the service callback path of the lag mitigation core,
+    built against the user-mode branch of kbfplat.h.  Synthetic batches of
+    KEYBOARD_INPUT_DATA are filtered and handed to a stub class service,
+    and the cost of every batch is measured with the monotonic clock.
+
+    Every combination of scenario, delivery variant and dedup mode is
+    reported as one JSON object per line, with the mean cost per packet and
+    batch and the p50, p99 and p99.9 cost per batch, so two runs can be
+    compared with diff or loaded into a spreadsheet:
+
+        kbfbench [--batches N] [--scenario NAME] [--variant NAME]
+
+    Allocations are counted by wrapping malloc at link time, see
+    tools/CMakeLists.txt; without the wrapper they are reported as null.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbfcore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_DEFAULT_BATCHES   20000
+#define BENCH_MAX_BATCH         256
+#define BENCH_SEQUENCE_WINDOW   100
+
+//
+// Allocation counter, fed by the malloc wrapper
+//
+static ULONGLONG BenchAllocations;
+
+#ifdef KBFBENCH_COUNT_ALLOCATIONS
+
+void *__real_malloc(size_t Size);
+
+void *
+__wrap_malloc(
+    size_t Size
+    )
+{
+    BenchAllocations++;
+    return __real_malloc(Size);
+}
+
+#endif
+
+//
+// Letters of the main block, scan code set 1
+//
+static const USHORT BenchKeys[] = {
+    0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26, 0x32,
+    0x31, 0x18, 0x19, 0x10, 0x13, 0x1F, 0x14, 0x16, 0x2F, 0x11, 0x2D, 0x15, 0x2C
+};
+
+#define BENCH_KEYS  (sizeof(BenchKeys) / sizeof(BenchKeys[0]))
+
+typedef struct _BENCH_CONTEXT {
+    PKBFILTER_CORE Core;
+    KBFILTER_POLICY Policy;
+    KBFILTER_CARRY Carry;
+    KEYBOARD_INPUT_DATA CarryPackets[KBFILTER_CARRY_PACKETS];
+    ULONGLONG Now;
+    ULONGLONG Delivered;
+    ULONG Checksum;
+} BENCH_CONTEXT, *PBENCH_CONTEXT;
+
+//
+// Stub class service.  Consumes everything, as a class driver with room in
+// its input queue does, and touches every packet so the work is not
+// optimized away.
+//
+static
+VOID
+BenchClassService(
+    PVOID Context,
+    PKEYBOARD_INPUT_DATA InputDataStart,
+    PKEYBOARD_INPUT_DATA InputDataEnd,
+    PULONG InputDataConsumed
+    )
+{
+    PBENCH_CONTEXT bench = Context;
+    PKEYBOARD_INPUT_DATA input;
+
+    for (input = InputDataStart; input < InputDataEnd; input++) {
+        bench->Checksum += input->MakeCode ^ input->Flags;
+    }
+
+    bench->Delivered += (ULONG) (InputDataEnd - InputDataStart);
+    *InputDataConsumed = (ULONG) (InputDataEnd - InputDataStart);
+}
+
+static
+ULONGLONG
+BenchReadClock(
+    PVOID Context
+    )
+{
+    return ((PBENCH_CONTEXT) Context)->Now;
+}
+
+static
+KEYBOARD_INPUT_DATA
+BenchKey(
+    USHORT MakeCode,
+    USHORT Flags
+    )
+{
+    KEYBOARD_INPUT_DATA input;
+
+    memset(&input, 0, sizeof(input));
+    input.MakeCode = MakeCode;
+    input.Flags = Flags;
+    return input;
+}
+
+//
+// Scenarios.  A generator fills the packets of one batch and advances the
+// injected clock to the time the batch is reported at.
+//
+typedef ULONG (*PBENCH_GENERATE)(ULONG Batch, PKEYBOARD_INPUT_DATA Packets, PULONGLONG Now);
+
+static
+ULONG
+BenchSingleKeys(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    //
+    // One make or break per batch, 60 ms apart
+    //
+    *Now += 60;
+    Packets[0] = BenchKey(BenchKeys[(Batch / 2) % BENCH_KEYS], (Batch & 1) ? KEY_BREAK : KEY_MAKE);
+    return 1;
+}
+
+static
+ULONG
+BenchSixKeys(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    ULONG i, first = (Batch * 6) % BENCH_KEYS;
+
+    //
+    // Six keys pressed together and released together, the most a USB boot
+    // protocol keyboard reports at once
+    //
+    *Now += 60;
+    for (i = 0; i < 6; i++) {
+        Packets[i] = BenchKey(BenchKeys[(first + i) % BENCH_KEYS], KEY_MAKE);
+        Packets[6 + i] = BenchKey(BenchKeys[(first + i) % BENCH_KEYS], KEY_BREAK);
+    }
+    return 12;
+}
+
+static
+ULONG
+BenchRollover(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    ULONG i;
+
+    //
+    // Every letter pressed in one batch and released in the next, as an
+    // N-key rollover keyboard reports a hand on the keys
+    //
+    *Now += 100;
+    for (i = 0; i < BENCH_KEYS; i++) {
+        Packets[i] = BenchKey(BenchKeys[i], (Batch & 1) ? KEY_BREAK : KEY_MAKE);
+    }
+    return BENCH_KEYS;
+}
+
+static
+ULONG
+BenchBacklog(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    ULONG i, seed = Batch * 2654435761u;
+
+    //
+    // 256 packets reported at once after a stall, typing interleaved with
+    // the duplicates the stall produced
+    //
+    *Now += 2000;
+    for (i = 0; i < BENCH_MAX_BATCH; i++) {
+        seed = seed * 1103515245 + 12345;
+        Packets[i] = BenchKey(BenchKeys[(seed >> 16) % 12], ((seed >> 8) & 1) ? KEY_BREAK : KEY_MAKE);
+    }
+    return BENCH_MAX_BATCH;
+}
+
+static
+ULONG
+BenchDuplicates(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    ULONG i;
+
+    //
+    // One press reported 256 times at the same key time; all but the first
+    // are dropped
+    //
+    *Now += 1000;
+    for (i = 0; i < BENCH_MAX_BATCH; i++) {
+        Packets[i] = BenchKey(BenchKeys[Batch % BENCH_KEYS], KEY_MAKE);
+    }
+    return BENCH_MAX_BATCH;
+}
+
+static
+ULONG
+BenchReplay(
+    ULONG Batch,
+    PKEYBOARD_INPUT_DATA Packets,
+    PULONGLONG Now
+    )
+{
+    ULONG i, count = 0;
+
+    //
+    // A six letter word typed once and replayed until the batch is full
+    //
+    *Now += 2000;
+    while (count + 12 <= BENCH_MAX_BATCH) {
+        for (i = 0; i < 6; i++) {
+            Packets[count++] = BenchKey(BenchKeys[(Batch + i) % BENCH_KEYS], KEY_MAKE);
+            Packets[count++] = BenchKey(BenchKeys[(Batch + i) % BENCH_KEYS], KEY_BREAK);
+        }
+    }
+    return count;
+}
+
+//
+// The -seq scenarios turn sequence dedup on, to compare its cost with the
+// per-key check alone on the same input: typing, a backlog whose repeated
+// keys start candidate runs, and replayed runs
+//
+typedef struct _BENCH_SCENARIO {
+    const char *Name;
+    PBENCH_GENERATE Generate;
+    ULONG SequenceWindowMs;
+} BENCH_SCENARIO;
+
+static const BENCH_SCENARIO Scenarios[] = {
+    { "single",     BenchSingleKeys,    0 },
+    { "6key",       BenchSixKeys,       0 },
+    { "6key-seq",   BenchSixKeys,       BENCH_SEQUENCE_WINDOW },
+    { "nkro",       BenchRollover,      0 },
+    { "backlog",    BenchBacklog,       0 },
+    { "backlog-seq", BenchBacklog,      BENCH_SEQUENCE_WINDOW },
+    { "duplicates", BenchDuplicates,    0 },
+    { "replay",     BenchReplay,        0 },
+    { "replay-seq", BenchReplay,        BENCH_SEQUENCE_WINDOW },
+};
+
+//
+// Delivery variants.  A variant filters one batch and hands the accepted
+// packets to the stub class service.
+//
+typedef VOID (*PBENCH_DELIVER)(PBENCH_CONTEXT Bench, PKEYBOARD_INPUT_DATA Start, PKEYBOARD_INPUT_DATA End);
+
+static
+VOID
+BenchDeliverPool(
+    PBENCH_CONTEXT Bench,
+    PKEYBOARD_INPUT_DATA Start,
+    PKEYBOARD_INPUT_DATA End
+    )
+{
+    PKEYBOARD_INPUT_DATA output;
+    ULONG count, consumed = 0;
+
+    //
+    // The service callback before the carry queue: an output buffer for the
+    // whole batch is allocated and freed every time
+    //
+    output = malloc((size_t) (End - Start) *
+                    KBFILTER_MAX_OUTPUT_PER_INPUT(&Bench->Policy) *
+                    sizeof(KEYBOARD_INPUT_DATA));
+    if (output == NULL) {
+        return;
+    }
+
+    count = KbFilter_FilterPackets(Bench->Core, &Bench->Policy, Start, End, output);
+    BenchClassService(Bench, output, output + count, &consumed);
+    free(output);
+}
+
+static
+VOID
+BenchDeliverPerPacket(
+    PBENCH_CONTEXT Bench,
+    PKEYBOARD_INPUT_DATA Start,
+    PKEYBOARD_INPUT_DATA End
+    )
+{
+    KEYBOARD_INPUT_DATA output[2];
+    PKEYBOARD_INPUT_DATA input;
+    ULONG count, consumed;
+
+    //
+    // The service callback before batched checks: every packet is checked
+    // on its own, with its own clock read and lock hold, and delivered.
+    // Sequence dedup only sees one packet at a time this way.
+    //
+    for (input = Start; input < End; input++) {
+        count = KbFilter_FilterPackets(Bench->Core, &Bench->Policy, input, input + 1, output);
+        BenchClassService(Bench, output, output + count, &consumed);
+    }
+}
+
+static
+VOID
+BenchDeliverCarry(
+    PBENCH_CONTEXT Bench,
+    PKEYBOARD_INPUT_DATA Start,
+    PKEYBOARD_INPUT_DATA End
+    )
+{
+    BOOLEAN retry;
+
+    KbFilter_FilterBatch(Bench->Core, &Bench->Policy, &Bench->Carry, Start, End, &retry);
+}
+
+typedef struct _BENCH_VARIANT {
+    const char *Name;
+    PBENCH_DELIVER Deliver;
+} BENCH_VARIANT;
+
+static const BENCH_VARIANT Variants[] = {
+    { "packet",     BenchDeliverPerPacket },
+    { "pool",       BenchDeliverPool },
+    { "carry",      BenchDeliverCarry },
+};
+
+static
+VOID
+BenchDefaultPolicy(
+    PKBFILTER_POLICY Policy
+    )
+{
+    ULONG slot;
+
+    memset(Policy, 0, sizeof(KBFILTER_POLICY));
+    Policy->Enabled = TRUE;
+    Policy->TypematicThresholds = TRUE;
+    Policy->LagCooldownMs = KBFILTER_LAG_COOLDOWN_MS;
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        Policy->Keys[slot].ThresholdMs = LAG_MITIGATION_THRESHOLD_MS;
+    }
+}
+
+static
+int
+BenchCompareCost(
+    const void *Left,
+    const void *Right
+    )
+{
+    ULONGLONG left = *(const ULONGLONG *) Left, right = *(const ULONGLONG *) Right;
+
+    return (left > right) - (left < right);
+}
+
+//
+// Cost below which the given share of the sorted batch costs falls, with
+// the share in parts per 10000
+//
+static
+ULONGLONG
+BenchPercentile(
+    const ULONGLONG *Costs,
+    ULONG Count,
+    ULONG Share
+    )
+{
+    ULONGLONG rank = ((ULONGLONG) Count * Share + 9999) / 10000;
+
+    return Costs[(rank == 0) ? 0 : rank - 1];
+}
+
+static
+int
+BenchRun(
+    const BENCH_SCENARIO *Scenario,
+    const BENCH_VARIANT *Variant,
+    KBFILTER_DEDUP_MODE DedupMode,
+    ULONG Batches
+    )
+{
+    static KEYBOARD_INPUT_DATA packets[BENCH_MAX_BATCH];
+    PBENCH_CONTEXT bench;
+    PULONGLONG costs;
+    ULONGLONG start, elapsed = 0, packetCount = 0, allocations;
+    ULONG batch, count, warmup = Batches / 10;
+
+    bench = calloc(1, sizeof(BENCH_CONTEXT));
+    costs = malloc(Batches * sizeof(ULONGLONG));
+    if (bench != NULL) {
+        bench->Core = malloc(sizeof(KBFILTER_CORE));
+    }
+    if (bench == NULL || costs == NULL || bench->Core == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    BenchDefaultPolicy(&bench->Policy);
+    bench->Policy.SequenceWindowMs = Scenario->SequenceWindowMs;
+    KbFilter_InitializeCore(bench->Core, DedupMode, KbFilterClockInjected, BenchReadClock, bench, 1000);
+    KbFilter_InitializeCarry(&bench->Carry, bench->CarryPackets, KBFILTER_CARRY_PACKETS);
+    KbFilter_ConnectCarry(&bench->Carry, BenchClassService, bench);
+
+    //
+    // The first tenth of the batches warms up caches and the branch
+    // predictor and is not measured
+    //
+    allocations = BenchAllocations;
+    for (batch = 0; batch < warmup + Batches; batch++) {
+        count = Scenario->Generate(batch, packets, &bench->Now);
+
+        if (batch == warmup) {
+            allocations = BenchAllocations;
+            bench->Delivered = 0;
+        }
+
+        start = KbfPlatPerformanceCounter(NULL);
+        Variant->Deliver(bench, packets, packets + count);
+
+        if (batch >= warmup) {
+            costs[batch - warmup] = KbfPlatPerformanceCounter(NULL) - start;
+            elapsed += costs[batch - warmup];
+            packetCount += count;
+        }
+    }
+    allocations = BenchAllocations - allocations;
+
+    qsort(costs, Batches, sizeof(ULONGLONG), BenchCompareCost);
+
+    printf("{\"scenario\":\"%s\",\"variant\":\"%s\",\"dedup\":\"%s\","
+           "\"batches\":%u,\"packets\":%llu,\"delivered\":%llu,"
+           "\"ns_per_packet\":%.2f,\"ns_per_batch\":%.2f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu,",
+           Scenario->Name,
+           Variant->Name,
+           (DedupMode == KbFilterDedupLocked) ? "locked" : "lockfree",
+           Batches,
+           (unsigned long long) packetCount,
+           (unsigned long long) bench->Delivered,
+           (double) elapsed / (double) packetCount,
+           (double) elapsed / (double) Batches,
+           (unsigned long long) BenchPercentile(costs, Batches, 5000),
+           (unsigned long long) BenchPercentile(costs, Batches, 9900),
+           (unsigned long long) BenchPercentile(costs, Batches, 9990),
+           (unsigned long long) costs[Batches - 1]);
+
+#ifdef KBFBENCH_COUNT_ALLOCATIONS
+    printf("\"allocs_per_batch\":%.2f}\n", (double) allocations / (double) Batches);
+#else
+    (void) allocations;
+    printf("\"allocs_per_batch\":null}\n");
+#endif
+
+    free(bench->Core);
+    free(bench);
+    free(costs);
+    return 0;
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    const char *scenarioName = NULL, *variantName = NULL;
+    ULONG batches = BENCH_DEFAULT_BATCHES;
+    size_t s, v;
+    int i, mode, status, found = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batches") == 0 && i + 1 < argc) {
+            batches = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            scenarioName = argv[++i];
+        } else if (strcmp(argv[i], "--variant") == 0 && i + 1 < argc) {
+            variantName = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--batches N] [--scenario NAME] [--variant NAME]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (batches == 0) {
+        batches = 1;
+    }
+
+    for (s = 0; s < sizeof(Scenarios) / sizeof(Scenarios[0]); s++) {
+        if (scenarioName != NULL && strcmp(scenarioName, Scenarios[s].Name) != 0) {
+            continue;
+        }
+
+        for (v = 0; v < sizeof(Variants) / sizeof(Variants[0]); v++) {
+            if (variantName != NULL && strcmp(variantName, Variants[v].Name) != 0) {
+                continue;
+            }
+
+            for (mode = KbFilterDedupLocked; mode <= KbFilterDedupLockFree; mode++) {
+                found = 1;
+                status = BenchRun(&Scenarios[s], &Variants[v], (KBFILTER_DEDUP_MODE) mode, batches);
+                if (status != 0) {
+                    return status;
+                }
+            }
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "no scenario or variant matches\n");
+        return 2;
+    }
+
+    return 0;
+}
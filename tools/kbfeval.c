@@ -0,0 +1,102 @@
+/*++
+
+Module Name:
+
+    kbfeval.c
+
+Abstract:
+
+    Scores a policy given on the command line, see kbftool.h, against
+    keystroke traces whose lag duplicates are labelled with
+    KBFILTR_KEYTRACE_DUPLICATE, using KbFilter_EvaluateKeyTrace:
+
+        kbfeval [policy options] TRACE...
+
+    One JSON object is printed per trace.  With several traces a last
+    object sums them up, as if they had been typed one after the other.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    KBFTOOL_OPTIONS options;
+    KBFILTER_EVALUATION evaluation, total;
+    PKBFILTER_CORE core;
+    PKBFILTR_KEYTRACE_RECORD records;
+    char **paths;
+    ULONG count, traces = 0, trace;
+    int i, parsed;
+
+    KbfToolInitializeOptions(&options);
+    memset(&total, 0, sizeof(total));
+
+    paths = malloc(argc * sizeof(char *));
+    if (paths == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    for (i = 1; i < argc; i++) {
+        parsed = KbfToolParseOption(&options, argc, argv, &i);
+        if (parsed < 0) {
+            return 2;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+
+        if (argv[i][0] == '-') {
+            traces = 0;
+            break;
+        }
+        paths[traces++] = argv[i];
+    }
+
+    if (traces == 0) {
+        fprintf(stderr, "usage: %s [options] TRACE...\n%s", argv[0], KbfToolOptionUsage);
+        return 2;
+    }
+
+    for (trace = 0; trace < traces; trace++) {
+        if (KbfToolLoadTrace(paths[trace], &records, &count) != 0) {
+            return 2;
+        }
+
+        core = KbfToolCreateCore(&options, NULL, NULL);
+        if (core == NULL) {
+            return 2;
+        }
+
+        KbFilter_EvaluateKeyTrace(core, &options.Policy, records, count, &evaluation);
+        KbfToolAddEvaluation(&total, &evaluation);
+
+        printf("{\"trace\":\"%s\",", paths[trace]);
+        KbfToolPrintEvaluation(stdout, &evaluation);
+        printf("}\n");
+
+        free(core);
+        free(records);
+    }
+
+    if (traces > 1) {
+        printf("{\"traces\":%u,", traces);
+        KbfToolPrintEvaluation(stdout, &total);
+        printf("}\n");
+    }
+
+    free(paths);
+    return 0;
+}
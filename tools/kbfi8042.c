@@ -0,0 +1,307 @@
+/*++
+
+Module Name:
+
+    kbfi8042.c
+
+Abstract:
+
+    Simulates an i8042 keyboard byte stream through the ISR hook and the
+    service callback of the filter.  Every byte goes through
+    KbFilter_SimulateIsr, the ISR fast reject and the arrival ring of
+    KbFilter_IsrHook, and every packet i8042prt would queue for it is
+    checked at once by KbFilter_FilterPackets at its arrival time:
+
+        kbfi8042 [--quiet] [--byte-us US] [policy options] [STREAM]
+
+    The stream is read from STREAM, or from standard input without one.
+    It holds bytes in hex, such as E0 48, and idle times such as +80000,
+    in microseconds, separated by white space; # starts a comment.  The
+    clock advances by --byte-us, by default 1000, the time a PS/2 keyboard
+    takes to clock out one byte, before every byte completes.
+
+    Every rejected byte and every decision is printed as one JSON object
+    per line, followed by a summary object.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define I8042_DEFAULT_BYTE_US       1000
+#define I8042_EVENT_RECORDS         64
+
+typedef struct _I8042_CONTEXT {
+    ULONGLONG Now;
+    PKBFILTER_CORE Core;
+    PKBFILTR_EVENT_RING Ring;
+    ULONG Cursor;
+    ULONG Bytes;
+    ULONG Packets;
+    ULONG Decisions[KBFILTR_DECISIONS];
+    BOOLEAN Quiet;
+} I8042_CONTEXT, *PI8042_CONTEXT;
+
+static
+ULONGLONG
+I8042ReadClock(
+    PVOID Context
+    )
+{
+    return ((PI8042_CONTEXT) Context)->Now;
+}
+
+static
+char *
+I8042ReadStream(
+    FILE *File
+    )
+{
+    char *text = NULL, *grown;
+    size_t length = 0, capacity = 0, read;
+
+    do {
+        if (capacity - length < 4096) {
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            grown = realloc(text, capacity + 1);
+            if (grown == NULL) {
+                free(text);
+                return NULL;
+            }
+            text = grown;
+        }
+
+        read = fread(text + length, 1, capacity - length, File);
+        length += read;
+    } while (read != 0);
+
+    text[length] = '\0';
+    return text;
+}
+
+static
+VOID
+I8042PrintEvents(
+    PI8042_CONTEXT Sim
+    )
+{
+    KBFILTR_EVENT_RECORD events[I8042_EVENT_RECORDS];
+    ULONG count, index, lost;
+
+    do {
+        count = KbFilter_ReadEvents(Sim->Ring, &Sim->Cursor, events, I8042_EVENT_RECORDS, &lost);
+
+        for (index = 0; index < count; index++) {
+            if (events[index].Decision < KBFILTR_DECISIONS) {
+                Sim->Decisions[events[index].Decision]++;
+            }
+
+            if (!Sim->Quiet) {
+                printf("{\"key_time\":%u,\"make_code\":%u,\"flags\":%u,\"decision\":\"%s\"}\n",
+                       events[index].KeyTime,
+                       events[index].MakeCode,
+                       events[index].Flags,
+                       KbfToolDecisionName(events[index].Decision));
+            }
+        }
+    } while (count == I8042_EVENT_RECORDS);
+}
+
+static
+VOID
+I8042Byte(
+    PI8042_CONTEXT Sim,
+    PKBFILTER_POLICY Policy,
+    UCHAR DataByte,
+    PKEYBOARD_SCAN_STATE ScanState
+    )
+{
+    KEYBOARD_INPUT_DATA packet, output[2];
+    ULONG produced, rejects = Sim->Core->IsrRejects;
+
+    Sim->Bytes++;
+    produced = KbFilter_SimulateIsr(Sim->Core, &DataByte, 1, ScanState, &packet);
+
+    if (Sim->Core->IsrRejects != rejects && !Sim->Quiet) {
+        printf("{\"time_us\":%llu,\"byte\":\"%02X\",\"isr\":\"rejected\"}\n",
+               (unsigned long long) Sim->Now,
+               DataByte);
+    }
+
+    if (produced == 0) {
+        return;
+    }
+
+    //
+    // i8042prt queues its DPC for the packet; nothing else is running, so
+    // the service callback gets it before the next byte
+    //
+    Sim->Packets++;
+    KbFilter_FilterPackets(Sim->Core, Policy, &packet, &packet + 1, output);
+    KbFilter_PublishEvents(Sim->Core);
+    I8042PrintEvents(Sim);
+}
+
+static
+int
+I8042Run(
+    PI8042_CONTEXT Sim,
+    PKBFILTER_POLICY Policy,
+    char *Text,
+    ULONG ByteUs
+    )
+{
+    KEYBOARD_SCAN_STATE scanState = Normal;
+    unsigned long value;
+    char *token, *end;
+    ULONG line = 1;
+
+    token = Text;
+    for (;;) {
+        while (isspace((unsigned char) *token) || *token == '#') {
+            if (*token == '#') {
+                token += strcspn(token, "\n");
+                continue;
+            }
+            if (*token == '\n') {
+                line++;
+            }
+            token++;
+        }
+
+        if (*token == '\0') {
+            return 1;
+        }
+
+        if (*token == '+') {
+            value = strtoul(token + 1, &end, 10);
+        } else {
+            value = strtoul(token, &end, 16);
+        }
+
+        if (end == token + (*token == '+') ||
+            (*end != '\0' && !isspace((unsigned char) *end) && *end != '#') ||
+            (*token != '+' && value > 0xFF)) {
+            fprintf(stderr, "line %u: invalid byte or idle time \"%.*s\"\n",
+                    line,
+                    (int) strcspn(token, " \t\r\n#"),
+                    token);
+            return 0;
+        }
+
+        if (*token == '+') {
+            Sim->Now += value;
+        } else {
+            Sim->Now += ByteUs;
+            I8042Byte(Sim, Policy, (UCHAR) value, &scanState);
+        }
+
+        token = end;
+    }
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    KBFTOOL_OPTIONS options;
+    KBFILTER_EVENT_WRITER writer;
+    I8042_CONTEXT sim;
+    FILE *file = stdin;
+    const char *path = NULL;
+    char *text;
+    ULONG byteUs = I8042_DEFAULT_BYTE_US;
+    UCHAR decision;
+    int i, parsed;
+
+    KbfToolInitializeOptions(&options);
+    options.Policy.RecordKeys = TRUE;
+    memset(&sim, 0, sizeof(sim));
+
+    for (i = 1; i < argc; i++) {
+        parsed = KbfToolParseOption(&options, argc, argv, &i);
+        if (parsed < 0) {
+            return 2;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--quiet") == 0) {
+            sim.Quiet = TRUE;
+        } else if (strcmp(argv[i], "--byte-us") == 0 && i + 1 < argc) {
+            byteUs = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--quiet] [--byte-us US] [options] [STREAM]\n%s",
+                    argv[0],
+                    KbfToolOptionUsage);
+            return 2;
+        }
+    }
+
+    if (path != NULL) {
+        file = fopen(path, "r");
+        if (file == NULL) {
+            perror(path);
+            return 2;
+        }
+    }
+
+    text = I8042ReadStream(file);
+    if (path != NULL) {
+        fclose(file);
+    }
+
+    sim.Core = malloc(sizeof(KBFILTER_CORE));
+    sim.Ring = malloc(FIELD_OFFSET(KBFILTR_EVENT_RING, Records) +
+                      KBFILTER_EVENT_RING_RECORDS * sizeof(KBFILTR_EVENT_RECORD));
+    if (text == NULL || sim.Core == NULL || sim.Ring == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    //
+    // The clock counts microseconds, so the fast reject compares the byte
+    // times of the stream exactly
+    //
+    KbFilter_InitializeCore(sim.Core, options.DedupMode, KbFilterClockInjected, I8042ReadClock, &sim, 1000000);
+    KbFilter_SetTypematic(sim.Core, &options.Typematic);
+    KbFilter_SetIsrReject(sim.Core, &options.Policy);
+    sim.Core->IsrHooked = TRUE;
+
+    KbFilter_InitializeEventRing(&writer, sim.Ring, KBFILTER_EVENT_RING_RECORDS);
+    KbFilter_AttachEventRing(sim.Core, &writer);
+
+    if (!I8042Run(&sim, &options.Policy, text, byteUs)) {
+        return 2;
+    }
+
+    printf("{\"stream\":\"%s\",\"bytes\":%u,\"isr_rejects\":%u,\"packets\":%u,\"decisions\":{",
+           (path != NULL) ? path : "-",
+           sim.Bytes,
+           sim.Core->IsrRejects,
+           sim.Packets);
+    for (decision = 0; decision < KBFILTR_DECISIONS; decision++) {
+        printf("%s\"%s\":%u", (decision == 0) ? "" : ",", KbfToolDecisionName(decision), sim.Decisions[decision]);
+    }
+    printf("}}\n");
+
+    KbFilter_AttachEventRing(sim.Core, NULL);
+    free(sim.Ring);
+    free(sim.Core);
+    free(text);
+    return 0;
+}
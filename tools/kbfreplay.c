@@ -0,0 +1,168 @@
+/*++
+
+Module Name:
+
+    kbfreplay.c
+
+Abstract:
+
+    Replays a keystroke trace file through KbFilter_FilterPackets with a
+    policy given on the command line, see kbftool.h, and reports every
+    packet whose decision differs from the recorded one:
+
+        kbfreplay [--quiet] [policy options] TRACE
+
+    Each difference is printed as one JSON object per line, followed by a
+    summary object with the packet count and the recorded and replayed
+    decisions.  The exit status is 0 if the replay reproduces the trace, 1
+    if decisions differ and 2 on errors, like diff.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _REPLAY_CONTEXT {
+    KBFILTER_REPLAY_DIFF Diff;
+    ULONG Recorded[KBFILTR_DECISIONS];
+    ULONG Replayed[KBFILTR_DECISIONS];
+    BOOLEAN Quiet;
+} REPLAY_CONTEXT, *PREPLAY_CONTEXT;
+
+static
+VOID
+ReplayPrintDifference(
+    PVOID Context,
+    ULONG Index,
+    PKEYBOARD_INPUT_DATA InputData,
+    ULONG KeyTime,
+    UCHAR Recorded,
+    UCHAR Replayed
+    )
+{
+    PREPLAY_CONTEXT replay = Context;
+
+    if (replay->Quiet) {
+        return;
+    }
+
+    printf("{\"record\":%u,\"key_time\":%u,\"make_code\":%u,\"flags\":%u,"
+           "\"recorded\":\"%s\",\"replayed\":\"%s\"}\n",
+           Index,
+           KeyTime,
+           InputData->MakeCode,
+           InputData->Flags,
+           KbfToolDecisionName(Recorded),
+           KbfToolDecisionName(Replayed));
+}
+
+static
+VOID
+ReplayCount(
+    PVOID Context,
+    ULONG Index,
+    PKEYBOARD_INPUT_DATA InputData,
+    ULONG KeyTime,
+    UCHAR Recorded,
+    UCHAR Replayed
+    )
+{
+    PREPLAY_CONTEXT replay = Context;
+
+    if (Recorded < KBFILTR_DECISIONS) {
+        replay->Recorded[Recorded]++;
+    }
+    if (Replayed < KBFILTR_DECISIONS) {
+        replay->Replayed[Replayed]++;
+    }
+
+    KbFilter_ReplayDiff(&replay->Diff, Index, InputData, KeyTime, Recorded, Replayed);
+}
+
+static
+VOID
+ReplayPrintDecisions(
+    const char *Name,
+    const ULONG *Decisions
+    )
+{
+    UCHAR decision;
+
+    printf("\"%s\":{", Name);
+    for (decision = 0; decision < KBFILTR_DECISIONS; decision++) {
+        printf("%s\"%s\":%u", (decision == 0) ? "" : ",", KbfToolDecisionName(decision), Decisions[decision]);
+    }
+    printf("}");
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    KBFTOOL_OPTIONS options;
+    REPLAY_CONTEXT replay;
+    PKBFILTER_CORE core;
+    PKBFILTR_KEYTRACE_RECORD records;
+    const char *path = NULL;
+    ULONG count, packets;
+    int i, parsed;
+
+    KbfToolInitializeOptions(&options);
+    memset(&replay, 0, sizeof(replay));
+
+    for (i = 1; i < argc; i++) {
+        parsed = KbfToolParseOption(&options, argc, argv, &i);
+        if (parsed < 0) {
+            return 2;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--quiet") == 0) {
+            replay.Quiet = TRUE;
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [--quiet] [options] TRACE\n%s", argv[0], KbfToolOptionUsage);
+        return 2;
+    }
+
+    if (KbfToolLoadTrace(path, &records, &count) != 0) {
+        return 2;
+    }
+
+    core = KbfToolCreateCore(&options, NULL, NULL);
+    if (core == NULL) {
+        return 2;
+    }
+
+    replay.Diff.DiffRoutine = ReplayPrintDifference;
+    replay.Diff.Context = &replay;
+    packets = KbFilter_ReplayPackets(core, &options.Policy, records, count, ReplayCount, &replay);
+
+    printf("{\"trace\":\"%s\",\"packets\":%u,\"differences\":%u,", path, packets, replay.Diff.Differences);
+    ReplayPrintDecisions("recorded", replay.Recorded);
+    printf(",");
+    ReplayPrintDecisions("replayed", replay.Replayed);
+    printf("}\n");
+
+    free(core);
+    free(records);
+    return (replay.Diff.Differences == 0) ? 0 : 1;
+}
@@ -0,0 +1,497 @@
+/*++
+
+Module Name:
+
+    kbfsweep.c
+
+Abstract:
+
+    Sweeps a grid of policies over a corpus of labelled keystroke traces
+    and prints the precision, recall and added latency of every grid point,
+    summed over the traces, as curves to pick thresholds from:
+
+        kbfsweep [--threads N] [--csv] [--thresholds LIST]
+                 [--max-runs LIST] [--override KEYS]... [policy options]
+                 TRACE...
+
+    The grid is the product of the thresholds, given to every key, the
+    sequence dedup run caps (SequenceMaxRun, the history depth the sequence
+    check looks back) and the per-key override sets.  LIST is either
+    comma-separated values or FIRST:LAST:STEP; KEYS is one or more --key
+    values joined by '+', applied on top of the threshold.  The grid always
+    includes the point without overrides.  Other policy options, see
+    kbftool.h, apply to every point.
+
+    Every (trace, point) pair is one KbFilter_EvaluateKeyTrace on its own
+    core.  The pairs are split into one deque per thread, in trace order so
+    that each thread starts on its own traces; a thread takes work from the
+    back of its deque and, once it runs dry, steals from the front of the
+    others.  Results do not depend on the number of threads.
+
+    Points are printed in grid order, thresholds varying fastest, one JSON
+    object per line or CSV with --csv.  A summary of the run goes to
+    stderr.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SWEEP_DEFAULT_THRESHOLDS    "25:500:25"
+#define SWEEP_MAX_VALUES            1024
+
+typedef struct _SWEEP_TRACE {
+    const char *Path;
+    PKBFILTR_KEYTRACE_RECORD Records;
+    ULONG Count;
+} SWEEP_TRACE, *PSWEEP_TRACE;
+
+typedef struct _SWEEP_POINT {
+    KBFTOOL_OPTIONS Options;
+    ULONG ThresholdMs;
+    ULONG MaxRun;
+    const char *Override;
+} SWEEP_POINT, *PSWEEP_POINT;
+
+//
+// Deque of work items, item n being trace n / points and point
+// n % points.  The owner takes from Tail, thieves from Head.
+//
+typedef struct _SWEEP_QUEUE {
+    pthread_mutex_t Lock;
+    PULONG Items;
+    ULONG Head;
+    ULONG Tail;
+} SWEEP_QUEUE, *PSWEEP_QUEUE;
+
+typedef struct _SWEEP {
+    PSWEEP_TRACE Traces;
+    ULONG TraceCount;
+    PSWEEP_POINT Points;
+    ULONG PointCount;
+    PKBFILTER_EVALUATION Results;           // [trace * PointCount + point]
+    PSWEEP_QUEUE Queues;
+    ULONG ThreadCount;
+} SWEEP, *PSWEEP;
+
+typedef struct _SWEEP_WORKER {
+    PSWEEP Sweep;
+    ULONG Index;
+    ULONG Evaluated;
+    ULONG Stolen;
+    int Failed;
+} SWEEP_WORKER, *PSWEEP_WORKER;
+
+static
+int
+SweepParseList(
+    const char *Text,
+    PULONG Values,
+    PULONG Count
+    )
+{
+    unsigned long first, last, step, value;
+    char *end;
+
+    *Count = 0;
+
+    first = strtoul(Text, &end, 0);
+    if (end != Text && *end == ':') {
+        last = strtoul(end + 1, &end, 0);
+        if (*end != ':') {
+            return 0;
+        }
+        step = strtoul(end + 1, &end, 0);
+        if (*end != '\0' || step == 0 || last < first || last > MAXUSHORT) {
+            return 0;
+        }
+
+        for (value = first; value <= last; value += step) {
+            if (*Count == SWEEP_MAX_VALUES) {
+                return 0;
+            }
+            Values[(*Count)++] = (ULONG) value;
+        }
+        return 1;
+    }
+
+    for (;;) {
+        value = strtoul(Text, &end, 0);
+        if (end == Text || value > MAXUSHORT || *Count == SWEEP_MAX_VALUES) {
+            return 0;
+        }
+        Values[(*Count)++] = (ULONG) value;
+
+        if (*end == '\0') {
+            return 1;
+        }
+        if (*end != ',') {
+            return 0;
+        }
+        Text = end + 1;
+    }
+}
+
+static
+int
+SweepApplyOverride(
+    PKBFTOOL_OPTIONS Options,
+    const char *Override
+    )
+{
+    char key[64], *argv[2];
+    const char *next;
+    size_t length;
+    int index;
+
+    argv[0] = "--key";
+    argv[1] = key;
+
+    while (*Override != '\0') {
+        next = strchr(Override, '+');
+        length = (next != NULL) ? (size_t) (next - Override) : strlen(Override);
+        if (length == 0 || length >= sizeof(key)) {
+            fprintf(stderr, "invalid override %s\n", Override);
+            return 0;
+        }
+
+        memcpy(key, Override, length);
+        key[length] = '\0';
+
+        index = 0;
+        if (KbfToolParseOption(Options, 2, argv, &index) <= 0) {
+            return 0;
+        }
+
+        Override += length;
+        if (*Override == '+') {
+            Override++;
+        }
+    }
+
+    return 1;
+}
+
+static
+int
+SweepTake(
+    PSWEEP Sweep,
+    ULONG Index,
+    PULONG Item,
+    PULONG Stolen
+    )
+{
+    PSWEEP_QUEUE queue;
+    ULONG victim;
+    int found = 0;
+
+    queue = &Sweep->Queues[Index];
+    pthread_mutex_lock(&queue->Lock);
+    if (queue->Head != queue->Tail) {
+        *Item = queue->Items[--queue->Tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&queue->Lock);
+
+    //
+    // No new work is ever queued, so once every deque is empty the sweep
+    // is done
+    //
+    for (victim = 1; !found && victim < Sweep->ThreadCount; victim++) {
+        queue = &Sweep->Queues[(Index + victim) % Sweep->ThreadCount];
+        pthread_mutex_lock(&queue->Lock);
+        if (queue->Head != queue->Tail) {
+            *Item = queue->Items[queue->Head++];
+            (*Stolen)++;
+            found = 1;
+        }
+        pthread_mutex_unlock(&queue->Lock);
+    }
+
+    return found;
+}
+
+static
+void *
+SweepWorker(
+    void *Context
+    )
+{
+    PSWEEP_WORKER worker = Context;
+    PSWEEP sweep = worker->Sweep;
+    PSWEEP_TRACE trace;
+    PSWEEP_POINT point;
+    PKBFILTER_CORE core;
+    ULONG item;
+
+    while (SweepTake(sweep, worker->Index, &item, &worker->Stolen)) {
+        trace = &sweep->Traces[item / sweep->PointCount];
+        point = &sweep->Points[item % sweep->PointCount];
+
+        core = KbfToolCreateCore(&point->Options, NULL, NULL);
+        if (core == NULL) {
+            worker->Failed = 1;
+            break;
+        }
+
+        KbFilter_EvaluateKeyTrace(core, &point->Options.Policy, trace->Records, trace->Count, &sweep->Results[item]);
+        worker->Evaluated++;
+        free(core);
+    }
+
+    return NULL;
+}
+
+static
+VOID
+SweepPrint(
+    PSWEEP Sweep,
+    int Csv
+    )
+{
+    KBFILTER_EVALUATION total;
+    PSWEEP_POINT point;
+    ULONG index, trace;
+
+    if (Csv) {
+        printf("threshold_ms,max_run,override,presses,true_positives,false_positives,"
+               "false_negatives,precision_permille,recall_permille,added_latency_ms,"
+               "max_added_latency_ms,unresolved_drops\n");
+    }
+
+    for (index = 0; index < Sweep->PointCount; index++) {
+        point = &Sweep->Points[index];
+
+        memset(&total, 0, sizeof(total));
+        for (trace = 0; trace < Sweep->TraceCount; trace++) {
+            KbfToolAddEvaluation(&total, &Sweep->Results[trace * Sweep->PointCount + index]);
+        }
+
+        if (Csv) {
+            printf("%u,%u,%s,%u,%u,%u,%u,%u,%u,%llu,%u,%u\n",
+                   point->ThresholdMs,
+                   point->MaxRun,
+                   point->Override,
+                   total.Presses,
+                   total.TruePositives,
+                   total.FalsePositives,
+                   total.FalseNegatives,
+                   total.PrecisionPermille,
+                   total.RecallPermille,
+                   (unsigned long long) total.AddedLatencyMs,
+                   total.MaxAddedLatencyMs,
+                   total.UnresolvedDrops);
+        } else {
+            printf("{\"threshold_ms\":%u,\"max_run\":%u,\"override\":\"%s\",",
+                   point->ThresholdMs,
+                   point->MaxRun,
+                   point->Override);
+            KbfToolPrintEvaluation(stdout, &total);
+            printf("}\n");
+        }
+    }
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    static ULONG thresholds[SWEEP_MAX_VALUES], maxRuns[SWEEP_MAX_VALUES];
+    KBFTOOL_OPTIONS options, scratch;
+    SWEEP sweep;
+    PSWEEP_POINT point;
+    PSWEEP_WORKER workers;
+    pthread_t *threads;
+    const char **overrides;
+    ULONG thresholdCount, maxRunCount = 1, overrideCount = 1;
+    ULONG index, slot, items, first, stolen = 0, threadCount = 0;
+    long processors;
+    int i, parsed, csv = 0, failed = 0;
+
+    KbfToolInitializeOptions(&options);
+    memset(&sweep, 0, sizeof(sweep));
+    SweepParseList(SWEEP_DEFAULT_THRESHOLDS, thresholds, &thresholdCount);
+    maxRuns[0] = 0;
+
+    overrides = malloc(argc * sizeof(char *));
+    sweep.Traces = malloc(argc * sizeof(SWEEP_TRACE));
+    if (overrides == NULL || sweep.Traces == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+    overrides[0] = "none";
+
+    for (i = 1; i < argc; i++) {
+        parsed = KbfToolParseOption(&options, argc, argv, &i);
+        if (parsed < 0) {
+            return 2;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--csv") == 0) {
+            csv = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threadCount = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--thresholds") == 0 && i + 1 < argc) {
+            if (!SweepParseList(argv[++i], thresholds, &thresholdCount)) {
+                fprintf(stderr, "invalid thresholds %s\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--max-runs") == 0 && i + 1 < argc) {
+            if (!SweepParseList(argv[++i], maxRuns, &maxRunCount)) {
+                fprintf(stderr, "invalid run caps %s\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--override") == 0 && i + 1 < argc) {
+            KbfToolInitializeOptions(&scratch);
+            if (!SweepApplyOverride(&scratch, argv[++i])) {
+                return 2;
+            }
+            overrides[overrideCount++] = argv[i];
+        } else if (argv[i][0] != '-') {
+            sweep.Traces[sweep.TraceCount++].Path = argv[i];
+        } else {
+            sweep.TraceCount = 0;
+            break;
+        }
+    }
+
+    if (sweep.TraceCount == 0) {
+        fprintf(stderr,
+                "usage: %s [--threads N] [--csv] [--thresholds LIST] [--max-runs LIST]\n"
+                "       [--override KEYS]... [options] TRACE...\n%s",
+                argv[0],
+                KbfToolOptionUsage);
+        return 2;
+    }
+
+    if (threadCount == 0) {
+        processors = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = (processors > 0) ? (ULONG) processors : 1;
+    }
+
+    for (index = 0; index < sweep.TraceCount; index++) {
+        if (KbfToolLoadTrace(sweep.Traces[index].Path, &sweep.Traces[index].Records, &sweep.Traces[index].Count) != 0) {
+            return 2;
+        }
+    }
+
+    //
+    // Build the grid, thresholds varying fastest
+    //
+    sweep.PointCount = thresholdCount * maxRunCount * overrideCount;
+    sweep.Points = calloc(sweep.PointCount, sizeof(SWEEP_POINT));
+    if (sweep.Points == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    for (index = 0; index < sweep.PointCount; index++) {
+        point = &sweep.Points[index];
+        point->ThresholdMs = thresholds[index % thresholdCount];
+        point->MaxRun = maxRuns[(index / thresholdCount) % maxRunCount];
+        point->Override = overrides[index / (thresholdCount * maxRunCount)];
+
+        point->Options = options;
+        point->Options.Policy.SequenceMaxRun = point->MaxRun;
+        for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+            point->Options.Policy.Keys[slot].ThresholdMs = (USHORT) point->ThresholdMs;
+        }
+
+        if (index >= thresholdCount * maxRunCount) {
+            SweepApplyOverride(&point->Options, point->Override);
+        }
+    }
+
+    //
+    // Split the work items into one contiguous block per thread
+    //
+    items = sweep.TraceCount * sweep.PointCount;
+    threadCount = MIN(threadCount, items);
+    sweep.ThreadCount = threadCount;
+    sweep.Results = calloc(items, sizeof(KBFILTER_EVALUATION));
+    sweep.Queues = calloc(threadCount, sizeof(SWEEP_QUEUE));
+    workers = calloc(threadCount, sizeof(SWEEP_WORKER));
+    threads = calloc(threadCount, sizeof(pthread_t));
+    if (sweep.Results == NULL || sweep.Queues == NULL || workers == NULL || threads == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    for (index = 0; index < threadCount; index++) {
+        first = (ULONG) ((ULONGLONG) items * index / threadCount);
+        sweep.Queues[index].Tail = (ULONG) ((ULONGLONG) items * (index + 1) / threadCount) - first;
+        sweep.Queues[index].Items = malloc(sweep.Queues[index].Tail * sizeof(ULONG));
+        if (sweep.Queues[index].Items == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 2;
+        }
+
+        //
+        // The owner works from the back, so store its block reversed to
+        // have it start with its first item
+        //
+        for (i = 0; (ULONG) i < sweep.Queues[index].Tail; i++) {
+            sweep.Queues[index].Items[i] = first + sweep.Queues[index].Tail - 1 - i;
+        }
+        pthread_mutex_init(&sweep.Queues[index].Lock, NULL);
+    }
+
+    for (index = 0; index < threadCount; index++) {
+        workers[index].Sweep = &sweep;
+        workers[index].Index = index;
+        if (pthread_create(&threads[index], NULL, SweepWorker, &workers[index]) != 0) {
+            fprintf(stderr, "cannot create thread %u\n", index);
+            return 2;
+        }
+    }
+
+    for (index = 0; index < threadCount; index++) {
+        pthread_join(threads[index], NULL);
+        stolen += workers[index].Stolen;
+        failed |= workers[index].Failed;
+    }
+
+    if (failed) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    SweepPrint(&sweep, csv);
+
+    fprintf(stderr,
+            "{\"traces\":%u,\"points\":%u,\"evaluations\":%u,\"threads\":%u,\"stolen\":%u}\n",
+            sweep.TraceCount,
+            sweep.PointCount,
+            items,
+            threadCount,
+            stolen);
+
+    for (index = 0; index < threadCount; index++) {
+        pthread_mutex_destroy(&sweep.Queues[index].Lock);
+        free(sweep.Queues[index].Items);
+    }
+    for (index = 0; index < sweep.TraceCount; index++) {
+        free(sweep.Traces[index].Records);
+    }
+    free(threads);
+    free(workers);
+    free(sweep.Queues);
+    free(sweep.Results);
+    free(sweep.Points);
+    free(sweep.Traces);
+    free(overrides);
+    return 0;
+}
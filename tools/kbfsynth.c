@@ -0,0 +1,314 @@
+/*++
+
+Module Name:
+
+    kbfsynth.c
+
+Abstract:
+
+    Synthesizes a labelled keystroke trace.  Letters are typed at human
+    speed, with fast double letters and rollover, and a share of the
+    presses is reported a second time shortly after its release, as lag
+    replays them.  The copies are labelled KBFILTR_KEYTRACE_DUPLICATE.
+
+    The packets are checked by a core with the given policy options and
+    recorded through its capture ring, one packet per range, so the trace
+    carries the decisions of that policy and can be fed to kbfreplay,
+    kbfeval and kbfsweep:
+
+        kbfsynth [--presses N] [--seed N] [--duplicates PERCENT]
+                 [policy options] TRACE
+
+    A summary is printed as one JSON object.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNTH_DEFAULT_PRESSES       2000
+#define SYNTH_DEFAULT_DUPLICATES    5
+
+//
+// Letters of the main block, scan code set 1
+//
+static const USHORT SynthKeys[] = {
+    0x1E, 0x30, 0x2E, 0x20, 0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26, 0x32,
+    0x31, 0x18, 0x19, 0x10, 0x13, 0x1F, 0x14, 0x16, 0x2F, 0x11, 0x2D, 0x15, 0x2C
+};
+
+#define SYNTH_KEYS  (sizeof(SynthKeys) / sizeof(SynthKeys[0]))
+
+typedef struct _SYNTH_PACKET {
+    KEYBOARD_INPUT_DATA Input;
+    ULONG KeyTime;
+    ULONG Order;
+    BOOLEAN Duplicate;
+} SYNTH_PACKET, *PSYNTH_PACKET;
+
+typedef struct _SYNTH_CONTEXT {
+    ULONGLONG Now;
+    PSYNTH_PACKET Packets;
+    ULONG PacketCount;
+    ULONG Capacity;
+    ULONG Seed;
+} SYNTH_CONTEXT, *PSYNTH_CONTEXT;
+
+static
+ULONGLONG
+SynthReadClock(
+    PVOID Context
+    )
+{
+    return ((PSYNTH_CONTEXT) Context)->Now;
+}
+
+static
+ULONG
+SynthRandom(
+    PSYNTH_CONTEXT Synth,
+    ULONG Range
+    )
+{
+    Synth->Seed = Synth->Seed * 1103515245 + 12345;
+    return ((Synth->Seed >> 16) & 0x7FFF) % Range;
+}
+
+static
+int
+SynthAdd(
+    PSYNTH_CONTEXT Synth,
+    USHORT MakeCode,
+    USHORT Flags,
+    ULONG KeyTime,
+    BOOLEAN Duplicate
+    )
+{
+    PSYNTH_PACKET grown;
+
+    if (Synth->PacketCount == Synth->Capacity) {
+        Synth->Capacity = (Synth->Capacity == 0) ? 4096 : Synth->Capacity * 2;
+        grown = realloc(Synth->Packets, Synth->Capacity * sizeof(SYNTH_PACKET));
+        if (grown == NULL) {
+            return 0;
+        }
+        Synth->Packets = grown;
+    }
+
+    memset(&Synth->Packets[Synth->PacketCount], 0, sizeof(SYNTH_PACKET));
+    Synth->Packets[Synth->PacketCount].Input.MakeCode = MakeCode;
+    Synth->Packets[Synth->PacketCount].Input.Flags = Flags;
+    Synth->Packets[Synth->PacketCount].KeyTime = KeyTime;
+    Synth->Packets[Synth->PacketCount].Order = Synth->PacketCount;
+    Synth->Packets[Synth->PacketCount].Duplicate = Duplicate;
+    Synth->PacketCount++;
+    return 1;
+}
+
+static
+int
+SynthCompareTime(
+    const void *Left,
+    const void *Right
+    )
+{
+    const SYNTH_PACKET *left = Left, *right = Right;
+
+    if (left->KeyTime != right->KeyTime) {
+        return (left->KeyTime > right->KeyTime) ? 1 : -1;
+    }
+
+    //
+    // Keep the generation order of packets at the same time
+    //
+    return (left->Order > right->Order) - (left->Order < right->Order);
+}
+
+static
+int
+SynthType(
+    PSYNTH_CONTEXT Synth,
+    ULONG Presses,
+    ULONG DuplicatePercent
+    )
+{
+    ULONG press, time = 1000, hold, copy, released = 0;
+    USHORT key, previous = SynthKeys[0];
+
+    for (press = 0; press < Presses; press++) {
+        //
+        // One press in ten doubles the previous letter, 90 to 150 ms after
+        // it; others follow 60 to 300 ms after the previous press, so the
+        // fastest ones roll over it.  Keys are held for 50 to 120 ms.
+        //
+        if (SynthRandom(Synth, 10) == 0) {
+            key = previous;
+            time += 90 + SynthRandom(Synth, 60);
+        } else {
+            key = SynthKeys[SynthRandom(Synth, SYNTH_KEYS)];
+            time += 60 + SynthRandom(Synth, 240);
+        }
+
+        //
+        // A letter is only pressed again once it has been released
+        //
+        if (key == previous && time < released + 10) {
+            time = released + 10;
+        }
+
+        hold = 50 + SynthRandom(Synth, 70);
+        released = time + hold;
+
+        if (!SynthAdd(Synth, key, KEY_MAKE, time, FALSE) ||
+            !SynthAdd(Synth, key, KEY_BREAK, time + hold, FALSE)) {
+            return 0;
+        }
+
+        //
+        // Lag reports the press again 5 to 40 ms after its release
+        //
+        if (SynthRandom(Synth, 100) < DuplicatePercent) {
+            copy = time + hold + 5 + SynthRandom(Synth, 35);
+            if (!SynthAdd(Synth, key, KEY_MAKE, copy, TRUE) ||
+                !SynthAdd(Synth, key, KEY_BREAK, copy + 3, FALSE)) {
+                return 0;
+            }
+            time = copy + 3;
+            released = copy + 3;
+        }
+
+        previous = key;
+    }
+
+    qsort(Synth->Packets, Synth->PacketCount, sizeof(SYNTH_PACKET), SynthCompareTime);
+    return 1;
+}
+
+int
+main(
+    int argc,
+    char **argv
+    )
+{
+    KBFTOOL_OPTIONS options;
+    SYNTH_CONTEXT synth;
+    PKBFILTER_CORE core;
+    PKBFILTR_KEYTRACE_RECORD records = NULL, grown;
+    KEYBOARD_INPUT_DATA output[2];
+    const char *path = NULL;
+    ULONG presses = SYNTH_DEFAULT_PRESSES, duplicates = SYNTH_DEFAULT_DUPLICATES;
+    ULONG index, record, recordCount = 0, capacity = 0, cursor = 0, lost = 0, drained, labelled = 0;
+    PSYNTH_PACKET packet;
+    int i, parsed;
+
+    KbfToolInitializeOptions(&options);
+    options.Policy.RecordKeys = TRUE;
+    memset(&synth, 0, sizeof(synth));
+    synth.Seed = 1;
+
+    for (i = 1; i < argc; i++) {
+        parsed = KbfToolParseOption(&options, argc, argv, &i);
+        if (parsed < 0) {
+            return 2;
+        }
+        if (parsed > 0) {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--presses") == 0 && i + 1 < argc) {
+            presses = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            synth.Seed = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--duplicates") == 0 && i + 1 < argc) {
+            duplicates = (ULONG) strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr,
+                "usage: %s [--presses N] [--seed N] [--duplicates PERCENT] [options] TRACE\n%s",
+                argv[0],
+                KbfToolOptionUsage);
+        return 2;
+    }
+
+    if (!SynthType(&synth, presses, duplicates)) {
+        fprintf(stderr, "out of memory\n");
+        return 2;
+    }
+
+    core = KbfToolCreateCore(&options, SynthReadClock, &synth);
+    if (core == NULL) {
+        return 2;
+    }
+
+    //
+    // Check every packet on its own at its key time and record it
+    //
+    packet = synth.Packets;
+    for (index = 0; index < synth.PacketCount; index++) {
+        synth.Now = synth.Packets[index].KeyTime - 1;
+        KbFilter_FilterPackets(core, &options.Policy, &synth.Packets[index].Input, &synth.Packets[index].Input + 1, output);
+
+        if (recordCount + KBFILTER_CAPTURE_RING_SIZE > capacity) {
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            grown = realloc(records, capacity * sizeof(KBFILTR_KEYTRACE_RECORD));
+            if (grown == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 2;
+            }
+            records = grown;
+        }
+
+        drained = KbFilter_DrainKeyTrace(core, &cursor, &records[recordCount], KBFILTER_CAPTURE_RING_SIZE, &lost);
+
+        //
+        // Label the copies.  Breaks synthesized with --stuck-key come before
+        // the make they were synthesized for and are not labelled.
+        //
+        for (record = recordCount; record < recordCount + drained; record++) {
+            if ((records[record].Kind & KBFILTR_KEYTRACE_KIND_MASK) != KBFILTR_KEYTRACE_KEY ||
+                records[record].u.Key.MakeCode != packet->Input.MakeCode ||
+                records[record].Flags != packet->Input.Flags) {
+                continue;
+            }
+
+            if (packet->Duplicate) {
+                records[record].Kind |= KBFILTR_KEYTRACE_DUPLICATE;
+                labelled++;
+            }
+            packet++;
+        }
+
+        recordCount += drained;
+    }
+
+    if (KbfToolSaveTrace(path, records, recordCount) != 0) {
+        return 2;
+    }
+
+    printf("{\"trace\":\"%s\",\"presses\":%u,\"packets\":%u,\"duplicates\":%u,\"records\":%u,\"lost\":%u}\n",
+           path,
+           presses,
+           synth.PacketCount,
+           labelled,
+           recordCount,
+           lost);
+
+    free(core);
+    free(records);
+    free(synth.Packets);
+    return 0;
+}
@@ -0,0 +1,557 @@
+/*++
+
+Module Name:
+
+    kbftool.c
+
+Abstract:
+
+    Helpers shared by the user-mode tools: command line policy options,
+    reading and writing keystroke trace files, decision names and
+    evaluation output.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "kbftool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char KbfToolOptionUsage[] =
+    "  --threshold MS              ThresholdMs of every key\n"
+    "  --key CODE[:e0|:e1]=MS      per-key threshold, CODE in hex\n"
+    "  --key CODE[:e0|:e1]=exempt  never filter the key\n"
+    "  --adaptive                  adaptive thresholds\n"
+    "  --no-typematic              do not cap thresholds by the typematic delay\n"
+    "  --sequence-window MS        SequenceWindowMs\n"
+    "  --sequence-max-run N        longest replayed run of sequence dedup\n"
+    "  --stuck-key MS              StuckKeyMs\n"
+    "  --lag-watermark MS          LagWatermarkMs\n"
+    "  --isr-reject US             IsrRejectUs, bounce window of the ISR fast reject\n"
+    "  --dedup locked|lockfree     dedup mode\n"
+    "  --typematic DELAY,RATE      typematic delay in ms and rate in repeats/s\n";
+
+VOID
+KbfToolInitializeOptions(
+    OUT PKBFTOOL_OPTIONS Options
+    )
+/*++
+
+Routine Description:
+
+    Fills in the defaults of the driver, see KbFilter_LoadPolicy, and the
+    default typematic parameters of the class driver.
+
+Arguments:
+
+    Options - Receives the defaults
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG slot;
+
+    memset(Options, 0, sizeof(KBFTOOL_OPTIONS));
+
+    Options->Policy.Enabled = TRUE;
+    Options->Policy.TypematicThresholds = TRUE;
+    Options->Policy.LagCooldownMs = KBFILTER_LAG_COOLDOWN_MS;
+    Options->Policy.DedupMode = KBFILTER_DEFAULT_DEDUP_MODE;
+    Options->Policy.Clock = KbFilterClockInjected;
+
+    for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+        Options->Policy.Keys[slot].ThresholdMs = LAG_MITIGATION_THRESHOLD_MS;
+    }
+
+    Options->DedupMode = KBFILTER_DEFAULT_DEDUP_MODE;
+    Options->Typematic.Rate = KEYBOARD_TYPEMATIC_RATE_DEFAULT;
+    Options->Typematic.Delay = KEYBOARD_TYPEMATIC_DELAY_DEFAULT;
+}
+
+static
+int
+KbfToolParseMs(
+    const char *Text,
+    PULONG Value
+    )
+{
+    char *end;
+    unsigned long value = strtoul(Text, &end, 0);
+
+    if (*Text == '\0' || *end != '\0' || value > MAXUSHORT) {
+        return 0;
+    }
+
+    *Value = (ULONG) value;
+    return 1;
+}
+
+static
+int
+KbfToolParseKey(
+    PKBFTOOL_OPTIONS Options,
+    const char *Text
+    )
+{
+    KEYBOARD_INPUT_DATA keyData;
+    const char *value;
+    char *end;
+    unsigned long makeCode;
+    ULONG slot, threshold;
+
+    memset(&keyData, 0, sizeof(keyData));
+
+    makeCode = strtoul(Text, &end, 16);
+    if (end == Text || makeCode > MAXUSHORT) {
+        return 0;
+    }
+    keyData.MakeCode = (USHORT) makeCode;
+
+    if (strncmp(end, ":e0", 3) == 0) {
+        keyData.Flags = KEY_E0;
+        end += 3;
+    } else if (strncmp(end, ":e1", 3) == 0) {
+        keyData.Flags = KEY_E1;
+        end += 3;
+    }
+
+    if (*end != '=') {
+        return 0;
+    }
+    value = end + 1;
+
+    slot = KbFilter_KeySlot(&keyData);
+    if (slot == KBFILTER_NO_KEY_SLOT) {
+        return 0;
+    }
+
+    if (strcmp(value, "exempt") == 0) {
+        Options->Policy.Keys[slot].Options = KBFILTR_KEY_POLICY_EXEMPT;
+        return 1;
+    }
+
+    if (!KbfToolParseMs(value, &threshold)) {
+        return 0;
+    }
+
+    Options->Policy.Keys[slot].ThresholdMs = (USHORT) threshold;
+    Options->Policy.Keys[slot].Options = 0;
+    return 1;
+}
+
+int
+KbfToolParseOption(
+    IN OUT PKBFTOOL_OPTIONS Options,
+    IN int Argc,
+    IN char **Argv,
+    IN OUT int *Index
+    )
+/*++
+
+Routine Description:
+
+    Parses the policy option at Argv[*Index], see kbftool.h, and advances
+    *Index past its value.
+
+Arguments:
+
+    Options - Options to update
+    Argc - Number of arguments
+    Argv - Arguments
+    Index - Index of the option; receives the index of its last argument
+
+Return Value:
+
+    1 if the option was parsed, 0 if it is not a policy option, -1 if its
+    value is missing or invalid.
+
+--*/
+{
+    const char *option = Argv[*Index];
+    const char *value = (*Index + 1 < Argc) ? Argv[*Index + 1] : NULL;
+    ULONG slot, number;
+    unsigned long delay, rate;
+    char *end;
+
+    if (strcmp(option, "--adaptive") == 0) {
+        Options->Policy.AdaptiveThresholds = TRUE;
+        return 1;
+    }
+
+    if (strcmp(option, "--no-typematic") == 0) {
+        Options->Policy.TypematicThresholds = FALSE;
+        return 1;
+    }
+
+    if (strcmp(option, "--threshold") != 0 &&
+        strcmp(option, "--key") != 0 &&
+        strcmp(option, "--sequence-window") != 0 &&
+        strcmp(option, "--sequence-max-run") != 0 &&
+        strcmp(option, "--stuck-key") != 0 &&
+        strcmp(option, "--lag-watermark") != 0 &&
+        strcmp(option, "--isr-reject") != 0 &&
+        strcmp(option, "--dedup") != 0 &&
+        strcmp(option, "--typematic") != 0) {
+        return 0;
+    }
+
+    if (value == NULL) {
+        fprintf(stderr, "%s needs a value\n", option);
+        return -1;
+    }
+    (*Index)++;
+
+    if (strcmp(option, "--key") == 0) {
+        if (!KbfToolParseKey(Options, value)) {
+            fprintf(stderr, "invalid key override %s\n", value);
+            return -1;
+        }
+        return 1;
+    }
+
+    if (strcmp(option, "--dedup") == 0) {
+        if (strcmp(value, "locked") == 0) {
+            Options->DedupMode = KbFilterDedupLocked;
+        } else if (strcmp(value, "lockfree") == 0) {
+            Options->DedupMode = KbFilterDedupLockFree;
+        } else {
+            fprintf(stderr, "invalid dedup mode %s\n", value);
+            return -1;
+        }
+        Options->Policy.DedupMode = Options->DedupMode;
+        return 1;
+    }
+
+    if (strcmp(option, "--typematic") == 0) {
+        delay = strtoul(value, &end, 0);
+        rate = (*end == ',') ? strtoul(end + 1, &end, 0) : 0;
+        if (*end != '\0' || delay == 0 || delay > MAXUSHORT || rate == 0 || rate > MAXUSHORT) {
+            fprintf(stderr, "invalid typematic parameters %s\n", value);
+            return -1;
+        }
+        Options->Typematic.Delay = (USHORT) delay;
+        Options->Typematic.Rate = (USHORT) rate;
+        return 1;
+    }
+
+    if (!KbfToolParseMs(value, &number)) {
+        fprintf(stderr, "invalid value %s for %s\n", value, option);
+        return -1;
+    }
+
+    if (strcmp(option, "--threshold") == 0) {
+        for (slot = 0; slot < KBFILTER_KEY_SLOTS; slot++) {
+            Options->Policy.Keys[slot].ThresholdMs = (USHORT) number;
+        }
+    } else if (strcmp(option, "--sequence-window") == 0) {
+        Options->Policy.SequenceWindowMs = number;
+    } else if (strcmp(option, "--sequence-max-run") == 0) {
+        Options->Policy.SequenceMaxRun = number;
+    } else if (strcmp(option, "--stuck-key") == 0) {
+        Options->Policy.StuckKeyMs = number;
+    } else if (strcmp(option, "--isr-reject") == 0) {
+        Options->Policy.IsrRejectUs = MIN(number, KBFILTER_ISR_REJECT_MAX_US);
+    } else {
+        Options->Policy.LagWatermarkMs = number;
+    }
+
+    return 1;
+}
+
+PKBFILTER_CORE
+KbfToolCreateCore(
+    IN PKBFTOOL_OPTIONS Options,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Allocates a core initialized with the dedup mode and typematic
+    parameters of the options and an injected clock in ms.
+
+Arguments:
+
+    Options - Options of the tool
+    Routine - Clock reader, NULL for a core only used for replays, which
+              bring their own clock
+    Context - Context passed to Routine
+
+Return Value:
+
+    The core, to be freed with free, or NULL if there is no memory.
+
+--*/
+{
+    PKBFILTER_CORE core;
+
+    core = malloc(sizeof(KBFILTER_CORE));
+    if (core == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return NULL;
+    }
+
+    KbFilter_InitializeCore(core, Options->DedupMode, KbFilterClockInjected, Routine, Context, 1000);
+    KbFilter_SetTypematic(core, &Options->Typematic);
+    return core;
+}
+
+int
+KbfToolLoadTrace(
+    IN const char *Path,
+    OUT PKBFILTR_KEYTRACE_RECORD *Records,
+    OUT PULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Reads a keystroke trace file: a KBFILTR_KEYTRACE_HEADER followed by
+    records of the size the header gives.  Trailing bytes of longer records
+    and a partial record at the end of the file are ignored.
+
+Arguments:
+
+    Path - Trace file
+    Records - Receives the records, to be freed with free
+    Count - Receives the number of records
+
+Return Value:
+
+    0 on success, otherwise nonzero after printing the reason.
+
+--*/
+{
+    KBFILTR_KEYTRACE_HEADER header;
+    PKBFILTR_KEYTRACE_RECORD records = NULL, grown;
+    unsigned char *buffer;
+    ULONG count = 0, capacity = 0;
+    FILE *file;
+
+    file = fopen(Path, "rb");
+    if (file == NULL) {
+        perror(Path);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.Magic != KBFILTR_KEYTRACE_MAGIC ||
+        header.Version != KBFILTR_KEYTRACE_VERSION ||
+        header.RecordSize < sizeof(KBFILTR_KEYTRACE_RECORD)) {
+        fprintf(stderr, "%s: not a keystroke trace\n", Path);
+        fclose(file);
+        return 1;
+    }
+
+    buffer = malloc(header.RecordSize);
+    if (buffer == NULL) {
+        fprintf(stderr, "out of memory\n");
+        fclose(file);
+        return 1;
+    }
+
+    while (fread(buffer, header.RecordSize, 1, file) == 1) {
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 4096 : capacity * 2;
+            grown = realloc(records, capacity * sizeof(KBFILTR_KEYTRACE_RECORD));
+            if (grown == NULL) {
+                fprintf(stderr, "out of memory\n");
+                free(records);
+                free(buffer);
+                fclose(file);
+                return 1;
+            }
+            records = grown;
+        }
+
+        memcpy(&records[count++], buffer, sizeof(KBFILTR_KEYTRACE_RECORD));
+    }
+
+    free(buffer);
+    fclose(file);
+
+    *Records = records;
+    *Count = count;
+    return 0;
+}
+
+int
+KbfToolSaveTrace(
+    IN const char *Path,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Writes records to a new keystroke trace file.
+
+Arguments:
+
+    Path - Trace file, replaced if it exists
+    Records - Records to write
+    Count - Number of records
+
+Return Value:
+
+    0 on success, otherwise nonzero after printing the reason.
+
+--*/
+{
+    KBFILTR_KEYTRACE_HEADER header;
+    FILE *file;
+    int failed;
+
+    memset(&header, 0, sizeof(header));
+    header.Magic = KBFILTR_KEYTRACE_MAGIC;
+    header.Version = KBFILTR_KEYTRACE_VERSION;
+    header.RecordSize = sizeof(KBFILTR_KEYTRACE_RECORD);
+
+    file = fopen(Path, "wb");
+    if (file == NULL) {
+        perror(Path);
+        return 1;
+    }
+
+    failed = fwrite(&header, sizeof(header), 1, file) != 1 ||
+             (Count != 0 && fwrite(Records, sizeof(KBFILTR_KEYTRACE_RECORD), Count, file) != Count);
+    failed |= fclose(file) != 0;
+
+    if (failed) {
+        fprintf(stderr, "%s: write failed\n", Path);
+    }
+    return failed;
+}
+
+const char *
+KbfToolDecisionName(
+    IN UCHAR Decision
+    )
+/*++
+
+Routine Description:
+
+    Names a decision for the JSON output of the tools.
+
+Arguments:
+
+    Decision - One of the KBFILTR_DECISION_ values
+
+Return Value:
+
+    Name of the decision.
+
+--*/
+{
+    switch (Decision) {
+    case KBFILTR_DECISION_ACCEPT:
+        return "accept";
+    case KBFILTR_DECISION_DUPLICATE:
+        return "duplicate";
+    case KBFILTR_DECISION_REPEAT:
+        return "repeat";
+    case KBFILTR_DECISION_SEQUENCE:
+        return "sequence";
+    case KBFILTR_DECISION_CROSS_DEVICE:
+        return "cross_device";
+    }
+
+    return "unknown";
+}
+
+VOID
+KbfToolPrintEvaluation(
+    IN FILE *File,
+    IN PKBFILTER_EVALUATION Evaluation
+    )
+/*++
+
+Routine Description:
+
+    Prints the scores of an evaluation as JSON members, without braces, so
+    that tools can add members of their own.
+
+Arguments:
+
+    File - Output stream
+    Evaluation - Scores to print
+
+Return Value:
+
+    None.
+
+--*/
+{
+    fprintf(File,
+            "\"presses\":%u,\"true_positives\":%u,\"false_positives\":%u,"
+            "\"false_negatives\":%u,\"precision_permille\":%u,\"recall_permille\":%u,"
+            "\"added_latency_ms\":%llu,\"max_added_latency_ms\":%u,\"unresolved_drops\":%u",
+            Evaluation->Presses,
+            Evaluation->TruePositives,
+            Evaluation->FalsePositives,
+            Evaluation->FalseNegatives,
+            Evaluation->PrecisionPermille,
+            Evaluation->RecallPermille,
+            (unsigned long long) Evaluation->AddedLatencyMs,
+            Evaluation->MaxAddedLatencyMs,
+            Evaluation->UnresolvedDrops);
+}
+
+static
+ULONG
+KbfToolPermille(
+    ULONG Hits,
+    ULONG Misses
+    )
+{
+    if (Hits + Misses == 0) {
+        return 1000;
+    }
+
+    return (ULONG) ((ULONGLONG) Hits * 1000 / (Hits + Misses));
+}
+
+VOID
+KbfToolAddEvaluation(
+    IN OUT PKBFILTER_EVALUATION Total,
+    IN PKBFILTER_EVALUATION Evaluation
+    )
+/*++
+
+Routine Description:
+
+    Adds the scores of an evaluation to a total, as if the traces had been
+    typed one after the other, and recomputes precision and recall.
+
+Arguments:
+
+    Total - Sum of evaluations, zeroed before the first one is added
+    Evaluation - Scores to add
+
+Return Value:
+
+    None.
+
+--*/
+{
+    Total->Presses += Evaluation->Presses;
+    Total->TruePositives += Evaluation->TruePositives;
+    Total->FalsePositives += Evaluation->FalsePositives;
+    Total->FalseNegatives += Evaluation->FalseNegatives;
+    Total->AddedLatencyMs += Evaluation->AddedLatencyMs;
+    Total->MaxAddedLatencyMs = MAX(Total->MaxAddedLatencyMs, Evaluation->MaxAddedLatencyMs);
+    Total->UnresolvedDrops += Evaluation->UnresolvedDrops;
+
+    Total->PrecisionPermille = KbfToolPermille(Total->TruePositives, Total->FalsePositives);
+    Total->RecallPermille = KbfToolPermille(Total->TruePositives, Total->FalseNegatives);
+}
@@ -0,0 +1,101 @@
+/*++
+
+Module Name:
+
+    kbftool.h
+
+Abstract:
+
+    Helpers shared by the user-mode tools built on the lag mitigation core:
+    policy options on the command line, keystroke trace files, decision
+    names and evaluation output.
+
+    Policy options mirror the registry values of the driver (see
+    LAG_MITIGATION_TEST.md) and start from the driver's defaults:
+
+        --threshold MS              ThresholdMs of every key
+        --key CODE[:e0|:e1]=MS      per-key threshold, CODE in hex
+        --key CODE[:e0|:e1]=exempt  never filter the key
+        --adaptive                  AdaptiveThresholds
+        --no-typematic              TypematicThresholds off
+        --sequence-window MS        SequenceWindowMs
+        --sequence-max-run N        SequenceMaxRun, not a registry value
+        --stuck-key MS              StuckKeyMs
+        --lag-watermark MS          LagWatermarkMs
+        --isr-reject US             IsrRejectUs, used by kbfi8042
+        --dedup locked|lockfree     dedup mode of the core
+        --typematic DELAY,RATE      typematic parameters of the keyboard
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef KBFTOOL_H
+#define KBFTOOL_H
+
+#include "kbfcore.h"
+
+#include <stdio.h>
+
+typedef struct _KBFTOOL_OPTIONS {
+    KBFILTER_POLICY Policy;
+    KBFILTER_DEDUP_MODE DedupMode;
+    KEYBOARD_TYPEMATIC_PARAMETERS Typematic;
+} KBFTOOL_OPTIONS, *PKBFTOOL_OPTIONS;
+
+extern const char KbfToolOptionUsage[];
+
+VOID
+KbfToolInitializeOptions(
+    OUT PKBFTOOL_OPTIONS Options
+    );
+
+int
+KbfToolParseOption(
+    IN OUT PKBFTOOL_OPTIONS Options,
+    IN int Argc,
+    IN char **Argv,
+    IN OUT int *Index
+    );
+
+PKBFILTER_CORE
+KbfToolCreateCore(
+    IN PKBFTOOL_OPTIONS Options,
+    IN PKBFILTER_CLOCK_ROUTINE Routine,
+    IN PVOID Context
+    );
+
+int
+KbfToolLoadTrace(
+    IN const char *Path,
+    OUT PKBFILTR_KEYTRACE_RECORD *Records,
+    OUT PULONG Count
+    );
+
+int
+KbfToolSaveTrace(
+    IN const char *Path,
+    IN PKBFILTR_KEYTRACE_RECORD Records,
+    IN ULONG Count
+    );
+
+const char *
+KbfToolDecisionName(
+    IN UCHAR Decision
+    );
+
+VOID
+KbfToolAddEvaluation(
+    IN OUT PKBFILTER_EVALUATION Total,
+    IN PKBFILTER_EVALUATION Evaluation
+    );
+
+VOID
+KbfToolPrintEvaluation(
+    IN FILE *File,
+    IN PKBFILTER_EVALUATION Evaluation
+    );
+
+#endif  // KBFTOOL_H